@@ -5,289 +5,733 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
-// QTYPE Values
-#define QTYPE_A 1      // a host address
-#define QTYPE_NS 2     // an authoritative name server
-#define QTYPE_MD 3     // a mail destination (Obsolete - use MX)
-#define QTYPE_MF 4     // a mail forwarder (Obsolete - use MX)
-#define QTYPE_CNAME 5  // the canonical name for an alias
-#define QTYPE_SOA 6    // marks the start of a zone of authority
-#define QTYPE_MB 7     // a mailbox domain name (EXPERIMENTAL)
-#define QTYPE_MG 8     // a mail group member (EXPERIMENTAL)
-#define QTYPE_MR 9     // a mail rename domain name (EXPERIMENTAL)
-#define QTYPE_NULL 10  // a null RR (EXPERIMENTAL)
-#define QTYPE_WKS 11   // a well known service description
-#define QTYPE_PTR 12   // a domain name pointer
-#define QTYPE_HINFO 13 // host information
-#define QTYPE_MINFO 14 // mailbox or mail list information
-#define QTYPE_MX 15    // mail exchange
-#define QTYPE_TXT 16   // text strings
-
-// QCLASS Values
-#define QCLASS_IN 1 // the Internet
-#define QCLASS_CS 2 // the CSNET class (Obsolete - used only for examples in some obsolete RFCs)
-#define QCLASS_CH 3 // the CHAOS class
-#define QCLASS_HS 4 // Hesiod [Dyer 87]
-
-#define DNS_PORT 53 // port to query DNS on
-
-//DNS header structure
+#include "getname_cache.h"
+#include "getname_capture.h"
+#include "getname_dns.h"
+#include "getname_forwarder.h"
+#include "getname_iterator.h"
+#include "getname_metrics.h"
+#include "getname_resolver.h"
+#include "getname_stub.h"
+#include "getname_zone.h"
+
+Cache cache;
+Cache *active_cache = NULL;
+Metrics *metrics = NULL;
+FILE *metrics_output = NULL;
+
+uint32_t timeout = DEFAULT_TIMEOUT;
+uint32_t attempts = DEFAULT_ATTEMPTS;
+uint16_t edns_size = DNS_EDNS_SIZE;
+uint16_t qtype = QTYPE_A;
+uint32_t batch = 0;
+uint32_t threads = 1;
+bool iterative = false;
+volatile sig_atomic_t stopping = 0;
+
+// One resolver thread of a threaded bulk query, working through its own slice
+// of the input on its own socket.
 typedef struct
 {
-    // Bits 00-15 | 2 bytes
-    uint16_t id; // identification number
-
-    // Bits 16-23 | 1 byte (little-endian)
-    uint8_t rd : 1;     // recursion desired
-    uint8_t tc : 1;     // truncated message
-    uint8_t aa : 1;     // authoritive answer
-    uint8_t opcode : 4; // purpose of message
-    uint8_t qr : 1;     // query/response flag
-
-    // Bits 24-31 | 1 byte (little-endian)
-    uint8_t rcode : 4; // response code
-    uint8_t z : 3;     // its z! reserved
-    uint8_t ra : 1;    // recursion available
-
-    // Bits 32-47 | 2 bytes
-    uint16_t q_count; // number of question entries
-    // Bits 48-63 | 2 bytes
-    uint16_t ans_count; // number of answer entries
-    // Bits 64-79 | 2 bytes
-    uint16_t auth_count; // number of authority entries
-    // Bits 80-95 | 2 bytes
-    uint16_t add_count; // number of resource entries
-} DNS_Header;
-
-// constant sized fields of query structure
-typedef struct
+    pthread_t thread;   // Thread running the resolver
+    Resolver resolver;  // Resolver owned by the thread
+    char *input;        // Start of the thread's slice of the input
+    size_t length;      // Length of the slice
+} Worker;
+
+bool start_metrics(char *path);
+void do_query(char *domain, char *addr, bool lines);
+void do_bulk_query(FILE *input, char *addr, uint32_t window);
+void do_threaded_query(FILE *input, char *addr, uint32_t window);
+void do_forward(char *listen, char *addr, uint32_t window);
+void do_stub(char *listen, uint32_t latency, uint32_t loss);
+void do_zone(char *path, char *listen);
+void do_capture(char *path, uint32_t top);
+void print_response(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length);
+void print_response_line(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length);
+
+void usage()
 {
-    uint16_t qtype;
-    uint16_t qclass;
-} Question;
+    printf("Usage: getname [options] (name) (ipaddr[:port][,...])\n");
+    printf("       getname [options] [-w window] -f (file|-) (ipaddr[:port][,...])\n");
+    printf("       getname [options] [-w window] -d ([ipaddr:]port) (ipaddr[:port][,...])\n");
+    printf("       getname [-L latency] [-P loss] -s ([ipaddr:]port)\n");
+    printf("       getname -z zonefile -s ([ipaddr:]port)\n");
+    printf("       getname [-j threads] [-n names] -r (capture|-)\n");
+    printf("Options:\n");
+    printf("  -q qtype      type of record to ask for (A)\n");
+    printf("  -l            print answers as lines: name qtype status ttl canonical data\n");
+    printf("  -i            resolve iteratively, treating the servers as root hints\n");
+    printf("  -b batch      send and receive up to batch datagrams per system call\n");
+    printf("  -j threads    split bulk input between threads, each with its own socket (1)\n");
+    printf("  -c cachefile  persist the answer cache in cachefile\n");
+    printf("  -m file       write latency histograms and counters as JSON lines to file, or - for\n");
+    printf("                stderr, on exit and on SIGUSR1\n");
+    printf("  -d listen     serve clients as a caching forwarder until interrupted\n");
+    printf("  -e size       advertised EDNS0 UDP payload size, 0 to disable (%d)\n", DNS_EDNS_SIZE);
+    printf("  -t timeout    milliseconds before a query is abandoned (%d)\n", DEFAULT_TIMEOUT);
+    printf("  -a attempts   sends of a query before it is abandoned (%d)\n", DEFAULT_ATTEMPTS);
+    printf("  -s listen     serve generated answers as a stub server until interrupted\n");
+    printf("  -L latency    milliseconds the stub server holds each reply (0)\n");
+    printf("  -P loss       percentage of queries the stub server drops (0)\n");
+    printf("  -z zonefile   serve the zone authoritatively with -s, reloading it on SIGHUP\n");
+    printf("  -r capture    decode a pcap of DNS over UDP, or length prefixed messages, and print\n");
+    printf("                counts by rcode and qtype, then the busiest names as: name messages\n");
+    printf("                queries responses nxdomain servfail error\n");
+    printf("  -n names      busiest names -r prints (%d)\n", CAPTURE_DEFAULT_NAMES);
+    printf("PTR queries take an address, or an IPv4 block such as 10.0.0.0/24 to sweep.\n");
+}
 
-// constant sized fields of the resource record structure
-#pragma pack(push, 1)
-typedef struct
+int main(int argc, char *argv[])
 {
-    uint16_t type;
-    uint16_t class;
-    uint32_t ttl;
-    uint16_t data_len;
-} R_Data;
-#pragma pack(pop)
-
-// pointers to resource record contents
-typedef struct
+    // Argument parsing
+    char *input = NULL;
+    char *cache_path = NULL;
+    char *metrics_path = NULL;
+    char *listen = NULL;
+    char *stub_listen = NULL;
+    char *zone_path = NULL;
+    char *capture_path = NULL;
+    uint32_t names = CAPTURE_DEFAULT_NAMES;
+    uint32_t latency = 0;
+    uint32_t loss = 0;
+    uint32_t window = DEFAULT_WINDOW;
+    bool lines = false;
+    int option;
+    while ((option = getopt(argc, argv, "a:b:c:d:e:f:ij:lm:n:q:r:s:t:w:z:L:P:")) != -1)
+    {
+        switch (option)
+        {
+        case 'a':
+            attempts = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        case 'd':
+            listen = optarg;
+            break;
+        case 'e':
+            edns_size = atoi(optarg);
+            break;
+        case 'f':
+            input = optarg;
+            break;
+        case 'i':
+            iterative = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1)
+            {
+                threads = 1;
+            }
+            break;
+        case 'l':
+            lines = true;
+            break;
+        case 'm':
+            metrics_path = optarg;
+            break;
+        case 'n':
+            names = atoi(optarg);
+            break;
+        case 'q':
+            qtype = dns_qtype_from_string(optarg);
+            if (qtype == 0)
+            {
+                printf("Error: Unknown qtype [%s]\n", optarg);
+                return 0;
+            }
+            break;
+        case 'r':
+            capture_path = optarg;
+            break;
+        case 's':
+            stub_listen = optarg;
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'z':
+            zone_path = optarg;
+            break;
+        case 'L':
+            latency = atoi(optarg);
+            break;
+        case 'P':
+            loss = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 0;
+        }
+    }
+
+    // Answers are always cached in process, and persist across runs with -c
+    if (cache_open(&cache, cache_path, CACHE_DEFAULT_CAPACITY))
+    {
+        active_cache = &cache;
+    }
+    if (metrics_path != NULL && !start_metrics(metrics_path))
+    {
+        return 0;
+    }
+
+    if (capture_path != NULL)
+    {
+        do_capture(capture_path, names);
+    }
+    else if (stub_listen != NULL && zone_path != NULL)
+    {
+        do_zone(zone_path, stub_listen);
+    }
+    else if (stub_listen != NULL)
+    {
+        do_stub(stub_listen, latency, loss);
+    }
+    else if (listen != NULL)
+    {
+        if (argc - optind != 1)
+        {
+            usage();
+            return 0;
+        }
+        do_forward(listen, argv[optind], window);
+    }
+    else if (input != NULL)
+    {
+        if (argc - optind != 1)
+        {
+            usage();
+            return 0;
+        }
+        FILE *file = strcmp(input, "-") == 0 ? stdin : fopen(input, "r");
+        if (file == NULL)
+        {
+            perror("Error: Failed to open input.\n");
+            return 0;
+        }
+        if (threads > 1)
+        {
+            do_threaded_query(file, argv[optind], window);
+        }
+        else
+        {
+            do_bulk_query(file, argv[optind], window);
+        }
+        if (file != stdin)
+        {
+            fclose(file);
+        }
+    }
+    else
+    {
+        if (argc - optind != 2)
+        {
+            usage();
+            return 0;
+        }
+        char *domain = argv[optind];
+        char *addr = argv[optind + 1];
+
+        // A PTR sweep over an address block is a bulk query in disguise
+        if (qtype == QTYPE_PTR && strchr(domain, '/') != NULL)
+        {
+            FILE *file = fmemopen(domain, strlen(domain), "r");
+            do_bulk_query(file, addr, window);
+            fclose(file);
+        }
+        else
+        {
+            // do the query
+            do_query(domain, addr, lines);
+        }
+    }
+
+    if (metrics != NULL)
+    {
+        metrics_write(metrics, active_cache, metrics_output);
+    }
+    if (active_cache != NULL)
+    {
+        cache_close(active_cache);
+    }
+    return 0;
+}
+
+void *write_metrics(void *argument)
 {
-    char *name;
-    R_Data *resource;
-    char *rdata;
-} RES_Record;
+    sigset_t *signals = (sigset_t *)argument;
+    int signal;
+    while (sigwait(signals, &signal) == 0)
+    {
+        metrics_write(metrics, active_cache, metrics_output);
+    }
+    return NULL;
+}
 
-// Structure of a Query
-typedef struct
+// Starts recording metrics, written to path on exit and whenever SIGUSR1
+// arrives. The signal is blocked in every thread and taken by one of its own,
+// so a snapshot can be asked for in any mode without its loop knowing.
+bool start_metrics(char *path)
 {
-    char *name;
-    Question *ques;
-} Query;
+    static sigset_t signals;
+    metrics_output = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (metrics_output == NULL)
+    {
+        perror("Error: Failed to open metrics file.\n");
+        return false;
+    }
+    metrics = metrics_create();
+    if (metrics == NULL)
+    {
+        perror("Error: Failed to allocate metrics.\n");
+        return false;
+    }
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, write_metrics, &signals) != 0)
+    {
+        perror("Error: Failed to start metrics thread.\n");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
 
-void do_query(char *domain, char *addr);
-void strcpy_to_dns(char *dest, char *src);
-int strcpy_from_dns(char *dest, uint8_t *buffer, uint8_t *pointer);
+// Applies the command line options shared by every mode.
+void configure(Resolver *resolver)
+{
+    resolver->cache = active_cache;
+    resolver->metrics = metrics;
+    resolver->timeout = timeout;
+    resolver->attempts = attempts;
+    resolver->edns_size = edns_size;
+    resolver_set_batch(resolver, batch);
+    if (iterative)
+    {
+        iterator_attach(resolver);
+    }
+}
 
-int main(int argc, char *argv[])
+void do_query(char *domain, char *address, bool lines)
 {
-    // Argument parsing
-    if (argc != 3)
+    Resolver resolver;
+    resolver_initialize(&resolver, address, 1, lines ? print_response_line : print_response, NULL);
+    configure(&resolver);
+
+    // PTR queries accept an address in place of the reverse name
+    char reverse[DNS_NAME_LENGTH];
+    if (qtype == QTYPE_PTR && dns_reverse_name(domain, reverse))
     {
-        printf("Usage: getname (name) (ipaddr)\n");
-        return 0;
+        domain = reverse;
+    }
+
+    if (!lines)
+    {
+        printf("Info: Sending %s query for [%s]...\n", dns_qtype_to_string(qtype), domain);
+    }
+    if (resolver_submit(&resolver, domain, qtype) && resolver.in_flight > 0)
+    {
+        if (!lines)
+        {
+            printf("Info: Receiving packet...\n");
+        }
+        resolver_drain(&resolver);
     }
-    char *domain = argv[1];
-    char *addr = argv[2];
 
-    // do the query
-    do_query(domain, addr);
+    resolver_destroy(&resolver);
+}
 
-    return 0;
+// Prints the statistics of a bulk query. They go to stderr so stdout holds
+// nothing but answer lines.
+void print_statistics(Resolver *resolver, double elapsed)
+{
+    uint32_t answered = resolver->received + (active_cache != NULL ? active_cache->hits : 0);
+    fprintf(stderr, "Info: Sent %u queries, received %u responses.\n", resolver->sent, resolver->received);
+    fprintf(stderr, "Info: Answered %u queries in %.3fs (%.0f queries/sec).\n", answered, elapsed, elapsed > 0 ? answered / elapsed : 0);
+    fprintf(stderr, "Info: %u send and %u receive system calls.\n", resolver->send_calls, resolver->receive_calls);
+    fprintf(stderr, "Info: Retransmitted %u times, abandoned %u queries, %u retried over TCP.\n", resolver->retransmits, resolver->abandoned, resolver->truncated);
+    resolver_print_servers(resolver);
+    if (resolver->iterator != NULL)
+    {
+        iterator_print_statistics(resolver->iterator);
+    }
+    if (active_cache != NULL)
+    {
+        fprintf(stderr, "Info: Cache hits %u, misses %u.\n", active_cache->hits, active_cache->misses);
+    }
+}
+
+void do_bulk_query(FILE *input, char *address, uint32_t window)
+{
+    Resolver resolver;
+    resolver_initialize(&resolver, address, window, print_response_line, NULL);
+    configure(&resolver);
+    int64_t started = resolver_now();
+    resolver_resolve_stream(&resolver, input, qtype);
+    print_statistics(&resolver, (resolver_now() - started) / 1000.0);
+    resolver_destroy(&resolver);
+}
+
+void *run_worker(void *argument)
+{
+    Worker *worker = (Worker *)argument;
+    if (worker->length > 0)
+    {
+        FILE *input = fmemopen(worker->input, worker->length, "r");
+        if (input != NULL)
+        {
+            resolver_resolve_stream(&worker->resolver, input, qtype);
+            fclose(input);
+        }
+    }
+    return NULL;
 }
 
-void do_query(char *domain, char *address)
+// Adds the counters of other into total, so one summary covers every worker.
+// Server round trip times are averaged, weighted by the answers behind them.
+// Iterative workers learn servers in their own order, so only servers at the
+// same index with the same address are merged.
+void merge_statistics(Resolver *total, Resolver *other)
 {
-    uint8_t payload[8192];
-    int payload_counter = 0;
-
-    // DNS request setup
-    DNS_Header *header = (DNS_Header *)(payload);
-    header->id = htons(getpid());
-    header->qr = 0;
-    header->opcode = 0;
-    header->aa = 0;
-    header->tc = 0;
-    header->rd = 1;
-    header->ra = 0;
-    header->z = 0;
-    header->rcode = 0;
-    header->q_count = htons(1);
-    header->ans_count = 0;
-    header->auth_count = 0;
-    header->add_count = 0;
-    payload_counter += sizeof(DNS_Header); // increment by DNS_Header size
-    printf("Payload counter A: %d\n", payload_counter);
-
-    // Question name setup
-    char *qname = (char *)(payload + payload_counter);
-    strcpy_to_dns(qname, domain);
-    payload_counter += strlen(qname) + 1; // increment by strlen plus null terminator
-    printf("Payload counter B: %d\n", payload_counter);
-
-    // Question setup
-    Question *question = (Question *)(payload + payload_counter);
-    question->qtype = htons(QTYPE_A);
-    question->qclass = htons(QCLASS_IN);
-    payload_counter += sizeof(Question); // increment by Question size
-    printf("Payload counter C: %d\n", payload_counter);
-
-    // Destination setup
-    struct sockaddr_in destination;
-    destination.sin_family = AF_INET;
-    destination.sin_port = htons(DNS_PORT);
-    destination.sin_addr.s_addr = inet_addr(address);
-    int i = sizeof(destination);
-
-    // Network send
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    printf("Info: Sending packet with size %d...\n", payload_counter);
-    if (sendto(sock, payload, payload_counter, 0, (struct sockaddr *)&destination, i) < 0)
-    {
-        perror("Error: Failed to send packet.\n");
+    total->sent += other->sent;
+    total->received += other->received;
+    total->retransmits += other->retransmits;
+    total->abandoned += other->abandoned;
+    total->truncated += other->truncated;
+    total->send_calls += other->send_calls;
+    total->receive_calls += other->receive_calls;
+    for (uint32_t i = 0; i < total->server_count && i < other->server_count; i++)
+    {
+        ResolverServer *server = &total->servers[i];
+        ResolverServer *add = &other->servers[i];
+        if (server->address.sin_addr.s_addr != add->address.sin_addr.s_addr || server->address.sin_port != add->address.sin_port)
+        {
+            continue;
+        }
+        uint32_t answered = server->answered + add->answered;
+        if (answered > 0)
+        {
+            server->srtt = (server->srtt * server->answered + add->srtt * add->answered) / answered;
+        }
+        server->sent += add->sent;
+        server->answered = answered;
+        server->timeouts += add->timeouts;
+        if (add->benched_until > server->benched_until)
+        {
+            server->benched_until = add->benched_until;
+        }
+    }
+    if (total->iterator != NULL && other->iterator != NULL)
+    {
+        total->iterator->lookups += other->iterator->lookups;
+        total->iterator->queries += other->iterator->queries;
+        total->iterator->referrals += other->iterator->referrals;
+        total->iterator->cnames += other->iterator->cnames;
+        total->iterator->shortcuts += other->iterator->shortcuts;
+        total->iterator->glueless += other->iterator->glueless;
+        total->iterator->failures += other->iterator->failures;
+    }
+}
+
+void do_threaded_query(FILE *input, char *address, uint32_t window)
+{
+    // Read the whole input so it can be split between the workers
+    size_t length = 0;
+    size_t capacity = 65536;
+    char *buffer = malloc(capacity);
+    size_t read;
+    while (buffer != NULL && (read = fread(buffer + length, 1, capacity - length, input)) > 0)
+    {
+        length += read;
+        if (length == capacity)
+        {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    if (buffer == NULL)
+    {
+        printf("Error: Failed to read input.\n");
         return;
     }
-    printf("Info: Sent packet.\n");
 
-    // Network receive
-    printf("Info: Receiving packet...\n");
-    if (recvfrom(sock, (char *)payload, 8192, 0, (struct sockaddr *)&destination, (socklen_t *)&i) < 0)
+    // Give each worker an even share, ending its slice on a line boundary.
+    // Every worker shares the one cache, so an answer found by any of them
+    // serves them all.
+    Worker *workers = calloc(threads, sizeof(Worker));
+    size_t start = 0;
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        size_t end = i == threads - 1 ? length : length * (i + 1) / threads;
+        if (end < start)
+        {
+            end = start;
+        }
+        while (end > 0 && end < length && buffer[end - 1] != '\n')
+        {
+            end++;
+        }
+        workers[i].input = buffer + start;
+        workers[i].length = end - start;
+        start = end;
+
+        resolver_initialize(&workers[i].resolver, address, window, print_response_line, NULL);
+        configure(&workers[i].resolver);
+    }
+
+    int64_t started = resolver_now();
+    uint32_t running = 0;
+    for (; running < threads; running++)
+    {
+        if (pthread_create(&workers[running].thread, NULL, run_worker, &workers[running]) != 0)
+        {
+            perror("Error: Failed to start worker thread.\n");
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < running; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (resolver_now() - started) / 1000.0;
+
+    for (uint32_t i = 1; i < threads; i++)
+    {
+        merge_statistics(&workers[0].resolver, &workers[i].resolver);
+    }
+    fprintf(stderr, "Info: %u worker threads.\n", running);
+    print_statistics(&workers[0].resolver, elapsed);
+
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        resolver_destroy(&workers[i].resolver);
+    }
+    free(workers);
+    free(buffer);
+}
+
+void stop(int signal)
+{
+    stopping = 1;
+}
+
+void do_forward(char *listen, char *address, uint32_t window)
+{
+    Forwarder forwarder;
+    if (!forwarder_initialize(&forwarder, listen, address, window))
     {
-        perror("Error: Failed to receive packet.\n");
         return;
     }
-    printf("Info: Received packet.\n");
+    configure(&forwarder.resolver);
+
+    // Serve until interrupted, then report what was done
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "Info: Forwarding queries on [%s] to [%s]...\n", listen, address);
+    while (!stopping)
+    {
+        forwarder_poll(&forwarder);
+    }
+    forwarder_print_statistics(&forwarder);
+    forwarder_destroy(&forwarder);
+}
 
-    if (ntohs(header->ans_count) < 1)
+Stub *active_stub = NULL;
+
+void stop_stub(int signal)
+{
+    active_stub->running = false;
+}
+
+void do_stub(char *listen, uint32_t latency, uint32_t loss)
+{
+    Stub stub;
+    if (!stub_initialize(&stub, listen, latency, loss))
     {
-        perror("Error: No answer.\n");
         return;
     }
+    active_stub = &stub;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_stub;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "Info: Serving generated answers on [%s]...\n", listen);
+    stub_serve(&stub);
+    stub_print_statistics(&stub);
+    stub_destroy(&stub);
+}
 
-    printf("Info: The response contains\n");
-    printf("  %d Questions.\n", ntohs(header->q_count));
-    printf("  %d Answers.\n", ntohs(header->ans_count));
+ZoneServer *active_zone = NULL;
 
-    // Answer data
-    RES_Record answer;
-    char answer_name[256];
-    char answer_data[256];
-
-    // Answer name parsing
-    answer.name = answer_name;
-    payload_counter += strcpy_from_dns(answer.name, payload, (payload + payload_counter));
-    printf("Info: Name: [%s]\n", answer.name);
-
-    // Answer resource parsing
-    answer.resource = (R_Data *)(payload + payload_counter);
-    answer.resource->type = ntohs(answer.resource->type);
-    answer.resource->class = ntohs(answer.resource->class);
-    answer.resource->ttl = ntohs(answer.resource->ttl);
-    answer.resource->data_len = ntohs(answer.resource->data_len);
-    payload_counter += sizeof(R_Data);
-    printf("Info: R_Data contains\n");
-    printf("  Type: %d\n", answer.resource->type);
-    printf("  Class: %d\n", answer.resource->class);
-    printf("  TTL: %d\n", answer.resource->ttl);
-    printf("  Data Length: %d\n", answer.resource->data_len);
-
-    answer.rdata = answer_data;
-    if (answer.resource->type == 1) // ipv4 address
-    {
-        int length = answer.resource->data_len;
-        uint8_t *pointer = payload + payload_counter;
-        sprintf(answer.rdata, "%u.%u.%u.%u", *(pointer), *(pointer + 1), *(pointer + 2), *(pointer + 3));
-        payload_counter += length;
+void signal_zone(int signal)
+{
+    if (signal == SIGHUP)
+    {
+        active_zone->reload = true;
     }
     else
     {
-        payload_counter += strcpy_from_dns(answer.rdata, payload, (payload + payload_counter));
+        active_zone->running = false;
     }
-    printf("Info: Address: [%s]\n", answer.rdata);
+}
 
-    return;
+void do_zone(char *path, char *listen)
+{
+    ZoneServer server;
+    if (!zone_server_initialize(&server, path, listen))
+    {
+        return;
+    }
+    active_zone = &server;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_zone;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    fprintf(stderr, "Info: Serving zone [%s] with %u rrsets on [%s]...\n", path, server.zone.header->rrset_count, listen);
+    zone_serve(&server);
+    zone_print_statistics(&server);
+    zone_server_destroy(&server);
 }
 
-int strcpy_from_dns(char *dest, uint8_t *buffer, uint8_t *pointer)
+void print_response(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length)
 {
-    unsigned int p = 0;
-    unsigned int jumped = 0;
-    unsigned int offset;
-    unsigned int count = 1;
-    dest[0] = '\0';
+    if (payload == NULL && query->error != NULL)
+    {
+        printf("Error: Query failed with %s.\n", query->error);
+        return;
+    }
+    if (payload == NULL)
+    {
+        printf("Error: No response after %u attempts.\n", query->attempts);
+        return;
+    }
+    DNS_Header *header = (DNS_Header *)payload;
+    printf("Info: Received packet.\n");
+    if (query->active == false)
+    {
+        printf("Info: Answer served from cache.\n");
+    }
+
+    if (ntohs(header->ans_count) < 1)
+    {
+        printf("Error: No answer (rcode %d).\n", header->rcode);
+        return;
+    }
 
-    //read the names in 3www6google3com format
-    while (*pointer != 0)
+    printf("Info: The response contains\n");
+    printf("  %d Questions.\n", ntohs(header->q_count));
+    printf("  %d Answers.\n", ntohs(header->ans_count));
+    printf("  %d Authority records.\n", ntohs(header->auth_count));
+    printf("  %d Additional records.\n", ntohs(header->add_count));
+
+    // Print every record in the response
+    const char *sections[] = {"Answer", "Authority", "Additional"};
+    DNS_Parser parser;
+    DNS_Record record;
+    char name[DNS_NAME_LENGTH];
+    char data[DNS_TEXT_LENGTH];
+    dns_parse_begin(&parser, payload, length);
+    while (dns_parse_record(&parser, &record))
     {
-        if (*pointer >= 0xC0) // 1100 000
+        dns_name_to_string(&record.name, name);
+        printf("Info: %s Name: [%s]\n", sections[record.section], name);
+        printf("Info: R_Data contains\n");
+        printf("  Type: %d\n", record.type);
+        printf("  Class: %d\n", record.class);
+        printf("  TTL: %u\n", record.ttl);
+        printf("  Data Length: %d\n", record.data_len);
+        if (!dns_rdata_to_string(&record, payload, length, data))
         {
-            offset = (*pointer) * 256 + *(pointer + 1) - 0xC000; //1100 0000 0000 0000
-            pointer = buffer + offset - 1;
-            jumped = 1; //we have jumped to another location so counting wont go up!
+            printf("Error: Malformed record data.\n");
+            continue;
         }
-        else
+        if (record.type == QTYPE_A)
         {
-            dest[p++] = *pointer;
+            printf("Info: Address: [%s]\n", data);
         }
-        pointer++;
-        if (jumped == 0)
+        else
         {
-            count++; //if we havent jumped to another location then we can count up
+            printf("Info: Data: [%s]\n", data);
         }
     }
-    dest[p] = '\0'; //string complete
+    if (parser.error)
+    {
+        printf("Error: Malformed response.\n");
+    }
+}
 
-    if (jumped == 1)
+void print_response_line(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length)
+{
+    const char *type = dns_qtype_to_string(query->qtype);
+    if (payload == NULL)
     {
-        count++; //number of steps we actually moved forward in the packet
+        printf("%s\t%s\t%s\t-\t-\t-\n", query->name, type, query->error != NULL ? query->error : "TIMEOUT");
+        return;
     }
 
-    // Convert from DNS
-    int i = 0;
-    for (; i < strlen(dest); i++)
+    // Follow any CNAME chain from the question to the records asked for
+    DNS_Parser parser;
+    DNS_Question question;
+    if (!dns_parse_begin(&parser, payload, length) || !dns_parse_question(&parser, &question))
+    {
+        printf("%s\t%s\tFORMERR\t-\t-\t-\n", query->name, type);
+        return;
+    }
+    DNS_Record records[64];
+    DNS_Name canonical = question.name;
+    int count = dns_follow_cnames(payload, length, &canonical, query->qtype, records, 64);
+
+    // One line per record: name qtype status ttl canonical data
+    DNS_Header *header = (DNS_Header *)payload;
+    char canonical_name[DNS_NAME_LENGTH];
+    char data[DNS_TEXT_LENGTH];
+    dns_name_to_string(&canonical, canonical_name);
+    for (int i = 0; i < count; i++)
     {
-        p = dest[i];
-        for (int j = 0; j < (int)p; j++)
+        if (!dns_rdata_to_string(&records[i], payload, length, data))
         {
-            dest[i] = dest[i + 1];
-            i++;
+            strcpy(data, "-");
         }
-        dest[i] = '.';
+        printf("%s\t%s\t%s\t%u\t%s\t%s\n", query->name, dns_qtype_to_string(records[i].type), dns_rcode_to_string(header->rcode), records[i].ttl, canonical_name, data);
+    }
+    if (count == 0)
+    {
+        const char *status = header->rcode == RCODE_NOERROR ? "NODATA" : dns_rcode_to_string(header->rcode);
+        printf("%s\t%s\t%s\t-\t%s\t-\n", query->name, type, status, canonical_name);
     }
-    dest[i - 1] = '\0'; //remove the last dot
-    return count;
 }
 
-void strcpy_to_dns(char *dest, char *src)
+void do_capture(char *path, uint32_t top)
 {
-    int length = strlen(src) + 1;
-    int last = 0;
-    strcpy(dest + 1, src);
-    for (int i = 1; i <= length; i++)
+    Capture capture;
+    if (capture_open(&capture, path, threads))
     {
-        if (dest[i] == '.' || dest[i] == '\0')
-        {
-            dest[last] = (i - last - 1);
-            last = i;
-        }
+        int64_t started = resolver_now();
+        capture_run(&capture);
+        capture_print(&capture, top, (resolver_now() - started) / 1000.0);
     }
+    capture_close(&capture);
 }
@@ -0,0 +1,238 @@
+/**
+ * getname_bench.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "getname_dns.h"
+#include "getname_resolver.h"
+#include "getname_stub.h"
+
+#define BENCH_MESSAGES 1024 // distinct messages cycled through by the parse benchmark
+
+// Per query timing for the resolver benchmark
+typedef struct
+{
+    uint32_t count;     // Queries submitted
+    int64_t *submitted; // Microsecond each query was submitted, by index
+    int64_t *latency;   // Microseconds each answered query took, by answer order
+    uint32_t answered;  // Entries in latency
+    uint32_t abandoned; // Queries that were never answered
+} Bench;
+
+// Returns the current monotonic time in microseconds.
+int64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void usage()
+{
+    printf("Usage: getname_bench [-n queries] [-w window] [-b batch] [-L latency] [-P loss] [-m messages]\n");
+    printf("  -n queries    queries sent through the resolver (100000)\n");
+    printf("  -w window     queries kept in flight (%d)\n", DEFAULT_WINDOW);
+    printf("  -b batch      datagrams per system call, 0 for one each (0)\n");
+    printf("  -L latency    milliseconds the stub server holds each reply (0)\n");
+    printf("  -P loss       percentage of queries the stub server drops (0)\n");
+    printf("  -m messages   messages decoded by the parse benchmark (1000000)\n");
+}
+
+void *serve(void *argument)
+{
+    stub_serve((Stub *)argument);
+    return NULL;
+}
+
+// Times encoding queries and decoding every record of the stub's answers.
+void bench_parse(uint32_t messages)
+{
+    static uint8_t queries[BENCH_MESSAGES][DNS_UDP_SIZE];
+    static uint8_t replies[BENCH_MESSAGES][DNS_UDP_SIZE];
+    static int lengths[BENCH_MESSAGES];
+    char name[DNS_NAME_LENGTH];
+
+    int64_t started = bench_now();
+    for (uint32_t i = 0; i < messages; i++)
+    {
+        uint32_t index = i % BENCH_MESSAGES;
+        sprintf(name, "host%u.bench.example", index);
+        lengths[index] = dns_write_query(queries[index], i, name, index % 2 ? QTYPE_AAAA : QTYPE_A, DNS_EDNS_SIZE);
+    }
+    double encode = (bench_now() - started) * 1000.0 / messages;
+    for (uint32_t i = 0; i < BENCH_MESSAGES; i++)
+    {
+        lengths[i] = stub_answer(queries[i], lengths[i], replies[i]);
+    }
+
+    // Decode the way print_response_line does, so the figure reflects what a
+    // bulk run pays per answer
+    uint32_t records = 0;
+    started = bench_now();
+    for (uint32_t i = 0; i < messages; i++)
+    {
+        uint32_t index = i % BENCH_MESSAGES;
+        DNS_Parser parser;
+        DNS_Question question;
+        DNS_Record record;
+        char data[DNS_TEXT_LENGTH];
+        dns_parse_begin(&parser, replies[index], lengths[index]);
+        dns_parse_question(&parser, &question);
+        dns_name_to_string(&question.name, name);
+        while (dns_parse_record(&parser, &record))
+        {
+            dns_rdata_to_string(&record, replies[index], lengths[index], data);
+            records += 1;
+        }
+    }
+    double decode = (bench_now() - started) * 1000.0 / messages;
+
+    printf("Info: Encoded %u queries at %.1fns per query.\n", messages, encode);
+    printf("Info: Decoded %u answers (%u records) at %.1fns per message.\n", messages, records, decode);
+}
+
+void bench_complete(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length)
+{
+    Bench *bench = (Bench *)resolver->context;
+    uint32_t index;
+    if (sscanf(query->name, "q%u.", &index) != 1 || index >= bench->count)
+    {
+        return;
+    }
+    if (payload == NULL)
+    {
+        bench->abandoned += 1;
+        return;
+    }
+    bench->latency[bench->answered++] = bench_now() - bench->submitted[index];
+}
+
+int compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times resolving queries against a stub server running on its own thread.
+void bench_resolve(uint32_t count, uint32_t window, uint32_t batch, uint32_t latency, uint32_t loss)
+{
+    Stub stub;
+    if (!stub_initialize(&stub, "127.0.0.1:0", latency, loss))
+    {
+        return;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, &stub);
+
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.count = count;
+    bench.submitted = malloc(count * sizeof(int64_t));
+    bench.latency = malloc(count * sizeof(int64_t));
+
+    char server[32];
+    sprintf(server, "127.0.0.1:%hu", stub_port(&stub));
+    Resolver resolver;
+    resolver_initialize(&resolver, server, window, bench_complete, &bench);
+    resolver_set_batch(&resolver, batch);
+
+    char name[DNS_NAME_LENGTH];
+    int64_t started = bench_now();
+    for (uint32_t i = 0; i < count;)
+    {
+        sprintf(name, "q%u.bench.example", i);
+        bench.submitted[i] = bench_now();
+        if (resolver_submit(&resolver, name, QTYPE_A))
+        {
+            i++;
+        }
+        else
+        {
+            resolver_poll(&resolver);
+        }
+    }
+    resolver_drain(&resolver);
+    double elapsed = (bench_now() - started) / 1000000.0;
+
+    stub.running = false;
+    pthread_join(thread, NULL);
+
+    // Latency percentiles over the answered queries
+    qsort(bench.latency, bench.answered, sizeof(int64_t), compare_latency);
+    double percentiles[] = {50, 90, 99, 99.9, 100};
+    printf("Info: Resolved %u of %u queries in %.3fs (%.0f queries/sec), abandoned %u.\n",
+           bench.answered, count, elapsed, elapsed > 0 ? bench.answered / elapsed : 0, bench.abandoned);
+    printf("Info: Latency");
+    for (uint32_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]) && bench.answered > 0; i++)
+    {
+        uint32_t rank = (uint32_t)(percentiles[i] / 100 * (bench.answered - 1));
+        printf(" p%g %.3fms%s", percentiles[i], bench.latency[rank] / 1000.0, i + 1 < sizeof(percentiles) / sizeof(percentiles[0]) ? "," : "");
+    }
+    printf("\n");
+    printf("Info: %u send and %u receive system calls, %u retransmits.\n", resolver.send_calls, resolver.receive_calls, resolver.retransmits);
+    fflush(stdout);
+    stub_print_statistics(&stub);
+
+    resolver_destroy(&resolver);
+    stub_destroy(&stub);
+    free(bench.submitted);
+    free(bench.latency);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t count = 100000;
+    uint32_t window = DEFAULT_WINDOW;
+    uint32_t batch = 0;
+    uint32_t latency = 0;
+    uint32_t loss = 0;
+    uint32_t messages = 1000000;
+    int option;
+    while ((option = getopt(argc, argv, "b:m:n:w:L:P:")) != -1)
+    {
+        switch (option)
+        {
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'm':
+            messages = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'L':
+            latency = atoi(optarg);
+            break;
+        case 'P':
+            loss = atoi(optarg);
+            break;
+        default:
+            usage();
+            return 0;
+        }
+    }
+    if (messages < 1 || count < 1)
+    {
+        usage();
+        return 0;
+    }
+
+    bench_parse(messages);
+    bench_resolve(count, window, batch, latency, loss);
+    return 0;
+}
@@ -0,0 +1,248 @@
+/**
+ * getname_cache.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "getname_cache.h"
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// Cache helpers
+///////////////////////////////////////////////////////////
+
+// Returns the length of the key for the name, dropping a trailing root dot so
+// equivalent names share an entry. Case is ignored when keys are hashed and
+// compared, so lookups needn't copy the name.
+static size_t cache_key_length(char *name)
+{
+    size_t length = strnlen(name, DNS_NAME_LENGTH - 1);
+    if (length > 1 && name[length - 1] == '.')
+    {
+        length--;
+    }
+    return length;
+}
+
+// Hash of the key, ignoring case. Never returns 0, which marks empty entries.
+static uint32_t cache_hash(char *name, size_t length, uint16_t qtype, uint16_t qclass)
+{
+    uint32_t hash = dns_key_hash(name, length, (uint32_t)qclass << 16 | qtype);
+    return hash == 0 ? 1 : hash;
+}
+
+// Returns the i'th entry along the key's probe sequence within its shard.
+static CacheEntry *cache_probe(Cache *cache, uint32_t hash, uint32_t i)
+{
+    uint32_t shard = hash % CACHE_SHARDS;
+    uint32_t slot = (hash / CACHE_SHARDS + i) % cache->shard_capacity;
+    return &cache->entries[(size_t)shard * cache->shard_capacity + slot];
+}
+
+static bool cache_entry_matches(CacheEntry *entry, uint32_t hash, char *name, size_t length, uint16_t qtype, uint16_t qclass)
+{
+    return entry->hash == hash && entry->qtype == qtype && entry->qclass == qclass && entry->name[length] == '\0' &&
+           dns_key_equals(entry->name, name, length);
+}
+
+///////////////////////////////////////////////////////////
+// Cache functions
+///////////////////////////////////////////////////////////
+
+bool cache_open(Cache *cache, char *path, uint32_t capacity)
+{
+    memset(cache, 0, sizeof(Cache));
+    if (capacity < CACHE_PROBE_LIMIT * CACHE_SHARDS)
+    {
+        capacity = CACHE_PROBE_LIMIT * CACHE_SHARDS;
+    }
+    capacity -= capacity % CACHE_SHARDS;
+
+    void *memory;
+    if (path == NULL)
+    {
+        cache->size = sizeof(CacheHeader) + (size_t)capacity * sizeof(CacheEntry);
+        memory = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    else
+    {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            perror("Error: Failed to open cache file.\n");
+            return false;
+        }
+
+        // Reuse the existing layout if the file was written by this version
+        CacheHeader existing;
+        struct stat info;
+        if (fstat(fd, &info) == 0 &&
+            pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+            existing.magic == CACHE_MAGIC &&
+            existing.entry_size == sizeof(CacheEntry) &&
+            existing.capacity % CACHE_SHARDS == 0 &&
+            info.st_size == (off_t)(sizeof(CacheHeader) + (size_t)existing.capacity * sizeof(CacheEntry)))
+        {
+            capacity = existing.capacity;
+        }
+        else if (ftruncate(fd, 0) < 0)
+        {
+            perror("Error: Failed to reset cache file.\n");
+            close(fd);
+            return false;
+        }
+
+        cache->size = sizeof(CacheHeader) + (size_t)capacity * sizeof(CacheEntry);
+        if (ftruncate(fd, cache->size) < 0)
+        {
+            perror("Error: Failed to size cache file.\n");
+            close(fd);
+            return false;
+        }
+        memory = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd); // the mapping keeps the file open
+    }
+
+    if (memory == MAP_FAILED)
+    {
+        perror("Error: Failed to map cache.\n");
+        return false;
+    }
+    cache->header = (CacheHeader *)memory;
+    cache->entries = (CacheEntry *)((uint8_t *)memory + sizeof(CacheHeader));
+
+    // A new or reset file is all zeros, which is an empty cache
+    cache->header->magic = CACHE_MAGIC;
+    cache->header->capacity = capacity;
+    cache->header->entry_size = sizeof(CacheEntry);
+    cache->shard_capacity = capacity / CACHE_SHARDS;
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    return true;
+}
+
+void cache_close(Cache *cache)
+{
+    if (cache->header != NULL)
+    {
+        munmap(cache->header, cache->size);
+        for (uint32_t i = 0; i < CACHE_SHARDS; i++)
+        {
+            pthread_mutex_destroy(&cache->locks[i]);
+        }
+    }
+    memset(cache, 0, sizeof(Cache));
+}
+
+int cache_lookup(Cache *cache, char *name, uint16_t qtype, uint16_t qclass, uint8_t *payload)
+{
+    size_t key_length = cache_key_length(name);
+    uint32_t hash = cache_hash(name, key_length, qtype, qclass);
+    pthread_mutex_t *lock = &cache->locks[hash % CACHE_SHARDS];
+    int64_t now = time(NULL);
+    int length = -1;
+    int64_t stored = 0;
+
+    pthread_mutex_lock(lock);
+    for (uint32_t i = 0; i < CACHE_PROBE_LIMIT; i++)
+    {
+        CacheEntry *entry = cache_probe(cache, hash, i);
+        if (entry->hash == 0)
+        {
+            break;
+        }
+        if (cache_entry_matches(entry, hash, name, key_length, qtype, qclass))
+        {
+            // A damaged file can hold a length past the entry, so treat that
+            // as a miss rather than overrun the caller's buffer
+            if (entry->expires > now && entry->length <= CACHE_RESPONSE_LENGTH)
+            {
+                memcpy(payload, entry->response, entry->length);
+                length = entry->length;
+                stored = entry->stored;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    if (length < 0)
+    {
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    dns_age_ttls(payload, length, now - stored);
+    __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+    return length;
+}
+
+void cache_insert(Cache *cache, char *name, uint16_t qtype, uint16_t qclass, uint8_t *payload, int length)
+{
+    if (length > CACHE_RESPONSE_LENGTH)
+    {
+        return;
+    }
+    int64_t ttl = dns_cache_ttl(payload, length);
+    if (ttl <= 0)
+    {
+        return;
+    }
+
+    size_t key_length = cache_key_length(name);
+    uint32_t hash = cache_hash(name, key_length, qtype, qclass);
+    pthread_mutex_t *lock = &cache->locks[hash % CACHE_SHARDS];
+    int64_t now = time(NULL);
+
+    pthread_mutex_lock(lock);
+
+    // Take the existing entry for the key, else the first free or expired
+    // entry, else evict whichever entry in the probe window expires soonest
+    CacheEntry *target = NULL;
+    for (uint32_t i = 0; i < CACHE_PROBE_LIMIT; i++)
+    {
+        CacheEntry *entry = cache_probe(cache, hash, i);
+        if (cache_entry_matches(entry, hash, name, key_length, qtype, qclass))
+        {
+            target = entry;
+            break;
+        }
+        if (entry->hash == 0 || entry->expires <= now)
+        {
+            if (target == NULL || target->expires > now)
+            {
+                target = entry;
+            }
+            if (entry->hash == 0)
+            {
+                break; // the key can't be any further along
+            }
+        }
+        else if (target == NULL || (target->expires > now && entry->expires < target->expires))
+        {
+            target = entry;
+        }
+    }
+
+    target->hash = hash;
+    target->qtype = qtype;
+    target->qclass = qclass;
+    target->stored = now;
+    target->expires = now + ttl;
+    target->length = length;
+    dns_key_lower(target->name, name, key_length);
+    target->name[key_length] = '\0';
+    memcpy(target->response, payload, length);
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,98 @@
+/**
+ * getname_cache.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_CACHE_INCLUDED
+#define GETNAME_CACHE_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// Cache macros
+///////////////////////////////////////////////////////////
+
+#define CACHE_MAGIC 0x33484341434E4755ULL // "UGNCACH3"
+#define CACHE_DEFAULT_CAPACITY 16384      // entries in a new cache
+#define CACHE_RESPONSE_LENGTH 1024        // largest response a cache entry holds
+#define CACHE_PROBE_LIMIT 16              // entries searched before evicting
+#define CACHE_SHARDS 64                   // independently locked slices of the table
+
+///////////////////////////////////////////////////////////
+// Cache structs
+///////////////////////////////////////////////////////////
+
+// Header at the start of the cache file
+typedef struct
+{
+    uint64_t magic;      // CACHE_MAGIC
+    uint32_t capacity;   // Number of entries following the header
+    uint32_t entry_size; // sizeof(CacheEntry) when the file was created
+} CacheHeader;
+
+// One cached response, keyed by (name, qtype, qclass)
+typedef struct
+{
+    uint32_t hash;                            // Hash of the key, 0 if the entry is empty
+    uint16_t qtype;                           // Key qtype
+    uint16_t qclass;                          // Key qclass
+    int64_t stored;                           // Wall clock second the response was stored
+    int64_t expires;                          // Wall clock second the response expires
+    uint16_t length;                          // Length of the stored response
+    char name[DNS_NAME_LENGTH];               // Key name, lowercase without a trailing dot
+    uint8_t response[CACHE_RESPONSE_LENGTH];  // Response as received off the wire
+} CacheEntry;
+
+// The table is split into CACHE_SHARDS contiguous shards. A key always probes
+// within the shard its hash selects, so one lock per shard covers every entry
+// a lookup or insert can touch, and threads resolving different names rarely
+// contend.
+typedef struct
+{
+    CacheHeader *header;                  // Mapped header
+    CacheEntry *entries;                  // Mapped entries, header->capacity in length
+    size_t size;                          // Total mapped size in bytes
+    uint32_t shard_capacity;              // Entries in each shard
+    pthread_mutex_t locks[CACHE_SHARDS];  // Guards each shard's entries
+    uint32_t hits;                        // Lookups answered from the cache
+    uint32_t misses;                      // Lookups that weren't
+} Cache;
+
+///////////////////////////////////////////////////////////
+// Cache functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Maps the cache file at path, creating it with capacity entries if it
+ * doesn't exist or doesn't match the current layout. A NULL path maps an
+ * anonymous cache that only lives as long as the process. The cache may be
+ * shared by any number of threads. Returns false if the cache couldn't be
+ * mapped.
+ */
+bool cache_open(Cache *cache, char *path, uint32_t capacity);
+
+/**
+ * Unmaps the cache, flushing it to its file if it has one.
+ */
+void cache_close(Cache *cache);
+
+/**
+ * Copies the unexpired response for the key into payload, with each record's
+ * ttl reduced by the time it has spent in the cache. Returns the response
+ * length, or -1 on a miss.
+ */
+int cache_lookup(Cache *cache, char *name, uint16_t qtype, uint16_t qclass, uint8_t *payload);
+
+/**
+ * Stores the response under the key for as long as its ttls allow. Responses
+ * that aren't cacheable, or are too large for an entry, are ignored.
+ */
+void cache_insert(Cache *cache, char *name, uint16_t qtype, uint16_t qclass, uint8_t *payload, int length);
+
+#endif
@@ -0,0 +1,733 @@
+/**
+ * getname_capture.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "getname_capture.h"
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// Capture macros
+///////////////////////////////////////////////////////////
+
+#define PCAP_MAGIC 0xA1B2C3D4u      // microsecond timestamps
+#define PCAP_MAGIC_NANO 0xA1B23C4Du // nanosecond timestamps
+#define PCAPNG_MAGIC 0x0A0D0D0Au    // section header block of a pcapng file
+#define PCAP_HEADER_LENGTH 24       // file header
+#define PCAP_RECORD_LENGTH 16       // record header
+#define RAW_RECORD_LENGTH 2         // length prefix
+
+#define LINKTYPE_NULL 0         // BSD loopback, a host order address family
+#define LINKTYPE_ETHERNET 1     // Ethernet II, possibly VLAN tagged
+#define LINKTYPE_RAW 101        // bare IPv4 or IPv6
+#define LINKTYPE_LINUX_SLL 113  // Linux cooked capture
+#define LINKTYPE_IPV4 228       // bare IPv4
+#define LINKTYPE_IPV6 229       // bare IPv6
+#define LINKTYPE_LINUX_SLL2 276 // Linux cooked capture, version 2
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8
+#define IPPROTO_UDP_NUMBER 17
+
+///////////////////////////////////////////////////////////
+// Capture helpers
+///////////////////////////////////////////////////////////
+
+static uint16_t capture_read16(uint8_t *data)
+{
+    return (uint16_t)(data[0] << 8 | data[1]);
+}
+
+static uint32_t capture_pcap32(Capture *capture, uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return capture->swapped ? __builtin_bswap32(value) : value;
+}
+
+// Returns the length of the record at the start of data, including its header,
+// 0 if fewer than length bytes hold all of it, or -1 if it can't be a record.
+static int64_t capture_record_length(Capture *capture, uint8_t *data, size_t length)
+{
+    int64_t total;
+    if (capture->format == CAPTURE_PCAP)
+    {
+        if (length < PCAP_RECORD_LENGTH)
+        {
+            return 0;
+        }
+        uint32_t included = capture_pcap32(capture, data + 8);
+        if (included > CAPTURE_RECORD)
+        {
+            return -1;
+        }
+        total = PCAP_RECORD_LENGTH + included;
+    }
+    else
+    {
+        if (length < RAW_RECORD_LENGTH)
+        {
+            return 0;
+        }
+        total = RAW_RECORD_LENGTH + capture_read16(data);
+    }
+    return (size_t)total <= length ? total : 0;
+}
+
+// Reads until the buffer is full or the capture ends. Returns the bytes read,
+// or -1 on an error.
+static ssize_t capture_fill(Capture *capture, uint8_t *buffer, size_t length)
+{
+    size_t filled = 0;
+    while (filled < length)
+    {
+        ssize_t got = read(capture->fd, buffer + filled, length - filled);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got < 0)
+        {
+            return -1;
+        }
+        if (got == 0)
+        {
+            break;
+        }
+        filled += got;
+    }
+    capture->bytes_read += filled;
+    return filled;
+}
+
+// Finds the UDP payload of a DNS datagram in a pcap record's packet. Returns
+// its length, or -1 if the packet isn't a whole DNS datagram over UDP.
+// Fragments and IPv6 extension headers are passed over rather than reassembled.
+static int capture_datagram(Capture *capture, uint8_t *packet, int length, uint8_t **payload)
+{
+    int offset = 0;
+    uint16_t ethertype = 0;
+    switch (capture->linktype)
+    {
+    case LINKTYPE_NULL:
+        if (length < 4)
+        {
+            return -1;
+        }
+        uint32_t family;
+        memcpy(&family, packet, sizeof(family));
+        family = capture->swapped ? __builtin_bswap32(family) : family;
+        ethertype = family == 2 ? ETHERTYPE_IPV4 : (family == 24 || family == 28 || family == 30) ? ETHERTYPE_IPV6 : 0;
+        offset = 4;
+        break;
+    case LINKTYPE_ETHERNET:
+        offset = 12;
+        do
+        {
+            if (length < offset + 2)
+            {
+                return -1;
+            }
+            ethertype = capture_read16(packet + offset);
+            offset += ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ ? 4 : 2;
+        } while (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ);
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (length < 16)
+        {
+            return -1;
+        }
+        ethertype = capture_read16(packet + 14);
+        offset = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (length < 20)
+        {
+            return -1;
+        }
+        ethertype = capture_read16(packet);
+        offset = 20;
+        break;
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        if (length < 1)
+        {
+            return -1;
+        }
+        ethertype = packet[0] >> 4 == 4 ? ETHERTYPE_IPV4 : packet[0] >> 4 == 6 ? ETHERTYPE_IPV6 : 0;
+        break;
+    default:
+        return -1;
+    }
+
+    uint8_t *ip = packet + offset;
+    int remaining = length - offset;
+    int udp;
+    if (ethertype == ETHERTYPE_IPV4)
+    {
+        if (remaining < 20 || ip[0] >> 4 != 4 || ip[9] != IPPROTO_UDP_NUMBER)
+        {
+            return -1;
+        }
+        uint16_t fragment = capture_read16(ip + 6);
+        if ((fragment & 0x3FFF) != 0)
+        {
+            return -1;
+        }
+        // Trust the IP length over the record's, which may carry link padding
+        int total = capture_read16(ip + 2);
+        remaining = total < remaining ? total : remaining;
+        udp = (ip[0] & 0x0F) * 4;
+    }
+    else if (ethertype == ETHERTYPE_IPV6)
+    {
+        if (remaining < 40 || ip[0] >> 4 != 6 || ip[6] != IPPROTO_UDP_NUMBER)
+        {
+            return -1;
+        }
+        int total = 40 + capture_read16(ip + 4);
+        remaining = total < remaining ? total : remaining;
+        udp = 40;
+    }
+    else
+    {
+        return -1;
+    }
+    if (remaining < udp + 8)
+    {
+        return -1;
+    }
+    if (capture_read16(ip + udp) != DNS_PORT && capture_read16(ip + udp + 2) != DNS_PORT)
+    {
+        return -1;
+    }
+    int datagram = capture_read16(ip + udp + 4);
+    if (datagram < 8 || datagram > remaining - udp)
+    {
+        return -1;
+    }
+    *payload = ip + udp + 8;
+    return datagram - 8;
+}
+
+static uint32_t capture_hash(char *name)
+{
+    return dns_key_hash(name, strlen(name), 0);
+}
+
+// Messages a name has been seen in, counting any it inherited on eviction.
+static uint64_t capture_weight(CaptureName *entry)
+{
+    return entry->queries + entry->responses + entry->error;
+}
+
+static void capture_heap_swap(CaptureTop *top, uint32_t a, uint32_t b)
+{
+    uint32_t index = top->heap[a];
+    top->heap[a] = top->heap[b];
+    top->heap[b] = index;
+    top->names[top->heap[a]].heap = a;
+    top->names[top->heap[b]].heap = b;
+}
+
+// Moves a name down the heap after its weight grew.
+static void capture_top_raise(CaptureTop *top, CaptureName *entry)
+{
+    uint32_t position = entry->heap;
+    while (true)
+    {
+        uint32_t smallest = position;
+        uint32_t left = position * 2 + 1;
+        uint32_t right = left + 1;
+        if (left < top->count && capture_weight(&top->names[top->heap[left]]) < capture_weight(&top->names[top->heap[smallest]]))
+        {
+            smallest = left;
+        }
+        if (right < top->count && capture_weight(&top->names[top->heap[right]]) < capture_weight(&top->names[top->heap[smallest]]))
+        {
+            smallest = right;
+        }
+        if (smallest == position)
+        {
+            return;
+        }
+        capture_heap_swap(top, position, smallest);
+        position = smallest;
+    }
+}
+
+static void capture_top_unlink(CaptureTop *top, CaptureName *entry)
+{
+    int32_t *link = &top->buckets[entry->hash & (CAPTURE_BUCKETS - 1)];
+    while (*link >= 0 && &top->names[*link] != entry)
+    {
+        link = &top->names[*link].next;
+    }
+    if (*link >= 0)
+    {
+        *link = entry->next;
+    }
+}
+
+// Returns the entry counting the name, taking a free one or evicting the
+// least seen name if it isn't tracked. The caller adds to its counts, then
+// calls capture_top_raise.
+static CaptureName *capture_top_slot(CaptureTop *top, char *name, uint32_t hash)
+{
+    int32_t *bucket = &top->buckets[hash & (CAPTURE_BUCKETS - 1)];
+    for (int32_t index = *bucket; index >= 0; index = top->names[index].next)
+    {
+        CaptureName *entry = &top->names[index];
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+        {
+            return entry;
+        }
+    }
+
+    CaptureName *entry;
+    uint64_t inherited = 0;
+    if (top->count < CAPTURE_NAMES)
+    {
+        // A new name weighs nothing, so it belongs at the top of the heap
+        uint32_t index = top->count++;
+        entry = &top->names[index];
+        top->heap[index] = index;
+        entry->heap = index;
+        while (entry->heap > 0)
+        {
+            capture_heap_swap(top, entry->heap, (entry->heap - 1) / 2);
+        }
+    }
+    else
+    {
+        entry = &top->names[top->heap[0]];
+        inherited = capture_weight(entry);
+        capture_top_unlink(top, entry);
+    }
+    uint32_t position = entry->heap;
+    memset(entry, 0, sizeof(CaptureName));
+    strcpy(entry->name, name);
+    entry->hash = hash;
+    entry->error = inherited;
+    entry->heap = position;
+    entry->next = *bucket;
+    *bucket = entry - top->names;
+    return entry;
+}
+
+static bool capture_statistics_initialize(CaptureStatistics *statistics)
+{
+    memset(statistics, 0, sizeof(CaptureStatistics));
+    memset(statistics->top.buckets, -1, sizeof(statistics->top.buckets));
+    statistics->top.names = malloc(CAPTURE_NAMES * sizeof(CaptureName));
+    return statistics->top.names != NULL;
+}
+
+static void capture_merge(CaptureStatistics *total, CaptureStatistics *other)
+{
+    total->records += other->records;
+    total->skipped += other->skipped;
+    total->malformed += other->malformed;
+    total->queries += other->queries;
+    total->responses += other->responses;
+    total->bytes += other->bytes;
+    total->resource_records += other->resource_records;
+    for (int i = 0; i < CAPTURE_RCODES; i++)
+    {
+        total->rcodes[i] += other->rcodes[i];
+    }
+    for (int i = 0; i < CAPTURE_QTYPES; i++)
+    {
+        total->qtypes[i] += other->qtypes[i];
+    }
+
+    // Space-Saving summaries merge by adding counts and errors name by name,
+    // keeping the bound on how far any count is overstated
+    for (uint32_t i = 0; i < other->top.count; i++)
+    {
+        CaptureName *from = &other->top.names[i];
+        CaptureName *to = capture_top_slot(&total->top, from->name, from->hash);
+        to->queries += from->queries;
+        to->responses += from->responses;
+        to->error += from->error;
+        for (int j = 0; j < CAPTURE_RCODES; j++)
+        {
+            to->rcodes[j] += from->rcodes[j];
+        }
+        capture_top_raise(&total->top, to);
+    }
+}
+
+// Decodes one DNS message and counts it.
+static void capture_decode(CaptureStatistics *statistics, uint8_t *message, int length)
+{
+    DNS_Parser parser;
+    DNS_Question question;
+    DNS_Record record;
+    bool asked = false;
+    if (dns_parse_begin(&parser, message, length))
+    {
+        asked = dns_parse_question(&parser, &question);
+        while (dns_parse_record(&parser, &record))
+        {
+            statistics->resource_records++;
+        }
+    }
+    if (parser.error)
+    {
+        statistics->malformed++;
+        return;
+    }
+
+    DNS_Header *header = (DNS_Header *)message;
+    statistics->bytes += length;
+    if (header->qr)
+    {
+        statistics->responses++;
+        statistics->rcodes[header->rcode]++;
+    }
+    else
+    {
+        statistics->queries++;
+        if (asked)
+        {
+            statistics->qtypes[question.qtype < CAPTURE_QTYPES ? question.qtype : CAPTURE_QTYPES - 1]++;
+        }
+    }
+    if (!asked)
+    {
+        return;
+    }
+
+    char name[DNS_NAME_LENGTH];
+    dns_key_lower(name, name, dns_name_to_string(&question.name, name));
+    CaptureName *entry = capture_top_slot(&statistics->top, name, capture_hash(name));
+    if (header->qr)
+    {
+        entry->responses++;
+        entry->rcodes[header->rcode]++;
+    }
+    else
+    {
+        entry->queries++;
+    }
+    capture_top_raise(&statistics->top, entry);
+}
+
+static void capture_decode_block(Capture *capture, CaptureWorker *worker)
+{
+    CaptureStatistics *statistics = &worker->statistics;
+    size_t offset = 0;
+    while (offset < worker->length)
+    {
+        uint8_t *data = worker->block + offset;
+        int64_t length = capture_record_length(capture, data, worker->length - offset);
+        offset += length;
+        statistics->records++;
+        if (capture->format == CAPTURE_RAW)
+        {
+            capture_decode(statistics, data + RAW_RECORD_LENGTH, length - RAW_RECORD_LENGTH);
+            continue;
+        }
+        uint8_t *payload;
+        int datagram = capture_datagram(capture, data + PCAP_RECORD_LENGTH, length - PCAP_RECORD_LENGTH, &payload);
+        if (datagram < 0)
+        {
+            statistics->skipped++;
+            continue;
+        }
+        capture_decode(statistics, payload, datagram);
+    }
+}
+
+static void *capture_work(void *argument)
+{
+    CaptureWorker *worker = (CaptureWorker *)argument;
+    Capture *capture = worker->capture;
+    pthread_mutex_lock(&capture->lock);
+    while (true)
+    {
+        while (!worker->ready && !capture->finished)
+        {
+            pthread_cond_wait(&capture->filled, &capture->lock);
+        }
+        if (!worker->ready)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&capture->lock);
+        capture_decode_block(capture, worker);
+        pthread_mutex_lock(&capture->lock);
+        worker->ready = false;
+        pthread_cond_signal(&capture->emptied);
+    }
+    pthread_mutex_unlock(&capture->lock);
+    return NULL;
+}
+
+// Waits for a worker without a block to decode.
+static CaptureWorker *capture_idle_worker(Capture *capture)
+{
+    pthread_mutex_lock(&capture->lock);
+    CaptureWorker *idle = NULL;
+    while (idle == NULL)
+    {
+        for (uint32_t i = 0; i < capture->running && idle == NULL; i++)
+        {
+            if (!capture->workers[i].ready)
+            {
+                idle = &capture->workers[i];
+            }
+        }
+        if (idle == NULL)
+        {
+            pthread_cond_wait(&capture->emptied, &capture->lock);
+        }
+    }
+    pthread_mutex_unlock(&capture->lock);
+    return idle;
+}
+
+///////////////////////////////////////////////////////////
+// Capture functions
+///////////////////////////////////////////////////////////
+
+bool capture_open(Capture *capture, char *path, uint32_t threads)
+{
+    memset(capture, 0, sizeof(Capture));
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->filled, NULL);
+    pthread_cond_init(&capture->emptied, NULL);
+    capture->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (capture->fd < 0)
+    {
+        perror("Error: Failed to open capture.\n");
+        return false;
+    }
+    posix_fadvise(capture->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    capture->workers = calloc(threads, sizeof(CaptureWorker));
+    if (capture->workers == NULL || !capture_statistics_initialize(&capture->total))
+    {
+        perror("Error: Failed to allocate capture workers.\n");
+        return false;
+    }
+    capture->worker_count = threads;
+    for (uint32_t i = 0; i < threads; i++)
+    {
+        CaptureWorker *worker = &capture->workers[i];
+        worker->capture = capture;
+        worker->block = malloc(CAPTURE_BLOCK);
+        if (worker->block == NULL || !capture_statistics_initialize(&worker->statistics))
+        {
+            perror("Error: Failed to allocate capture workers.\n");
+            return false;
+        }
+    }
+
+    // The first bytes of a raw capture are its first record, so they're left
+    // at the start of the first worker's block for capture_run to carry on from
+    uint8_t *header = capture->workers[0].block;
+    ssize_t length = capture_fill(capture, header, PCAP_HEADER_LENGTH);
+    if (length < 0)
+    {
+        perror("Error: Failed to read capture.\n");
+        return false;
+    }
+    uint32_t magic = 0;
+    if (length >= 4)
+    {
+        memcpy(&magic, header, sizeof(magic));
+    }
+    if (magic == PCAPNG_MAGIC)
+    {
+        printf("Error: pcapng captures aren't supported, convert with editcap -F pcap.\n");
+        return false;
+    }
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NANO ||
+        magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NANO))
+    {
+        if (length < PCAP_HEADER_LENGTH)
+        {
+            printf("Error: Capture ends inside its pcap header.\n");
+            return false;
+        }
+        capture->format = CAPTURE_PCAP;
+        capture->swapped = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NANO;
+        capture->linktype = capture_pcap32(capture, header + 20) & 0xFFFF;
+        capture->workers[0].length = 0;
+    }
+    else
+    {
+        capture->format = CAPTURE_RAW;
+        capture->workers[0].length = length;
+    }
+    return true;
+}
+
+void capture_run(Capture *capture)
+{
+    // Whatever capture_open read past the header is carried into the first
+    // block, as is each block's trailing partial record into the next
+    uint8_t *carry = malloc(CAPTURE_RECORD + PCAP_RECORD_LENGTH);
+    size_t carried = capture->workers[0].length;
+    if (carry == NULL)
+    {
+        perror("Error: Failed to allocate capture buffer.\n");
+        return;
+    }
+    memcpy(carry, capture->workers[0].block, carried);
+
+    for (; capture->running < capture->worker_count; capture->running++)
+    {
+        CaptureWorker *worker = &capture->workers[capture->running];
+        if (pthread_create(&worker->thread, NULL, capture_work, worker) != 0)
+        {
+            perror("Error: Failed to start capture thread.\n");
+            break;
+        }
+    }
+
+    bool reading = capture->running > 0;
+    while (reading)
+    {
+        CaptureWorker *worker = capture_idle_worker(capture);
+        memcpy(worker->block, carry, carried);
+        ssize_t filled = capture_fill(capture, worker->block + carried, CAPTURE_BLOCK - carried);
+        if (filled < 0)
+        {
+            perror("Error: Failed to read capture.\n");
+            filled = 0;
+        }
+        size_t length = carried + filled;
+        reading = carried + filled == CAPTURE_BLOCK;
+
+        // Hand over whole records only, keeping the rest for the next block
+        size_t offset = 0;
+        int64_t record;
+        while ((record = capture_record_length(capture, worker->block + offset, length - offset)) > 0)
+        {
+            offset += record;
+        }
+        if (record < 0)
+        {
+            printf("Error: Capture is corrupt after byte %" PRIu64 ".\n", capture->bytes_read - (length - offset));
+            reading = false;
+        }
+        else if (!reading && offset < length)
+        {
+            capture->truncated = true;
+        }
+        carried = length - offset;
+        memcpy(carry, worker->block + offset, carried);
+
+        pthread_mutex_lock(&capture->lock);
+        worker->length = offset;
+        worker->ready = offset > 0;
+        pthread_cond_broadcast(&capture->filled);
+        pthread_mutex_unlock(&capture->lock);
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    capture->finished = true;
+    pthread_cond_broadcast(&capture->filled);
+    pthread_mutex_unlock(&capture->lock);
+    for (uint32_t i = 0; i < capture->running; i++)
+    {
+        pthread_join(capture->workers[i].thread, NULL);
+        capture_merge(&capture->total, &capture->workers[i].statistics);
+    }
+    free(carry);
+}
+
+static int capture_compare(const void *a, const void *b)
+{
+    uint64_t left = capture_weight(*(CaptureName **)a);
+    uint64_t right = capture_weight(*(CaptureName **)b);
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+void capture_print(Capture *capture, uint32_t top, double elapsed)
+{
+    CaptureStatistics *total = &capture->total;
+    uint64_t messages = total->queries + total->responses;
+    fprintf(stderr, "Info: Read %" PRIu64 " records (%.1f MB) in %.3f seconds, %.0f records/second, %.1f MB/second.\n",
+            total->records, capture->bytes_read / 1e6, elapsed, elapsed > 0 ? total->records / elapsed : 0.0,
+            elapsed > 0 ? capture->bytes_read / 1e6 / elapsed : 0.0);
+    fprintf(stderr, "Info: Decoded %" PRIu64 " messages: %" PRIu64 " queries, %" PRIu64 " responses, %" PRIu64 " resource records.\n",
+            messages, total->queries, total->responses, total->resource_records);
+    fprintf(stderr, "Info: %" PRIu64 " malformed messages, %" PRIu64 " records that weren't DNS over UDP.\n",
+            total->malformed, total->skipped);
+    if (capture->truncated)
+    {
+        fprintf(stderr, "Info: Capture ends partway through a record.\n");
+    }
+
+    for (int i = 0; i < CAPTURE_RCODES; i++)
+    {
+        if (total->rcodes[i] > 0)
+        {
+            printf("rcode %s %" PRIu64 "\n", dns_rcode_to_string(i), total->rcodes[i]);
+        }
+    }
+    for (int i = 0; i < CAPTURE_QTYPES; i++)
+    {
+        if (total->qtypes[i] > 0)
+        {
+            printf("qtype %s %" PRIu64 "\n", i == CAPTURE_QTYPES - 1 ? "OTHER" : dns_qtype_to_string(i), total->qtypes[i]);
+        }
+    }
+
+    CaptureName **sorted = malloc(total->top.count * sizeof(CaptureName *));
+    if (sorted == NULL)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < total->top.count; i++)
+    {
+        sorted[i] = &total->top.names[i];
+    }
+    qsort(sorted, total->top.count, sizeof(CaptureName *), capture_compare);
+    for (uint32_t i = 0; i < total->top.count && i < top; i++)
+    {
+        CaptureName *entry = sorted[i];
+        printf("name %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", entry->name,
+               capture_weight(entry), entry->queries, entry->responses, entry->rcodes[RCODE_NXDOMAIN],
+               entry->rcodes[RCODE_SERVFAIL], entry->error);
+    }
+    free(sorted);
+}
+
+void capture_close(Capture *capture)
+{
+    if (capture->fd > STDIN_FILENO)
+    {
+        close(capture->fd);
+    }
+    for (uint32_t i = 0; capture->workers != NULL && i < capture->worker_count; i++)
+    {
+        free(capture->workers[i].block);
+        free(capture->workers[i].statistics.top.names);
+    }
+    free(capture->workers);
+    free(capture->total.top.names);
+    pthread_mutex_destroy(&capture->lock);
+    pthread_cond_destroy(&capture->filled);
+    pthread_cond_destroy(&capture->emptied);
+}
@@ -0,0 +1,141 @@
+/**
+ * getname_capture.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_CAPTURE_INCLUDED
+#define GETNAME_CAPTURE_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// Capture macros
+///////////////////////////////////////////////////////////
+
+#define CAPTURE_BLOCK (4 << 20)  // bytes of whole records handed to a worker at once
+#define CAPTURE_RECORD 262144    // largest record accepted, the pcap default snaplen
+#define CAPTURE_NAMES 8192       // names each worker counts exactly before evicting
+#define CAPTURE_BUCKETS 16384    // buckets in each worker's name table, a power of two
+#define CAPTURE_RCODES 16        // rcodes counted individually
+#define CAPTURE_QTYPES 256       // qtypes counted individually, larger ones share the last
+#define CAPTURE_DEFAULT_NAMES 20 // busiest names printed by default
+
+///////////////////////////////////////////////////////////
+// Capture structs
+///////////////////////////////////////////////////////////
+
+// How records are framed in a capture
+typedef enum
+{
+    CAPTURE_RAW,  // each message follows a two byte big-endian length, as over TCP
+    CAPTURE_PCAP, // a libpcap file of UDP datagrams
+} CaptureFormat;
+
+// Traffic seen for one question name
+typedef struct
+{
+    char name[DNS_NAME_LENGTH];      // Lowercase question name
+    uint32_t hash;                   // Hash of name
+    uint64_t queries;                // Queries asking for the name
+    uint64_t responses;              // Responses answering for the name
+    uint64_t rcodes[CAPTURE_RCODES]; // Responses by rcode
+    uint64_t error;                  // Most the counts may be overstated by, from evictions
+    int32_t next;                    // Next name in the same bucket, or -1
+    uint32_t heap;                   // Position in the heap
+} CaptureName;
+
+// The busiest names of a stream in a fixed table, by the Space-Saving
+// algorithm. Once the table is full a new name takes the place of the least
+// seen one and inherits its count as error, so every name seen more often
+// than total / CAPTURE_NAMES times is kept.
+typedef struct
+{
+    CaptureName *names;               // Tracked names, CAPTURE_NAMES in length
+    uint32_t count;                   // Number of entries in names in use
+    uint32_t heap[CAPTURE_NAMES];     // Min heap of names by messages seen
+    int32_t buckets[CAPTURE_BUCKETS]; // First name hashed to each bucket, or -1
+} CaptureTop;
+
+// Counters over the messages one worker decoded
+typedef struct
+{
+    uint64_t records;                // Records read from the capture
+    uint64_t skipped;                // Records that weren't DNS over UDP
+    uint64_t malformed;              // DNS messages the parser rejected
+    uint64_t queries;                // Queries decoded
+    uint64_t responses;              // Responses decoded
+    uint64_t bytes;                  // Bytes of DNS messages decoded
+    uint64_t resource_records;       // Records of every section decoded
+    uint64_t rcodes[CAPTURE_RCODES]; // Responses by rcode
+    uint64_t qtypes[CAPTURE_QTYPES]; // Queries by qtype
+    CaptureTop top;                  // Busiest question names
+} CaptureStatistics;
+
+// A decoding thread and the block it's been given
+typedef struct
+{
+    pthread_t thread;             // Thread decoding blocks
+    struct Capture *capture;      // Capture the blocks come from
+    uint8_t *block;               // Block being decoded, CAPTURE_BLOCK in length
+    size_t length;                // Bytes of whole records in block
+    bool ready;                   // Set while block holds records to decode
+    CaptureStatistics statistics; // What the worker has decoded
+} CaptureWorker;
+
+// Streams a capture through a fixed set of buffers, reading it in order while
+// workers decode earlier blocks.
+typedef struct Capture
+{
+    int fd;                  // Capture being read
+    CaptureFormat format;    // How records are framed
+    bool swapped;            // True if pcap headers are the other byte order
+    uint32_t linktype;       // Link layer of pcap records
+    CaptureWorker *workers;  // Decoding threads
+    uint32_t worker_count;   // Number of entries in workers
+    uint32_t running;        // Number of workers started
+    bool finished;           // Set once every block has been handed out
+    pthread_mutex_t lock;    // Guards handing blocks to workers
+    pthread_cond_t filled;   // Signalled when a block is handed out or reading stops
+    pthread_cond_t emptied;  // Signalled when a worker finishes a block
+    CaptureStatistics total; // Every worker's counts, once merged
+    uint64_t bytes_read;     // Bytes of the capture read
+    bool truncated;          // True if the capture ended partway through a record
+} Capture;
+
+///////////////////////////////////////////////////////////
+// Capture functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Opens a capture, or stdin if path is "-", and sniffs its format from the
+ * first bytes: a libpcap magic number means pcap, anything else is taken as
+ * raw length prefixed messages. Returns false if it can't be read or is a
+ * format that isn't supported.
+ */
+bool capture_open(Capture *capture, char *path, uint32_t threads);
+
+/**
+ * Reads the capture to its end, decoding every message with the DNS parser
+ * across the worker threads. Memory use is fixed by the number of workers,
+ * however large the capture is.
+ */
+void capture_run(Capture *capture);
+
+/**
+ * Prints totals to stderr, then counts by rcode and qtype and the top busiest
+ * question names to stdout.
+ */
+void capture_print(Capture *capture, uint32_t top, double elapsed);
+
+/**
+ * Closes the capture and releases its workers.
+ */
+void capture_close(Capture *capture);
+
+#endif
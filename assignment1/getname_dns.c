@@ -0,0 +1,1023 @@
+/**
+ * getname_dns.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// DNS functions
+///////////////////////////////////////////////////////////
+
+int dns_write_query(uint8_t *payload, uint16_t id, char *domain, uint16_t qtype, uint16_t edns_size)
+{
+    DNS_Builder builder;
+    dns_build_begin(&builder, payload, DNS_UDP_SIZE, id);
+    ((DNS_Header *)payload)->rd = 1;
+    dns_build_question(&builder, domain, qtype, QCLASS_IN);
+    if (edns_size > 0)
+    {
+        dns_build_opt(&builder, edns_size);
+    }
+    return dns_build_end(&builder);
+}
+
+// Returns the minimum field of an SOA record, or -1 if the rdata is short.
+static int64_t dns_soa_minimum(uint8_t *message, int length, DNS_Record *record)
+{
+    DNS_Name name;
+    int end = record->rdata + record->data_len;
+    int offset = dns_name_at(message, end, record->rdata, &name); // mname
+    if (offset < 0)
+    {
+        return -1;
+    }
+    offset = dns_name_at(message, end, offset, &name); // rname
+    if (offset < 0 || offset + 20 > end)
+    {
+        return -1;
+    }
+    uint32_t minimum;
+    memcpy(&minimum, message + offset + 16, sizeof(minimum)); // after serial, refresh, retry, expire
+    return ntohl(minimum);
+}
+
+int64_t dns_cache_ttl(uint8_t *payload, int length)
+{
+    DNS_Parser parser;
+    if (!dns_parse_begin(&parser, payload, length))
+    {
+        return -1;
+    }
+    DNS_Header *header = (DNS_Header *)payload;
+    if (header->tc || (header->rcode != RCODE_NOERROR && header->rcode != RCODE_NXDOMAIN))
+    {
+        return -1;
+    }
+
+    bool negative = header->rcode == RCODE_NXDOMAIN || header->ans_count == 0;
+    int64_t ttl = -1;
+    DNS_Record record;
+    while (dns_parse_record(&parser, &record) && record.section != SECTION_ADDITIONAL)
+    {
+        int64_t record_ttl = record.ttl;
+        if (negative)
+        {
+            // Negative answers live for min(SOA ttl, SOA minimum)
+            if (record.section != SECTION_AUTHORITY || record.type != QTYPE_SOA)
+            {
+                continue;
+            }
+            int64_t minimum = dns_soa_minimum(payload, length, &record);
+            if (minimum >= 0 && minimum < record_ttl)
+            {
+                record_ttl = minimum;
+            }
+        }
+        else if (record.section != SECTION_ANSWER)
+        {
+            break; // the authority section doesn't bound a positive answer
+        }
+
+        if (ttl < 0 || record_ttl < ttl)
+        {
+            ttl = record_ttl;
+        }
+    }
+    if (parser.error)
+    {
+        return -1;
+    }
+
+    if (ttl < 0)
+    {
+        ttl = negative ? DNS_NEGATIVE_TTL : 0;
+    }
+    return ttl;
+}
+
+void dns_age_ttls(uint8_t *payload, int length, uint32_t elapsed)
+{
+    DNS_Parser parser;
+    if (!dns_parse_begin(&parser, payload, length))
+    {
+        return;
+    }
+    DNS_Record record;
+    while (dns_parse_record(&parser, &record))
+    {
+        if (record.type == QTYPE_OPT)
+        {
+            continue; // the OPT ttl holds flags, not a ttl
+        }
+        R_Data *resource = (R_Data *)(payload + record.resource);
+        resource->ttl = htonl(record.ttl > elapsed ? record.ttl - elapsed : 0);
+    }
+}
+
+///////////////////////////////////////////////////////////
+// DNS parser functions
+///////////////////////////////////////////////////////////
+
+bool dns_parse_begin(DNS_Parser *parser, uint8_t *message, int length)
+{
+    memset(parser, 0, sizeof(DNS_Parser));
+    if (length < (int)sizeof(DNS_Header))
+    {
+        parser->error = true;
+        return false;
+    }
+    DNS_Header *header = (DNS_Header *)message;
+    parser->message = message;
+    parser->length = length;
+    parser->offset = sizeof(DNS_Header);
+    parser->questions = ntohs(header->q_count);
+    parser->remaining[SECTION_ANSWER] = ntohs(header->ans_count);
+    parser->remaining[SECTION_AUTHORITY] = ntohs(header->auth_count);
+    parser->remaining[SECTION_ADDITIONAL] = ntohs(header->add_count);
+    return true;
+}
+
+bool dns_parse_question(DNS_Parser *parser, DNS_Question *question)
+{
+    if (parser->error || parser->questions == 0)
+    {
+        return false;
+    }
+    int offset = dns_name_at(parser->message, parser->length, parser->offset, &question->name);
+    if (offset < 0 || offset + (int)sizeof(Question) > parser->length)
+    {
+        parser->error = true;
+        return false;
+    }
+    Question fixed; // names leave the fixed fields unaligned
+    memcpy(&fixed, parser->message + offset, sizeof(Question));
+    question->qtype = ntohs(fixed.qtype);
+    question->qclass = ntohs(fixed.qclass);
+    parser->offset = offset + sizeof(Question);
+    parser->questions -= 1;
+    return true;
+}
+
+bool dns_parse_record(DNS_Parser *parser, DNS_Record *record)
+{
+    // Records follow the questions, so step over any the caller didn't read
+    DNS_Question question;
+    while (dns_parse_question(parser, &question))
+    {
+    }
+    if (parser->error)
+    {
+        return false;
+    }
+
+    // Find the section the next record belongs to
+    DNS_Section section = SECTION_ANSWER;
+    while (section <= SECTION_ADDITIONAL && parser->remaining[section] == 0)
+    {
+        section++;
+    }
+    if (section > SECTION_ADDITIONAL)
+    {
+        return false;
+    }
+
+    int offset = dns_name_at(parser->message, parser->length, parser->offset, &record->name);
+    if (offset < 0 || offset + (int)sizeof(R_Data) > parser->length)
+    {
+        parser->error = true;
+        return false;
+    }
+    R_Data *resource = (R_Data *)(parser->message + offset);
+    record->type = ntohs(resource->type);
+    record->class = ntohs(resource->class);
+    record->ttl = ntohl(resource->ttl);
+    record->data_len = ntohs(resource->data_len);
+    record->resource = offset;
+    record->rdata = offset + sizeof(R_Data);
+    record->section = section;
+    if (record->rdata + record->data_len > parser->length)
+    {
+        parser->error = true;
+        return false;
+    }
+    parser->offset = record->rdata + record->data_len;
+    parser->remaining[section] -= 1;
+    return true;
+}
+
+int dns_name_at(uint8_t *message, int length, int offset, DNS_Name *name)
+{
+    name->message = message;
+    name->length = length;
+    name->offset = offset;
+
+    int end = -1;          // offset past the name where it's stored
+    int limit = length;    // reads must stay below the last pointer followed
+    int decoded = 1;       // presentation length, counting the root
+    while (offset < limit)
+    {
+        uint8_t label = message[offset];
+        if (label == 0)
+        {
+            return end < 0 ? offset + 1 : end;
+        }
+        if ((label & 0xC0) == 0xC0)
+        {
+            if (offset + 1 >= limit)
+            {
+                return -1;
+            }
+            int target = ((label & 0x3F) << 8) | message[offset + 1];
+            if (end < 0)
+            {
+                end = offset + 2;
+            }
+            // Pointers must move strictly backwards, which rules out loops
+            if (target >= offset)
+            {
+                return -1;
+            }
+            limit = offset;
+            offset = target;
+            continue;
+        }
+        if (label & 0xC0)
+        {
+            return -1; // extended label types aren't supported
+        }
+        decoded += label + 1;
+        if (decoded > DNS_NAME_LENGTH - 1 || offset + 1 + label >= limit)
+        {
+            return -1;
+        }
+        offset += label + 1;
+    }
+    return -1;
+}
+
+// Returns the offset of the next label in an already validated name, following
+// any compression pointers, or -1 at the root.
+static int dns_name_next_label(uint8_t *message, int offset)
+{
+    while ((message[offset] & 0xC0) == 0xC0)
+    {
+        offset = ((message[offset] & 0x3F) << 8) | message[offset + 1];
+    }
+    return message[offset] == 0 ? -1 : offset;
+}
+
+int dns_name_to_string(DNS_Name *name, char *dest)
+{
+    int written = 0;
+    int offset = dns_name_next_label(name->message, name->offset);
+    while (offset >= 0)
+    {
+        uint8_t label = name->message[offset];
+        memcpy(dest + written, name->message + offset + 1, label);
+        written += label;
+        dest[written++] = '.';
+        offset = dns_name_next_label(name->message, offset + 1 + label);
+    }
+    if (written == 0)
+    {
+        dest[written++] = '.';
+    }
+    else
+    {
+        written -= 1; // drop the trailing dot
+    }
+    dest[written] = '\0';
+    return written;
+}
+
+bool dns_name_equals_string(DNS_Name *name, char *dotted)
+{
+    int offset = dns_name_next_label(name->message, name->offset);
+    while (offset >= 0)
+    {
+        uint8_t label = name->message[offset];
+        uint8_t *chars = name->message + offset + 1;
+        for (int i = 0; i < label; i++)
+        {
+            if (tolower(chars[i]) != tolower((unsigned char)*dotted))
+            {
+                return false;
+            }
+            dotted++;
+        }
+        offset = dns_name_next_label(name->message, offset + 1 + label);
+        if (*dotted == '.')
+        {
+            dotted++;
+        }
+        else if (offset >= 0 || *dotted != '\0')
+        {
+            return false;
+        }
+    }
+    return *dotted == '\0' || (dotted[0] == '.' && dotted[1] == '\0');
+}
+
+bool dns_name_equals(DNS_Name *a, DNS_Name *b)
+{
+    int a_offset = dns_name_next_label(a->message, a->offset);
+    int b_offset = dns_name_next_label(b->message, b->offset);
+    while (a_offset >= 0 && b_offset >= 0)
+    {
+        // The length byte is compared along with the label, since label
+        // lengths never reach 'A' and so are never folded
+        uint8_t label = a->message[a_offset];
+        if (!dns_key_equals(a->message + a_offset, b->message + b_offset, 1 + label))
+        {
+            return false;
+        }
+        a_offset = dns_name_next_label(a->message, a_offset + 1 + label);
+        b_offset = dns_name_next_label(b->message, b_offset + 1 + label);
+    }
+    return a_offset < 0 && b_offset < 0;
+}
+
+// Writes TXT character-strings as space separated quoted strings, escaping
+// anything that isn't printable, into dest, which holds size bytes. Every
+// separator, quote and character is checked for room before it's written,
+// and output that doesn't fit is cut off with "...".
+static bool dns_txt_to_string(uint8_t *rdata, int data_len, char *dest, int size)
+{
+    // Room is always kept for "..." and the terminator
+    int limit = size - 4;
+    int written = 0;
+    int offset = 0;
+    while (offset < data_len)
+    {
+        int string_length = rdata[offset++];
+        if (offset + string_length > data_len)
+        {
+            return false;
+        }
+        // Piece -1 opens the string, piece string_length closes it
+        for (int i = -1; i <= string_length; i++)
+        {
+            char piece[8];
+            int piece_length;
+            if (i < 0)
+            {
+                piece_length = sprintf(piece, written > 0 ? " \"" : "\"");
+            }
+            else if (i == string_length)
+            {
+                piece_length = sprintf(piece, "\"");
+            }
+            else
+            {
+                uint8_t c = rdata[offset + i];
+                if (c == '"' || c == '\\')
+                {
+                    piece_length = sprintf(piece, "\\%c", c);
+                }
+                else if (c < 0x20 || c > 0x7E)
+                {
+                    piece_length = sprintf(piece, "\\%03u", c);
+                }
+                else
+                {
+                    piece_length = sprintf(piece, "%c", c);
+                }
+            }
+            if (written + piece_length > limit)
+            {
+                strcpy(dest + written, "...");
+                return true;
+            }
+            memcpy(dest + written, piece, piece_length);
+            written += piece_length;
+        }
+        offset += string_length;
+    }
+    dest[written] = '\0';
+    return true;
+}
+
+bool dns_rdata_to_string(DNS_Record *record, uint8_t *message, int length, char *dest)
+{
+    uint8_t *rdata = message + record->rdata;
+    int end = record->rdata + record->data_len;
+    DNS_Name name;
+    int offset;
+    int written;
+
+    switch (record->type)
+    {
+    case QTYPE_A:
+        if (record->data_len != 4)
+        {
+            return false;
+        }
+        sprintf(dest, "%u.%u.%u.%u", rdata[0], rdata[1], rdata[2], rdata[3]);
+        return true;
+    case QTYPE_AAAA:
+        if (record->data_len != 16)
+        {
+            return false;
+        }
+        inet_ntop(AF_INET6, rdata, dest, DNS_TEXT_LENGTH);
+        return true;
+    case QTYPE_NS:
+    case QTYPE_CNAME:
+    case QTYPE_PTR:
+        if (dns_name_at(message, end, record->rdata, &name) < 0)
+        {
+            return false;
+        }
+        dns_name_to_string(&name, dest);
+        return true;
+    case QTYPE_MX:
+        if (record->data_len < 3 || dns_name_at(message, end, record->rdata + 2, &name) < 0)
+        {
+            return false;
+        }
+        written = sprintf(dest, "%u ", (rdata[0] << 8) | rdata[1]);
+        dns_name_to_string(&name, dest + written);
+        return true;
+    case QTYPE_SOA:
+        offset = dns_name_at(message, end, record->rdata, &name); // mname
+        if (offset < 0)
+        {
+            return false;
+        }
+        written = dns_name_to_string(&name, dest);
+        dest[written++] = ' ';
+        offset = dns_name_at(message, end, offset, &name); // rname
+        if (offset < 0 || offset + 20 != end)
+        {
+            return false;
+        }
+        written += dns_name_to_string(&name, dest + written);
+        uint32_t fields[5]; // serial, refresh, retry, expire, minimum
+        memcpy(fields, message + offset, sizeof(fields));
+        sprintf(dest + written, " %u %u %u %u %u", ntohl(fields[0]), ntohl(fields[1]), ntohl(fields[2]), ntohl(fields[3]), ntohl(fields[4]));
+        return true;
+    case QTYPE_TXT:
+        return dns_txt_to_string(rdata, record->data_len, dest, DNS_TEXT_LENGTH);
+    default:
+        sprintf(dest, "\\# %u", record->data_len);
+        return true;
+    }
+}
+
+int dns_follow_cnames(uint8_t *message, int length, DNS_Name *name, uint16_t qtype, DNS_Record *records, int max)
+{
+    DNS_Parser parser;
+    DNS_Record record;
+    DNS_Name target;
+
+    // Each pass over the answer section follows at most one link of the chain,
+    // and a chain can't be longer than the section
+    int links = 0;
+    bool followed = true;
+    while (followed && links < 16)
+    {
+        followed = false;
+        dns_parse_begin(&parser, message, length);
+        while (dns_parse_record(&parser, &record) && record.section == SECTION_ANSWER)
+        {
+            if (record.type == QTYPE_CNAME && qtype != QTYPE_CNAME && dns_name_equals(&record.name, name) &&
+                dns_name_at(message, record.rdata + record.data_len, record.rdata, &target) >= 0)
+            {
+                *name = target;
+                followed = true;
+                links += 1;
+                break;
+            }
+        }
+    }
+
+    // Collect the records of the type asked for that belong to the final name
+    int count = 0;
+    dns_parse_begin(&parser, message, length);
+    while (dns_parse_record(&parser, &record) && record.section == SECTION_ANSWER && count < max)
+    {
+        if ((record.type == qtype || qtype == QTYPE_ANY) && dns_name_equals(&record.name, name))
+        {
+            records[count++] = record;
+        }
+    }
+    return count;
+}
+
+///////////////////////////////////////////////////////////
+// DNS builder functions
+///////////////////////////////////////////////////////////
+
+// Replaces the longest tail of the name just written, whose labels start at
+// the offsets given, with a pointer to the same name earlier in the message,
+// then remembers the labels written out in full as targets for later names.
+// Tails are only compared with names of the same encoded length.
+static void dns_build_compress(DNS_Builder *builder, int *labels, int count, bool compress)
+{
+    uint8_t *message = builder->message;
+    int end = builder->length;
+
+    int kept = count;    // labels written out in full
+    int tail_length = 1; // encoded length of what follows them
+    for (int i = 0; compress && builder->suffix_count > 0 && i < count && kept == count; i++)
+    {
+        DNS_Name tail = {message, end, labels[i]};
+        for (int j = 0; j < builder->suffix_count; j++)
+        {
+            DNS_Suffix *suffix = &builder->suffixes[j];
+            DNS_Name earlier = {message, end, suffix->offset};
+            if (suffix->length == end - labels[i] && dns_name_equals(&earlier, &tail))
+            {
+                uint16_t pointer = htons(0xC000 | suffix->offset);
+                memcpy(message + labels[i], &pointer, sizeof(pointer));
+                builder->length = labels[i] + sizeof(pointer);
+                kept = i;
+                tail_length = suffix->length;
+                break;
+            }
+        }
+    }
+    int kept_end = kept < count ? labels[kept] : end - 1;
+    for (int i = 0; i < kept && builder->suffix_count < DNS_SUFFIXES && labels[i] < 0x4000; i++)
+    {
+        builder->suffixes[builder->suffix_count].offset = labels[i];
+        builder->suffixes[builder->suffix_count].length = kept_end - labels[i] + tail_length;
+        builder->suffix_count++;
+    }
+}
+
+// Writes a dotted name uncompressed, finding each dot with memchr and copying
+// the label straight into place behind its length, noting where it starts. A
+// trailing dot is optional, and "." or "" is the root. Returns the number of
+// labels, or -1 if the name is malformed or doesn't fit.
+static int dns_build_dotted(DNS_Builder *builder, char *dotted, int *labels)
+{
+    size_t length = strlen(dotted);
+    if (length > 0 && dotted[length - 1] == '.')
+    {
+        length -= 1;
+    }
+    int encoded = length == 0 ? 1 : length + 2; // the first label's length and the root
+    if (encoded > DNS_NAME_LENGTH - 1 || builder->length + encoded > builder->capacity ||
+        (length > 0 && dotted[length - 1] == '.'))
+    {
+        return -1;
+    }
+    uint8_t *out = builder->message + builder->length;
+    char *end = dotted + length;
+    int count = 0;
+    for (char *label = dotted; label < end;)
+    {
+        char *dot = memchr(label, '.', end - label);
+        dot = dot == NULL ? end : dot;
+        if (dot == label || dot - label > 63)
+        {
+            return -1;
+        }
+        labels[count++] = out - builder->message;
+        *out = dot - label;
+        memcpy(out + 1, label, dot - label);
+        out += dot - label + 1;
+        label = dot + 1;
+    }
+    *out = 0;
+    builder->length += encoded;
+    return count;
+}
+
+// Copies a validated name uncompressed, following any pointers in it, and
+// notes where each label starts. Returns the number of labels, or -1 if the
+// name doesn't fit.
+static int dns_build_copy(DNS_Builder *builder, DNS_Name *name, int *labels)
+{
+    uint8_t *message = builder->message;
+    int offset = builder->length;
+    int limit = offset + DNS_NAME_LENGTH - 1; // the 255 byte limit on an encoded name
+    limit = limit < builder->capacity ? limit : builder->capacity;
+    int from = dns_name_next_label(name->message, name->offset);
+    int count = 0;
+    while (from >= 0)
+    {
+        uint8_t label = name->message[from];
+        if (offset + 1 + label >= limit)
+        {
+            return -1;
+        }
+        labels[count++] = offset;
+        memcpy(message + offset, name->message + from, label + 1);
+        offset += label + 1;
+        from = dns_name_next_label(name->message, from + 1 + label);
+    }
+    if (offset >= limit)
+    {
+        return -1;
+    }
+    message[offset] = 0;
+    builder->length = offset + 1;
+    return count;
+}
+
+// Fills in the rdata length of the open record.
+static void dns_build_close(DNS_Builder *builder)
+{
+    if (builder->record < 0 || builder->error)
+    {
+        builder->record = -1;
+        return;
+    }
+    int length = builder->length - builder->record - sizeof(R_Data);
+    if (length > UINT16_MAX)
+    {
+        builder->error = true;
+    }
+    uint16_t data_len = htons(length);
+    memcpy(builder->message + builder->record + offsetof(R_Data, data_len), &data_len, sizeof(data_len));
+    builder->record = -1;
+}
+
+bool dns_name_encodable(char *dotted)
+{
+    uint8_t wire[DNS_NAME_LENGTH];
+    int labels[DNS_NAME_LENGTH / 2];
+    DNS_Builder builder = {.message = wire, .capacity = sizeof(wire)};
+    return dns_build_dotted(&builder, dotted, labels) >= 0;
+}
+
+void dns_build_begin(DNS_Builder *builder, uint8_t *buffer, int capacity, uint16_t id)
+{
+    builder->message = buffer;
+    builder->capacity = capacity;
+    builder->length = 0;
+    builder->record = -1;
+    memset(builder->counts, 0, sizeof(builder->counts));
+    builder->suffix_count = 0;
+    builder->error = capacity < (int)sizeof(DNS_Header);
+    if (!builder->error)
+    {
+        memset(buffer, 0, sizeof(DNS_Header));
+        ((DNS_Header *)buffer)->id = htons(id);
+        builder->length = sizeof(DNS_Header);
+    }
+}
+
+void dns_build_question(DNS_Builder *builder, char *name, uint16_t qtype, uint16_t qclass)
+{
+    int labels[DNS_NAME_LENGTH / 2];
+    int count = builder->error ? -1 : dns_build_dotted(builder, name, labels);
+    if (count < 0)
+    {
+        builder->error = true;
+        return;
+    }
+    dns_build_compress(builder, labels, count, true);
+    Question question = {htons(qtype), htons(qclass)};
+    dns_build_data(builder, &question, sizeof(Question));
+    builder->counts[0] += 1;
+}
+
+void dns_build_question_name(DNS_Builder *builder, DNS_Name *name, uint16_t qtype, uint16_t qclass)
+{
+    dns_build_name(builder, name, true);
+    Question question = {htons(qtype), htons(qclass)};
+    dns_build_data(builder, &question, sizeof(Question));
+    builder->counts[0] += 1;
+}
+
+void dns_build_record(DNS_Builder *builder, DNS_Section section, DNS_Name *owner, uint16_t type, uint16_t class, uint32_t ttl)
+{
+    dns_build_close(builder);
+    if (owner != NULL)
+    {
+        dns_build_name(builder, owner, true);
+    }
+    else
+    {
+        uint16_t pointer = htons(0xC000 | sizeof(DNS_Header));
+        dns_build_data(builder, &pointer, sizeof(pointer));
+    }
+    R_Data resource = {htons(type), htons(class), htonl(ttl), 0};
+    builder->record = builder->length;
+    dns_build_data(builder, &resource, sizeof(R_Data));
+    builder->counts[section + 1] += 1;
+}
+
+void dns_build_data(DNS_Builder *builder, const void *data, int length)
+{
+    if (builder->error || builder->length + length > builder->capacity)
+    {
+        builder->error = true;
+        return;
+    }
+    memcpy(builder->message + builder->length, data, length);
+    builder->length += length;
+}
+
+void dns_build_name(DNS_Builder *builder, DNS_Name *name, bool compress)
+{
+    int labels[DNS_NAME_LENGTH / 2];
+    int count = builder->error ? -1 : dns_build_copy(builder, name, labels);
+    if (count < 0)
+    {
+        builder->error = true;
+        return;
+    }
+    dns_build_compress(builder, labels, count, compress);
+}
+
+void dns_build_opt(DNS_Builder *builder, uint16_t udp_size)
+{
+    uint8_t root = 0;
+    R_Data opt = {htons(QTYPE_OPT), htons(udp_size), 0, 0}; // extended rcode, version 0, no flags
+    dns_build_close(builder);
+    dns_build_data(builder, &root, sizeof(root));
+    builder->record = builder->length;
+    dns_build_data(builder, &opt, sizeof(R_Data));
+    builder->counts[SECTION_ADDITIONAL + 1] += 1;
+}
+
+int dns_build_end(DNS_Builder *builder)
+{
+    dns_build_close(builder);
+    if (builder->error)
+    {
+        return -1;
+    }
+    DNS_Header *header = (DNS_Header *)builder->message;
+    header->q_count = htons(builder->counts[0]);
+    header->ans_count = htons(builder->counts[SECTION_ANSWER + 1]);
+    header->auth_count = htons(builder->counts[SECTION_AUTHORITY + 1]);
+    header->add_count = htons(builder->counts[SECTION_ADDITIONAL + 1]);
+    return builder->length;
+}
+
+///////////////////////////////////////////////////////////
+// DNS key functions
+///////////////////////////////////////////////////////////
+
+#define DNS_KEY_ONES 0x0101010101010101ULL // a byte of 1 in every lane of a word
+
+static inline uint8_t dns_key_lower_byte(uint8_t byte)
+{
+    return byte >= 'A' && byte <= 'Z' ? byte | 0x20 : byte;
+}
+
+// Lowercases the eight bytes of a word at once. A byte is an uppercase letter
+// if its high bit is clear and adding 0x80 - 'A' sets it but adding
+// 0x80 - 'Z' - 1 doesn't; masking off the high bits first keeps carries from
+// crossing into the next byte.
+static inline uint64_t dns_key_lower_word(uint64_t word)
+{
+    uint64_t low = word & (0x7F * DNS_KEY_ONES);
+    uint64_t upper = (low + (0x80 - 'A') * DNS_KEY_ONES) ^ (low + (0x80 - 'Z' - 1) * DNS_KEY_ONES);
+    return word | ((upper & ~word & (0x80 * DNS_KEY_ONES)) >> 2);
+}
+
+#ifdef __SSE2__
+// Lowercases sixteen bytes at once. The compares are signed, so bytes from
+// 0x80 up never pass for letters.
+static inline __m128i dns_key_lower_block(__m128i bytes)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// Loads sixteen bytes as two lowercased words.
+static inline void dns_key_load(uint64_t *words, const uint8_t *bytes)
+{
+#ifdef __SSE2__
+    _mm_storeu_si128((__m128i *)words, dns_key_lower_block(_mm_loadu_si128((const __m128i *)bytes)));
+#else
+    memcpy(words, bytes, 16);
+    words[0] = dns_key_lower_word(words[0]);
+    words[1] = dns_key_lower_word(words[1]);
+#endif
+}
+
+// Loads the last 1 to 15 bytes of a key as two lowercased words without
+// reading past its end, by overlapping loads back from the end, or the last
+// 16 bytes if the key is at least that long. Every byte lands in some word.
+static inline void dns_key_load_tail(uint64_t *words, const uint8_t *key, size_t length)
+{
+    if (length >= 16)
+    {
+        dns_key_load(words, key + length - 16);
+    }
+    else if (length >= 8)
+    {
+        memcpy(&words[0], key, 8);
+        memcpy(&words[1], key + length - 8, 8);
+        words[0] = dns_key_lower_word(words[0]);
+        words[1] = dns_key_lower_word(words[1]);
+    }
+    else if (length >= 4)
+    {
+        uint32_t first, last;
+        memcpy(&first, key, 4);
+        memcpy(&last, key + length - 4, 4);
+        words[0] = dns_key_lower_word((uint64_t)last << 32 | first);
+        words[1] = 0;
+    }
+    else
+    {
+        words[0] = dns_key_lower_word((uint64_t)key[0] | key[length / 2] << 8 | key[length - 1] << 16);
+        words[1] = 0;
+    }
+}
+
+// Folds a lowercased word into the hash.
+static inline uint64_t dns_key_mix(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+void dns_key_lower(void *dest, const void *name, size_t length)
+{
+    uint8_t *out = dest;
+    const uint8_t *in = name;
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16)
+    {
+        _mm_storeu_si128((__m128i *)(out + i), dns_key_lower_block(_mm_loadu_si128((const __m128i *)(in + i))));
+    }
+#endif
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, in + i, 8);
+        word = dns_key_lower_word(word);
+        memcpy(out + i, &word, 8);
+    }
+    for (; i < length; i++)
+    {
+        out[i] = dns_key_lower_byte(in[i]);
+    }
+}
+
+uint32_t dns_key_hash(const void *name, size_t length, uint32_t seed)
+{
+    const uint8_t *in = name;
+    uint64_t hash = 0xCBF29CE484222325ULL ^ seed;
+    uint64_t words[2];
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        dns_key_load(words, in + i);
+        hash = dns_key_mix(dns_key_mix(hash, words[0]), words[1]);
+    }
+    if (i < length)
+    {
+        dns_key_load_tail(words, in, length);
+        hash = dns_key_mix(dns_key_mix(hash, words[0]), words[1]);
+    }
+
+    // Finish with the murmur3 avalanche so every bit of the key, and its
+    // length, reaches the low bits that pick buckets
+    hash ^= length;
+    hash = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDULL;
+    hash = (hash ^ (hash >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    return (uint32_t)(hash ^ (hash >> 33));
+}
+
+bool dns_key_equals(const void *a, const void *b, size_t length)
+{
+    const uint8_t *left = a;
+    const uint8_t *right = b;
+    uint64_t x[2], y[2];
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+#ifdef __SSE2__
+        __m128i lower_left = dns_key_lower_block(_mm_loadu_si128((const __m128i *)(left + i)));
+        __m128i lower_right = dns_key_lower_block(_mm_loadu_si128((const __m128i *)(right + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(lower_left, lower_right)) != 0xFFFF)
+        {
+            return false;
+        }
+#else
+        dns_key_load(x, left + i);
+        dns_key_load(y, right + i);
+        if (x[0] != y[0] || x[1] != y[1])
+        {
+            return false;
+        }
+#endif
+    }
+    if (i < length)
+    {
+        dns_key_load_tail(x, left, length);
+        dns_key_load_tail(y, right, length);
+        return x[0] == y[0] && x[1] == y[1];
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+// DNS naming functions
+///////////////////////////////////////////////////////////
+
+// Mnemonics for the types getname knows by name
+static const struct
+{
+    uint16_t qtype;
+    const char *name;
+} dns_qtypes[] = {
+    {QTYPE_A, "A"},
+    {QTYPE_NS, "NS"},
+    {QTYPE_CNAME, "CNAME"},
+    {QTYPE_SOA, "SOA"},
+    {QTYPE_PTR, "PTR"},
+    {QTYPE_HINFO, "HINFO"},
+    {QTYPE_MX, "MX"},
+    {QTYPE_TXT, "TXT"},
+    {QTYPE_AAAA, "AAAA"},
+    {QTYPE_OPT, "OPT"},
+    {QTYPE_ANY, "ANY"},
+};
+
+uint16_t dns_qtype_from_string(char *name)
+{
+    for (uint32_t i = 0; i < sizeof(dns_qtypes) / sizeof(dns_qtypes[0]); i++)
+    {
+        if (strcasecmp(name, dns_qtypes[i].name) == 0)
+        {
+            return dns_qtypes[i].qtype;
+        }
+    }
+    // RFC 3597 generic form, TYPE<number>
+    unsigned int number;
+    char extra;
+    if (sscanf(name, "%*1[Tt]%*1[Yy]%*1[Pp]%*1[Ee]%u%c", &number, &extra) == 1 && number > 0 && number < 65536)
+    {
+        return number;
+    }
+    return 0;
+}
+
+const char *dns_qtype_to_string(uint16_t qtype)
+{
+    for (uint32_t i = 0; i < sizeof(dns_qtypes) / sizeof(dns_qtypes[0]); i++)
+    {
+        if (dns_qtypes[i].qtype == qtype)
+        {
+            return dns_qtypes[i].name;
+        }
+    }
+    static __thread char generic[16]; // per thread, so resolver threads can call this
+    sprintf(generic, "TYPE%u", qtype);
+    return generic;
+}
+
+const char *dns_rcode_to_string(uint8_t rcode)
+{
+    static const char *names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+    if (rcode < sizeof(names) / sizeof(names[0]))
+    {
+        return names[rcode];
+    }
+    static __thread char generic[16];
+    sprintf(generic, "RCODE%u", rcode);
+    return generic;
+}
+
+bool dns_reverse_name(char *address, char *dest)
+{
+    uint8_t bytes[16];
+    if (inet_pton(AF_INET, address, bytes) == 1)
+    {
+        sprintf(dest, "%u.%u.%u.%u.in-addr.arpa", bytes[3], bytes[2], bytes[1], bytes[0]);
+        return true;
+    }
+    if (inet_pton(AF_INET6, address, bytes) == 1)
+    {
+        const char *digits = "0123456789abcdef";
+        int written = 0;
+        for (int i = 15; i >= 0; i--)
+        {
+            dest[written++] = digits[bytes[i] & 0xF];
+            dest[written++] = '.';
+            dest[written++] = digits[bytes[i] >> 4];
+            dest[written++] = '.';
+        }
+        strcpy(dest + written, "ip6.arpa");
+        return true;
+    }
+    return false;
+}
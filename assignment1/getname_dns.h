@@ -0,0 +1,386 @@
+/**
+ * getname_dns.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_DNS_INCLUDED
+#define GETNAME_DNS_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////
+// DNS macros
+///////////////////////////////////////////////////////////
+
+// QTYPE Values
+#define QTYPE_A 1      // a host address
+#define QTYPE_NS 2     // an authoritative name server
+#define QTYPE_MD 3     // a mail destination (Obsolete - use MX)
+#define QTYPE_MF 4     // a mail forwarder (Obsolete - use MX)
+#define QTYPE_CNAME 5  // the canonical name for an alias
+#define QTYPE_SOA 6    // marks the start of a zone of authority
+#define QTYPE_MB 7     // a mailbox domain name (EXPERIMENTAL)
+#define QTYPE_MG 8     // a mail group member (EXPERIMENTAL)
+#define QTYPE_MR 9     // a mail rename domain name (EXPERIMENTAL)
+#define QTYPE_NULL 10  // a null RR (EXPERIMENTAL)
+#define QTYPE_WKS 11   // a well known service description
+#define QTYPE_PTR 12   // a domain name pointer
+#define QTYPE_HINFO 13 // host information
+#define QTYPE_MINFO 14 // mailbox or mail list information
+#define QTYPE_MX 15    // mail exchange
+#define QTYPE_TXT 16   // text strings
+#define QTYPE_AAAA 28  // an IPv6 host address
+#define QTYPE_OPT 41   // EDNS0 option pseudo record
+#define QTYPE_DS 43    // a delegation signer
+#define QTYPE_ANY 255  // a request for all records
+
+// QCLASS Values
+#define QCLASS_IN 1 // the Internet
+#define QCLASS_CS 2 // the CSNET class (Obsolete - used only for examples in some obsolete RFCs)
+#define QCLASS_CH 3 // the CHAOS class
+#define QCLASS_HS 4 // Hesiod [Dyer 87]
+
+#define DNS_PORT 53             // port to query DNS on
+#define DNS_PACKET_LENGTH 8192  // size of the send/receive buffers
+#define DNS_NAME_LENGTH 256     // size of a presentation format name buffer
+#define DNS_TEXT_LENGTH 1024    // size of a presentation format rdata buffer
+#define DNS_NEGATIVE_TTL 60     // ttl for negative answers without an SOA
+#define DNS_EDNS_SIZE 1232      // default advertised EDNS0 UDP payload size
+#define DNS_UDP_SIZE 512        // largest UDP payload without EDNS0
+#define DNS_SUFFIXES 128        // names a builder remembers as compression targets
+
+// RCODE Values
+#define RCODE_NOERROR 0  // no error condition
+#define RCODE_FORMERR 1  // the server was unable to interpret the query
+#define RCODE_SERVFAIL 2 // the server was unable to process the query
+#define RCODE_NXDOMAIN 3 // the domain name referenced in the query does not exist
+#define RCODE_NOTIMP 4   // the server does not support the kind of query
+#define RCODE_REFUSED 5  // the server refuses to perform the operation
+
+///////////////////////////////////////////////////////////
+// DNS structs
+///////////////////////////////////////////////////////////
+
+//DNS header structure
+typedef struct
+{
+    // Bits 00-15 | 2 bytes
+    uint16_t id; // identification number
+
+    // Bits 16-23 | 1 byte (little-endian)
+    uint8_t rd : 1;     // recursion desired
+    uint8_t tc : 1;     // truncated message
+    uint8_t aa : 1;     // authoritive answer
+    uint8_t opcode : 4; // purpose of message
+    uint8_t qr : 1;     // query/response flag
+
+    // Bits 24-31 | 1 byte (little-endian)
+    uint8_t rcode : 4; // response code
+    uint8_t z : 3;     // its z! reserved
+    uint8_t ra : 1;    // recursion available
+
+    // Bits 32-47 | 2 bytes
+    uint16_t q_count; // number of question entries
+    // Bits 48-63 | 2 bytes
+    uint16_t ans_count; // number of answer entries
+    // Bits 64-79 | 2 bytes
+    uint16_t auth_count; // number of authority entries
+    // Bits 80-95 | 2 bytes
+    uint16_t add_count; // number of resource entries
+} DNS_Header;
+
+// constant sized fields of query structure
+typedef struct
+{
+    uint16_t qtype;
+    uint16_t qclass;
+} Question;
+
+// constant sized fields of the resource record structure
+#pragma pack(push, 1)
+typedef struct
+{
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t data_len;
+} R_Data;
+#pragma pack(pop)
+
+// view of a name inside a received message, followed without copying
+typedef struct
+{
+    uint8_t *message; // start of the message holding the name
+    int length;       // length of the message
+    int offset;       // offset of the name's first label
+} DNS_Name;
+
+// host order copy of a question entry
+typedef struct
+{
+    DNS_Name name;
+    uint16_t qtype;
+    uint16_t qclass;
+} DNS_Question;
+
+// section a resource record was read from
+typedef enum
+{
+    SECTION_ANSWER,
+    SECTION_AUTHORITY,
+    SECTION_ADDITIONAL,
+} DNS_Section;
+
+// host order copy of a resource record's fixed fields, and where its rdata is
+typedef struct
+{
+    DNS_Name name;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t data_len;
+    int resource;        // offset of the record's R_Data
+    int rdata;           // offset of the record's rdata
+    DNS_Section section; // section the record was read from
+} DNS_Record;
+
+// cursor over a received message
+typedef struct
+{
+    uint8_t *message;    // message being parsed
+    int length;          // length of the message
+    int offset;          // offset of the next entry
+    uint16_t questions;  // questions left to read
+    uint16_t remaining[3]; // records left to read in each DNS_Section
+    bool error;          // set once the message is found to be malformed
+} DNS_Parser;
+
+// a name, or the tail of one, already written that later names can point at
+typedef struct
+{
+    uint16_t offset; // offset of its first label in the message
+    uint8_t length;  // its encoded length, as if uncompressed
+} DNS_Suffix;
+
+// cursor writing a message into a caller's buffer
+typedef struct
+{
+    uint8_t *message;                  // buffer being written
+    int capacity;                      // size of the buffer
+    int length;                        // bytes written so far
+    int record;                        // offset of the open record's R_Data, or -1
+    uint16_t counts[4];                // questions, then records in each DNS_Section
+    DNS_Suffix suffixes[DNS_SUFFIXES]; // names that can be pointed at
+    int suffix_count;                  // number of entries in suffixes
+    bool error;                        // set once something didn't fit or was malformed
+} DNS_Builder;
+
+///////////////////////////////////////////////////////////
+// DNS functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Writes a single question query for the domain into the payload. If
+ * edns_size is non-zero an EDNS0 OPT record advertising it as the UDP payload
+ * size is appended. The payload must hold DNS_UDP_SIZE bytes. Returns the
+ * number of bytes written, or -1 if the domain is too long or malformed.
+ */
+int dns_write_query(uint8_t *payload, uint16_t id, char *domain, uint16_t qtype, uint16_t edns_size);
+
+/**
+ * Returns the number of seconds the response may be cached for, the smallest
+ * ttl among its records. Negative answers (NXDOMAIN/NODATA) use the SOA in
+ * the authority section, or DNS_NEGATIVE_TTL without one. Returns -1 if the
+ * response isn't cacheable or is malformed.
+ */
+int64_t dns_cache_ttl(uint8_t *payload, int length);
+
+/**
+ * Subtracts elapsed seconds from the ttl of every record in the response,
+ * clamping at zero.
+ */
+void dns_age_ttls(uint8_t *payload, int length, uint32_t elapsed);
+
+///////////////////////////////////////////////////////////
+// DNS builder functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Returns true if the dotted name can be encoded: no empty labels, none longer
+ * than 63 bytes, and 255 bytes encoded in all.
+ */
+bool dns_name_encodable(char *dotted);
+
+/**
+ * Starts a message in the caller's buffer, with a zeroed header carrying the
+ * id. Flags are set through the header at the start of the buffer. Nothing is
+ * allocated; the builder only ever writes inside capacity bytes.
+ */
+void dns_build_begin(DNS_Builder *builder, uint8_t *buffer, int capacity, uint16_t id);
+
+/**
+ * Appends a question for a dotted name, encoded in one pass over the string.
+ */
+void dns_build_question(DNS_Builder *builder, char *name, uint16_t qtype, uint16_t qclass);
+
+/**
+ * Appends a question for a name viewed in another message, or in a buffer of
+ * uncompressed names.
+ */
+void dns_build_question_name(DNS_Builder *builder, DNS_Name *name, uint16_t qtype, uint16_t qclass);
+
+/**
+ * Starts a resource record in the section, which must not come before the
+ * section of the last record. A NULL owner is a pointer to the first question
+ * name, even when that's the root. Its rdata is appended with dns_build_data
+ * and dns_build_name, and its length is filled in when the next record starts
+ * or the message ends.
+ */
+void dns_build_record(DNS_Builder *builder, DNS_Section section, DNS_Name *owner, uint16_t type, uint16_t class, uint32_t ttl);
+
+/**
+ * Appends bytes to the open record's rdata.
+ */
+void dns_build_data(DNS_Builder *builder, const void *data, int length);
+
+/**
+ * Appends a name to the open record's rdata. With compress, the longest tail
+ * of it already in the message is replaced by a pointer, which RFC 3597 only
+ * allows in the rdata of the original types, such as NS, CNAME, PTR, MX and
+ * SOA.
+ */
+void dns_build_name(DNS_Builder *builder, DNS_Name *name, bool compress);
+
+/**
+ * Appends an EDNS0 OPT record advertising the UDP payload size.
+ */
+void dns_build_opt(DNS_Builder *builder, uint16_t udp_size);
+
+/**
+ * Closes the last record and writes the section counts into the header.
+ * Returns the length of the message, or -1 if it didn't fit or a name was
+ * malformed.
+ */
+int dns_build_end(DNS_Builder *builder);
+
+///////////////////////////////////////////////////////////
+// DNS key functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Copies length bytes of a name to dest with ASCII letters lowercased. Works
+ * on dotted and wire format names alike, since label lengths never reach 'A'.
+ * dest may be name. Runs 16 bytes at a time with SSE2, else 8 at a time.
+ */
+void dns_key_lower(void *dest, const void *name, size_t length);
+
+/**
+ * Hashes length bytes of a name as if lowercased, mixed with a seed such as
+ * the qtype. The SSE2 and scalar versions give the same hash, so hashes can
+ * be written to disk.
+ */
+uint32_t dns_key_hash(const void *name, size_t length, uint32_t seed);
+
+/**
+ * Returns true if length bytes of a and b are equal ignoring ASCII case.
+ */
+bool dns_key_equals(const void *a, const void *b, size_t length);
+
+///////////////////////////////////////////////////////////
+// DNS parser functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Starts parsing the message. Returns false if it's too short to hold a
+ * header.
+ */
+bool dns_parse_begin(DNS_Parser *parser, uint8_t *message, int length);
+
+/**
+ * Reads the next question. Returns false once the question section is
+ * exhausted or the message is malformed, setting parser->error for the latter.
+ */
+bool dns_parse_question(DNS_Parser *parser, DNS_Question *question);
+
+/**
+ * Reads the next resource record from the answer, authority, and additional
+ * sections in turn, skipping any unread questions first. Returns false once
+ * every section is exhausted or the message is malformed, setting
+ * parser->error for the latter.
+ */
+bool dns_parse_record(DNS_Parser *parser, DNS_Record *record);
+
+/**
+ * Validates the name at offset and points the view at it. Compression
+ * pointers must point strictly before the last pointer followed, which bounds
+ * the walk and rejects loops. Returns the offset just past the name as it's
+ * stored at offset, or -1 if the name is malformed.
+ */
+int dns_name_at(uint8_t *message, int length, int offset, DNS_Name *name);
+
+/**
+ * Writes the name in dotted form into dest, which must hold DNS_NAME_LENGTH
+ * bytes. The root name is written as ".". Returns the length written.
+ */
+int dns_name_to_string(DNS_Name *name, char *dest);
+
+/**
+ * Compares the name to a dotted name, ignoring case and a trailing dot.
+ */
+bool dns_name_equals_string(DNS_Name *name, char *dotted);
+
+/**
+ * Compares two names, ignoring case.
+ */
+bool dns_name_equals(DNS_Name *a, DNS_Name *b);
+
+/**
+ * Writes the record's rdata in presentation form into dest, which must hold
+ * DNS_TEXT_LENGTH bytes. Types without a specific format are written as
+ * "\# <length>". Returns false if the rdata is malformed.
+ */
+bool dns_rdata_to_string(DNS_Record *record, uint8_t *message, int length, char *dest);
+
+/**
+ * Follows the CNAME chain starting at name through the answer section, then
+ * copies up to max records of qtype owned by the end of the chain into
+ * records. Name is left pointing at the end of the chain. Returns the number
+ * of records copied; zero with a moved name means the chain leaves the
+ * answer section.
+ */
+int dns_follow_cnames(uint8_t *message, int length, DNS_Name *name, uint16_t qtype, DNS_Record *records, int max);
+
+///////////////////////////////////////////////////////////
+// DNS naming functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Returns the qtype for a mnemonic such as "AAAA" or the generic "TYPE28"
+ * form, or 0 if it isn't recognized.
+ */
+uint16_t dns_qtype_from_string(char *name);
+
+/**
+ * Returns the mnemonic for the qtype, or its generic "TYPE28" form.
+ *
+ * Successive calls to this function may overwrite the returned string.
+ */
+const char *dns_qtype_to_string(uint16_t qtype);
+
+/**
+ * Returns the mnemonic for the rcode.
+ *
+ * Successive calls to this function may overwrite the returned string.
+ */
+const char *dns_rcode_to_string(uint8_t rcode);
+
+/**
+ * Writes the in-addr.arpa or ip6.arpa name for an IPv4 or IPv6 address into
+ * dest, which must hold DNS_NAME_LENGTH bytes. Returns false if the address
+ * can't be parsed.
+ */
+bool dns_reverse_name(char *address, char *dest);
+
+#endif
@@ -0,0 +1,410 @@
+/**
+ * getname_forwarder.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "getname_cache.h"
+#include "getname_dns.h"
+#include "getname_forwarder.h"
+#include "getname_resolver.h"
+
+///////////////////////////////////////////////////////////
+// Forwarder helpers
+///////////////////////////////////////////////////////////
+
+// Hash of the name and qtype, ignoring case.
+static uint32_t forwarder_hash(char *name, uint16_t qtype)
+{
+    return dns_key_hash(name, strlen(name), qtype);
+}
+
+// Returns true if the query in flight is for the key.
+static bool forwarder_matches(ForwarderQuery *query, char *name, size_t length, uint16_t qtype, uint32_t hash)
+{
+    return query->hash == hash && query->qtype == qtype && query->name[length] == '\0' && dns_key_equals(query->name, name, length);
+}
+
+// Returns the upstream query for the key, or -1 if there isn't one in flight.
+static int32_t forwarder_find(Forwarder *forwarder, char *name, uint16_t qtype, uint32_t hash)
+{
+    size_t length = strlen(name);
+    int32_t index = forwarder->buckets[hash % FORWARDER_BUCKETS];
+    while (index >= 0)
+    {
+        ForwarderQuery *query = &forwarder->queries[index];
+        if (forwarder_matches(query, name, length, qtype, hash))
+        {
+            return index;
+        }
+        index = query->next;
+    }
+    return -1;
+}
+
+// Unlinks the upstream query for the key from its bucket and returns it, or
+// -1 if there isn't one in flight.
+static int32_t forwarder_remove(Forwarder *forwarder, char *name, uint16_t qtype, uint32_t hash)
+{
+    size_t length = strlen(name);
+    int32_t *link = &forwarder->buckets[hash % FORWARDER_BUCKETS];
+    while (*link >= 0)
+    {
+        int32_t index = *link;
+        ForwarderQuery *query = &forwarder->queries[index];
+        if (forwarder_matches(query, name, length, qtype, hash))
+        {
+            *link = query->next;
+            return index;
+        }
+        link = &query->next;
+    }
+    return -1;
+}
+
+// Checks that the encoded name is a plain sequence of labels, without any
+// compression pointers that would mean something else in a reply.
+static bool forwarder_name_is_plain(uint8_t *name, int length)
+{
+    int offset = 0;
+    while (offset < length)
+    {
+        uint8_t label = name[offset];
+        if (label & 0xC0)
+        {
+            return false;
+        }
+        if (label == 0)
+        {
+            return offset == length - 1;
+        }
+        offset += 1 + label;
+    }
+    return false;
+}
+
+// Writes a reply holding only the header and the client's question.
+static int forwarder_write_empty(ForwarderClient *client, uint16_t qtype, uint16_t qclass, uint8_t rcode, bool truncated, uint8_t *reply)
+{
+    DNS_Builder builder;
+    DNS_Name name = {client->name, client->name_length, 0};
+    dns_build_begin(&builder, reply, DNS_PACKET_LENGTH, ntohs(client->id));
+    DNS_Header *header = (DNS_Header *)reply;
+    header->qr = 1;
+    header->rd = client->rd;
+    header->ra = 1;
+    header->tc = truncated;
+    header->rcode = rcode;
+    dns_build_question_name(&builder, &name, qtype, qclass);
+    return dns_build_end(&builder);
+}
+
+// Drops a trailing OPT record from the reply, for clients that didn't send
+// one. Returns the new length.
+static int forwarder_strip_opt(uint8_t *reply, int length)
+{
+    DNS_Parser parser;
+    DNS_Record record;
+    DNS_Record last;
+    bool found = false;
+    dns_parse_begin(&parser, reply, length);
+    while (dns_parse_record(&parser, &record))
+    {
+        last = record;
+        found = true;
+    }
+    if (!found || parser.error || last.type != QTYPE_OPT || last.section != SECTION_ADDITIONAL || parser.offset != length)
+    {
+        return length;
+    }
+    DNS_Header *header = (DNS_Header *)reply;
+    header->add_count = htons(ntohs(header->add_count) - 1);
+    return last.name.offset; // the OPT record's name is the root, a single byte
+}
+
+static void forwarder_send(Forwarder *forwarder, struct sockaddr_in *address, uint8_t *reply, int length)
+{
+    if (sendto(forwarder->socket, reply, length, 0, (struct sockaddr *)address, sizeof(struct sockaddr_in)) < 0)
+    {
+        perror("Error: Failed to send reply.\n");
+        return;
+    }
+    forwarder->replies += 1;
+}
+
+// Sends the upstream answer to one waiting client, or SERVFAIL if there
+// wasn't one.
+static void forwarder_answer(Forwarder *forwarder, ForwarderClient *client, uint16_t qtype, uint8_t *payload, int length)
+{
+    uint8_t reply[DNS_PACKET_LENGTH];
+    if (payload == NULL)
+    {
+        forwarder->failures += 1;
+        forwarder_send(forwarder, &client->address, reply, forwarder_write_empty(client, qtype, QCLASS_IN, RCODE_SERVFAIL, false, reply));
+        return;
+    }
+    uint8_t rcode = ((DNS_Header *)payload)->rcode;
+    if (length > client->limit)
+    {
+        forwarder->truncated += 1;
+        forwarder_send(forwarder, &client->address, reply, forwarder_write_empty(client, qtype, QCLASS_IN, rcode, true, reply));
+        return;
+    }
+
+    // The answer echoes whichever client asked first, so give this one back
+    // its own spelling of the name. Both encode to the same length.
+    memcpy(reply, payload, length);
+    DNS_Parser parser;
+    DNS_Question question;
+    if (!dns_parse_begin(&parser, reply, length) || !dns_parse_question(&parser, &question) ||
+        parser.offset != (int)(sizeof(DNS_Header) + client->name_length + sizeof(Question)))
+    {
+        forwarder->failures += 1;
+        forwarder_send(forwarder, &client->address, reply, forwarder_write_empty(client, qtype, QCLASS_IN, RCODE_SERVFAIL, false, reply));
+        return;
+    }
+    memcpy(reply + sizeof(DNS_Header), client->name, client->name_length);
+
+    DNS_Header *header = (DNS_Header *)reply;
+    header->id = client->id;
+    header->rd = client->rd;
+    header->ra = 1;
+    if (!client->edns)
+    {
+        length = forwarder_strip_opt(reply, length);
+    }
+    forwarder_send(forwarder, &client->address, reply, length);
+}
+
+// Answers every client waiting on the upstream query and releases it.
+static void forwarder_complete(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length)
+{
+    Forwarder *forwarder = (Forwarder *)resolver->context;
+    int32_t index = forwarder_remove(forwarder, query->name, query->qtype, forwarder_hash(query->name, query->qtype));
+    if (index < 0)
+    {
+        return;
+    }
+    ForwarderQuery *pending = &forwarder->queries[index];
+    int32_t next = pending->clients;
+    while (next >= 0)
+    {
+        ForwarderClient *client = &forwarder->clients[next];
+        forwarder_answer(forwarder, client, pending->qtype, payload, length);
+        int32_t done = next;
+        next = client->next;
+        client->next = forwarder->free_clients;
+        forwarder->free_clients = done;
+    }
+    pending->next = forwarder->free_queries;
+    forwarder->free_queries = index;
+}
+
+// Joins the client to the query in flight for the key, or sends a new one.
+static void forwarder_submit(Forwarder *forwarder, ForwarderClient *waiting, char *name, uint16_t qtype)
+{
+    if (forwarder->free_clients < 0)
+    {
+        forwarder->dropped += 1; // the client will ask again
+        return;
+    }
+    int32_t client_index = forwarder->free_clients;
+    ForwarderClient *client = &forwarder->clients[client_index];
+    forwarder->free_clients = client->next;
+    *client = *waiting;
+    client->next = -1;
+
+    uint32_t hash = forwarder_hash(name, qtype);
+    int32_t index = forwarder_find(forwarder, name, qtype, hash);
+    if (index >= 0)
+    {
+        ForwarderQuery *query = &forwarder->queries[index];
+        forwarder->clients[query->last].next = client_index;
+        query->last = client_index;
+        forwarder->coalesced += 1;
+        return;
+    }
+
+    // There's always a free entry, since every entry but this one is in
+    // flight and the table holds one more than the window
+    index = forwarder->free_queries;
+    ForwarderQuery *query = &forwarder->queries[index];
+    forwarder->free_queries = query->next;
+    strcpy(query->name, name);
+    query->qtype = qtype;
+    query->hash = hash;
+    query->clients = client_index;
+    query->last = client_index;
+    query->next = forwarder->buckets[hash % FORWARDER_BUCKETS];
+    forwarder->buckets[hash % FORWARDER_BUCKETS] = index;
+
+    // A cached answer completes the query before resolver_submit returns. If
+    // the window is full, a cached answer can still be served, but anything
+    // else fails.
+    Resolver *resolver = &forwarder->resolver;
+    if (!resolver_submit(resolver, name, qtype))
+    {
+        ResolverQuery full;
+        memset(&full, 0, sizeof(full));
+        strcpy(full.name, name);
+        full.qtype = qtype;
+        uint8_t payload[DNS_PACKET_LENGTH];
+        int length = resolver->cache != NULL ? cache_lookup(resolver->cache, name, qtype, QCLASS_IN, payload) : -1;
+        forwarder_complete(resolver, &full, length >= 0 ? payload : NULL, length >= 0 ? length : 0);
+    }
+}
+
+// Validates a client query and answers or forwards it.
+static void forwarder_receive(Forwarder *forwarder, uint8_t *payload, int length, struct sockaddr_in *source)
+{
+    if (length < (int)sizeof(DNS_Header) || ((DNS_Header *)payload)->qr)
+    {
+        forwarder->dropped += 1;
+        return;
+    }
+    forwarder->queries_received += 1;
+
+    DNS_Header *header = (DNS_Header *)payload;
+    ForwarderClient client;
+    memset(&client, 0, sizeof(client));
+    client.address = *source;
+    client.id = header->id;
+    client.rd = header->rd;
+    client.limit = DNS_UDP_SIZE;
+
+    uint8_t reply[DNS_PACKET_LENGTH];
+    DNS_Parser parser;
+    DNS_Question question;
+    if (ntohs(header->q_count) != 1 || !dns_parse_begin(&parser, payload, length) || !dns_parse_question(&parser, &question) ||
+        !forwarder_name_is_plain(payload + sizeof(DNS_Header), parser.offset - sizeof(DNS_Header) - sizeof(Question)))
+    {
+        DNS_Header *error = (DNS_Header *)reply;
+        memset(error, 0, sizeof(DNS_Header));
+        error->id = client.id;
+        error->qr = 1;
+        error->rcode = RCODE_FORMERR;
+        forwarder_send(forwarder, source, reply, sizeof(DNS_Header));
+        return;
+    }
+    client.name_length = parser.offset - sizeof(DNS_Header) - sizeof(Question);
+    memcpy(client.name, payload + sizeof(DNS_Header), client.name_length);
+    if (header->opcode != 0 || question.qclass != QCLASS_IN)
+    {
+        forwarder_send(forwarder, source, reply, forwarder_write_empty(&client, question.qtype, question.qclass, RCODE_NOTIMP, false, reply));
+        return;
+    }
+
+    // An OPT record raises the size of reply the client can take over UDP
+    DNS_Record record;
+    while (dns_parse_record(&parser, &record))
+    {
+        if (record.type == QTYPE_OPT)
+        {
+            client.edns = true;
+            client.limit = record.class < DNS_UDP_SIZE ? DNS_UDP_SIZE : record.class > DNS_PACKET_LENGTH ? DNS_PACKET_LENGTH : record.class;
+        }
+    }
+
+    // Coalesce on the lowercase name, the same key the cache uses
+    char name[DNS_NAME_LENGTH];
+    int name_length = dns_name_to_string(&question.name, name);
+    dns_key_lower(name, name, name_length);
+    forwarder_submit(forwarder, &client, name, question.qtype);
+}
+
+// Drains queued client queries from the listening socket.
+static void forwarder_read(Resolver *resolver)
+{
+    Forwarder *forwarder = (Forwarder *)resolver->context;
+    uint8_t payload[DNS_PACKET_LENGTH];
+    for (int i = 0; i < FORWARDER_READS; i++)
+    {
+        struct sockaddr_in source;
+        socklen_t source_length = sizeof(source);
+        ssize_t length = recvfrom(forwarder->socket, payload, DNS_PACKET_LENGTH, MSG_DONTWAIT, (struct sockaddr *)&source, &source_length);
+        if (length < 0)
+        {
+            break;
+        }
+        forwarder_receive(forwarder, payload, length, &source);
+    }
+}
+
+///////////////////////////////////////////////////////////
+// Forwarder functions
+///////////////////////////////////////////////////////////
+
+bool forwarder_initialize(Forwarder *forwarder, char *listen, char *servers, uint32_t window)
+{
+    memset(forwarder, 0, sizeof(Forwarder));
+
+    forwarder->socket = resolver_bind(listen);
+    if (forwarder->socket < 0)
+    {
+        return false;
+    }
+
+    resolver_initialize(&forwarder->resolver, servers, window, forwarder_complete, forwarder);
+    resolver_watch(&forwarder->resolver, forwarder->socket, forwarder_read);
+
+    // One more query entry than the window, for the query being submitted
+    uint32_t capacity = forwarder->resolver.window + 1;
+    forwarder->queries = calloc(capacity, sizeof(ForwarderQuery));
+    forwarder->clients = calloc(FORWARDER_CLIENTS, sizeof(ForwarderClient));
+    if (forwarder->queries == NULL || forwarder->clients == NULL)
+    {
+        perror("Error: Failed to allocate forwarder.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        forwarder->queries[i].next = i + 1 < capacity ? (int32_t)i + 1 : -1;
+    }
+    for (uint32_t i = 0; i < FORWARDER_CLIENTS; i++)
+    {
+        forwarder->clients[i].next = i + 1 < FORWARDER_CLIENTS ? (int32_t)i + 1 : -1;
+    }
+    forwarder->free_queries = 0;
+    forwarder->free_clients = 0;
+    memset(forwarder->buckets, 0xFF, sizeof(forwarder->buckets));
+    return true;
+}
+
+void forwarder_destroy(Forwarder *forwarder)
+{
+    resolver_destroy(&forwarder->resolver);
+    close(forwarder->socket);
+    free(forwarder->queries);
+    free(forwarder->clients);
+    memset(forwarder, 0, sizeof(Forwarder));
+}
+
+void forwarder_poll(Forwarder *forwarder)
+{
+    resolver_poll(&forwarder->resolver);
+}
+
+void forwarder_print_statistics(Forwarder *forwarder)
+{
+    Resolver *resolver = &forwarder->resolver;
+    fprintf(stderr, "Info: Received %u client queries, dropped %u datagrams.\n", forwarder->queries_received, forwarder->dropped);
+    fprintf(stderr, "Info: Sent %u replies, %u truncated, %u SERVFAIL.\n", forwarder->replies, forwarder->truncated, forwarder->failures);
+    fprintf(stderr, "Info: Coalesced %u queries onto one already in flight.\n", forwarder->coalesced);
+    fprintf(stderr, "Info: Sent %u queries upstream, received %u responses.\n", resolver->sent, resolver->received);
+    fprintf(stderr, "Info: Retransmitted %u times, abandoned %u queries, %u retried over TCP.\n", resolver->retransmits, resolver->abandoned, resolver->truncated);
+    resolver_print_servers(resolver);
+    if (resolver->cache != NULL)
+    {
+        fprintf(stderr, "Info: Cache hits %u, misses %u.\n", resolver->cache->hits, resolver->cache->misses);
+    }
+}
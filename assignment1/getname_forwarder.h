@@ -0,0 +1,99 @@
+/**
+ * getname_forwarder.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_FORWARDER_INCLUDED
+#define GETNAME_FORWARDER_INCLUDED
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "getname_dns.h"
+#include "getname_resolver.h"
+
+///////////////////////////////////////////////////////////
+// Forwarder macros
+///////////////////////////////////////////////////////////
+
+#define FORWARDER_CLIENTS 16384  // clients that can wait on upstream answers at once
+#define FORWARDER_BUCKETS 8192   // buckets in the in flight query table
+#define FORWARDER_READS 64       // datagrams read per wakeup before polling again
+
+///////////////////////////////////////////////////////////
+// Forwarder structs
+///////////////////////////////////////////////////////////
+
+// A client query waiting on an upstream answer
+typedef struct
+{
+    struct sockaddr_in address;    // Where the reply goes
+    uint16_t id;                   // Client's DNS_Header id
+    uint8_t rd;                    // Client's recursion desired flag
+    bool edns;                     // True if the client sent an OPT record
+    uint16_t limit;                // Largest UDP reply the client accepts
+    uint8_t name[DNS_NAME_LENGTH]; // Question name as the client encoded it
+    uint16_t name_length;          // Encoded length of name
+    int32_t next;                  // Next client waiting on the same query, or -1
+} ForwarderClient;
+
+// An upstream query and the clients waiting on it
+typedef struct
+{
+    char name[DNS_NAME_LENGTH]; // Lowercase name sent upstream
+    uint16_t qtype;             // Type of record asked for
+    uint32_t hash;              // Hash of name and qtype
+    int32_t clients;            // First waiting client, or -1
+    int32_t last;               // Last waiting client, or -1
+    int32_t next;               // Next query in the same bucket, or next free query
+} ForwarderQuery;
+
+typedef struct
+{
+    int32_t socket;                     // UDP socket clients query
+    Resolver resolver;                  // Forwards misses to the upstream servers
+    ForwarderQuery *queries;            // Upstream queries, resolver.window in length
+    int32_t free_queries;               // First unused entry in queries, or -1
+    int32_t buckets[FORWARDER_BUCKETS]; // First query hashed to each bucket, or -1
+    ForwarderClient *clients;           // Waiting clients, FORWARDER_CLIENTS in length
+    int32_t free_clients;               // First unused entry in clients, or -1
+    uint32_t queries_received;          // Total client queries
+    uint32_t coalesced;                 // Client queries joined to one already in flight
+    uint32_t replies;                   // Total replies sent to clients
+    uint32_t truncated;                 // Replies truncated to fit the client's limit
+    uint32_t failures;                  // SERVFAIL replies for unanswered queries
+    uint32_t dropped;                   // Malformed or unanswerable client datagrams
+} Forwarder;
+
+///////////////////////////////////////////////////////////
+// Forwarder functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Binds a forwarder to listen, a port or ipaddr:port, and forwards the
+ * queries it can't answer from the cache to the comma separated upstream
+ * servers. Up to window distinct queries are kept in flight upstream. Returns
+ * false if the socket couldn't be bound.
+ */
+bool forwarder_initialize(Forwarder *forwarder, char *listen, char *servers, uint32_t window);
+
+/**
+ * Releases the socket, the resolver and the tables held by the forwarder.
+ */
+void forwarder_destroy(Forwarder *forwarder);
+
+/**
+ * Waits for client queries and upstream answers and handles whatever
+ * arrives. Client queries for a name and qtype already in flight upstream
+ * wait on that query rather than sending another.
+ */
+void forwarder_poll(Forwarder *forwarder);
+
+/**
+ * Prints the forwarder's counters to stderr.
+ */
+void forwarder_print_statistics(Forwarder *forwarder);
+
+#endif
@@ -0,0 +1,510 @@
+/**
+ * getname_iterator.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "getname_cache.h"
+#include "getname_dns.h"
+#include "getname_iterator.h"
+#include "getname_resolver.h"
+
+///////////////////////////////////////////////////////////
+// Iterator helpers
+///////////////////////////////////////////////////////////
+
+// Copies the dotted name into dest in lowercase, without a trailing dot
+// unless it's the root.
+static void iterator_lower(char *name, char *dest)
+{
+    int length = strnlen(name, DNS_NAME_LENGTH - 1);
+    dns_key_lower(dest, name, length);
+    if (length > 1 && dest[length - 1] == '.')
+    {
+        length -= 1;
+    }
+    dest[length] = '\0';
+    if (length == 0)
+    {
+        strcpy(dest, ".");
+    }
+}
+
+// Writes the name from a message in lowercase dotted form.
+static void iterator_name(DNS_Name *name, char *dest)
+{
+    char dotted[DNS_NAME_LENGTH];
+    dns_name_to_string(name, dotted);
+    iterator_lower(dotted, dest);
+}
+
+// Returns true if the lowercase name is the zone or below it.
+static bool iterator_within(char *name, char *zone)
+{
+    size_t name_length = strlen(name);
+    size_t zone_length = strlen(zone);
+    if (strcmp(zone, ".") == 0 || (name_length == zone_length && strcmp(name, zone) == 0))
+    {
+        return true;
+    }
+    return name_length > zone_length && name[name_length - zone_length - 1] == '.' && strcmp(name + name_length - zone_length, zone) == 0;
+}
+
+// Returns true if the cached delegation is for the zone name, whose hash and
+// length are given.
+static bool iterator_matches(IteratorZone *zone, char *name, size_t length, uint32_t hash)
+{
+    return zone->hash == hash && zone->name[length] == '\0' && dns_key_equals(zone->name, name, length);
+}
+
+// Returns the cached delegation for the lowercase zone name, or NULL if it
+// isn't cached or has lapsed.
+static IteratorZone *iterator_find(Iterator *iterator, char *name, int64_t now)
+{
+    size_t length = strlen(name);
+    uint32_t hash = dns_key_hash(name, length, 0);
+    for (uint32_t i = 0; i < ITERATOR_PROBES; i++)
+    {
+        IteratorZone *zone = &iterator->zones[(hash + i) & (ITERATOR_ZONES - 1)];
+        if (zone->expires > now && iterator_matches(zone, name, length, hash))
+        {
+            return zone;
+        }
+    }
+    return NULL;
+}
+
+// Caches the delegation, over any older copy of it, an empty or lapsed slot,
+// or failing those the slot that would lapse first.
+static void iterator_store(Iterator *iterator, IteratorZone *zone, int64_t now)
+{
+    size_t length = strlen(zone->name);
+    IteratorZone *victim = NULL;
+    for (uint32_t i = 0; i < ITERATOR_PROBES; i++)
+    {
+        IteratorZone *slot = &iterator->zones[(zone->hash + i) & (ITERATOR_ZONES - 1)];
+        if (iterator_matches(slot, zone->name, length, zone->hash))
+        {
+            victim = slot;
+            break;
+        }
+        if (victim == NULL || (victim->expires > now && slot->expires < victim->expires))
+        {
+            victim = slot;
+        }
+    }
+    *victim = *zone;
+}
+
+// Points the frame at the closest delegation known for its name.
+static void iterator_begin(Iterator *iterator, IteratorFrame *frame)
+{
+    char name[DNS_NAME_LENGTH];
+    iterator_lower(frame->name, name);
+    int64_t now = resolver_now();
+    frame->zone = iterator->root;
+    for (char *suffix = name; *suffix != '\0';)
+    {
+        IteratorZone *zone = iterator_find(iterator, suffix, now);
+        if (zone != NULL)
+        {
+            frame->zone = *zone;
+            iterator->shortcuts += 1;
+            break;
+        }
+        char *dot = strchr(suffix, '.');
+        if (dot == NULL)
+        {
+            break;
+        }
+        suffix = dot + 1;
+    }
+    frame->tried = 0;
+    frame->next_name = 0;
+}
+
+// Reads a referral from the response: NS records in the authority section
+// for a zone below the one the frame asked and at or above its name. Glue for
+// the servers is only taken from the additional section if it's inside the
+// zone that was asked, since that server has no say over anything else.
+// Returns false if the response isn't a usable referral.
+static bool iterator_referral(Iterator *iterator, IteratorFrame *frame, uint8_t *payload, int length, IteratorZone *zone)
+{
+    char name[DNS_NAME_LENGTH];
+    char owner[DNS_NAME_LENGTH];
+    char servers[ITERATOR_SERVERS][DNS_NAME_LENGTH];
+    bool glued[ITERATOR_SERVERS];
+    uint32_t server_count = 0;
+    uint32_t ttl = UINT32_MAX;
+    iterator_lower(frame->name, name);
+    memset(zone, 0, sizeof(IteratorZone));
+
+    DNS_Parser parser;
+    DNS_Record record;
+    DNS_Name target;
+    dns_parse_begin(&parser, payload, length);
+    while (dns_parse_record(&parser, &record))
+    {
+        if (record.class != QCLASS_IN)
+        {
+            continue;
+        }
+        if (record.section == SECTION_AUTHORITY && record.type == QTYPE_NS)
+        {
+            iterator_name(&record.name, owner);
+            if (zone->name[0] == '\0')
+            {
+                if (strcmp(owner, frame->zone.name) == 0 || !iterator_within(owner, frame->zone.name) || !iterator_within(name, owner))
+                {
+                    continue;
+                }
+                strcpy(zone->name, owner);
+            }
+            if (strcmp(owner, zone->name) != 0 || server_count == ITERATOR_SERVERS ||
+                dns_name_at(payload, record.rdata + record.data_len, record.rdata, &target) < 0)
+            {
+                continue;
+            }
+            iterator_name(&target, servers[server_count]);
+            glued[server_count++] = false;
+            ttl = record.ttl < ttl ? record.ttl : ttl;
+        }
+        else if (record.section == SECTION_ADDITIONAL && record.type == QTYPE_A && record.data_len == 4 && server_count > 0)
+        {
+            iterator_name(&record.name, owner);
+            if (!iterator_within(owner, frame->zone.name))
+            {
+                continue;
+            }
+            for (uint32_t i = 0; i < server_count && zone->server_count < ITERATOR_SERVERS; i++)
+            {
+                if (strcmp(owner, servers[i]) == 0)
+                {
+                    struct sockaddr_in address;
+                    memset(&address, 0, sizeof(address));
+                    address.sin_family = AF_INET;
+                    address.sin_port = iterator->port;
+                    memcpy(&address.sin_addr, payload + record.rdata, 4);
+                    zone->servers[zone->server_count++] = resolver_add_server(iterator->resolver, &address);
+                    glued[i] = true;
+                    break;
+                }
+            }
+        }
+    }
+    if (server_count == 0)
+    {
+        return false;
+    }
+
+    // Servers without glue are looked up if the ones with it don't answer
+    for (uint32_t i = 0; i < server_count && zone->name_count < ITERATOR_NAMES; i++)
+    {
+        if (!glued[i])
+        {
+            strcpy(zone->names[zone->name_count++], servers[i]);
+        }
+    }
+    zone->hash = dns_key_hash(zone->name, strlen(zone->name), 0);
+    zone->expires = resolver_now() + (int64_t)ttl * 1000;
+    return true;
+}
+
+// Returns the untried server of the frame with the lowest smoothed round trip
+// time, counting unmeasured servers as fastest, or -1 if all have been tried.
+static int32_t iterator_pick_server(Iterator *iterator, IteratorFrame *frame)
+{
+    int32_t best = -1;
+    double best_srtt = 0;
+    for (uint32_t i = 0; i < frame->zone.server_count; i++)
+    {
+        ResolverServer *server = &iterator->resolver->servers[frame->zone.servers[i]];
+        double srtt = server->sampled ? server->srtt : 0;
+        if (!(frame->tried & (1u << i)) && (best < 0 || srtt < best_srtt))
+        {
+            best = i;
+            best_srtt = srtt;
+        }
+    }
+    return best;
+}
+
+static void iterator_finish(Iterator *iterator, uint32_t index, uint8_t *payload, int length);
+
+// Sends the frame's query to the next server of the zone it's at. Once they
+// have all been tried, looks up the address of a server named without glue,
+// nesting up to ITERATOR_DEPTH lookups. A lookup out of servers fails, which
+// for a nested one moves the frame below it on.
+static void iterator_ask(Iterator *iterator, uint32_t index)
+{
+    IteratorTask *task = &iterator->tasks[index];
+    while (true)
+    {
+        IteratorFrame *frame = &task->frames[task->depth];
+        int32_t server = iterator_pick_server(iterator, frame);
+        if (server >= 0)
+        {
+            frame->tried |= 1u << server;
+            iterator->queries += 1;
+            resolver_submit_to(iterator->resolver, frame->name, frame->qtype, frame->zone.servers[server], index);
+            return;
+        }
+        if (frame->next_name < frame->zone.name_count && task->depth < ITERATOR_DEPTH)
+        {
+            IteratorFrame *lookup = &task->frames[++task->depth];
+            strcpy(lookup->name, frame->zone.names[frame->next_name++]);
+            lookup->qtype = QTYPE_A;
+            lookup->steps = 0;
+            iterator_begin(iterator, lookup);
+            iterator->glueless += 1;
+            continue;
+        }
+        if (task->depth == 0)
+        {
+            iterator_finish(iterator, index, NULL, 0);
+            return;
+        }
+        task->depth -= 1;
+    }
+}
+
+// Adds the addresses a nested lookup found to the frame that needed them,
+// and to the cached copy of its delegation.
+static void iterator_add_servers(Iterator *iterator, IteratorFrame *frame, uint8_t *payload, int length)
+{
+    DNS_Parser parser;
+    DNS_Question question;
+    DNS_Record records[ITERATOR_SERVERS];
+    if (!dns_parse_begin(&parser, payload, length) || !dns_parse_question(&parser, &question))
+    {
+        return;
+    }
+    DNS_Name canonical = question.name;
+    int count = dns_follow_cnames(payload, length, &canonical, QTYPE_A, records, ITERATOR_SERVERS);
+    IteratorZone *cached = iterator_find(iterator, frame->zone.name, resolver_now());
+    for (int i = 0; i < count; i++)
+    {
+        if (records[i].data_len != 4 || frame->zone.server_count == ITERATOR_SERVERS)
+        {
+            continue;
+        }
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = iterator->port;
+        memcpy(&address.sin_addr, payload + records[i].rdata, 4);
+        uint32_t server = resolver_add_server(iterator->resolver, &address);
+        frame->zone.servers[frame->zone.server_count++] = server;
+        if (cached != NULL && cached->server_count < ITERATOR_SERVERS)
+        {
+            cached->servers[cached->server_count++] = server;
+        }
+    }
+}
+
+// Completes the frame being worked on with the response, or with NULL if it
+// ran out of servers. A nested lookup hands its addresses down and the frame
+// below carries on. The lookup itself is answered through the callback, with
+// a SERVFAIL standing in for no response.
+static void iterator_finish(Iterator *iterator, uint32_t index, uint8_t *payload, int length)
+{
+    IteratorTask *task = &iterator->tasks[index];
+    if (task->depth > 0)
+    {
+        task->depth -= 1;
+        if (payload != NULL)
+        {
+            iterator_add_servers(iterator, &task->frames[task->depth], payload, length);
+        }
+        iterator_ask(iterator, index);
+        return;
+    }
+
+    uint8_t failure[DNS_PACKET_LENGTH];
+    Resolver *resolver = iterator->resolver;
+    int64_t now = resolver_now_us();
+    if (resolver->metrics != NULL)
+    {
+        MetricsQtype *qtype = metrics_qtype(resolver->metrics, task->qtype);
+        metrics_count(payload != NULL ? &qtype->answered : &qtype->abandoned);
+        if (payload != NULL)
+        {
+            histogram_record(&qtype->latency, now - task->submitted_us);
+        }
+    }
+    if (payload == NULL)
+    {
+        length = dns_write_query(failure, 0, task->name, task->qtype, 0);
+        DNS_Header *header = (DNS_Header *)failure;
+        header->qr = 1;
+        header->ra = 1;
+        header->rcode = RCODE_SERVFAIL;
+        payload = failure;
+        iterator->failures += 1;
+    }
+    else if (resolver->cache != NULL)
+    {
+        cache_insert(resolver->cache, task->name, task->qtype, QCLASS_IN, payload, length);
+    }
+
+    ResolverQuery query;
+    memset(&query, 0, sizeof(query));
+    strcpy(query.name, task->name);
+    query.qtype = task->qtype;
+    query.id = ntohs(((DNS_Header *)payload)->id);
+    query.active = true;
+    task->active = false;
+    iterator->free_tasks[iterator->free_length++] = index;
+    if (resolver->callback != NULL)
+    {
+        resolver->callback(resolver, &query, payload, length);
+    }
+    if (resolver->metrics != NULL)
+    {
+        histogram_record(&resolver->metrics->processing, resolver_now_us() - now);
+    }
+}
+
+///////////////////////////////////////////////////////////
+// Iterator functions
+///////////////////////////////////////////////////////////
+
+void iterator_attach(Resolver *resolver)
+{
+    Iterator *iterator = calloc(1, sizeof(Iterator));
+    if (iterator == NULL)
+    {
+        perror("Error: Failed to allocate iterator.\n");
+        exit(EXIT_FAILURE);
+    }
+    iterator->resolver = resolver;
+    iterator->zones = calloc(ITERATOR_ZONES, sizeof(IteratorZone));
+    iterator->tasks = calloc(resolver->window, sizeof(IteratorTask));
+    iterator->free_tasks = malloc(resolver->window * sizeof(uint32_t));
+    if (iterator->zones == NULL || iterator->tasks == NULL || iterator->free_tasks == NULL)
+    {
+        perror("Error: Failed to allocate iterator.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < resolver->window; i++)
+    {
+        iterator->free_tasks[i] = resolver->window - i - 1;
+    }
+    iterator->free_length = resolver->window;
+
+    // Each lookup has at most one query in flight, so the resolver's window
+    // always has room for it
+    strcpy(iterator->root.name, ".");
+    iterator->root.expires = INT64_MAX;
+    for (uint32_t i = 0; i < resolver->server_count && i < ITERATOR_SERVERS; i++)
+    {
+        iterator->root.servers[iterator->root.server_count++] = i;
+    }
+    iterator->port = resolver->servers[0].address.sin_port;
+    resolver->iterator = iterator;
+}
+
+void iterator_destroy(Iterator *iterator)
+{
+    free(iterator->zones);
+    free(iterator->tasks);
+    free(iterator->free_tasks);
+    free(iterator);
+}
+
+bool iterator_submit(Iterator *iterator, char *name, uint16_t qtype)
+{
+    if (iterator->free_length == 0)
+    {
+        return false;
+    }
+    uint32_t index = iterator->free_tasks[--iterator->free_length];
+    IteratorTask *task = &iterator->tasks[index];
+    strncpy(task->name, name, DNS_NAME_LENGTH - 1);
+    task->name[DNS_NAME_LENGTH - 1] = '\0';
+    task->qtype = qtype;
+    task->active = true;
+    task->submitted_us = resolver_now_us();
+    task->depth = 0;
+
+    IteratorFrame *frame = &task->frames[0];
+    strcpy(frame->name, task->name);
+    frame->qtype = qtype;
+    frame->steps = 0;
+    iterator_begin(iterator, frame);
+    iterator->lookups += 1;
+    iterator_ask(iterator, index);
+    return true;
+}
+
+void iterator_receive(Iterator *iterator, ResolverQuery *query, uint8_t *payload, int length)
+{
+    IteratorTask *task = &iterator->tasks[query->tag];
+    IteratorFrame *frame = &task->frames[task->depth];
+
+    // A server that doesn't answer, or can't, is a reason to ask the next one
+    DNS_Header *header = (DNS_Header *)payload;
+    DNS_Parser parser;
+    DNS_Question question;
+    if (payload == NULL || !dns_parse_begin(&parser, payload, length) || !dns_parse_question(&parser, &question) ||
+        (header->rcode != RCODE_NOERROR && header->rcode != RCODE_NXDOMAIN))
+    {
+        iterator_ask(iterator, query->tag);
+        return;
+    }
+
+    // An answer is final unless its CNAME chain leads out of what the server
+    // knows, in which case the target is chased from the top
+    if (header->rcode == RCODE_NXDOMAIN || header->ans_count != 0)
+    {
+        DNS_Record record;
+        DNS_Name canonical = question.name;
+        if (header->rcode == RCODE_NOERROR && frame->steps < ITERATOR_STEPS &&
+            dns_follow_cnames(payload, length, &canonical, frame->qtype, &record, 1) == 0 && !dns_name_equals(&canonical, &question.name))
+        {
+            dns_name_to_string(&canonical, frame->name);
+            frame->steps += 1;
+            iterator->cnames += 1;
+            iterator_begin(iterator, frame);
+            iterator_ask(iterator, query->tag);
+            return;
+        }
+        iterator_finish(iterator, query->tag, payload, length);
+        return;
+    }
+
+    // An empty answer is NODATA from a server with authority, or a referral
+    // further down the tree
+    if (header->aa)
+    {
+        iterator_finish(iterator, query->tag, payload, length);
+        return;
+    }
+    IteratorZone zone;
+    if (frame->steps < ITERATOR_STEPS && iterator_referral(iterator, frame, payload, length, &zone))
+    {
+        iterator_store(iterator, &zone, resolver_now());
+        frame->zone = zone;
+        frame->tried = 0;
+        frame->next_name = 0;
+        frame->steps += 1;
+        iterator->referrals += 1;
+    }
+    iterator_ask(iterator, query->tag);
+}
+
+void iterator_print_statistics(Iterator *iterator)
+{
+    fprintf(stderr, "Info: Iterated %u lookups with %u queries, following %u referrals and %u CNAMEs.\n",
+            iterator->lookups, iterator->queries, iterator->referrals, iterator->cnames);
+    fprintf(stderr, "Info: Started %u lookups from cached delegations, looked up %u servers without glue, failed %u lookups.\n",
+            iterator->shortcuts, iterator->glueless, iterator->failures);
+}
@@ -0,0 +1,120 @@
+/**
+ * getname_iterator.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_ITERATOR_INCLUDED
+#define GETNAME_ITERATOR_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "getname_dns.h"
+#include "getname_resolver.h"
+
+///////////////////////////////////////////////////////////
+// Iterator macros
+///////////////////////////////////////////////////////////
+
+#define ITERATOR_ZONES 4096 // delegations the cache holds, a power of two
+#define ITERATOR_PROBES 4   // cache slots a delegation may land in
+#define ITERATOR_SERVERS 8  // server addresses kept per delegation
+#define ITERATOR_NAMES 4    // server names without glue kept per delegation
+#define ITERATOR_DEPTH 3    // nested lookups of server names without glue
+#define ITERATOR_STEPS 24   // referrals and CNAMEs followed per lookup
+
+///////////////////////////////////////////////////////////
+// Iterator structs
+///////////////////////////////////////////////////////////
+
+// The servers a zone is delegated to
+typedef struct
+{
+    char name[DNS_NAME_LENGTH];                  // Lowercase zone name, "." for the root
+    uint32_t hash;                               // Hash of name
+    int64_t expires;                             // Monotonic millisecond the delegation lapses, 0 if unused
+    uint32_t servers[ITERATOR_SERVERS];          // Resolver server index of each address
+    uint32_t server_count;                       // Number of entries in servers
+    char names[ITERATOR_NAMES][DNS_NAME_LENGTH]; // Servers named without glue
+    uint32_t name_count;                         // Number of entries in names
+} IteratorZone;
+
+// One name being chased down the tree
+typedef struct
+{
+    char name[DNS_NAME_LENGTH]; // Name asked for, after any CNAMEs
+    uint16_t qtype;             // Type of record asked for
+    IteratorZone zone;          // Copy of the delegation being asked
+    uint32_t tried;             // Bit per entry of zone.servers already asked
+    uint32_t next_name;         // Next entry of zone.names to look up
+    uint32_t steps;             // Referrals and CNAMEs followed
+} IteratorFrame;
+
+// A lookup, with a frame for each nested lookup of a server's address
+typedef struct
+{
+    char name[DNS_NAME_LENGTH];                 // Name originally asked for
+    uint16_t qtype;                             // Type originally asked for
+    bool active;                                // True while the lookup is running
+    int64_t submitted_us;                       // Monotonic microsecond the lookup was submitted
+    uint32_t depth;                             // Index of the frame being worked on
+    IteratorFrame frames[ITERATOR_DEPTH + 1];   // The lookup, then nested lookups
+} IteratorTask;
+
+struct Iterator
+{
+    Resolver *resolver;   // Resolver the queries go through
+    uint16_t port;        // Port, network order, servers learned from referrals are asked on
+    IteratorZone root;    // The root hints
+    IteratorZone *zones;  // Delegation cache, ITERATOR_ZONES in length
+    IteratorTask *tasks;  // Lookup slots, the resolver's window in length
+    uint32_t *free_tasks; // Stack of unused lookup slots
+    uint32_t free_length; // Number of entries in free_tasks
+    uint32_t lookups;     // Total lookups started
+    uint32_t queries;     // Total queries sent to servers
+    uint32_t referrals;   // Total referrals followed
+    uint32_t cnames;      // Total CNAMEs chased out of a zone
+    uint32_t shortcuts;   // Total lookups started below the root from the cache
+    uint32_t glueless;    // Total lookups of server names without glue
+    uint32_t failures;    // Total lookups that ran out of servers
+};
+
+///////////////////////////////////////////////////////////
+// Iterator functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Switches the resolver to iterative resolution. Its servers become the root
+ * hints, and every query is chased down from the closest delegation known,
+ * following referrals, glue and CNAMEs until a server answers with authority.
+ * Servers learned from referrals are asked on the port of the first hint, so
+ * a stand-in hierarchy can run on loopback addresses. The resolver destroys
+ * the iterator.
+ */
+void iterator_attach(Resolver *resolver);
+
+/**
+ * Releases the iterator's tables.
+ */
+void iterator_destroy(Iterator *iterator);
+
+/**
+ * Starts a lookup for records of qtype owned by the name. The resolver's
+ * callback receives the final answer, or a SERVFAIL if no server could give
+ * one. Returns false if every lookup slot is busy.
+ */
+bool iterator_submit(Iterator *iterator, char *name, uint16_t qtype);
+
+/**
+ * Takes the response to one of the iterator's queries, or NULL if it was
+ * abandoned, and moves its lookup along.
+ */
+void iterator_receive(Iterator *iterator, ResolverQuery *query, uint8_t *payload, int length);
+
+/**
+ * Prints the iterator's counters to stderr.
+ */
+void iterator_print_statistics(Iterator *iterator);
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * getname_metrics.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "getname_cache.h"
+#include "getname_dns.h"
+#include "getname_metrics.h"
+
+///////////////////////////////////////////////////////////
+// Metrics helpers
+///////////////////////////////////////////////////////////
+
+// Values below HISTOGRAM_EXACT get a bucket each. Above it, each power of two
+// is split into HISTOGRAM_SUB_BUCKETS equal buckets, so a bucket is never
+// wider than about 3% of the values in it.
+static uint32_t histogram_index(uint64_t value)
+{
+    if (value < HISTOGRAM_EXACT)
+    {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - 5; // 2^5 == HISTOGRAM_SUB_BUCKETS
+    uint32_t index = HISTOGRAM_EXACT + (shift - 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Returns the smallest value that lands in the bucket.
+static uint64_t histogram_lowest(uint32_t index)
+{
+    if (index < HISTOGRAM_EXACT)
+    {
+        return index;
+    }
+    uint32_t shift = (index - HISTOGRAM_EXACT) / HISTOGRAM_SUB_BUCKETS + 1;
+    uint64_t sub_bucket = (index - HISTOGRAM_EXACT) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return sub_bucket << shift;
+}
+
+// Returns the largest value that lands in the bucket.
+static uint64_t histogram_highest(uint32_t index)
+{
+    return index + 1 < HISTOGRAM_BUCKETS ? histogram_lowest(index + 1) - 1 : UINT64_MAX;
+}
+
+static uint32_t metrics_load(uint32_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void metrics_write_histogram(FILE *output, const char *name, Histogram *histogram)
+{
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    uint64_t total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    fprintf(output, "\"%s\":{\"count\":%" PRIu64 ",\"mean\":%.1f", name, count, count > 0 ? (double)total / count : 0.0);
+    double percentiles[] = {50, 90, 99, 99.9};
+    const char *labels[] = {"p50", "p90", "p99", "p999"};
+    for (int i = 0; i < 4; i++)
+    {
+        fprintf(output, ",\"%s\":%" PRIu64, labels[i], histogram_percentile(histogram, percentiles[i]));
+    }
+    fprintf(output, ",\"max\":%" PRIu64 ",\"buckets\":[", __atomic_load_n(&histogram->max, __ATOMIC_RELAXED));
+    bool first = true;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        uint32_t bucket = metrics_load(&histogram->buckets[i]);
+        if (bucket > 0)
+        {
+            fprintf(output, "%s[%" PRIu64 ",%u]", first ? "" : ",", histogram_lowest(i), bucket);
+            first = false;
+        }
+    }
+    fprintf(output, "]}");
+}
+
+///////////////////////////////////////////////////////////
+// Metrics functions
+///////////////////////////////////////////////////////////
+
+void metrics_count(uint32_t *counter)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+void histogram_record(Histogram *histogram, int64_t value)
+{
+    uint64_t recorded = value < 0 ? 0 : value;
+    __atomic_add_fetch(&histogram->buckets[histogram_index(recorded)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, recorded, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (recorded > max && !__atomic_compare_exchange_n(&histogram->max, &max, recorded, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+uint64_t histogram_percentile(Histogram *histogram, double percentile)
+{
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    if (count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100 * count + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += metrics_load(&histogram->buckets[i]);
+        if (seen >= rank)
+        {
+            uint64_t highest = histogram_highest(i);
+            return highest < max ? highest : max;
+        }
+    }
+    return max;
+}
+
+Metrics *metrics_create()
+{
+    Metrics *metrics = calloc(1, sizeof(Metrics));
+    if (metrics != NULL)
+    {
+        pthread_mutex_init(&metrics->lock, NULL);
+    }
+    return metrics;
+}
+
+void metrics_destroy(Metrics *metrics)
+{
+    pthread_mutex_destroy(&metrics->lock);
+    free(metrics);
+}
+
+MetricsServer *metrics_server(Metrics *metrics, struct sockaddr_in *address)
+{
+    MetricsServer *found = NULL;
+    pthread_mutex_lock(&metrics->lock);
+    for (uint32_t i = 0; i < metrics->server_count && found == NULL; i++)
+    {
+        struct sockaddr_in *known = &metrics->servers[i].address;
+        if (known->sin_addr.s_addr == address->sin_addr.s_addr && known->sin_port == address->sin_port)
+        {
+            found = &metrics->servers[i];
+        }
+    }
+    if (found == NULL && metrics->server_count < METRICS_SERVERS)
+    {
+        found = &metrics->servers[metrics->server_count++];
+        found->address = *address;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+    return found;
+}
+
+MetricsQtype *metrics_qtype(Metrics *metrics, uint16_t qtype)
+{
+    return &metrics->qtypes[qtype < METRICS_QTYPES ? qtype : METRICS_QTYPES - 1];
+}
+
+void metrics_write(Metrics *metrics, Cache *cache, FILE *output)
+{
+    pthread_mutex_lock(&metrics->lock);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    metrics->dumps += 1;
+    fprintf(output, "{\"time\":%ld.%03ld,\"dump\":%u", (long)now.tv_sec, now.tv_nsec / 1000000, metrics->dumps);
+    fprintf(output, ",\"queries\":%u,\"retransmits\":%u,\"timeouts\":%u,\"abandoned\":%u,\"truncated\":%u",
+            metrics_load(&metrics->queries), metrics_load(&metrics->retransmits), metrics_load(&metrics->timeouts),
+            metrics_load(&metrics->abandoned), metrics_load(&metrics->truncated));
+    if (cache != NULL)
+    {
+        fprintf(output, ",\"cache_hits\":%u,\"cache_misses\":%u", metrics_load(&cache->hits), metrics_load(&cache->misses));
+    }
+
+    fprintf(output, ",\"servers\":[");
+    for (uint32_t i = 0; i < metrics->server_count; i++)
+    {
+        MetricsServer *server = &metrics->servers[i];
+        fprintf(output, "%s{\"address\":\"%s:%hu\",\"sent\":%u,\"answered\":%u,\"timeouts\":%u,", i > 0 ? "," : "",
+                inet_ntoa(server->address.sin_addr), ntohs(server->address.sin_port),
+                metrics_load(&server->sent), metrics_load(&server->answered), metrics_load(&server->timeouts));
+        metrics_write_histogram(output, "rtt_us", &server->rtt);
+        fprintf(output, "}");
+    }
+
+    fprintf(output, "],\"qtypes\":[");
+    bool first = true;
+    for (uint32_t i = 0; i < METRICS_QTYPES; i++)
+    {
+        MetricsQtype *qtype = &metrics->qtypes[i];
+        uint32_t answered = metrics_load(&qtype->answered);
+        uint32_t abandoned = metrics_load(&qtype->abandoned);
+        if (answered == 0 && abandoned == 0)
+        {
+            continue;
+        }
+        fprintf(output, "%s{\"qtype\":\"%s\",\"answered\":%u,\"abandoned\":%u,", first ? "" : ",",
+                i == METRICS_QTYPES - 1 ? "OTHER" : dns_qtype_to_string(i), answered, abandoned);
+        metrics_write_histogram(output, "latency_us", &qtype->latency);
+        fprintf(output, "}");
+        first = false;
+    }
+    fprintf(output, "],");
+    metrics_write_histogram(output, "processing_us", &metrics->processing);
+    fprintf(output, "}\n");
+    fflush(output);
+    pthread_mutex_unlock(&metrics->lock);
+}
@@ -0,0 +1,126 @@
+/**
+ * getname_metrics.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_METRICS_INCLUDED
+#define GETNAME_METRICS_INCLUDED
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "getname_cache.h"
+
+///////////////////////////////////////////////////////////
+// Metrics macros
+///////////////////////////////////////////////////////////
+
+#define HISTOGRAM_EXACT 64       // values below this are recorded exactly
+#define HISTOGRAM_SUB_BUCKETS 32 // buckets per power of two above HISTOGRAM_EXACT, about 3% wide
+#define HISTOGRAM_BUCKETS 1024   // buckets, covering up to 2^36 microseconds
+#define METRICS_SERVERS 64       // servers tracked individually
+#define METRICS_QTYPES 257       // qtypes up to ANY tracked individually, larger ones share the last
+
+///////////////////////////////////////////////////////////
+// Metrics structs
+///////////////////////////////////////////////////////////
+
+// Log-linear histogram of microsecond values, in the manner of HdrHistogram.
+// Every field is updated atomically, so threads can record into one
+// histogram while another reads it.
+typedef struct
+{
+    uint64_t count;                      // Values recorded
+    uint64_t total;                      // Sum of the values recorded
+    uint64_t max;                        // Largest value recorded
+    uint32_t buckets[HISTOGRAM_BUCKETS]; // Values recorded in each bucket
+} Histogram;
+
+// What was seen of one server, over every resolver sharing the metrics
+typedef struct
+{
+    struct sockaddr_in address; // The server
+    uint32_t sent;              // Sends, including retransmits
+    uint32_t answered;          // Responses received
+    uint32_t timeouts;          // Sends that timed out
+    Histogram rtt;              // Round trip of queries answered on their first send
+} MetricsServer;
+
+// What was seen of one qtype
+typedef struct
+{
+    uint32_t answered;  // Queries answered by a server
+    uint32_t abandoned; // Queries never answered
+    Histogram latency;  // Submission to answer, over every send
+} MetricsQtype;
+
+// Latencies and counters shared by every resolver of a run
+typedef struct
+{
+    pthread_mutex_t lock;                   // Guards adding servers, and writing
+    MetricsServer servers[METRICS_SERVERS]; // Servers in the order first seen
+    uint32_t server_count;                  // Number of entries in servers
+    MetricsQtype qtypes[METRICS_QTYPES];    // Indexed by qtype
+    Histogram processing;                   // Time spent in the callback per answer
+    uint32_t queries;                       // Queries sent, not counting retransmits
+    uint32_t retransmits;                   // Retransmitted sends
+    uint32_t timeouts;                      // Sends that timed out
+    uint32_t abandoned;                     // Queries that ran out of time or attempts
+    uint32_t truncated;                     // Queries retried over TCP
+    uint32_t dumps;                         // Snapshots written
+} Metrics;
+
+///////////////////////////////////////////////////////////
+// Metrics functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Adds one to a counter of the metrics, which other threads may share.
+ */
+void metrics_count(uint32_t *counter);
+
+/**
+ * Records a value in microseconds. Values past the last bucket land in it.
+ */
+void histogram_record(Histogram *histogram, int64_t value);
+
+/**
+ * Returns the highest value equivalent to the one at the percentile, or 0 if
+ * nothing is recorded.
+ */
+uint64_t histogram_percentile(Histogram *histogram, double percentile);
+
+/**
+ * Allocates an empty set of metrics, or returns NULL if it can't.
+ */
+Metrics *metrics_create();
+
+/**
+ * Releases the metrics.
+ */
+void metrics_destroy(Metrics *metrics);
+
+/**
+ * Returns the entry for the server, adding it if it's new, or NULL if
+ * METRICS_SERVERS are already tracked.
+ */
+MetricsServer *metrics_server(Metrics *metrics, struct sockaddr_in *address);
+
+/**
+ * Returns the entry for the qtype.
+ */
+MetricsQtype *metrics_qtype(Metrics *metrics, uint16_t qtype);
+
+/**
+ * Writes a snapshot of the metrics, and the cache's counters if it's given,
+ * as one line of JSON. Each histogram carries its count, mean, percentiles and
+ * max, along with the bounds and counts of its non-empty buckets so it can be
+ * rebuilt exactly.
+ */
+void metrics_write(Metrics *metrics, Cache *cache, FILE *output);
+
+#endif
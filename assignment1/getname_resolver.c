@@ -0,0 +1,1245 @@
+/**
+ * getname_resolver.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#define _GNU_SOURCE // sendmmsg and recvmmsg
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "getname_dns.h"
+#include "getname_iterator.h"
+#include "getname_resolver.h"
+
+///////////////////////////////////////////////////////////
+// Resolver helpers
+///////////////////////////////////////////////////////////
+
+// Steps the id sequence. The multiplier and increment give a full period
+// modulo 2^16 so every id is visited before one repeats.
+static uint16_t resolver_next_id(Resolver *resolver)
+{
+    uint16_t id = resolver->next_id;
+    resolver->next_id = (uint16_t)(resolver->next_id * 25173 + 13849);
+    return id;
+}
+
+static void resolver_release(Resolver *resolver, uint32_t slot)
+{
+    ResolverQuery *query = &resolver->queries[slot];
+    resolver->slot_by_id[query->id] = -1;
+    query->active = false;
+    resolver->free_slots[resolver->free_length++] = slot;
+    resolver->in_flight -= 1;
+}
+
+// Hands the response, or NULL if the query was abandoned, to whoever is
+// waiting on it and frees the query's slot. An iterative query's slot is
+// freed first, since the iterator usually sends its next query from the call.
+static void resolver_complete(Resolver *resolver, uint32_t slot, uint8_t *payload, int length)
+{
+    ResolverQuery *query = &resolver->queries[slot];
+    if (query->iterative)
+    {
+        ResolverQuery finished = *query;
+        resolver_release(resolver, slot);
+        iterator_receive(resolver->iterator, &finished, payload, length);
+        return;
+    }
+
+    // Time the callback too, since parsing and printing the answer is part of
+    // what a bulk run pays per query
+    int64_t now = resolver_now_us();
+    if (resolver->metrics != NULL)
+    {
+        MetricsQtype *qtype = metrics_qtype(resolver->metrics, query->qtype);
+        metrics_count(payload != NULL ? &qtype->answered : &qtype->abandoned);
+        if (payload != NULL)
+        {
+            histogram_record(&qtype->latency, now - query->submitted_us);
+        }
+    }
+    if (resolver->callback != NULL)
+    {
+        resolver->callback(resolver, query, payload, length);
+    }
+    if (resolver->metrics != NULL && payload != NULL)
+    {
+        histogram_record(&resolver->metrics->processing, resolver_now_us() - now);
+    }
+    resolver_release(resolver, slot);
+}
+
+// Reports a query that can't be sent to the callback as though abandoned,
+// with the error status it was rejected with, so every name submitted still
+// gets exactly one result.
+static void resolver_reject(Resolver *resolver, char *name, uint16_t qtype, const char *error)
+{
+    ResolverQuery query;
+    memset(&query, 0, sizeof(query));
+    strncpy(query.name, name, DNS_NAME_LENGTH - 1);
+    query.qtype = qtype;
+    query.error = error;
+    if (resolver->callback != NULL)
+    {
+        resolver->callback(resolver, &query, NULL, 0);
+    }
+}
+
+// Returns the server's entry in the metrics, or NULL if there are none or
+// the metrics are tracking as many servers as they can.
+static MetricsServer *resolver_server_metrics(Resolver *resolver, uint32_t server_index)
+{
+    ResolverServer *server = &resolver->servers[server_index];
+    if (resolver->metrics != NULL && server->metrics == NULL)
+    {
+        server->metrics = metrics_server(resolver->metrics, &server->address);
+    }
+    return server->metrics;
+}
+
+// Checks that the response echoes the name we asked for, so a stray response
+// that happens to reuse an id isn't attributed to the wrong query.
+static bool resolver_question_matches(ResolverQuery *query, uint8_t *payload, int length)
+{
+    DNS_Parser parser;
+    DNS_Question question;
+    if (!dns_parse_begin(&parser, payload, length) || !dns_parse_question(&parser, &question))
+    {
+        return false;
+    }
+    return question.qtype == query->qtype && dns_name_equals_string(&question.name, query->name);
+}
+
+// Parses an ipaddr[:port] entry.
+static bool resolver_parse_server(char *entry, struct sockaddr_in *address)
+{
+    char host[64];
+    uint16_t port = DNS_PORT;
+    if (sscanf(entry, "%63[^:]:%hu", host, &port) < 1)
+    {
+        return false;
+    }
+    memset(address, 0, sizeof(struct sockaddr_in));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    return inet_pton(AF_INET, host, &address->sin_addr) == 1;
+}
+
+static int32_t resolver_find_server(Resolver *resolver, struct sockaddr_in *source)
+{
+    for (uint32_t i = 0; i < resolver->server_count; i++)
+    {
+        struct sockaddr_in *address = &resolver->servers[i].address;
+        if (address->sin_addr.s_addr == source->sin_addr.s_addr && address->sin_port == source->sin_port)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Retransmit timeout from the server's smoothed round trip time (RFC 6298).
+static int64_t resolver_server_rto(ResolverServer *server)
+{
+    if (!server->sampled)
+    {
+        return INITIAL_RTO;
+    }
+    int64_t rto = server->srtt + 4 * server->rttvar;
+    return rto < MIN_RTO ? MIN_RTO : rto > MAX_RTO ? MAX_RTO : rto;
+}
+
+static void resolver_server_sample(ResolverServer *server, double rtt)
+{
+    if (!server->sampled)
+    {
+        server->srtt = rtt;
+        server->rttvar = rtt / 2;
+        server->sampled = true;
+    }
+    else
+    {
+        double delta = server->srtt > rtt ? server->srtt - rtt : rtt - server->srtt;
+        server->rttvar = 0.75 * server->rttvar + 0.25 * delta;
+        server->srtt = 0.875 * server->srtt + 0.125 * rtt;
+    }
+}
+
+static void resolver_server_failed(ResolverServer *server, int64_t now)
+{
+    server->failures += 1;
+    if (server->failures >= SERVER_FAILURES)
+    {
+        server->benched_until = now + SERVER_PENALTY;
+    }
+}
+
+// Picks the fastest server that isn't benched, preferring one other than
+// avoid. Unsampled servers count as fastest so each one gets measured. If
+// every server is benched, the one coming back soonest is used.
+static uint32_t resolver_pick_server(Resolver *resolver, int64_t now, int32_t avoid)
+{
+    int32_t best = -1;
+    for (uint32_t i = 0; i < resolver->server_count; i++)
+    {
+        ResolverServer *server = &resolver->servers[i];
+        if (server->benched_until > now || ((int32_t)i == avoid && resolver->server_count > 1))
+        {
+            continue;
+        }
+        double srtt = server->sampled ? server->srtt : 0;
+        if (best < 0 || srtt < (resolver->servers[best].sampled ? resolver->servers[best].srtt : 0))
+        {
+            best = i;
+        }
+    }
+    if (best >= 0)
+    {
+        return best;
+    }
+
+    best = 0;
+    for (uint32_t i = 1; i < resolver->server_count; i++)
+    {
+        if ((int32_t)i != avoid && resolver->servers[i].benched_until < resolver->servers[best].benched_until)
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+///////////////////////////////////////////////////////////
+// Resolver stream helpers
+///////////////////////////////////////////////////////////
+
+// Closes the server's TCP connection and brings the timers of every query
+// waiting on it forward, so they're retried or abandoned on the next poll.
+static void resolver_stream_close(Resolver *resolver, uint32_t server_index)
+{
+    ResolverStream *stream = &resolver->servers[server_index].stream;
+    if (stream->socket >= 0)
+    {
+        close(stream->socket);
+    }
+    stream->socket = -1;
+    stream->connected = false;
+    stream->output_length = 0;
+    stream->output_sent = 0;
+    stream->input_length = 0;
+
+    int64_t now = resolver_now();
+    for (uint32_t slot = 0; slot < resolver->window; slot++)
+    {
+        ResolverQuery *query = &resolver->queries[slot];
+        if (query->active && query->tcp && query->server == server_index)
+        {
+            query->error = "TCPFAIL";
+            query->retransmit_at = now;
+            resolver->next_retransmit = now;
+        }
+    }
+}
+
+static bool resolver_stream_open(ResolverServer *server)
+{
+    ResolverStream *stream = &server->stream;
+    if (stream->input == NULL)
+    {
+        stream->input = malloc(STREAM_LENGTH);
+        if (stream->input == NULL)
+        {
+            return false;
+        }
+    }
+    stream->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (stream->socket < 0)
+    {
+        perror("Error: Failed to create TCP socket.\n");
+        return false;
+    }
+    fcntl(stream->socket, F_SETFL, fcntl(stream->socket, F_GETFL) | O_NONBLOCK);
+    int result = connect(stream->socket, (struct sockaddr *)&server->address, sizeof(server->address));
+    if (result < 0 && errno != EINPROGRESS)
+    {
+        close(stream->socket);
+        stream->socket = -1;
+        return false;
+    }
+    stream->connected = result == 0;
+    return true;
+}
+
+// Writes as much queued output as the connection will take.
+static void resolver_stream_flush(Resolver *resolver, uint32_t server_index)
+{
+    ResolverStream *stream = &resolver->servers[server_index].stream;
+    while (stream->connected && stream->output_sent < stream->output_length)
+    {
+        ssize_t sent = send(stream->socket, stream->output + stream->output_sent, stream->output_length - stream->output_sent, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                resolver_stream_close(resolver, server_index);
+            }
+            return;
+        }
+        stream->output_sent += sent;
+    }
+    if (stream->output_sent == stream->output_length)
+    {
+        stream->output_length = 0;
+        stream->output_sent = 0;
+    }
+}
+
+// Queues the message with its two byte length prefix (RFC 1035 4.2.2),
+// opening the connection first if needed. Queries queued together are
+// pipelined on the one connection.
+static bool resolver_stream_write(Resolver *resolver, uint32_t server_index, uint8_t *payload, int length)
+{
+    ResolverServer *server = &resolver->servers[server_index];
+    ResolverStream *stream = &server->stream;
+    if (stream->socket < 0 && !resolver_stream_open(server))
+    {
+        return false;
+    }
+    uint32_t needed = stream->output_length + 2 + length;
+    if (needed > stream->output_capacity)
+    {
+        uint32_t capacity = stream->output_capacity == 0 ? 4096 : stream->output_capacity;
+        while (capacity < needed)
+        {
+            capacity *= 2;
+        }
+        uint8_t *output = realloc(stream->output, capacity);
+        if (output == NULL)
+        {
+            return false;
+        }
+        stream->output = output;
+        stream->output_capacity = capacity;
+    }
+    stream->output[stream->output_length++] = length >> 8;
+    stream->output[stream->output_length++] = length & 0xFF;
+    memcpy(stream->output + stream->output_length, payload, length);
+    stream->output_length += length;
+    resolver_stream_flush(resolver, server_index);
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+// Resolver batch helpers
+///////////////////////////////////////////////////////////
+
+static void resolver_batch_free(ResolverBatch *batch)
+{
+    free(batch->send_buffers);
+    free(batch->send_messages);
+    free(batch->send_vectors);
+    free(batch->receive_buffers);
+    free(batch->receive_messages);
+    free(batch->receive_vectors);
+    free(batch->sources);
+    memset(batch, 0, sizeof(ResolverBatch));
+}
+
+// Copies the query into the send batch, writing the batch once it's full.
+static void resolver_queue(Resolver *resolver, ResolverServer *server, uint8_t *payload, int length)
+{
+    ResolverBatch *batch = &resolver->batch;
+    uint32_t index = batch->queued++;
+    memcpy(batch->send_buffers + index * DNS_UDP_SIZE, payload, length);
+    batch->send_vectors[index].iov_len = length;
+    batch->send_messages[index].msg_hdr.msg_name = &server->address;
+    if (batch->queued == batch->size)
+    {
+        resolver_flush(resolver);
+    }
+}
+
+// Sends the query to its current server and arms its retransmit timer. A
+// failed send is left for the timer to retry.
+static void resolver_send(Resolver *resolver, ResolverQuery *query, int64_t now)
+{
+    ResolverServer *server = &resolver->servers[query->server];
+    uint8_t payload[DNS_PACKET_LENGTH];
+    int payload_counter = dns_write_query(payload, query->id, query->name, query->qtype, query->edns ? resolver->edns_size : 0);
+    if (query->iterative)
+    {
+        ((DNS_Header *)payload)->rd = 0;
+    }
+    server->sent += 1;
+    query->attempts += 1;
+    query->sent_at = now;
+    query->sent_us = resolver_now_us();
+    MetricsServer *metrics = resolver_server_metrics(resolver, query->server);
+    if (metrics != NULL)
+    {
+        metrics_count(&metrics->sent);
+    }
+
+    int64_t deadline = query->started + resolver->timeout;
+    if (query->tcp)
+    {
+        // TCP handles its own retransmission, so the timer only bounds the
+        // exchange. It gets at least MAX_RTO even late in the query's life.
+        query->retransmit_at = now + MAX_RTO > deadline ? now + MAX_RTO : deadline;
+        if (!resolver_stream_write(resolver, query->server, payload, payload_counter))
+        {
+            fprintf(stderr, "Error: Failed to queue TCP query.\n");
+            query->error = "TCPFAIL";
+            query->retransmit_at = now + MIN_RTO;
+        }
+    }
+    else
+    {
+        if (resolver->batch.size > 0)
+        {
+            resolver_queue(resolver, server, payload, payload_counter);
+        }
+        else
+        {
+            resolver->send_calls += 1;
+            if (sendto(resolver->socket, payload, payload_counter, 0, (struct sockaddr *)&server->address, sizeof(server->address)) < 0)
+            {
+                perror("Error: Failed to send packet.\n");
+            }
+        }
+
+        // Back off exponentially, but never past the query's deadline
+        int64_t rto = resolver_server_rto(server) << (query->attempts - 1);
+        if (rto > MAX_RTO)
+        {
+            rto = MAX_RTO;
+        }
+        query->retransmit_at = now + rto < deadline ? now + rto : deadline;
+    }
+    if (query->retransmit_at < resolver->next_retransmit)
+    {
+        resolver->next_retransmit = query->retransmit_at;
+    }
+}
+
+// Claims a slot and an unused id for the query and sends it to the server.
+// The caller has checked the window has room.
+static void resolver_start(Resolver *resolver, char *name, uint16_t qtype, uint32_t server, bool iterative, uint32_t tag)
+{
+    // Pick an id that isn't already in flight. The window is far smaller than
+    // the id space, so this terminates quickly.
+    uint16_t id = resolver_next_id(resolver);
+    while (resolver->slot_by_id[id] != -1)
+    {
+        id = resolver_next_id(resolver);
+    }
+
+    // Claim a slot
+    int64_t now = resolver_now();
+    uint32_t slot = resolver->free_slots[--resolver->free_length];
+    ResolverQuery *query = &resolver->queries[slot];
+    strncpy(query->name, name, DNS_NAME_LENGTH - 1);
+    query->name[DNS_NAME_LENGTH - 1] = '\0';
+    query->id = id;
+    query->qtype = qtype;
+    query->active = true;
+    query->attempts = 0;
+    query->tcp = false;
+    query->edns = resolver->edns_size > 0;
+    query->started = now;
+    query->submitted_us = resolver_now_us();
+    query->server = server;
+    query->iterative = iterative;
+    query->tag = tag;
+    query->error = NULL;
+    resolver->slot_by_id[id] = slot;
+    resolver->in_flight += 1;
+    resolver->sent += 1;
+    if (resolver->metrics != NULL)
+    {
+        metrics_count(&resolver->metrics->queries);
+    }
+
+    resolver_send(resolver, query, now);
+}
+
+// Fails the query over to another server, or abandons it if it is out of time
+// or attempts. Iterative queries stay on their server, and are abandoned
+// sooner so the iterator can move on to the next one.
+static void resolver_retry(Resolver *resolver, uint32_t slot, int64_t now)
+{
+    ResolverQuery *query = &resolver->queries[slot];
+    int64_t deadline = query->started + resolver->timeout;
+    if (now >= (query->tcp && query->retransmit_at > deadline ? query->retransmit_at : deadline) || query->attempts >= resolver->attempts ||
+        (query->iterative && query->attempts >= ITERATIVE_ATTEMPTS))
+    {
+        resolver->abandoned += 1;
+        if (resolver->metrics != NULL)
+        {
+            metrics_count(&resolver->metrics->abandoned);
+        }
+        resolver_complete(resolver, slot, NULL, 0);
+        return;
+    }
+    if (!query->iterative)
+    {
+        query->server = resolver_pick_server(resolver, now, query->server);
+    }
+    resolver->retransmits += 1;
+    if (resolver->metrics != NULL)
+    {
+        metrics_count(&resolver->metrics->retransmits);
+    }
+    resolver_send(resolver, query, now);
+}
+
+// Retransmits or abandons every query whose timer has expired.
+static void resolver_expire(Resolver *resolver, int64_t now)
+{
+    if (now < resolver->next_retransmit)
+    {
+        return;
+    }
+    resolver->next_retransmit = INT64_MAX;
+    for (uint32_t slot = 0; slot < resolver->window; slot++)
+    {
+        ResolverQuery *query = &resolver->queries[slot];
+        if (!query->active)
+        {
+            continue;
+        }
+        if (query->retransmit_at <= now)
+        {
+            ResolverServer *server = &resolver->servers[query->server];
+            server->timeouts += 1;
+            resolver_server_failed(server, now);
+            MetricsServer *metrics = resolver_server_metrics(resolver, query->server);
+            if (metrics != NULL)
+            {
+                metrics_count(&metrics->timeouts);
+            }
+            if (resolver->metrics != NULL)
+            {
+                metrics_count(&resolver->metrics->timeouts);
+            }
+            resolver_retry(resolver, slot, now);
+        }
+        if (query->active && query->retransmit_at < resolver->next_retransmit)
+        {
+            resolver->next_retransmit = query->retransmit_at;
+        }
+    }
+}
+
+// Matches a response from the server to its query and dispatches it.
+static void resolver_receive(Resolver *resolver, uint8_t *payload, int length, uint32_t server_index, bool tcp, int64_t now)
+{
+    if (length < (int)sizeof(DNS_Header))
+    {
+        return;
+    }
+    DNS_Header *header = (DNS_Header *)payload;
+    if (header->qr != 1)
+    {
+        return;
+    }
+
+    // Match the response to its query
+    int32_t slot = resolver->slot_by_id[ntohs(header->id)];
+    if (slot < 0)
+    {
+        return;
+    }
+    ResolverQuery *query = &resolver->queries[slot];
+    if (!resolver_question_matches(query, payload, length))
+    {
+        return;
+    }
+
+    // Only sample queries that were sent once, since a response to a
+    // retransmitted query can't be tied to a particular send (Karn)
+    ResolverServer *server = &resolver->servers[server_index];
+    server->answered += 1;
+    server->failures = 0;
+    server->benched_until = 0;
+    MetricsServer *metrics = resolver_server_metrics(resolver, server_index);
+    if (metrics != NULL)
+    {
+        metrics_count(&metrics->answered);
+    }
+    if (query->attempts == 1 && !tcp && server_index == query->server)
+    {
+        resolver_server_sample(server, now - query->sent_at);
+        if (metrics != NULL)
+        {
+            histogram_record(&metrics->rtt, resolver_now_us() - query->sent_us);
+        }
+    }
+
+    // A truncated answer is asked again over TCP, on the same server
+    if (header->tc && !tcp)
+    {
+        if (!query->tcp)
+        {
+            query->tcp = true;
+            query->server = server_index;
+            resolver->truncated += 1;
+            if (resolver->metrics != NULL)
+            {
+                metrics_count(&resolver->metrics->truncated);
+            }
+            resolver_send(resolver, query, now);
+        }
+        return;
+    }
+
+    // Servers that predate EDNS0 answer FORMERR to an OPT record, so ask
+    // them again without one
+    if (header->rcode == RCODE_FORMERR && query->edns)
+    {
+        query->edns = false;
+        query->server = server_index;
+        resolver->retransmits += 1;
+        if (resolver->metrics != NULL)
+        {
+            metrics_count(&resolver->metrics->retransmits);
+        }
+        resolver_send(resolver, query, now);
+        return;
+    }
+
+    // A server that can't answer is a reason to ask another one, as long as
+    // the query has attempts left
+    bool failed = header->rcode == RCODE_SERVFAIL || header->rcode == RCODE_REFUSED;
+    if (failed && !query->iterative && resolver->server_count > 1 && query->attempts < resolver->attempts && now < query->started + resolver->timeout)
+    {
+        resolver_server_failed(server, now);
+        resolver_retry(resolver, slot, now);
+        return;
+    }
+
+    resolver->received += 1;
+    if (resolver->cache != NULL && !query->iterative)
+    {
+        cache_insert(resolver->cache, query->name, query->qtype, QCLASS_IN, payload, length);
+    }
+    resolver_complete(resolver, slot, payload, length);
+}
+
+// Reads up to a batch of datagrams with one system call and dispatches each
+// one from a known server.
+static void resolver_receive_batch(Resolver *resolver)
+{
+    ResolverBatch *batch = &resolver->batch;
+    for (uint32_t i = 0; i < batch->size; i++)
+    {
+        batch->receive_messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    resolver->receive_calls += 1;
+    int received = recvmmsg(resolver->socket, batch->receive_messages, batch->size, MSG_DONTWAIT, NULL);
+    if (received < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("Error: Failed to receive packets.\n");
+        }
+        return;
+    }
+    int64_t now = resolver_now();
+    for (int i = 0; i < received; i++)
+    {
+        int32_t server_index = resolver_find_server(resolver, &batch->sources[i]);
+        if (server_index >= 0)
+        {
+            uint8_t *payload = batch->receive_buffers + (size_t)i * DNS_PACKET_LENGTH;
+            resolver_receive(resolver, payload, batch->receive_messages[i].msg_len, server_index, false, now);
+        }
+    }
+}
+
+// Completes a pending connect, flushes queued queries, and dispatches every
+// complete response read from the server's TCP connection.
+static void resolver_stream_ready(Resolver *resolver, uint32_t server_index, short events)
+{
+    ResolverStream *stream = &resolver->servers[server_index].stream;
+    if (!stream->connected && (events & (POLLOUT | POLLERR | POLLHUP)))
+    {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(stream->socket, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error != 0)
+        {
+            fprintf(stderr, "Error: TCP connection to %s failed.\n", inet_ntoa(resolver->servers[server_index].address.sin_addr));
+            resolver_stream_close(resolver, server_index);
+            return;
+        }
+        stream->connected = true;
+    }
+    resolver_stream_flush(resolver, server_index);
+    if (stream->socket < 0 || !(events & (POLLIN | POLLHUP)))
+    {
+        return;
+    }
+
+    ssize_t bytes_read = recv(stream->socket, stream->input + stream->input_length, STREAM_LENGTH - stream->input_length, 0);
+    if (bytes_read <= 0)
+    {
+        if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            resolver_stream_close(resolver, server_index);
+        }
+        return;
+    }
+    stream->input_length += bytes_read;
+
+    // Dispatch every complete message, then keep any partial one
+    uint32_t offset = 0;
+    int64_t now = resolver_now();
+    while (stream->socket >= 0 && stream->input_length - offset >= 2)
+    {
+        uint32_t length = (stream->input[offset] << 8) | stream->input[offset + 1];
+        if (stream->input_length - offset - 2 < length)
+        {
+            break;
+        }
+        resolver_receive(resolver, stream->input + offset + 2, length, server_index, true, now);
+        offset += 2 + length;
+        stream = &resolver->servers[server_index].stream; // the iterator may have added servers
+    }
+    if (stream->socket < 0)
+    {
+        return; // a callback closed the connection and discarded its input
+    }
+    memmove(stream->input, stream->input + offset, stream->input_length - offset);
+    stream->input_length -= offset;
+}
+
+///////////////////////////////////////////////////////////
+// Resolver functions
+///////////////////////////////////////////////////////////
+
+int64_t resolver_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int64_t resolver_now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void resolver_initialize(Resolver *resolver, char *servers, uint32_t window, ResolverCallback callback, void *context)
+{
+    memset(resolver, 0, sizeof(Resolver));
+
+    // Clamp the window to something the id space and slot table can hold
+    if (window < 1)
+    {
+        window = 1;
+    }
+    if (window > MAX_WINDOW)
+    {
+        window = MAX_WINDOW;
+    }
+
+    // Network setup
+    resolver->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (resolver->socket < 0)
+    {
+        perror("Error: Failed to create socket.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Destination setup
+    resolver->servers = calloc(MAX_SERVERS, sizeof(ResolverServer));
+    if (resolver->servers == NULL)
+    {
+        perror("Error: Failed to allocate resolver.\n");
+        exit(EXIT_FAILURE);
+    }
+    resolver->server_capacity = MAX_SERVERS;
+    char list[1024];
+    strncpy(list, servers, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    char *save = NULL;
+    for (char *entry = strtok_r(list, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save))
+    {
+        if (resolver->server_count == MAX_SERVERS)
+        {
+            fprintf(stderr, "Error: Only %d servers are supported, ignoring [%s]\n", MAX_SERVERS, entry);
+            continue;
+        }
+        if (!resolver_parse_server(entry, &resolver->servers[resolver->server_count].address))
+        {
+            fprintf(stderr, "Error: Invalid server address [%s]\n", entry);
+            continue;
+        }
+        resolver->servers[resolver->server_count].stream.socket = -1;
+        resolver->server_count += 1;
+    }
+    if (resolver->server_count == 0)
+    {
+        fprintf(stderr, "Error: No usable server address.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Slot setup
+    resolver->window = window;
+    resolver->queries = calloc(window, sizeof(ResolverQuery));
+    resolver->free_slots = malloc(window * sizeof(uint32_t));
+    resolver->slot_by_id = malloc(ID_SPACE * sizeof(int32_t));
+    if (resolver->queries == NULL || resolver->free_slots == NULL || resolver->slot_by_id == NULL)
+    {
+        perror("Error: Failed to allocate resolver.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < window; i++)
+    {
+        resolver->free_slots[i] = window - i - 1;
+    }
+    resolver->free_length = window;
+    memset(resolver->slot_by_id, 0xFF, ID_SPACE * sizeof(int32_t));
+
+    resolver->next_id = getpid();
+    resolver->next_retransmit = INT64_MAX;
+    resolver->timeout = DEFAULT_TIMEOUT;
+    resolver->attempts = DEFAULT_ATTEMPTS;
+    resolver->edns_size = DNS_EDNS_SIZE;
+    resolver->callback = callback;
+    resolver->context = context;
+    resolver->watch_socket = -1;
+}
+
+void resolver_set_batch(Resolver *resolver, uint32_t size)
+{
+    resolver_flush(resolver);
+    resolver_batch_free(&resolver->batch);
+    if (size == 0)
+    {
+        return;
+    }
+    if (size > MAX_BATCH)
+    {
+        size = MAX_BATCH;
+    }
+
+    ResolverBatch *batch = &resolver->batch;
+    batch->send_buffers = malloc((size_t)size * DNS_UDP_SIZE);
+    batch->send_messages = calloc(size, sizeof(struct mmsghdr));
+    batch->send_vectors = calloc(size, sizeof(struct iovec));
+    batch->receive_buffers = malloc((size_t)size * DNS_PACKET_LENGTH);
+    batch->receive_messages = calloc(size, sizeof(struct mmsghdr));
+    batch->receive_vectors = calloc(size, sizeof(struct iovec));
+    batch->sources = calloc(size, sizeof(struct sockaddr_in));
+    if (batch->send_buffers == NULL || batch->send_messages == NULL || batch->send_vectors == NULL ||
+        batch->receive_buffers == NULL || batch->receive_messages == NULL || batch->receive_vectors == NULL || batch->sources == NULL)
+    {
+        perror("Error: Failed to allocate batch.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The headers point at fixed buffers, so only lengths and addresses change
+    // from one batch to the next
+    for (uint32_t i = 0; i < size; i++)
+    {
+        batch->send_vectors[i].iov_base = batch->send_buffers + (size_t)i * DNS_UDP_SIZE;
+        batch->send_messages[i].msg_hdr.msg_iov = &batch->send_vectors[i];
+        batch->send_messages[i].msg_hdr.msg_iovlen = 1;
+        batch->send_messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        batch->receive_vectors[i].iov_base = batch->receive_buffers + (size_t)i * DNS_PACKET_LENGTH;
+        batch->receive_vectors[i].iov_len = DNS_PACKET_LENGTH;
+        batch->receive_messages[i].msg_hdr.msg_iov = &batch->receive_vectors[i];
+        batch->receive_messages[i].msg_hdr.msg_iovlen = 1;
+        batch->receive_messages[i].msg_hdr.msg_name = &batch->sources[i];
+    }
+    batch->size = size;
+}
+
+int32_t resolver_bind(char *listen)
+{
+    // Listen on every interface unless an address is given
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    char host[64];
+    uint16_t port = DNS_PORT;
+    if (strchr(listen, ':') != NULL)
+    {
+        if (sscanf(listen, "%63[^:]:%hu", host, &port) != 2 || inet_pton(AF_INET, host, &address.sin_addr) != 1)
+        {
+            fprintf(stderr, "Error: Invalid listen address [%s]\n", listen);
+            return -1;
+        }
+    }
+    else if (sscanf(listen, "%hu", &port) != 1)
+    {
+        fprintf(stderr, "Error: Invalid listen port [%s]\n", listen);
+        return -1;
+    }
+    address.sin_port = htons(port);
+
+    int32_t listener = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (listener < 0)
+    {
+        perror("Error: Failed to create socket.\n");
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("Error: Failed to bind socket.\n");
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+uint32_t resolver_add_server(Resolver *resolver, struct sockaddr_in *address)
+{
+    int32_t existing = resolver_find_server(resolver, address);
+    if (existing >= 0)
+    {
+        return existing;
+    }
+
+    // Batched sends point at server addresses, so they go out before the
+    // servers move
+    if (resolver->server_count == resolver->server_capacity)
+    {
+        resolver_flush(resolver);
+        uint32_t capacity = resolver->server_capacity * 2;
+        ResolverServer *servers = realloc(resolver->servers, capacity * sizeof(ResolverServer));
+        if (servers == NULL)
+        {
+            perror("Error: Failed to allocate resolver.\n");
+            exit(EXIT_FAILURE);
+        }
+        resolver->servers = servers;
+        resolver->server_capacity = capacity;
+    }
+    ResolverServer *server = &resolver->servers[resolver->server_count];
+    memset(server, 0, sizeof(ResolverServer));
+    server->address = *address;
+    server->stream.socket = -1;
+    return resolver->server_count++;
+}
+
+void resolver_watch(Resolver *resolver, int32_t socket, ResolverWatch watch)
+{
+    resolver->watch_socket = socket;
+    resolver->watch = watch;
+}
+
+void resolver_flush(Resolver *resolver)
+{
+    ResolverBatch *batch = &resolver->batch;
+    uint32_t sent = 0;
+    while (sent < batch->queued)
+    {
+        resolver->send_calls += 1;
+        int result = sendmmsg(resolver->socket, batch->send_messages + sent, batch->queued - sent, 0);
+        if (result < 0)
+        {
+            // Skip the datagram that failed, its query's timer will retry it
+            perror("Error: Failed to send packet.\n");
+            result = 1;
+        }
+        sent += result;
+    }
+    batch->queued = 0;
+}
+
+void resolver_destroy(Resolver *resolver)
+{
+    if (resolver->iterator != NULL)
+    {
+        iterator_destroy(resolver->iterator);
+    }
+    resolver_batch_free(&resolver->batch);
+    for (uint32_t i = 0; i < resolver->server_count; i++)
+    {
+        ResolverStream *stream = &resolver->servers[i].stream;
+        if (stream->socket >= 0)
+        {
+            close(stream->socket);
+        }
+        free(stream->output);
+        free(stream->input);
+    }
+    close(resolver->socket);
+    free(resolver->servers);
+    free(resolver->queries);
+    free(resolver->free_slots);
+    free(resolver->slot_by_id);
+    memset(resolver, 0, sizeof(Resolver));
+}
+
+bool resolver_submit(Resolver *resolver, char *name, uint16_t qtype)
+{
+    if (resolver->in_flight == resolver->window)
+    {
+        return false;
+    }
+
+    // Serve the answer from the cache if we have it
+    if (resolver->cache != NULL)
+    {
+        uint8_t payload[DNS_PACKET_LENGTH];
+        int length = cache_lookup(resolver->cache, name, qtype, QCLASS_IN, payload);
+        if (length >= 0)
+        {
+            ResolverQuery query;
+            memset(&query, 0, sizeof(query));
+            strncpy(query.name, name, DNS_NAME_LENGTH - 1);
+            query.qtype = qtype;
+            query.id = ntohs(((DNS_Header *)payload)->id);
+            if (resolver->callback != NULL)
+            {
+                resolver->callback(resolver, &query, payload, length);
+            }
+            return true;
+        }
+    }
+
+    // Names too long to encode, or with empty or oversized labels, can't be sent
+    if (!dns_name_encodable(name))
+    {
+        fprintf(stderr, "Error: Name too long or malformed [%s]\n", name);
+        resolver_reject(resolver, name, qtype, "BADNAME");
+        return true;
+    }
+    if (resolver->iterator != NULL)
+    {
+        return iterator_submit(resolver->iterator, name, qtype);
+    }
+
+    resolver_start(resolver, name, qtype, resolver_pick_server(resolver, resolver_now(), -1), false, 0);
+    return true;
+}
+
+bool resolver_submit_to(Resolver *resolver, char *name, uint16_t qtype, uint32_t server, uint32_t tag)
+{
+    if (resolver->in_flight == resolver->window)
+    {
+        return false;
+    }
+    resolver_start(resolver, name, qtype, server, true, tag);
+    return true;
+}
+
+void resolver_poll(Resolver *resolver)
+{
+    // Anything still batched has to go out before we wait on the answers
+    resolver_flush(resolver);
+
+    // Sleep no longer than the next retransmit
+    int wait = -1;
+    if (resolver->in_flight > 0)
+    {
+        int64_t until = resolver->next_retransmit - resolver_now();
+        wait = until < 0 ? 0 : until > INT32_MAX ? INT32_MAX : until;
+    }
+
+    // Watch the UDP socket, every open TCP connection and the caller's socket
+    struct pollfd descriptors[2 + resolver->server_count];
+    uint32_t servers[2 + resolver->server_count];
+    nfds_t count = 0;
+    descriptors[count].fd = resolver->socket;
+    descriptors[count].events = POLLIN;
+    count++;
+    for (uint32_t i = 0; i < resolver->server_count; i++)
+    {
+        ResolverStream *stream = &resolver->servers[i].stream;
+        if (stream->socket >= 0)
+        {
+            descriptors[count].fd = stream->socket;
+            descriptors[count].events = POLLIN;
+            if (!stream->connected || stream->output_length > 0)
+            {
+                descriptors[count].events |= POLLOUT;
+            }
+            servers[count] = i;
+            count++;
+        }
+    }
+    nfds_t streams = count;
+    if (resolver->watch_socket >= 0)
+    {
+        descriptors[count].fd = resolver->watch_socket;
+        descriptors[count].events = POLLIN;
+        count++;
+    }
+    if (poll(descriptors, count, wait) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("Error: Failed to poll socket.\n");
+        }
+        return;
+    }
+
+    if ((descriptors[0].revents & POLLIN) && resolver->batch.size > 0)
+    {
+        resolver_receive_batch(resolver);
+    }
+    else if (descriptors[0].revents & POLLIN)
+    {
+        uint8_t payload[DNS_PACKET_LENGTH];
+        struct sockaddr_in source;
+        socklen_t source_length = sizeof(source);
+
+        // Network receive, ignoring anything that isn't from one of our servers
+        resolver->receive_calls += 1;
+        ssize_t length = recvfrom(resolver->socket, (char *)payload, DNS_PACKET_LENGTH, MSG_DONTWAIT, (struct sockaddr *)&source, &source_length);
+        int32_t server_index = resolver_find_server(resolver, &source);
+        if (length >= 0 && server_index >= 0)
+        {
+            resolver_receive(resolver, payload, length, server_index, false, resolver_now());
+        }
+    }
+    for (nfds_t i = 1; i < streams; i++)
+    {
+        if (descriptors[i].revents != 0)
+        {
+            resolver_stream_ready(resolver, servers[i], descriptors[i].revents);
+        }
+    }
+    if (streams < count && descriptors[streams].revents != 0 && resolver->watch != NULL)
+    {
+        resolver->watch(resolver);
+    }
+
+    resolver_expire(resolver, resolver_now());
+}
+
+void resolver_drain(Resolver *resolver)
+{
+    while (resolver->in_flight > 0)
+    {
+        resolver_poll(resolver);
+    }
+}
+
+// Submits the query, polling until the window has room for it.
+static void resolver_submit_blocking(Resolver *resolver, char *name, uint16_t qtype)
+{
+    while (!resolver_submit(resolver, name, qtype))
+    {
+        resolver_poll(resolver);
+    }
+}
+
+// Submits a PTR query for every address in an IPv4 CIDR block.
+static bool resolver_submit_sweep(Resolver *resolver, char *block)
+{
+    char address[INET_ADDRSTRLEN];
+    unsigned int prefix;
+    char extra;
+    struct in_addr base;
+    if (sscanf(block, "%15[0-9.]/%u%c", address, &prefix, &extra) != 2 || prefix > 32 || inet_pton(AF_INET, address, &base) != 1)
+    {
+        return false;
+    }
+    uint32_t first = ntohl(base.s_addr) & (prefix == 0 ? 0 : 0xFFFFFFFFu << (32 - prefix));
+    uint64_t count = 1ull << (32 - prefix);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint32_t host = first + i;
+        char name[DNS_NAME_LENGTH];
+        sprintf(name, "%u.%u.%u.%u.in-addr.arpa", host & 0xFF, (host >> 8) & 0xFF, (host >> 16) & 0xFF, host >> 24);
+        resolver_submit_blocking(resolver, name, QTYPE_PTR);
+    }
+    return true;
+}
+
+void resolver_resolve_stream(Resolver *resolver, FILE *input, uint16_t qtype)
+{
+    char line[1024];
+    while (fgets(line, sizeof(line), input) != NULL)
+    {
+        // Split the line into a name and an optional qtype
+        char name[1024];
+        char type[32];
+        int fields = sscanf(line, "%1023s %31s", name, type);
+        if (fields < 1 || name[0] == '#')
+        {
+            continue;
+        }
+        uint16_t line_qtype = qtype;
+        if (fields == 2 && type[0] != '#')
+        {
+            line_qtype = dns_qtype_from_string(type);
+            if (line_qtype == 0)
+            {
+                fprintf(stderr, "Error: Unknown qtype [%s]\n", type);
+                resolver_reject(resolver, name, 0, "BADTYPE");
+                continue;
+            }
+        }
+
+        // PTR queries take addresses or whole IPv4 blocks in place of names
+        if (line_qtype == QTYPE_PTR)
+        {
+            char reverse[DNS_NAME_LENGTH];
+            if (strchr(name, '/') != NULL)
+            {
+                if (!resolver_submit_sweep(resolver, name))
+                {
+                    fprintf(stderr, "Error: Invalid address block [%s]\n", name);
+                    resolver_reject(resolver, name, line_qtype, "BADNAME");
+                }
+                continue;
+            }
+            if (dns_reverse_name(name, reverse))
+            {
+                resolver_submit_blocking(resolver, reverse, line_qtype);
+                continue;
+            }
+        }
+
+        // Drop a trailing root dot
+        int length = strlen(name);
+        if (length > 1 && name[length - 1] == '.')
+        {
+            name[length - 1] = '\0';
+        }
+        resolver_submit_blocking(resolver, name, line_qtype);
+    }
+    resolver_drain(resolver);
+}
+
+void resolver_print_servers(Resolver *resolver)
+{
+    for (uint32_t i = 0; i < resolver->server_count; i++)
+    {
+        ResolverServer *server = &resolver->servers[i];
+        fprintf(stderr, "Info: Server %s:%hu srtt %.1fms, sent %u, answered %u, timeouts %u%s\n",
+               inet_ntoa(server->address.sin_addr),
+               ntohs(server->address.sin_port),
+               server->srtt,
+               server->sent,
+               server->answered,
+               server->timeouts,
+               server->benched_until > resolver_now() ? " (benched)" : "");
+    }
+}
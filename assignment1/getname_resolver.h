@@ -0,0 +1,253 @@
+/**
+ * getname_resolver.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_RESOLVER_INCLUDED
+#define GETNAME_RESOLVER_INCLUDED
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "getname_cache.h"
+#include "getname_dns.h"
+#include "getname_metrics.h"
+
+///////////////////////////////////////////////////////////
+// Resolver macros
+///////////////////////////////////////////////////////////
+
+#define DEFAULT_WINDOW 64      // queries kept in flight by default
+#define MAX_WINDOW 4096        // upper bound on queries in flight
+#define ID_SPACE 65536         // number of distinct DNS_Header ids
+#define MAX_SERVERS 8          // servers a resolver can fail over between
+#define DEFAULT_TIMEOUT 5000   // milliseconds before a query is abandoned
+#define DEFAULT_ATTEMPTS 4     // sends of a query before it is abandoned
+#define INITIAL_RTO 500        // retransmit timeout before a server has samples
+#define MIN_RTO 50             // lower bound on a server's retransmit timeout
+#define MAX_RTO 4000           // upper bound on a server's retransmit timeout
+#define SERVER_FAILURES 3      // consecutive timeouts before a server is benched
+#define SERVER_PENALTY 2000    // milliseconds a benched server is avoided for
+#define STREAM_LENGTH 65537    // length prefix plus the largest TCP message
+#define MAX_BATCH 256          // upper bound on datagrams per sendmmsg/recvmmsg
+#define ITERATIVE_ATTEMPTS 2   // sends of an iterative query before its server is given up on
+
+///////////////////////////////////////////////////////////
+// Resolver structs
+///////////////////////////////////////////////////////////
+
+typedef struct
+{
+    int32_t socket;           // TCP socket, or -1 while closed
+    bool connected;           // True once the non-blocking connect completes
+    uint8_t *output;          // Length prefixed queries waiting to be written
+    uint32_t output_length;   // Bytes queued in output
+    uint32_t output_sent;     // Bytes of output already written
+    uint32_t output_capacity; // Allocated size of output
+    uint8_t *input;           // Partially read length prefixed response
+    uint32_t input_length;    // Bytes read into input
+} ResolverStream;
+
+typedef struct
+{
+    uint32_t size;                     // Datagrams per system call
+    uint32_t queued;                   // Queries waiting in the send batch
+    uint8_t *send_buffers;             // size buffers of DNS_UDP_SIZE bytes
+    struct mmsghdr *send_messages;     // Headers for the send batch
+    struct iovec *send_vectors;        // One vector per send buffer
+    uint8_t *receive_buffers;          // size buffers of DNS_PACKET_LENGTH bytes
+    struct mmsghdr *receive_messages;  // Headers for the receive batch
+    struct iovec *receive_vectors;     // One vector per receive buffer
+    struct sockaddr_in *sources;       // Source address of each received datagram
+} ResolverBatch;
+
+typedef struct
+{
+    struct sockaddr_in address; // Where queries are sent
+    ResolverStream stream;      // Connection truncated queries are retried on
+    double srtt;                // Smoothed round trip time in milliseconds
+    double rttvar;              // Round trip time variation in milliseconds
+    bool sampled;               // True once srtt holds a measurement
+    uint32_t failures;          // Consecutive timeouts
+    int64_t benched_until;      // Monotonic millisecond the server is avoided until
+    uint32_t sent;              // Total sends, including retransmits
+    uint32_t answered;          // Total responses received
+    uint32_t timeouts;          // Total sends that timed out
+    MetricsServer *metrics;     // Entry in the resolver's metrics, NULL until first used
+} ResolverServer;
+
+typedef struct
+{
+    char name[DNS_NAME_LENGTH]; // Name that was asked for
+    uint16_t id;                // DNS_Header id the query was sent with
+    uint16_t qtype;             // Type of record asked for
+    bool active;                // True while the query is in flight
+    uint32_t server;            // Server the latest attempt went to
+    uint32_t attempts;          // Number of times the query has been sent
+    bool tcp;                   // True once a truncated answer moved it to TCP
+    bool edns;                  // True while the query carries an OPT record
+    int64_t started;            // Monotonic millisecond of the first send
+    int64_t sent_at;            // Monotonic millisecond of the latest send
+    int64_t retransmit_at;      // Monotonic millisecond of the next retransmit
+    int64_t submitted_us;       // Monotonic microsecond the query was submitted
+    int64_t sent_us;            // Monotonic microsecond of the latest send
+    bool iterative;             // True if sent without rd to the one server chosen for it
+    uint32_t tag;               // Iterator task an iterative query belongs to
+    const char *error;          // Status to report if it ends without an answer, NULL for a timeout
+} ResolverQuery;
+
+typedef struct Resolver Resolver;
+typedef struct Iterator Iterator;
+
+/**
+ * Called once for every query, with the response matched to it. If the query
+ * was abandoned, or rejected before it was sent, the payload is NULL, the
+ * length is 0 and the query's error says why. The payload is only valid for
+ * the duration of the call.
+ */
+typedef void (*ResolverCallback)(Resolver *resolver, ResolverQuery *query, uint8_t *payload, int length);
+
+/**
+ * Called from resolver_poll when the watched socket is readable.
+ */
+typedef void (*ResolverWatch)(Resolver *resolver);
+
+struct Resolver
+{
+    int32_t socket;                        // UDP socket shared by every query
+    ResolverServer *servers;               // Servers the queries are sent to
+    uint32_t server_count;                 // Number of entries in servers
+    uint32_t server_capacity;              // Allocated length of servers
+    uint32_t window;                       // Maximum number of queries in flight
+    uint32_t in_flight;                    // Current number of queries in flight
+    ResolverQuery *queries;                // Query slots, window in length
+    uint32_t *free_slots;                  // Stack of unused query slots
+    uint32_t free_length;                  // Number of entries in free_slots
+    int32_t *slot_by_id;                   // Maps a DNS_Header id to a query slot, or -1
+    uint16_t next_id;                      // Next candidate DNS_Header id
+    int64_t next_retransmit;               // Earliest retransmit_at of any query in flight
+    uint32_t timeout;                      // Milliseconds before a query is abandoned
+    uint32_t attempts;                     // Sends of a query before it is abandoned
+    uint16_t edns_size;                    // Advertised EDNS0 payload size, 0 to disable
+    ResolverBatch batch;                   // Batched UDP I/O, enabled when batch.size > 0
+    ResolverCallback callback;             // Receives matched responses
+    void *context;                         // Caller data for the callback
+    int32_t watch_socket;                  // Extra socket polled alongside ours, or -1
+    ResolverWatch watch;                   // Called when watch_socket is readable
+    Cache *cache;                          // Answers are served from and stored here, if set
+    Iterator *iterator;                    // Resolves from the servers as root hints down, if set
+    Metrics *metrics;                      // Latencies and counters are recorded here, if set
+    uint32_t sent;                         // Total queries sent
+    uint32_t received;                     // Total responses matched
+    uint32_t retransmits;                  // Total retransmitted sends
+    uint32_t abandoned;                    // Total queries that ran out of time or attempts
+    uint32_t truncated;                    // Total queries retried over TCP
+    uint32_t send_calls;                   // Total UDP send system calls
+    uint32_t receive_calls;                // Total UDP receive system calls
+};
+
+///////////////////////////////////////////////////////////
+// Resolver functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Initializes a resolver that keeps up to window queries in flight. Servers
+ * is a comma separated list of ipaddr[:port] entries that queries fail over
+ * between.
+ */
+void resolver_initialize(Resolver *resolver, char *servers, uint32_t window, ResolverCallback callback, void *context);
+
+/**
+ * Switches the resolver's UDP traffic to batched I/O. Sends are queued and
+ * written size at a time with one sendmmsg, and responses are drained up to
+ * size at a time with one recvmmsg. A size of 0 switches back to a system
+ * call per datagram.
+ */
+void resolver_set_batch(Resolver *resolver, uint32_t size);
+
+/**
+ * Returns a UDP socket bound to listen, a port or ipaddr:port, or -1 if it
+ * couldn't be bound. A bare port listens on every interface.
+ */
+int32_t resolver_bind(char *listen);
+
+/**
+ * Returns the index of the server at address, adding it to the servers if
+ * it's new. Servers added this way are only used by resolver_submit_to.
+ */
+uint32_t resolver_add_server(Resolver *resolver, struct sockaddr_in *address);
+
+/**
+ * Adds the socket to those resolver_poll waits on, calling watch whenever it's
+ * readable. This lets a caller serve its own socket from the resolver's loop.
+ */
+void resolver_watch(Resolver *resolver, int32_t socket, ResolverWatch watch);
+
+/**
+ * Writes any queries waiting in the send batch.
+ */
+void resolver_flush(Resolver *resolver);
+
+/**
+ * Releases the socket and the query slots held by the resolver.
+ */
+void resolver_destroy(Resolver *resolver);
+
+/**
+ * Sends a query for records of qtype owned by the name. Returns false without
+ * sending if the window is already full. If the resolver has a cache holding
+ * an answer for the query, the callback is invoked with it immediately and
+ * nothing is sent.
+ */
+bool resolver_submit(Resolver *resolver, char *name, uint16_t qtype);
+
+/**
+ * Sends an iterative query, without rd, to one server. It isn't failed over
+ * to other servers or answered from the cache, and its response or
+ * abandonment goes to the resolver's iterator, along with the tag, rather
+ * than to the callback. Returns false if the window is already full.
+ */
+bool resolver_submit_to(Resolver *resolver, char *name, uint16_t qtype, uint32_t server, uint32_t tag);
+
+/**
+ * Waits until a datagram or TCP data is received or the next retransmit is
+ * due, then dispatches any complete responses matching in flight queries and
+ * retransmits or abandons any queries whose timers have expired. Truncated
+ * UDP responses are retried over a TCP connection to the same server, which
+ * is kept open and shared by every query that needs it.
+ */
+void resolver_poll(Resolver *resolver);
+
+/**
+ * Polls until no queries are left in flight.
+ */
+void resolver_drain(Resolver *resolver);
+
+/**
+ * Resolves every name in the input, keeping the window full until the input
+ * is exhausted. Each line holds a name and an optional qtype, which defaults
+ * to qtype. For PTR queries the name may instead be an IPv4 or IPv6 address,
+ * or an IPv4 CIDR block to sweep. Blank lines and lines starting with '#' are
+ * skipped.
+ */
+void resolver_resolve_stream(Resolver *resolver, FILE *input, uint16_t qtype);
+
+/**
+ * Prints the latency and health of each server to stderr.
+ */
+void resolver_print_servers(Resolver *resolver);
+
+/**
+ * Returns the current monotonic time in milliseconds.
+ */
+int64_t resolver_now();
+
+/**
+ * Returns the current monotonic time in microseconds.
+ */
+int64_t resolver_now_us();
+
+#endif
@@ -0,0 +1,212 @@
+/**
+ * getname_stub.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "getname_dns.h"
+#include "getname_resolver.h"
+#include "getname_stub.h"
+
+///////////////////////////////////////////////////////////
+// Stub helpers
+///////////////////////////////////////////////////////////
+
+// FNV-1a over the encoded name, ignoring case, so the generated address is
+// stable for a name however it's spelled.
+static uint32_t stub_hash(uint8_t *name, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash = (hash ^ (uint8_t)tolower(name[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Sends every delayed reply that's due.
+static void stub_send_due(Stub *stub, int64_t now)
+{
+    while (stub->queued > 0 && stub->queue[stub->head].due <= now)
+    {
+        StubReply *reply = &stub->queue[stub->head];
+        if (sendto(stub->socket, reply->reply, reply->length, 0, (struct sockaddr *)&reply->address, sizeof(struct sockaddr_in)) >= 0)
+        {
+            stub->sent += 1;
+        }
+        stub->head = (stub->head + 1) % STUB_QUEUE;
+        stub->queued -= 1;
+    }
+}
+
+// Reads queued queries, dropping some to simulate loss and queuing the
+// replies to the rest.
+static void stub_receive(Stub *stub, int64_t now)
+{
+    uint8_t query[DNS_PACKET_LENGTH];
+    for (int i = 0; i < STUB_READS; i++)
+    {
+        struct sockaddr_in source;
+        socklen_t source_length = sizeof(source);
+        ssize_t length = recvfrom(stub->socket, query, DNS_PACKET_LENGTH, MSG_DONTWAIT, (struct sockaddr *)&source, &source_length);
+        if (length < 0)
+        {
+            break;
+        }
+        stub->received += 1;
+
+        // xorshift, so the loss pattern doesn't share rand() with the caller
+        stub->seed ^= stub->seed << 13;
+        stub->seed ^= stub->seed >> 17;
+        stub->seed ^= stub->seed << 5;
+        if (stub->seed % 100 < stub->loss)
+        {
+            stub->lost += 1;
+            continue;
+        }
+        if (stub->queued == STUB_QUEUE)
+        {
+            stub->overflowed += 1;
+            continue;
+        }
+
+        StubReply *reply = &stub->queue[(stub->head + stub->queued) % STUB_QUEUE];
+        reply->address = source;
+        reply->due = now + stub->latency;
+        reply->length = stub_answer(query, length, reply->reply);
+        stub->queued += 1;
+    }
+}
+
+///////////////////////////////////////////////////////////
+// Stub functions
+///////////////////////////////////////////////////////////
+
+bool stub_initialize(Stub *stub, char *listen, uint32_t latency, uint32_t loss)
+{
+    memset(stub, 0, sizeof(Stub));
+    stub->socket = resolver_bind(listen);
+    if (stub->socket < 0)
+    {
+        return false;
+    }
+    stub->queue = malloc(STUB_QUEUE * sizeof(StubReply));
+    if (stub->queue == NULL)
+    {
+        perror("Error: Failed to allocate stub.\n");
+        exit(EXIT_FAILURE);
+    }
+    stub->latency = latency;
+    stub->loss = loss;
+    stub->seed = 2463534242u;
+    stub->running = true;
+    return true;
+}
+
+void stub_destroy(Stub *stub)
+{
+    close(stub->socket);
+    free(stub->queue);
+    memset(stub, 0, sizeof(Stub));
+}
+
+uint16_t stub_port(Stub *stub)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(stub->socket, (struct sockaddr *)&address, &length) < 0)
+    {
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+int stub_answer(uint8_t *query, int length, uint8_t *reply)
+{
+    // Anything without a single readable question gets an empty FORMERR
+    DNS_Parser parser;
+    DNS_Question question;
+    if (!dns_parse_begin(&parser, query, length) || ntohs(((DNS_Header *)query)->q_count) != 1 ||
+        !dns_parse_question(&parser, &question) || parser.offset > DNS_UDP_SIZE - 64)
+    {
+        memset(reply, 0, sizeof(DNS_Header));
+        memcpy(reply, query, length < (int)sizeof(uint16_t) ? length : (int)sizeof(uint16_t));
+        ((DNS_Header *)reply)->qr = 1;
+        ((DNS_Header *)reply)->rcode = RCODE_FORMERR;
+        return sizeof(DNS_Header);
+    }
+
+    // Echo the header and question, dropping any other sections
+    DNS_Header *header = (DNS_Header *)reply;
+    DNS_Builder builder;
+    dns_build_begin(&builder, reply, DNS_UDP_SIZE, ntohs(((DNS_Header *)query)->id));
+    header->opcode = ((DNS_Header *)query)->opcode;
+    header->rd = ((DNS_Header *)query)->rd;
+    header->qr = 1;
+    header->aa = 1;
+    header->ra = 1;
+    dns_build_question_name(&builder, &question.name, question.qtype, question.qclass);
+
+    uint8_t *name = reply + sizeof(DNS_Header);
+    int name_length = builder.length - sizeof(DNS_Header) - sizeof(Question);
+    if (name[0] >= 2 && tolower(name[1]) == 'n' && tolower(name[2]) == 'x')
+    {
+        header->rcode = RCODE_NXDOMAIN;
+        return dns_build_end(&builder);
+    }
+
+    uint32_t hash = stub_hash(name, name_length);
+    if (question.qtype == QTYPE_A || question.qtype == QTYPE_ANY)
+    {
+        uint8_t address[4] = {10, hash >> 16, hash >> 8, hash};
+        dns_build_record(&builder, SECTION_ANSWER, NULL, QTYPE_A, QCLASS_IN, STUB_TTL);
+        dns_build_data(&builder, address, sizeof(address));
+    }
+    if (question.qtype == QTYPE_AAAA || question.qtype == QTYPE_ANY)
+    {
+        uint8_t address[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, hash >> 24, hash >> 16, hash >> 8, hash};
+        dns_build_record(&builder, SECTION_ANSWER, NULL, QTYPE_AAAA, QCLASS_IN, STUB_TTL);
+        dns_build_data(&builder, address, sizeof(address));
+    }
+    return dns_build_end(&builder);
+}
+
+void stub_serve(Stub *stub)
+{
+    while (stub->running)
+    {
+        // Sleep until a query arrives or the oldest reply is due, waking
+        // regularly to notice being stopped
+        int64_t now = resolver_now();
+        int wait = 100;
+        if (stub->queued > 0)
+        {
+            int64_t until = stub->queue[stub->head].due - now;
+            wait = until < 0 ? 0 : until < wait ? until : wait;
+        }
+        struct pollfd descriptor = {stub->socket, POLLIN, 0};
+        if (poll(&descriptor, 1, wait) > 0)
+        {
+            stub_receive(stub, resolver_now());
+        }
+        stub_send_due(stub, resolver_now());
+    }
+}
+
+void stub_print_statistics(Stub *stub)
+{
+    fprintf(stderr, "Info: Received %u queries, sent %u replies.\n", stub->received, stub->sent);
+    fprintf(stderr, "Info: Dropped %u queries as loss, %u with the queue full.\n", stub->lost, stub->overflowed);
+}
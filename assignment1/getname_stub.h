@@ -0,0 +1,92 @@
+/**
+ * getname_stub.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_STUB_INCLUDED
+#define GETNAME_STUB_INCLUDED
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// Stub macros
+///////////////////////////////////////////////////////////
+
+#define STUB_QUEUE 8192  // replies that can wait out the latency at once
+#define STUB_TTL 300     // ttl of every generated record
+#define STUB_READS 64    // datagrams read per wakeup before sending again
+
+///////////////////////////////////////////////////////////
+// Stub structs
+///////////////////////////////////////////////////////////
+
+// A reply waiting out the configured latency
+typedef struct
+{
+    struct sockaddr_in address;  // Where the reply goes
+    int64_t due;                 // Monotonic millisecond the reply is sent at
+    uint16_t length;             // Length of reply
+    uint8_t reply[DNS_UDP_SIZE]; // The reply
+} StubReply;
+
+typedef struct
+{
+    int32_t socket;        // UDP socket queries arrive on
+    uint32_t latency;      // Milliseconds each reply is held for
+    uint32_t loss;         // Percentage of queries dropped without a reply
+    StubReply *queue;      // Ring of delayed replies, STUB_QUEUE in length
+    uint32_t head;         // Index of the oldest delayed reply
+    uint32_t queued;       // Number of delayed replies
+    uint32_t seed;         // State of the loss generator
+    volatile bool running; // Cleared to make stub_serve return
+    uint32_t received;     // Total queries received
+    uint32_t sent;         // Total replies sent
+    uint32_t lost;         // Total queries dropped to simulate loss
+    uint32_t overflowed;   // Total queries dropped because the queue was full
+} Stub;
+
+///////////////////////////////////////////////////////////
+// Stub functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Binds a stub server to listen, a port or ipaddr:port. Replies are held for
+ * latency milliseconds, and loss percent of queries are dropped. Returns
+ * false if the socket couldn't be bound.
+ */
+bool stub_initialize(Stub *stub, char *listen, uint32_t latency, uint32_t loss);
+
+/**
+ * Releases the socket and queue held by the stub.
+ */
+void stub_destroy(Stub *stub);
+
+/**
+ * Returns the port the stub is bound to, which is useful after binding port 0.
+ */
+uint16_t stub_port(Stub *stub);
+
+/**
+ * Writes the generated reply to the query into reply, returning its length.
+ * Names whose first label starts with "nx" don't exist. Every other name owns
+ * one A and one AAAA record derived from a hash of the name, and nothing
+ * else. Malformed queries get FORMERR.
+ */
+int stub_answer(uint8_t *query, int length, uint8_t *reply);
+
+/**
+ * Answers queries until stub->running is cleared.
+ */
+void stub_serve(Stub *stub);
+
+/**
+ * Prints the stub's counters to stderr.
+ */
+void stub_print_statistics(Stub *stub);
+
+#endif
@@ -0,0 +1,1242 @@
+/**
+ * getname_zone.c
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#define _GNU_SOURCE // qsort_r, sendmmsg and recvmmsg
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "getname_dns.h"
+#include "getname_resolver.h"
+#include "getname_zone.h"
+
+///////////////////////////////////////////////////////////
+// Zone helpers
+///////////////////////////////////////////////////////////
+
+// Growable byte buffer the compiler builds the image data in
+typedef struct
+{
+    uint8_t *bytes;  // Allocated bytes
+    size_t length;   // Bytes in use
+    size_t capacity; // Allocated size of bytes
+} ZoneBuffer;
+
+// One record read from the zone file, with its owner and rdata in the arena
+typedef struct
+{
+    uint32_t owner;        // Offset of the lowercase encoded owner
+    uint16_t owner_length; // Encoded length of the owner
+    uint16_t type;         // Record type
+    uint32_t ttl;          // Record ttl
+    uint32_t rdata;        // Offset of the rdata, names uncompressed
+    uint16_t rdata_length; // Length of the rdata
+} ZoneSource;
+
+// State carried from line to line while reading a zone file
+typedef struct
+{
+    FILE *file;                      // Zone file being read
+    char *path;                      // Its path, for errors
+    int line;                        // Number of the last physical line read
+    uint8_t origin[DNS_NAME_LENGTH]; // $ORIGIN, encoded
+    int origin_length;               // Encoded length of origin, 0 if unset
+    uint32_t ttl;                    // $TTL, or the last explicit ttl without one
+    bool ttl_directive;              // True once a $TTL is read
+    uint8_t owner[DNS_NAME_LENGTH];  // Owner of the previous record
+    int owner_length;                // Encoded length of owner, 0 if none yet
+} ZoneReader;
+
+// Size of the buffers rrsets are encoded in, a fragment behind the header and
+// question it's written to follow
+#define ZONE_SCRATCH_LENGTH (ZONE_FRAGMENT_LENGTH + 2 * DNS_NAME_LENGTH + 64)
+
+static size_t zone_buffer_append(ZoneBuffer *buffer, const void *bytes, size_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity < 65536 ? 65536 : buffer->capacity;
+        while (capacity < buffer->length + length)
+        {
+            capacity *= 2;
+        }
+        buffer->bytes = realloc(buffer->bytes, capacity);
+        if (buffer->bytes == NULL)
+        {
+            perror("Error: Failed to allocate zone.\n");
+            exit(EXIT_FAILURE);
+        }
+        buffer->capacity = capacity;
+    }
+    size_t offset = buffer->length;
+    memcpy(buffer->bytes + offset, bytes, length);
+    buffer->length += length;
+    return offset;
+}
+
+// Hash of the encoded name and the type. Part of the image format.
+static uint32_t zone_hash(uint8_t *name, int length, uint16_t type)
+{
+    return dns_key_hash(name, length, type);
+}
+
+// Returns the index of the rrset for the lowercase encoded name and type, or
+// -1 if there isn't one.
+static int32_t zone_lookup(uint32_t *buckets, uint32_t bucket_count, ZoneRRset *rrsets, uint8_t *data,
+                           uint8_t *name, int length, uint16_t type, uint32_t hash)
+{
+    for (uint32_t i = hash & (bucket_count - 1);; i = (i + 1) & (bucket_count - 1))
+    {
+        uint32_t entry = buckets[i];
+        if (entry == 0)
+        {
+            return -1;
+        }
+        ZoneRRset *rrset = &rrsets[entry - 1];
+        if (rrset->hash == hash && rrset->type == type && rrset->name_length == length &&
+            memcmp(data + rrset->name, name, length) == 0)
+        {
+            return entry - 1;
+        }
+    }
+}
+
+static int32_t zone_find(Zone *zone, uint8_t *name, int length, uint16_t type)
+{
+    return zone_lookup(zone->buckets, zone->header->bucket_count, zone->rrsets, zone->data,
+                       name, length, type, zone_hash(name, length, type));
+}
+
+// Returns the encoded length of an uncompressed name.
+static int zone_name_length(uint8_t *name)
+{
+    int length = 0;
+    while (name[length] != 0)
+    {
+        length += name[length] + 1;
+    }
+    return length + 1;
+}
+
+// Appends the record's rdata, compressing any names in it if asked.
+static void zone_write_rdata(DNS_Builder *builder, ZoneSource *source, uint8_t *arena, bool compress)
+{
+    uint8_t *rdata = arena + source->rdata;
+    DNS_Name name = {rdata, source->rdata_length, 0};
+    switch (source->type)
+    {
+    case QTYPE_NS:
+    case QTYPE_CNAME:
+    case QTYPE_PTR:
+        dns_build_name(builder, &name, compress);
+        break;
+    case QTYPE_MX:
+        dns_build_data(builder, rdata, sizeof(uint16_t));
+        name.offset = sizeof(uint16_t);
+        dns_build_name(builder, &name, compress);
+        break;
+    case QTYPE_SOA:
+    {
+        int mname = zone_name_length(rdata);
+        int rname = zone_name_length(rdata + mname);
+        dns_build_name(builder, &name, compress);
+        name.offset = mname;
+        dns_build_name(builder, &name, compress);
+        dns_build_data(builder, rdata + mname + rname, 5 * sizeof(uint32_t));
+        break;
+    }
+    default:
+        dns_build_data(builder, rdata, source->rdata_length);
+    }
+}
+
+// Writes the records of an rrset into out as they'd follow a question for the
+// owner, each owned by a pointer to the question name, and returns the length
+// written. With compress, names in the rdata are compressed against the
+// question and each other. out must hold ZONE_SCRATCH_LENGTH bytes.
+static int zone_write_rrset(uint8_t *out, ZoneSource *sources, int count, uint8_t *arena, bool compress)
+{
+    DNS_Builder builder;
+    DNS_Name owner = {arena + sources[0].owner, sources[0].owner_length, 0};
+    dns_build_begin(&builder, out, ZONE_SCRATCH_LENGTH, 0);
+    dns_build_question_name(&builder, &owner, sources[0].type, QCLASS_IN);
+    int base = builder.length;
+    for (int i = 0; i < count; i++)
+    {
+        dns_build_record(&builder, SECTION_ANSWER, NULL, sources[i].type, QCLASS_IN, sources[i].ttl);
+        zone_write_rdata(&builder, &sources[i], arena, compress);
+    }
+    int length = dns_build_end(&builder);
+    if (length < 0 || length - base > ZONE_FRAGMENT_LENGTH)
+    {
+        return -1;
+    }
+    memmove(out, out + base, length - base);
+    return length - base;
+}
+
+// Points the owner of each of the first count records at offset.
+static void zone_patch_owners(uint8_t *records, int count, int offset)
+{
+    uint16_t pointer = htons(0xC000 | offset);
+    int position = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(records + position, &pointer, sizeof(pointer));
+        R_Data resource;
+        memcpy(&resource, records + position + sizeof(pointer), sizeof(R_Data));
+        position += sizeof(pointer) + sizeof(R_Data) + ntohs(resource.data_len);
+    }
+}
+
+///////////////////////////////////////////////////////////
+// Zone file parsing
+///////////////////////////////////////////////////////////
+
+// Encodes a presentation name relative to the origin. Returns the encoded
+// length, or -1 if the name is malformed or no origin is set for it.
+static int zone_encode_name(ZoneReader *reader, char *text, uint8_t *wire, bool lowercase)
+{
+    if (strcmp(text, "@") == 0)
+    {
+        if (reader->origin_length == 0)
+        {
+            return -1;
+        }
+        memcpy(wire, reader->origin, reader->origin_length);
+        return reader->origin_length;
+    }
+    if (strcmp(text, ".") == 0)
+    {
+        wire[0] = 0;
+        return 1;
+    }
+
+    int length = 0;
+    char *label = text;
+    while (*label != '\0')
+    {
+        char *end = strchr(label, '.');
+        int size = end == NULL ? (int)strlen(label) : end - label;
+        if (size == 0 || size > 63 || length + 1 + size > DNS_NAME_LENGTH - 2)
+        {
+            return -1;
+        }
+        wire[length] = size;
+        for (int i = 0; i < size; i++)
+        {
+            wire[length + 1 + i] = lowercase ? tolower((unsigned char)label[i]) : label[i];
+        }
+        length += 1 + size;
+        if (end == NULL)
+        {
+            // Relative to the origin
+            if (reader->origin_length == 0 || length + reader->origin_length > DNS_NAME_LENGTH - 1)
+            {
+                return -1;
+            }
+            memcpy(wire + length, reader->origin, reader->origin_length);
+            return length + reader->origin_length;
+        }
+        label = end + 1;
+    }
+    wire[length] = 0;
+    return length + 1;
+}
+
+// Reads the next logical line, joining lines inside parentheses and dropping
+// comments. Returns false at the end of the file.
+static bool zone_read_line(ZoneReader *reader, char *line, bool *continued)
+{
+    char physical[ZONE_LINE_LENGTH];
+    int length = 0;
+    int depth = 0;
+    *continued = false;
+    line[0] = '\0';
+    do
+    {
+        if (fgets(physical, sizeof(physical), reader->file) == NULL)
+        {
+            return length > 0;
+        }
+        reader->line += 1;
+        if (length == 0 && depth == 0)
+        {
+            *continued = physical[0] == ' ' || physical[0] == '\t';
+        }
+
+        bool quoted = false;
+        for (int i = 0; physical[i] != '\0' && physical[i] != '\n' && length < ZONE_LINE_LENGTH - 2; i++)
+        {
+            char c = physical[i];
+            if (c == '"')
+            {
+                quoted = !quoted;
+            }
+            else if (c == ';' && !quoted)
+            {
+                break;
+            }
+            else if ((c == '(' || c == ')') && !quoted)
+            {
+                depth += c == '(' ? 1 : -1;
+                c = ' ';
+            }
+            line[length++] = c == '\r' ? ' ' : c;
+        }
+        line[length++] = ' ';
+        line[length] = '\0';
+    } while (depth > 0);
+    return true;
+}
+
+// Splits the line into whitespace separated tokens, keeping quoted strings
+// whole. Returns the number of tokens.
+static int zone_tokenize(char *line, char **tokens, int max)
+{
+    int count = 0;
+    while (*line != '\0' && count < max)
+    {
+        while (*line == ' ' || *line == '\t')
+        {
+            line++;
+        }
+        if (*line == '\0')
+        {
+            break;
+        }
+        tokens[count++] = line;
+        bool quoted = false;
+        while (*line != '\0' && (quoted || (*line != ' ' && *line != '\t')))
+        {
+            quoted ^= *line == '"';
+            line++;
+        }
+        if (*line != '\0')
+        {
+            *line++ = '\0';
+        }
+    }
+    return count;
+}
+
+static bool zone_is_number(char *token)
+{
+    if (*token == '\0')
+    {
+        return false;
+    }
+    for (; *token != '\0'; token++)
+    {
+        if (!isdigit((unsigned char)*token))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Encodes the rdata tokens of a record of the type, uncompressed. Returns the
+// rdata length, or -1 if they're malformed.
+static int zone_encode_rdata(ZoneReader *reader, uint16_t type, char **tokens, int count, uint8_t *rdata)
+{
+    switch (type)
+    {
+    case QTYPE_A:
+        return count == 1 && inet_pton(AF_INET, tokens[0], rdata) == 1 ? 4 : -1;
+    case QTYPE_AAAA:
+        return count == 1 && inet_pton(AF_INET6, tokens[0], rdata) == 1 ? 16 : -1;
+    case QTYPE_NS:
+    case QTYPE_CNAME:
+    case QTYPE_PTR:
+        return count == 1 ? zone_encode_name(reader, tokens[0], rdata, false) : -1;
+    case QTYPE_MX:
+    {
+        if (count != 2 || !zone_is_number(tokens[0]))
+        {
+            return -1;
+        }
+        uint16_t preference = htons(atoi(tokens[0]));
+        memcpy(rdata, &preference, sizeof(preference));
+        int length = zone_encode_name(reader, tokens[1], rdata + sizeof(preference), false);
+        return length < 0 ? -1 : length + (int)sizeof(preference);
+    }
+    case QTYPE_TXT:
+    {
+        int length = 0;
+        for (int i = 0; i < count; i++)
+        {
+            char *text = tokens[i];
+            int size = strlen(text);
+            if (size >= 2 && text[0] == '"' && text[size - 1] == '"')
+            {
+                text += 1;
+                size -= 2;
+            }
+            if (size > 255 || length + 1 + size > ZONE_LINE_LENGTH)
+            {
+                return -1;
+            }
+            rdata[length] = size;
+            memcpy(rdata + length + 1, text, size);
+            length += 1 + size;
+        }
+        return count > 0 ? length : -1;
+    }
+    case QTYPE_SOA:
+    {
+        if (count != 7)
+        {
+            return -1;
+        }
+        int length = zone_encode_name(reader, tokens[0], rdata, false);
+        int rname = length < 0 ? -1 : zone_encode_name(reader, tokens[1], rdata + length, false);
+        if (rname < 0)
+        {
+            return -1;
+        }
+        length += rname;
+        for (int i = 2; i < 7; i++)
+        {
+            if (!zone_is_number(tokens[i]))
+            {
+                return -1;
+            }
+            uint32_t value = htonl(strtoul(tokens[i], NULL, 10));
+            memcpy(rdata + length, &value, sizeof(value));
+            length += sizeof(value);
+        }
+        return length;
+    }
+    default:
+        return -1;
+    }
+}
+
+// Reads every record in the zone file into sources, with names and rdata in
+// the arena. Returns false and prints the offending line on any error.
+static bool zone_read(char *path, ZoneBuffer *arena, ZoneBuffer *sources)
+{
+    ZoneReader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.path = path;
+    reader.ttl = 3600;
+    reader.file = fopen(path, "r");
+    if (reader.file == NULL)
+    {
+        perror("Error: Failed to open zone file.\n");
+        return false;
+    }
+
+    char line[ZONE_LINE_LENGTH];
+    char *tokens[64];
+    bool continued;
+    const char *error = NULL;
+    while (error == NULL && zone_read_line(&reader, line, &continued))
+    {
+        int count = zone_tokenize(line, tokens, 64);
+        if (count == 0)
+        {
+            continue;
+        }
+
+        // Directives
+        if (strcasecmp(tokens[0], "$ORIGIN") == 0)
+        {
+            uint8_t origin[DNS_NAME_LENGTH];
+            int length = count == 2 ? zone_encode_name(&reader, tokens[1], origin, true) : -1;
+            if (length < 0)
+            {
+                error = "invalid $ORIGIN";
+                continue;
+            }
+            memcpy(reader.origin, origin, length);
+            reader.origin_length = length;
+            continue;
+        }
+        if (strcasecmp(tokens[0], "$TTL") == 0)
+        {
+            if (count != 2 || !zone_is_number(tokens[1]))
+            {
+                error = "invalid $TTL";
+                continue;
+            }
+            reader.ttl = strtoul(tokens[1], NULL, 10);
+            reader.ttl_directive = true;
+            continue;
+        }
+        if (tokens[0][0] == '$')
+        {
+            error = "unsupported directive";
+            continue;
+        }
+
+        // [owner] [ttl] [class] type rdata...
+        int index = 0;
+        if (!continued)
+        {
+            reader.owner_length = zone_encode_name(&reader, tokens[index++], reader.owner, true);
+            if (reader.owner_length < 0)
+            {
+                error = "invalid owner name";
+                continue;
+            }
+        }
+        else if (reader.owner_length <= 0)
+        {
+            error = "record without an owner";
+            continue;
+        }
+        uint32_t ttl = reader.ttl;
+        uint16_t type = 0;
+        for (; index < count && type == 0; index++)
+        {
+            if (zone_is_number(tokens[index]))
+            {
+                ttl = strtoul(tokens[index], NULL, 10);
+                reader.ttl = reader.ttl_directive ? reader.ttl : ttl;
+            }
+            else if (strcasecmp(tokens[index], "IN") != 0)
+            {
+                type = dns_qtype_from_string(tokens[index]);
+                if (type == 0)
+                {
+                    break;
+                }
+            }
+        }
+        if (type == 0)
+        {
+            error = "unknown type";
+            continue;
+        }
+
+        uint8_t rdata[ZONE_LINE_LENGTH + DNS_NAME_LENGTH];
+        int rdata_length = zone_encode_rdata(&reader, type, tokens + index, count - index, rdata);
+        if (rdata_length < 0)
+        {
+            error = "invalid or unsupported rdata";
+            continue;
+        }
+        ZoneSource source;
+        source.owner = zone_buffer_append(arena, reader.owner, reader.owner_length);
+        source.owner_length = reader.owner_length;
+        source.type = type;
+        source.ttl = ttl;
+        source.rdata = zone_buffer_append(arena, rdata, rdata_length);
+        source.rdata_length = rdata_length;
+        zone_buffer_append(sources, &source, sizeof(source));
+    }
+    if (error != NULL)
+    {
+        printf("Error: %s:%d: %s.\n", path, reader.line, error);
+    }
+    fclose(reader.file);
+    return error == NULL;
+}
+
+// Orders records by owner, then type, so each rrset is contiguous.
+static int zone_compare_sources(const void *a, const void *b, void *context)
+{
+    const ZoneSource *x = a;
+    const ZoneSource *y = b;
+    uint8_t *arena = context;
+    if (x->owner_length != y->owner_length)
+    {
+        return x->owner_length - y->owner_length;
+    }
+    int compare = memcmp(arena + x->owner, arena + y->owner, x->owner_length);
+    if (compare != 0)
+    {
+        return compare;
+    }
+    return x->type - y->type;
+}
+
+// True if the name is the origin or falls below it.
+static bool zone_in_origin(uint8_t *name, int length, uint8_t *origin, int origin_length)
+{
+    for (int i = 0; i < length; i += name[i] + 1)
+    {
+        if (length - i == origin_length && memcmp(name + i, origin, origin_length) == 0)
+        {
+            return true;
+        }
+        if (name[i] == 0)
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+// Adds the rrset to the build tables.
+static void zone_insert(uint32_t *buckets, uint32_t bucket_count, ZoneRRset *rrsets, uint32_t *rrset_count, ZoneRRset *rrset)
+{
+    uint32_t i = rrset->hash & (bucket_count - 1);
+    while (buckets[i] != 0)
+    {
+        i = (i + 1) & (bucket_count - 1);
+    }
+    rrsets[*rrset_count] = *rrset;
+    *rrset_count += 1;
+    buckets[i] = *rrset_count;
+}
+
+///////////////////////////////////////////////////////////
+// Zone functions
+///////////////////////////////////////////////////////////
+
+bool zone_compile(char *path, char *image_path)
+{
+    ZoneBuffer arena = {0};
+    ZoneBuffer sources_buffer = {0};
+    if (!zone_read(path, &arena, &sources_buffer))
+    {
+        free(arena.bytes);
+        free(sources_buffer.bytes);
+        return false;
+    }
+    ZoneSource *sources = (ZoneSource *)sources_buffer.bytes;
+    uint32_t source_count = sources_buffer.length / sizeof(ZoneSource);
+    qsort_r(sources, source_count, sizeof(ZoneSource), zone_compare_sources, arena.bytes);
+
+    // The zone's apex is the owner of its SOA
+    int32_t apex = -1;
+    for (uint32_t i = 0; i < source_count; i++)
+    {
+        if (sources[i].type == QTYPE_SOA)
+        {
+            apex = i;
+            break;
+        }
+    }
+    const char *error = apex < 0 ? "zone has no SOA record" : NULL;
+
+    // Bound the table sizes: one entry per rrset, one per name or ancestor
+    // that exists, and one per delegation
+    uint32_t bound = 1;
+    for (uint32_t i = 0; i < source_count && error == NULL; i++)
+    {
+        uint8_t *owner = arena.bytes + sources[i].owner;
+        if (!zone_in_origin(owner, sources[i].owner_length, arena.bytes + sources[apex].owner, sources[apex].owner_length))
+        {
+            error = "record outside the zone";
+        }
+        bound += 2;
+        for (int j = 0; owner[j] != 0; j += owner[j] + 1)
+        {
+            bound += 1;
+        }
+    }
+    uint32_t bucket_count = 1;
+    while (bucket_count < 2 * bound)
+    {
+        bucket_count *= 2;
+    }
+    uint32_t *buckets = calloc(bucket_count, sizeof(uint32_t));
+    ZoneRRset *rrsets = calloc(bound, sizeof(ZoneRRset));
+    uint8_t *fragment = malloc(ZONE_SCRATCH_LENGTH);
+    uint8_t *portable = malloc(ZONE_SCRATCH_LENGTH);
+    if (buckets == NULL || rrsets == NULL || fragment == NULL || portable == NULL)
+    {
+        perror("Error: Failed to allocate zone.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t rrset_count = 0;
+    ZoneBuffer data = {0};
+    int32_t soa = -1;
+    uint32_t origin = 0;
+
+    // Encode each rrset, storing each owner name once
+    uint32_t owner = 0;
+    for (uint32_t start = 0, end = 0; start < source_count && error == NULL; start = end)
+    {
+        ZoneSource *first = &sources[start];
+        uint8_t *name = arena.bytes + first->owner;
+        end = start + 1;
+        while (end < source_count && zone_compare_sources(first, &sources[end], arena.bytes) == 0)
+        {
+            end++;
+        }
+        if (end - start > 0xFFFF)
+        {
+            error = "rrset has too many records";
+            break;
+        }
+
+        bool new_owner = start == 0 || sources[start - 1].owner_length != first->owner_length ||
+                         memcmp(arena.bytes + sources[start - 1].owner, name, first->owner_length) != 0;
+        if (new_owner)
+        {
+            owner = zone_buffer_append(&data, name, first->owner_length);
+
+            // The name and every ancestor up to the apex exist
+            uint8_t *stored = name;
+            for (int j = 0; j < first->owner_length; j += stored[j] + 1)
+            {
+                uint32_t hash = zone_hash(stored + j, first->owner_length - j, ZONE_EXISTS);
+                if (zone_lookup(buckets, bucket_count, rrsets, data.bytes, stored + j, first->owner_length - j, ZONE_EXISTS, hash) >= 0)
+                {
+                    break; // so do all of its ancestors
+                }
+                ZoneRRset exists = {hash, ZONE_EXISTS, 0, owner + j, first->owner_length - j, 0, 0, 0, 0, 0};
+                zone_insert(buckets, bucket_count, rrsets, &rrset_count, &exists);
+                if (stored[j] == 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        int fragment_length = zone_write_rrset(fragment, first, end - start, arena.bytes, true);
+        int portable_length = zone_write_rrset(portable, first, end - start, arena.bytes, false);
+        if (fragment_length < 0 || portable_length < 0)
+        {
+            error = "rrset too large to encode";
+            break;
+        }
+        ZoneRRset rrset;
+        memset(&rrset, 0, sizeof(rrset));
+        rrset.hash = zone_hash(name, first->owner_length, first->type);
+        rrset.type = first->type;
+        rrset.count = end - start;
+        rrset.name = owner;
+        rrset.name_length = first->owner_length;
+        rrset.fragment = zone_buffer_append(&data, fragment, fragment_length);
+        rrset.fragment_length = fragment_length;
+        rrset.portable = rrset.fragment;
+        rrset.portable_length = fragment_length;
+        if (fragment_length != portable_length || memcmp(fragment, portable, fragment_length) != 0)
+        {
+            rrset.portable = zone_buffer_append(&data, portable, portable_length);
+            rrset.portable_length = portable_length;
+        }
+        if (start == (uint32_t)apex)
+        {
+            soa = rrset_count;
+            origin = owner;
+        }
+        zone_insert(buckets, bucket_count, rrsets, &rrset_count, &rrset);
+    }
+
+    // Every NS rrset below the apex is a delegation. Its referral is the NS
+    // records followed by glue for any name servers inside the zone.
+    uint32_t rrsets_encoded = rrset_count;
+    for (uint32_t i = 0; i < rrsets_encoded && error == NULL; i++)
+    {
+        ZoneRRset *ns = &rrsets[i];
+        if (ns->type != QTYPE_NS || (ns->name_length == sources[apex].owner_length && ns->name == origin))
+        {
+            continue;
+        }
+        int length = 0;
+        memcpy(fragment, data.bytes + ns->portable, ns->portable_length);
+        length += ns->portable_length;
+        uint16_t glue = 0;
+        int position = 0;
+        for (int r = 0; r < ns->count; r++)
+        {
+            R_Data resource;
+            memcpy(&resource, data.bytes + ns->portable + position + 2, sizeof(R_Data));
+            uint8_t *target = data.bytes + ns->portable + position + 2 + sizeof(R_Data);
+            position += 2 + sizeof(R_Data) + ntohs(resource.data_len);
+
+            uint8_t lower[DNS_NAME_LENGTH];
+            int target_length = zone_name_length(target);
+            dns_key_lower(lower, target, target_length);
+            uint16_t types[] = {QTYPE_A, QTYPE_AAAA};
+            for (int t = 0; t < 2; t++)
+            {
+                int32_t address = zone_lookup(buckets, bucket_count, rrsets, data.bytes, lower, target_length, types[t], zone_hash(lower, target_length, types[t]));
+                if (address < 0)
+                {
+                    continue;
+                }
+                // Glue records carry their owner in full, since it isn't in the question
+                ZoneRRset *set = &rrsets[address];
+                int offset = 0;
+                for (int g = 0; g < set->count; g++)
+                {
+                    R_Data fixed;
+                    memcpy(&fixed, data.bytes + set->portable + offset + 2, sizeof(R_Data));
+                    int record = sizeof(R_Data) + ntohs(fixed.data_len);
+                    if (length + target_length + record > ZONE_FRAGMENT_LENGTH)
+                    {
+                        break;
+                    }
+                    memcpy(fragment + length, target, target_length);
+                    memcpy(fragment + length + target_length, data.bytes + set->portable + offset + 2, record);
+                    length += target_length + record;
+                    offset += 2 + record;
+                    glue += 1;
+                }
+            }
+        }
+        ZoneRRset referral = *ns;
+        referral.type = ZONE_REFERRAL;
+        referral.hash = zone_hash(data.bytes + ns->name, ns->name_length, ZONE_REFERRAL);
+        referral.extra = glue;
+        referral.fragment = zone_buffer_append(&data, fragment, length);
+        referral.fragment_length = length;
+        referral.portable = referral.fragment;
+        referral.portable_length = length;
+        zone_insert(buckets, bucket_count, rrsets, &rrset_count, &referral);
+    }
+    if (data.length > UINT32_MAX)
+    {
+        error = "zone too large";
+    }
+
+    // Write the image beside its final path, then move it into place
+    bool written = false;
+    if (error == NULL)
+    {
+        ZoneHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = ZONE_MAGIC;
+        header.bucket_count = bucket_count;
+        header.rrset_count = rrset_count;
+        header.origin = origin;
+        header.origin_length = sources[apex].owner_length;
+        header.soa = soa;
+        header.data_length = data.length;
+        header.size = sizeof(header) + (uint64_t)bucket_count * sizeof(uint32_t) + (uint64_t)rrset_count * sizeof(ZoneRRset) + data.length;
+
+        char temporary[1100];
+        snprintf(temporary, sizeof(temporary), "%s.%d", image_path, getpid());
+        FILE *image = fopen(temporary, "wb");
+        if (image == NULL)
+        {
+            perror("Error: Failed to create zone image.\n");
+        }
+        else
+        {
+            written = fwrite(&header, sizeof(header), 1, image) == 1 &&
+                      fwrite(buckets, sizeof(uint32_t), bucket_count, image) == bucket_count &&
+                      fwrite(rrsets, sizeof(ZoneRRset), rrset_count, image) == rrset_count &&
+                      fwrite(data.bytes, 1, data.length, image) == data.length;
+            written = fclose(image) == 0 && written;
+            if (!written || rename(temporary, image_path) < 0)
+            {
+                perror("Error: Failed to write zone image.\n");
+                unlink(temporary);
+                written = false;
+            }
+        }
+    }
+    else
+    {
+        printf("Error: %s: %s.\n", path, error);
+    }
+
+    free(arena.bytes);
+    free(sources_buffer.bytes);
+    free(buckets);
+    free(rrsets);
+    free(fragment);
+    free(portable);
+    free(data.bytes);
+    return written;
+}
+
+bool zone_open(Zone *zone, char *image_path)
+{
+    memset(zone, 0, sizeof(Zone));
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Error: Failed to open zone image.\n");
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < (off_t)sizeof(ZoneHeader))
+    {
+        printf("Error: Zone image is truncated.\n");
+        close(fd);
+        return false;
+    }
+    void *memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (memory == MAP_FAILED)
+    {
+        perror("Error: Failed to map zone image.\n");
+        return false;
+    }
+
+    ZoneHeader *header = (ZoneHeader *)memory;
+    uint64_t tables = sizeof(ZoneHeader) + (uint64_t)header->bucket_count * sizeof(uint32_t) + (uint64_t)header->rrset_count * sizeof(ZoneRRset);
+    if (header->magic != ZONE_MAGIC || header->size != (uint64_t)info.st_size || tables + header->data_length != header->size ||
+        header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0 || header->soa < 0 ||
+        (uint32_t)header->soa >= header->rrset_count)
+    {
+        printf("Error: Zone image is malformed.\n");
+        munmap(memory, info.st_size);
+        return false;
+    }
+    zone->header = header;
+    zone->buckets = (uint32_t *)(header + 1);
+    zone->rrsets = (ZoneRRset *)(zone->buckets + header->bucket_count);
+    zone->data = (uint8_t *)(zone->rrsets + header->rrset_count);
+    zone->size = info.st_size;
+    return true;
+}
+
+void zone_close(Zone *zone)
+{
+    if (zone->header != NULL)
+    {
+        munmap(zone->header, zone->size);
+    }
+    memset(zone, 0, sizeof(Zone));
+}
+
+int zone_answer(Zone *zone, uint8_t *query, int length, uint8_t *reply)
+{
+    if (length < (int)sizeof(DNS_Header) || ((DNS_Header *)query)->qr)
+    {
+        return -1;
+    }
+
+    // Anything without a single plainly encoded question gets FORMERR
+    DNS_Parser parser;
+    DNS_Question question;
+    int name_length = 0;
+    bool valid = ntohs(((DNS_Header *)query)->q_count) == 1 && dns_parse_begin(&parser, query, length) &&
+                 dns_parse_question(&parser, &question);
+    if (valid)
+    {
+        name_length = parser.offset - sizeof(DNS_Header) - sizeof(Question);
+        for (int i = 0; valid && i < name_length; i += query[sizeof(DNS_Header) + i] + 1)
+        {
+            valid = (query[sizeof(DNS_Header) + i] & 0xC0) == 0;
+        }
+    }
+    DNS_Header *header = (DNS_Header *)reply;
+    if (!valid)
+    {
+        memset(reply, 0, sizeof(DNS_Header));
+        header->id = ((DNS_Header *)query)->id;
+        header->qr = 1;
+        header->rcode = RCODE_FORMERR;
+        return sizeof(DNS_Header);
+    }
+
+    // An OPT record raises the size of reply the client can take
+    int limit = DNS_UDP_SIZE;
+    bool edns = false;
+    DNS_Record record;
+    while (dns_parse_record(&parser, &record))
+    {
+        if (record.type == QTYPE_OPT)
+        {
+            edns = true;
+            limit = record.class < DNS_UDP_SIZE ? DNS_UDP_SIZE : record.class > DNS_PACKET_LENGTH ? DNS_PACKET_LENGTH : record.class;
+        }
+    }
+
+    // Echo the header and question
+    int question_end = sizeof(DNS_Header) + name_length + sizeof(Question);
+    memcpy(reply, query, question_end);
+    header->qr = 1;
+    header->aa = 0;
+    header->tc = 0;
+    header->ra = 0;
+    header->z = 0;
+    header->rcode = RCODE_NOERROR;
+    header->ans_count = 0;
+    header->auth_count = 0;
+    header->add_count = 0;
+    int written = question_end;
+    if (header->opcode != 0)
+    {
+        header->rcode = RCODE_NOTIMP;
+        return written;
+    }
+
+    // Names are stored lowercase
+    uint8_t name[DNS_NAME_LENGTH];
+    int labels[DNS_NAME_LENGTH / 2];
+    int label_count = 0;
+    dns_key_lower(name, query + sizeof(DNS_Header), name_length);
+    for (int i = 0; name[i] != 0; i += name[i] + 1)
+    {
+        labels[label_count++] = i;
+    }
+    labels[label_count++] = name_length - 1;
+
+    // Only names at or below the origin are ours to answer
+    int origin_length = zone->header->origin_length;
+    int apex = name_length - origin_length;
+    bool in_zone = false;
+    for (int i = 0; i < label_count && !in_zone; i++)
+    {
+        in_zone = labels[i] == apex && memcmp(name + apex, zone->data + zone->header->origin, origin_length) == 0;
+    }
+    if (!in_zone || question.qclass != QCLASS_IN)
+    {
+        header->rcode = RCODE_REFUSED;
+        return written;
+    }
+
+    // The delegation closest to the apex covers everything below it. A DS
+    // query for the delegation itself is answered by the parent.
+    for (int i = label_count - 1; i >= 0; i--)
+    {
+        int suffix = labels[i];
+        if (suffix >= apex || (suffix == 0 && question.qtype == QTYPE_DS))
+        {
+            continue;
+        }
+        int32_t index = zone_find(zone, name + suffix, name_length - suffix, ZONE_REFERRAL);
+        if (index < 0)
+        {
+            continue;
+        }
+        ZoneRRset *referral = &zone->rrsets[index];
+        if (written + (int)referral->fragment_length > limit)
+        {
+            header->tc = 1;
+            return written;
+        }
+        memcpy(reply + written, zone->data + referral->fragment, referral->fragment_length);
+        zone_patch_owners(reply + written, referral->count, sizeof(DNS_Header) + suffix);
+        written += referral->fragment_length;
+        header->auth_count = htons(referral->count);
+        header->add_count = htons(referral->extra);
+        break;
+    }
+
+    if (header->auth_count == 0)
+    {
+        header->aa = 1;
+        int32_t index = zone_find(zone, name, name_length, question.qtype);
+        if (index < 0 && question.qtype != QTYPE_CNAME)
+        {
+            index = zone_find(zone, name, name_length, QTYPE_CNAME);
+        }
+        if (index >= 0)
+        {
+            ZoneRRset *answer = &zone->rrsets[index];
+            if (written + (int)answer->fragment_length > limit)
+            {
+                header->tc = 1;
+                return written;
+            }
+            memcpy(reply + written, zone->data + answer->fragment, answer->fragment_length);
+            written += answer->fragment_length;
+            header->ans_count = htons(answer->count);
+        }
+        else
+        {
+            // Negative answers carry the SOA, owned by the apex in the question
+            if (zone_find(zone, name, name_length, ZONE_EXISTS) < 0)
+            {
+                header->rcode = RCODE_NXDOMAIN;
+            }
+            ZoneRRset *soa = &zone->rrsets[zone->header->soa];
+            if (written + (int)soa->portable_length <= limit)
+            {
+                memcpy(reply + written, zone->data + soa->portable, soa->portable_length);
+                zone_patch_owners(reply + written, 1, sizeof(DNS_Header) + apex);
+                written += soa->portable_length;
+                header->auth_count = htons(1);
+            }
+        }
+    }
+
+    if (edns && written + 1 + (int)sizeof(R_Data) <= limit)
+    {
+        reply[written++] = 0; // root name
+        R_Data opt = {htons(QTYPE_OPT), htons(DNS_EDNS_SIZE), 0, 0};
+        memcpy(reply + written, &opt, sizeof(R_Data));
+        written += sizeof(R_Data);
+        header->add_count = htons(ntohs(header->add_count) + 1);
+    }
+    return written;
+}
+
+static void *zone_compile_thread(void *argument)
+{
+    ZoneServer *server = (ZoneServer *)argument;
+    server->compile_ok = zone_compile(server->path, server->image);
+    server->compiled = true;
+    return NULL;
+}
+
+// Swaps in a freshly compiled zone, or starts compiling one if asked to.
+static void zone_reload(ZoneServer *server)
+{
+    if (server->compiled)
+    {
+        pthread_join(server->compiler, NULL);
+        Zone fresh;
+        if (server->compile_ok && zone_open(&fresh, server->image))
+        {
+            zone_close(&server->zone);
+            server->zone = fresh;
+            server->reloads += 1;
+            fprintf(stderr, "Info: Reloaded zone [%s].\n", server->path);
+        }
+        server->compiled = false;
+        server->compiling = false;
+    }
+    if (server->reload && !server->compiling)
+    {
+        server->reload = false;
+        server->compiling = true;
+        if (pthread_create(&server->compiler, NULL, zone_compile_thread, server) != 0)
+        {
+            perror("Error: Failed to start zone compiler.\n");
+            server->compiling = false;
+        }
+    }
+}
+
+bool zone_server_initialize(ZoneServer *server, char *path, char *listen)
+{
+    memset(server, 0, sizeof(ZoneServer));
+    server->path = path;
+    snprintf(server->image, sizeof(server->image), "%s.image", path);
+    if (!zone_compile(path, server->image) || !zone_open(&server->zone, server->image))
+    {
+        return false;
+    }
+    server->socket = resolver_bind(listen);
+    if (server->socket < 0)
+    {
+        zone_close(&server->zone);
+        return false;
+    }
+    server->running = true;
+    return true;
+}
+
+void zone_server_destroy(ZoneServer *server)
+{
+    if (server->compiling)
+    {
+        pthread_join(server->compiler, NULL);
+    }
+    close(server->socket);
+    zone_close(&server->zone);
+}
+
+void zone_serve(ZoneServer *server)
+{
+    static uint8_t queries[ZONE_BATCH][DNS_PACKET_LENGTH];
+    static uint8_t replies[ZONE_BATCH][DNS_PACKET_LENGTH];
+    struct mmsghdr receive[ZONE_BATCH];
+    struct mmsghdr send[ZONE_BATCH];
+    struct iovec receive_vectors[ZONE_BATCH];
+    struct iovec send_vectors[ZONE_BATCH];
+    struct sockaddr_in sources[ZONE_BATCH];
+    memset(receive, 0, sizeof(receive));
+    for (int i = 0; i < ZONE_BATCH; i++)
+    {
+        receive_vectors[i].iov_base = queries[i];
+        receive_vectors[i].iov_len = DNS_PACKET_LENGTH;
+        receive[i].msg_hdr.msg_iov = &receive_vectors[i];
+        receive[i].msg_hdr.msg_iovlen = 1;
+        receive[i].msg_hdr.msg_name = &sources[i];
+    }
+
+    while (server->running)
+    {
+        zone_reload(server);
+
+        // Wake regularly to notice being stopped or asked to reload
+        struct pollfd descriptor = {server->socket, POLLIN, 0};
+        if (poll(&descriptor, 1, 100) <= 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < ZONE_BATCH; i++)
+        {
+            receive[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        int received = recvmmsg(server->socket, receive, ZONE_BATCH, MSG_DONTWAIT, NULL);
+        if (received <= 0)
+        {
+            continue;
+        }
+
+        // Answer the whole batch, then send every reply with one call
+        int replying = 0;
+        for (int i = 0; i < received; i++)
+        {
+            server->queries += 1;
+            int length = zone_answer(&server->zone, queries[i], receive[i].msg_len, replies[replying]);
+            if (length < 0)
+            {
+                continue;
+            }
+            DNS_Header *header = (DNS_Header *)replies[replying];
+            if (header->tc)
+            {
+                server->truncated += 1;
+            }
+            else if (header->rcode == RCODE_NXDOMAIN)
+            {
+                server->nxdomain += 1;
+            }
+            else if (header->rcode != RCODE_NOERROR)
+            {
+                server->refused += 1;
+            }
+            else if (header->ans_count != 0)
+            {
+                server->answers += 1;
+            }
+            else if (!header->aa)
+            {
+                server->referrals += 1;
+            }
+            else
+            {
+                server->nodata += 1;
+            }
+            send_vectors[replying].iov_base = replies[replying];
+            send_vectors[replying].iov_len = length;
+            memset(&send[replying], 0, sizeof(send[replying]));
+            send[replying].msg_hdr.msg_iov = &send_vectors[replying];
+            send[replying].msg_hdr.msg_iovlen = 1;
+            send[replying].msg_hdr.msg_name = &sources[i];
+            send[replying].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            replying++;
+        }
+        for (int sent = 0; sent < replying;)
+        {
+            int result = sendmmsg(server->socket, send + sent, replying - sent, 0);
+            if (result < 0)
+            {
+                perror("Error: Failed to send reply.\n");
+                result = 1; // skip the reply that failed
+            }
+            sent += result;
+        }
+    }
+}
+
+void zone_print_statistics(ZoneServer *server)
+{
+    fprintf(stderr, "Info: Received %u queries, reloaded %u times.\n", server->queries, server->reloads);
+    fprintf(stderr, "Info: Answered %u, referred %u, NODATA %u, NXDOMAIN %u, refused %u, truncated %u.\n",
+            server->answers, server->referrals, server->nodata, server->nxdomain, server->refused, server->truncated);
+}
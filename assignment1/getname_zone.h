@@ -0,0 +1,156 @@
+/**
+ * getname_zone.h
+ *
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef GETNAME_ZONE_INCLUDED
+#define GETNAME_ZONE_INCLUDED
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "getname_dns.h"
+
+///////////////////////////////////////////////////////////
+// Zone macros
+///////////////////////////////////////////////////////////
+
+#define ZONE_MAGIC 0x32454E4F5A4E4755ULL // "UGNZONE2"
+#define ZONE_EXISTS 0                    // pseudo type marking a name that exists
+#define ZONE_REFERRAL 65535              // pseudo type holding a delegation's NS and glue
+#define ZONE_LINE_LENGTH 4096            // longest logical line in a zone file
+#define ZONE_FRAGMENT_LENGTH 65535       // largest pre-encoded fragment
+#define ZONE_BATCH 64                    // datagrams per recvmmsg/sendmmsg when serving
+
+///////////////////////////////////////////////////////////
+// Zone structs
+///////////////////////////////////////////////////////////
+
+// Header at the start of a compiled zone image
+typedef struct
+{
+    uint64_t magic;         // ZONE_MAGIC
+    uint64_t size;          // Total size of the image in bytes
+    uint32_t bucket_count;  // Entries in the bucket table, a power of two
+    uint32_t rrset_count;   // Entries in the rrset table
+    uint32_t origin;        // Offset of the encoded origin in the data
+    uint16_t origin_length; // Encoded length of the origin
+    uint16_t reserved;      // Keeps the tables aligned
+    int32_t soa;            // Index of the origin's SOA rrset, or -1
+    uint32_t data_length;   // Bytes of data following the rrset table
+} ZoneHeader;
+
+// Every record of one type owned by one name, pre-encoded for the wire.
+//
+// The fragment is laid out to follow the question of a query for the owner,
+// so each record's owner is a pointer to the question name and names in the
+// rdata are compressed against it and each other. The portable form has
+// uncompressed rdata, for when the rrset lands anywhere else in a reply, and
+// its owner pointers are patched as it's copied. The two are the same bytes
+// for types without names in their rdata.
+typedef struct
+{
+    uint32_t hash;            // Hash of the owner and type
+    uint16_t type;            // Record type, or a ZONE_ pseudo type
+    uint16_t count;           // Records in the fragment, NS records for a referral
+    uint32_t name;            // Offset of the lowercase encoded owner in the data
+    uint16_t name_length;     // Encoded length of the owner
+    uint16_t extra;           // Glue records following a referral's NS records
+    uint32_t fragment;        // Offset of the fragment in the data
+    uint32_t fragment_length; // Length of the fragment
+    uint32_t portable;        // Offset of the portable form in the data
+    uint32_t portable_length; // Length of the portable form
+} ZoneRRset;
+
+// A mapped zone image
+typedef struct
+{
+    ZoneHeader *header; // Mapped header
+    uint32_t *buckets;  // Rrset index plus one for each bucket, 0 when empty
+    ZoneRRset *rrsets;  // Rrset table
+    uint8_t *data;      // Names and fragments the rrsets point into
+    size_t size;        // Total mapped size in bytes
+} Zone;
+
+// Answers queries from a zone, reloading it on request
+typedef struct
+{
+    int32_t socket;            // UDP socket queries arrive on
+    Zone zone;                 // Zone being served
+    char *path;                // Zone file the zone is compiled from
+    char image[1024];          // Path of the compiled image
+    volatile bool running;     // Cleared to make zone_serve return
+    volatile bool reload;      // Set to recompile and swap in the zone
+    pthread_t compiler;        // Thread compiling a reloaded zone
+    volatile bool compiling;   // True while compiler is running
+    volatile bool compiled;    // Set by compiler once the new image is ready
+    bool compile_ok;           // True if the last compile succeeded
+    uint32_t queries;          // Total queries received
+    uint32_t answers;          // Replies with records in the answer section
+    uint32_t referrals;        // Replies delegating to another server
+    uint32_t nodata;           // Replies for names without the type asked for
+    uint32_t nxdomain;         // Replies for names that don't exist
+    uint32_t refused;          // Queries outside the zone or not supported
+    uint32_t truncated;        // Replies truncated to fit the client's limit
+    uint32_t reloads;          // Times a new image was swapped in
+} ZoneServer;
+
+///////////////////////////////////////////////////////////
+// Zone functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Compiles the zone file at path into an image at image_path. The image is
+ * written beside it and renamed into place, so a mapped copy of the old image
+ * stays valid. The zone file holds one record per line in master file format,
+ * with $ORIGIN and $TTL directives, parentheses continuing a record across
+ * lines, and A, AAAA, NS, CNAME, PTR, MX, TXT and SOA records. Returns false
+ * and prints the offending line if the zone can't be compiled.
+ */
+bool zone_compile(char *path, char *image_path);
+
+/**
+ * Maps a compiled image. Returns false if it's missing or malformed.
+ */
+bool zone_open(Zone *zone, char *image_path);
+
+/**
+ * Unmaps the image.
+ */
+void zone_close(Zone *zone);
+
+/**
+ * Writes the authoritative reply to the query into reply, returning its
+ * length, or -1 if the datagram should be ignored. Names below a delegation
+ * get a referral to the delegated servers, with glue. Replies that would be
+ * larger than the client accepts are truncated.
+ */
+int zone_answer(Zone *zone, uint8_t *query, int length, uint8_t *reply);
+
+/**
+ * Compiles the zone file at path, then binds a server for it to listen, a
+ * port or ipaddr:port. Returns false if either fails.
+ */
+bool zone_server_initialize(ZoneServer *server, char *path, char *listen);
+
+/**
+ * Releases the socket and the mapped zone.
+ */
+void zone_server_destroy(ZoneServer *server);
+
+/**
+ * Answers queries until server->running is cleared. Setting server->reload
+ * recompiles the zone file on another thread while the old zone is still
+ * served, then swaps the new one in.
+ */
+void zone_serve(ZoneServer *server);
+
+/**
+ * Prints the server's counters to stderr.
+ */
+void zone_print_statistics(ZoneServer *server);
+
+#endif
@@ -23,9 +23,9 @@
 
 typedef struct
 {
-    User self;                    // User data for the primary user
-    UserList peers;               // Active peers
-    FileDescriptorSet master_fds; // The master file descriptor set
+    User self;        // User data for the primary user
+    UserList peers;   // Active peers
+    EventLoop events; // Watches stdin, the accept socket and peer sockets
 } Peerchat;
 
 ///////////////////////////////////////////////////////////
@@ -37,13 +37,20 @@ typedef struct
  */
 void peerchat_handle_peer_data(Peerchat *state, int32_t peer_socket);
 
+/**
+ * Event loop callback for a peer socket.
+ */
+void peerchat_on_peer(void *context, int32_t file_descriptor) {
+    peerchat_handle_peer_data((Peerchat *)context, file_descriptor);
+}
+
 /**
  * Initializes a peerchat.
  */
 void peerchat_initialize(Peerchat *state) {
     memset(state, 0, sizeof(Peerchat));
-    filedescriptorset_reset(&state->master_fds);
-    userlist_initialize(&state->peers, &state->master_fds);
+    eventloop_initialize(&state->events);
+    userlist_initialize(&state->peers, &state->events, peerchat_on_peer, state);
 }
 
 /**
@@ -51,7 +58,7 @@ void peerchat_initialize(Peerchat *state) {
  */
 void peerchat_accept(Peerchat *state, int32_t accept_socket) {
     struct sockaddr_in address;
-    socklen_t address_length;
+    socklen_t address_length = sizeof(address);
     // Accept the connection
     int32_t peer_socket = accept(accept_socket, (struct sockaddr *)&address, &address_length);
     // Fail if we were unable to create the socket
@@ -105,8 +112,8 @@ void peerchat_connect(Peerchat *state, uint16_t port, uint32_t address) {
 }
 
 /**
- * Handle input from stdin. This should exhaust stdin such that select does
- * not re-trigger for stdin.
+ * Handle input from stdin. This should exhaust stdin such that the event
+ * loop does not re-trigger for stdin.
  */
 void peerchat_handle_input(Peerchat *state) {
     // Read the line from stdin
@@ -231,6 +238,20 @@ void peerchat_handle_peer_data(Peerchat *state, int32_t peer_socket) {
     }
 }
 
+/**
+ * Event loop callback for stdin.
+ */
+void peerchat_on_input(void *context, int32_t file_descriptor) {
+    peerchat_handle_input((Peerchat *)context);
+}
+
+/**
+ * Event loop callback for the accept socket.
+ */
+void peerchat_on_accept(void *context, int32_t file_descriptor) {
+    peerchat_accept((Peerchat *)context, file_descriptor);
+}
+
 ///////////////////////////////////////////////////////////
 // Main function
 ///////////////////////////////////////////////////////////
@@ -244,8 +265,8 @@ int main(int argc, char *argv[]) {
     peerchat_initialize(&state);
     // Parse the command line arguments
     user_parse_arguments(&state.self, argc, argv);
-    // Add stdin to the file descriptor set
-    filedescriptorset_add(&state.master_fds, STDIN_FILENO);
+    // Watch stdin for input
+    eventloop_add(&state.events, STDIN_FILENO, peerchat_on_input, &state);
 
     // Setup socket that our peers will connect to
     int32_t accept_socket = socket(
@@ -274,31 +295,12 @@ int main(int argc, char *argv[]) {
         printf("[Error: Unable to set max pending connections]\n");
         exit(EXIT_FAILURE);
     }
-    // Add accept_socket to the master file descriptor list
-    filedescriptorset_add(&state.master_fds, accept_socket);
+    // Watch accept_socket for new connections
+    eventloop_add(&state.events, accept_socket, peerchat_on_accept, &state);
 
-    // Loop forever
+    // Loop forever, dispatching whatever is ready
     while (true) {
-        fd_set read_fds = filedescriptorset_select(&state.master_fds);
-
-        // Loop through our file descriptors
-        for (int32_t i = 0; i < state.master_fds.length; i++) {
-            // If the file descriptor is not set, skip to the next one
-            if (!FD_ISSET(i, &read_fds)) continue;
-
-            // If the file descriptor is stdin, handle input
-            if (i == STDIN_FILENO) {
-                peerchat_handle_input(&state);
-            }
-            // If the file descriptor is accept_socket, handle a new connection
-            else if (i == accept_socket) {
-                peerchat_accept(&state, accept_socket);
-            }
-            // Else we're receiving data from an already established connection
-            else {
-                peerchat_handle_peer_data(&state, i);
-            }
-        }
+        eventloop_wait(&state.events);
     }
 
     return 0;
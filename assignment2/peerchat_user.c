@@ -20,9 +20,11 @@
 // UserList functions
 ///////////////////////////////////////////////////////////
 
-void userlist_initialize(UserList *list, FileDescriptorSet *master_fds) {
+void userlist_initialize(UserList *list, EventLoop *events, EventCallback on_data, void *context) {
     list->length = 0;
-    list->master_fds = master_fds;
+    list->events = events;
+    list->on_data = on_data;
+    list->context = context;
 }
 
 void userlist_print_by_age(UserList *list, uint8_t age) {
@@ -83,8 +85,8 @@ User *userlist_add(UserList *list, int32_t socket, uint16_t port, uint32_t addre
     slot->port = port;
     slot->address = address;
     list->length += 1;
-    // Add the file descriptor
-    filedescriptorset_add(list->master_fds, socket);
+    // Watch the socket
+    eventloop_add(list->events, socket, list->on_data, list->context);
     return slot;
 }
 
@@ -94,8 +96,8 @@ void userlist_remove_by_socket(UserList *list, int32_t socket) {
         if (user->socket == socket) {
             printf("[%s@%s left the chat]\n", user->username, ip4_to_string(user->address));
             // Disconnect the user
+            eventloop_remove(list->events, user->socket);
             close(user->socket);
-            filedescriptorset_remove(list->master_fds, user->socket);
             // Fix internal state
             list->length -= 1;
             *user = list->users[list->length];
@@ -109,8 +111,8 @@ void userlist_remove_all(UserList *list) {
         User user = list->users[i];
         printf("[%s@%s left the chat]\n", user.username, ip4_to_string(user.address));
         // Disconnect the user
+        eventloop_remove(list->events, user.socket);
         close(user.socket);
-        filedescriptorset_remove(list->master_fds, user.socket);
     }
     list->length = 0;
 }
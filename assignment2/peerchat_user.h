@@ -30,9 +30,11 @@ typedef struct
 ///////////////////////////////////////////////////////////
 
 typedef struct {
-    User users[MAX_PEERS];         // Array of users
-    uint32_t length;               // Total number users
-    FileDescriptorSet *master_fds; // Associated file descriptor set
+    User users[MAX_PEERS]; // Array of users
+    uint32_t length;       // Total number users
+    EventLoop *events;     // Event loop watching the peer sockets
+    EventCallback on_data; // Called when a peer socket is readable
+    void *context;         // Passed to on_data
 } UserList;
 
 ///////////////////////////////////////////////////////////
@@ -40,9 +42,10 @@ typedef struct {
 ///////////////////////////////////////////////////////////
 
 /**
- * Initializes a userlist.
+ * Initializes a userlist. The sockets of added users are watched by the event
+ * loop, which calls on_data with the context when one is readable.
  */
-void userlist_initialize(UserList *list, FileDescriptorSet *master_fds);
+void userlist_initialize(UserList *list, EventLoop *events, EventCallback on_data, void *context);
 
 /**
  * Prints users matching the given age.
@@ -5,45 +5,243 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "peerchat_utility.h"
 
 ///////////////////////////////////////////////////////////
-// FileDescriptorSet functions
+// EventLoop helpers
 ///////////////////////////////////////////////////////////
 
-void filedescriptorset_add(FileDescriptorSet *set, int32_t file_descriptor) {
-    FD_SET(file_descriptor, &set->master_fds);
-    set->length = file_descriptor >= set->length ? file_descriptor + 1 : set->length;
+/**
+ * Grows an array to hold at least the given number of entries, zeroing the new
+ * entries. Exits if memory runs out.
+ */
+static void *eventloop_grow(void *array, uint32_t *capacity, uint32_t needed, size_t size) {
+    uint32_t grown = *capacity == 0 ? 16 : *capacity;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    uint8_t *resized = realloc(array, grown * size);
+    if (resized == NULL) {
+        printf("[Error: Out of memory]\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(resized + *capacity * size, 0, (grown - *capacity) * size);
+    *capacity = grown;
+    return resized;
+}
+
+static bool eventloop_timer_before(EventLoop *loop, uint32_t a, uint32_t b) {
+    return loop->timers[loop->heap[a]].deadline < loop->timers[loop->heap[b]].deadline;
+}
+
+static void eventloop_timer_swap(EventLoop *loop, uint32_t a, uint32_t b) {
+    uint32_t slot = loop->heap[a];
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = slot;
+    loop->timers[loop->heap[a]].next = a;
+    loop->timers[loop->heap[b]].next = b;
+}
+
+/**
+ * Restores the heap after the entry at the given position changed.
+ */
+static void eventloop_timer_fix(EventLoop *loop, uint32_t position) {
+    while (position > 0 && eventloop_timer_before(loop, position, (position - 1) / 2)) {
+        eventloop_timer_swap(loop, position, (position - 1) / 2);
+        position = (position - 1) / 2;
+    }
+    while (true) {
+        uint32_t smallest = position;
+        uint32_t left = 2 * position + 1;
+        uint32_t right = left + 1;
+        if (left < loop->timer_count && eventloop_timer_before(loop, left, smallest)) smallest = left;
+        if (right < loop->timer_count && eventloop_timer_before(loop, right, smallest)) smallest = right;
+        if (smallest == position) return;
+        eventloop_timer_swap(loop, position, smallest);
+        position = smallest;
+    }
+}
+
+/**
+ * Takes the timer at the given heap position out of the heap and frees its
+ * slot.
+ */
+static void eventloop_timer_remove(EventLoop *loop, uint32_t position) {
+    uint32_t slot = loop->heap[position];
+    loop->timer_count -= 1;
+    if (position != loop->timer_count) {
+        loop->heap[position] = loop->heap[loop->timer_count];
+        loop->timers[loop->heap[position]].next = position;
+        eventloop_timer_fix(loop, position);
+    }
+    EventTimer *timer = &loop->timers[slot];
+    timer->callback = NULL;
+    timer->generation += 1;
+    timer->next = loop->free_timer;
+    loop->free_timer = slot;
+}
+
+///////////////////////////////////////////////////////////
+// EventLoop functions
+///////////////////////////////////////////////////////////
+
+void eventloop_initialize(EventLoop *loop) {
+    memset(loop, 0, sizeof(EventLoop));
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll < 0) {
+        printf("[Error: Unable to create event loop]\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
-void filedescriptorset_remove(FileDescriptorSet *set, int32_t file_descriptor) {
-    FD_CLR(file_descriptor, &set->master_fds);
-    // TODO: Shrink the set->length on remove if needed.
+void eventloop_add(EventLoop *loop, int32_t file_descriptor, EventCallback callback, void *context) {
+    if ((uint32_t)file_descriptor >= loop->handler_capacity) {
+        loop->handlers = eventloop_grow(loop->handlers, &loop->handler_capacity, file_descriptor + 1, sizeof(EventHandler));
+    }
+    EventHandler *handler = &loop->handlers[file_descriptor];
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = file_descriptor;
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, file_descriptor, &event) < 0) {
+        // Regular files can't be watched, but select always found them
+        // readable, so keep treating them that way
+        if (errno != EPERM) {
+            printf("[Error: Unable to watch file descriptor %d]\n", file_descriptor);
+            return;
+        }
+        handler->polled = true;
+        loop->polled += 1;
+    }
+    handler->callback = callback;
+    handler->context = context;
+    loop->length += 1;
+}
+
+void eventloop_remove(EventLoop *loop, int32_t file_descriptor) {
+    if ((uint32_t)file_descriptor >= loop->handler_capacity || loop->handlers[file_descriptor].callback == NULL) {
+        return;
+    }
+    EventHandler *handler = &loop->handlers[file_descriptor];
+    if (handler->polled) {
+        loop->polled -= 1;
+    } else {
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, file_descriptor, NULL);
+    }
+    memset(handler, 0, sizeof(EventHandler));
+    loop->length -= 1;
 }
 
-void filedescriptorset_reset(FileDescriptorSet *set) {
-    FD_ZERO(&set->master_fds);
-    set->length = 0;
+TimerId eventloop_timer_add(EventLoop *loop, uint32_t delay, TimerCallback callback, void *context) {
+    if (loop->free_timer == loop->timer_capacity) {
+        uint32_t old_capacity = loop->timer_capacity;
+        loop->timers = eventloop_grow(loop->timers, &loop->timer_capacity, old_capacity + 1, sizeof(EventTimer));
+        uint32_t heap_capacity = old_capacity;
+        loop->heap = eventloop_grow(loop->heap, &heap_capacity, loop->timer_capacity, sizeof(uint32_t));
+        // Thread the new slots onto the free list
+        for (uint32_t i = old_capacity; i < loop->timer_capacity; i++) {
+            loop->timers[i].next = i + 1;
+        }
+        loop->free_timer = old_capacity;
+    }
+    uint32_t slot = loop->free_timer;
+    EventTimer *timer = &loop->timers[slot];
+    loop->free_timer = timer->next;
+    timer->deadline = monotonic_ms() + delay;
+    timer->callback = callback;
+    timer->context = context;
+    timer->next = loop->timer_count;
+    loop->heap[loop->timer_count] = slot;
+    loop->timer_count += 1;
+    eventloop_timer_fix(loop, timer->next);
+    // Generations start at 1 so that no id is 0
+    if (timer->generation == 0) {
+        timer->generation = 1;
+    }
+    return (uint64_t)timer->generation << 32 | slot;
+}
+
+void eventloop_timer_cancel(EventLoop *loop, TimerId id) {
+    uint32_t slot = (uint32_t)id;
+    if (slot >= loop->timer_capacity) {
+        return;
+    }
+    EventTimer *timer = &loop->timers[slot];
+    if (timer->callback != NULL && timer->generation == (uint32_t)(id >> 32)) {
+        eventloop_timer_remove(loop, timer->next);
+    }
 }
 
-fd_set filedescriptorset_select(FileDescriptorSet *set) {
-    fd_set read_fds = set->master_fds;
-    // Block until a file descriptor that we set has data to consume.
-    // We don't care about write_fds, except_fds, and timeout.
-    if (select(set->length, &read_fds, NULL, NULL, NULL) == -1) {
-        // Debug error message. Since we're not setting a timeout, select
-        // should never return -1.
-        printf("[Error: Select failed]\n");
+void eventloop_wait(EventLoop *loop) {
+    // Sleep until the next timer is due, or not at all if a descriptor is
+    // always ready
+    int timeout = -1;
+    if (loop->polled > 0) {
+        timeout = 0;
+    } else if (loop->timer_count > 0) {
+        uint64_t now = monotonic_ms();
+        uint64_t deadline = loop->timers[loop->heap[0]].deadline;
+        timeout = deadline <= now ? 0 : deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+    }
+
+    struct epoll_event events[EVENTLOOP_BATCH];
+    int ready = epoll_wait(loop->epoll, events, EVENTLOOP_BATCH, timeout);
+    if (ready < 0) {
+        if (errno == EINTR) return;
+        printf("[Error: Event wait failed]\n");
         exit(EXIT_FAILURE);
     }
-    return read_fds;
+
+    // A callback may stop watching descriptors that are later in the batch,
+    // so look each handler up as it's reached
+    for (int i = 0; i < ready; i++) {
+        int32_t file_descriptor = events[i].data.fd;
+        if ((uint32_t)file_descriptor < loop->handler_capacity) {
+            EventHandler *handler = &loop->handlers[file_descriptor];
+            if (handler->callback != NULL && !handler->polled) {
+                handler->callback(handler->context, file_descriptor);
+            }
+        }
+    }
+    for (uint32_t i = 0; loop->polled > 0 && i < loop->handler_capacity; i++) {
+        EventHandler *handler = &loop->handlers[i];
+        if (handler->callback != NULL && handler->polled) {
+            handler->callback(handler->context, i);
+        }
+    }
+
+    // Fire the timers that were due when we woke. Timers they add wait for
+    // the next call, even if they're due immediately.
+    uint64_t now = monotonic_ms();
+    uint32_t due = loop->timer_count;
+    while (due > 0 && loop->timer_count > 0 && loop->timers[loop->heap[0]].deadline <= now) {
+        EventTimer *timer = &loop->timers[loop->heap[0]];
+        TimerCallback callback = timer->callback;
+        void *context = timer->context;
+        eventloop_timer_remove(loop, 0);
+        callback(context);
+        due -= 1;
+    }
+}
+
+void eventloop_destroy(EventLoop *loop) {
+    close(loop->epoll);
+    free(loop->handlers);
+    free(loop->timers);
+    free(loop->heap);
+    memset(loop, 0, sizeof(EventLoop));
 }
 
 ///////////////////////////////////////////////////////////
@@ -73,3 +271,9 @@ char *ip4_to_string(uint32_t ip4_address) {
     address.s_addr = ip4_address;
     return inet_ntoa(address);
 }
+
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
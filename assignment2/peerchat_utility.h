@@ -19,40 +19,97 @@
 #define USERNAME_LENGTH 32
 #define MESSAGE_LENGTH 256
 #define DEFAULT_PORT 8129
+#define EVENTLOOP_BATCH 64 // Readiness events taken from the kernel per wait
 
 ///////////////////////////////////////////////////////////
-// FileDescriptorSet structs
+// EventLoop structs
 ///////////////////////////////////////////////////////////
 
+/**
+ * Called when a watched file descriptor has data to read.
+ */
+typedef void (*EventCallback)(void *context, int32_t file_descriptor);
+
+/**
+ * Called once when a timer expires.
+ */
+typedef void (*TimerCallback)(void *context);
+
+/**
+ * Identifies a pending timer. The slot is in the low 32 bits and the slot's
+ * generation in the high 32 bits, so a stale id never cancels a newer timer.
+ * 0 is never a valid id.
+ */
+typedef uint64_t TimerId;
+
+typedef struct {
+    EventCallback callback; // Called when the descriptor is readable, NULL if unwatched
+    void *context;          // Passed to the callback
+    bool polled;            // True if epoll can't watch it, such as a regular file, so it's always ready
+} EventHandler;
+
+typedef struct {
+    uint64_t deadline;      // Monotonic millisecond the timer fires at
+    TimerCallback callback; // Called when the timer fires, NULL if the slot is free
+    void *context;          // Passed to the callback
+    uint32_t generation;    // Bumped each time the slot is freed
+    uint32_t next;          // Heap position while pending, next free slot while free
+} EventTimer;
+
 typedef struct {
-    fd_set master_fds; // The file descriptor list
-    uint32_t length;   // Total number of active read file descriptors
-} FileDescriptorSet;
+    int32_t epoll;             // The epoll instance
+    EventHandler *handlers;    // Handlers indexed by file descriptor
+    uint32_t handler_capacity; // Number of entries in handlers
+    uint32_t length;           // Total number of watched file descriptors
+    uint32_t polled;           // Number of watched file descriptors that are always ready
+    EventTimer *timers;        // Timer slots
+    uint32_t timer_capacity;   // Number of entries in timers
+    uint32_t free_timer;       // First free slot in timers, or timer_capacity if none are free
+    uint32_t *heap;            // Pending timer slots as a min heap by deadline
+    uint32_t timer_count;      // Number of entries in heap
+} EventLoop;
 
 ///////////////////////////////////////////////////////////
-// FileDescriptorSet functions
+// EventLoop functions
 ///////////////////////////////////////////////////////////
 
 /**
- * Adds the given file descriptor to the set.
+ * Initializes an event loop with nothing watched and no timers.
  */
-void filedescriptorset_add(FileDescriptorSet *set, int32_t file_descriptor);
+void eventloop_initialize(EventLoop *loop);
 
 /**
- * Removes the given file descriptor to the set.
+ * Watches the given file descriptor, calling back each time it's readable.
  */
-void filedescriptorset_remove(FileDescriptorSet *set, int32_t file_descriptor);
+void eventloop_add(EventLoop *loop, int32_t file_descriptor, EventCallback callback, void *context);
 
 /**
- * Clears all tracked file descriptors.
+ * Stops watching the given file descriptor. Call before closing it.
  */
-void filedescriptorset_reset(FileDescriptorSet *set);
+void eventloop_remove(EventLoop *loop, int32_t file_descriptor);
 
 /**
- * Selects on the tracked file descriptors. Returns the read file descriptor
- * set. 
+ * Calls back once after delay milliseconds. Returns an id for cancelling.
  */
-fd_set filedescriptorset_select(FileDescriptorSet *set);
+TimerId eventloop_timer_add(EventLoop *loop, uint32_t delay, TimerCallback callback, void *context);
+
+/**
+ * Cancels a pending timer. Does nothing if it's already fired or been
+ * cancelled.
+ */
+void eventloop_timer_cancel(EventLoop *loop, TimerId timer);
+
+/**
+ * Blocks until a watched file descriptor is readable or the next timer is due,
+ * then calls back for each ready descriptor and each expired timer. Only the
+ * descriptors that are ready are visited, however many are watched.
+ */
+void eventloop_wait(EventLoop *loop);
+
+/**
+ * Releases the event loop.
+ */
+void eventloop_destroy(EventLoop *loop);
 
 ///////////////////////////////////////////////////////////
 // Utility functions
@@ -81,4 +138,9 @@ uint32_t remove_delimiters(char *source);
  */
 char *ip4_to_string(uint32_t ip4_address);
 
+/**
+ * Returns milliseconds from a monotonic clock.
+ */
+uint64_t monotonic_ms(void);
+
 #endif
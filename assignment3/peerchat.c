@@ -4,6 +4,8 @@
  * Author: Joseph Cumbo (jwc6999)
  */
 
+#define _GNU_SOURCE // struct mmsghdr, through peerchat_packet.h
+
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -13,7 +15,10 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "peerchat_gossip.h"
 #include "peerchat_packet.h"
+#include "peerchat_reliable.h"
+#include "peerchat_swim.h"
 #include "peerchat_user.h"
 #include "peerchat_utility.h"
 
@@ -23,10 +28,16 @@
 
 typedef struct
 {
-    int32_t socket;               // UDP socket
-    User self;                    // User data for the primary user
-    UserList peers;               // Active peers
-    FileDescriptorSet master_fds; // The master file descriptor set
+    int32_t socket;          // UDP socket
+    User self;               // User data for the primary user
+    UserList peers;          // Active peers
+    EventLoop events;        // Watches stdin and the socket
+    PacketReceiver receiver; // Buffers the socket is drained into
+    Gossip gossip;           // Rumor ids and settings for gossip broadcasts
+    Reliable reliable;       // Sequencing and acks for every packet we send
+    Swim swim;               // Probes peers to find the ones that died without leaving
+    bool exiting;            // Set once we've left and are only waiting on acks
+    bool lingered;           // Set once we've waited long enough for the acks
 } Peerchat;
 
 ///////////////////////////////////////////////////////////
@@ -48,6 +59,11 @@ void peerchat_read_join(Peerchat *state, PacketJoin *packet, uint32_t address);
  */
 void peerchat_read_leave(Peerchat *state, PacketLeave *packet, uint32_t address);
 
+/**
+ * Handle reading a rumor relayed by a peer.
+ */
+void peerchat_read_rumor(Peerchat *state, PacketRumor *packet, uint32_t address);
+
 ///////////////////////////////////////////////////////////
 // Peerchat functions
 ///////////////////////////////////////////////////////////
@@ -57,26 +73,55 @@ void peerchat_read_leave(Peerchat *state, PacketLeave *packet, uint32_t address)
  */
 void peerchat_initialize(Peerchat *state) {
     memset(state, 0, sizeof(Peerchat));
-    filedescriptorset_reset(&state->master_fds);
-    userlist_initialize(&state->peers, &state->master_fds);
+    eventloop_initialize(&state->events);
+    userlist_initialize(&state->peers);
+    packet_receiver_initialize(&state->receiver);
+    gossip_initialize(&state->gossip);
 }
 
 /**
- * Establish a connection the target address/port.
+ * Establish a connection the target address/port. If share is set, our join
+ * lists all our peers so the target can connect to them too.
  */
-void peerchat_connect(Peerchat *state, uint16_t port, uint32_t address) {
+void peerchat_connect(Peerchat *state, uint16_t port, uint32_t address, bool share) {
     // Check if we already are connected to the peer
     if (userlist_has_user(&state->peers, port, address)) {
         return;
     }
-    // Send our join
-    PacketJoin *join = packet_join(&state->self, &state->peers, port, address);
-    packet_send_direct(state->socket, join, sizeof(PacketJoin), port, address);
+    // Send our join, split over as many packets as our peers need
+    uint32_t cursor = share ? 0 : state->peers.length;
+    do {
+        Packet *join = packet_join(&state->self, &state->peers, port, address, &cursor);
+        reliable_send(&state->reliable, join, port, address);
+    } while (cursor < state->peers.length);
+}
+
+/**
+ * Sends the packet to every peer.
+ */
+void peerchat_broadcast(Peerchat *state, Packet *packet) {
+    reliable_send_all(&state->reliable, packet, &state->peers);
+}
+
+/**
+ * Sends the rumor to fanout peers picked at random.
+ */
+void peerchat_gossip(Peerchat *state, Packet *packet, uint8_t fanout) {
+    uint32_t *chosen;
+    uint32_t count = gossip_pick(&state->gossip, state->peers.length, fanout, &chosen);
+    reliable_send_some(&state->reliable, packet, &state->peers, chosen, count);
+}
+
+/**
+ * Called back when we stop waiting for our last packets to be acknowledged.
+ */
+void peerchat_on_linger(void *context) {
+    ((Peerchat *)context)->lingered = true;
 }
 
 /**
- * Handle input from stdin. This should exhaust stdin such that select does
- * not re-trigger for stdin.
+ * Handle input from stdin. This should exhaust stdin such that the event
+ * loop does not re-trigger for stdin.
  */
 void peerchat_handle_input(Peerchat *state) {
     // Read the line from stdin
@@ -89,12 +134,17 @@ void peerchat_handle_input(Peerchat *state) {
         // Disconnect from all peers and exit the program
         if (starts_with(line, "/exit")) {
             // Send leave packet
-            PacketLeave *packet = packet_leave(&state->self);
-            packet_send_all(state->socket, packet, sizeof(PacketLeave), &state->peers);
+            Packet *packet = packet_leave(&state->self);
+            peerchat_broadcast(state, packet);
             // Cleanup userlist
             userlist_remove_all(&state->peers);
+            swim_remove_all(&state->swim);
             printf("[Exited]\n");
-            exit(EXIT_SUCCESS);
+            // Stop taking input, and give the leave a little while to be
+            // acknowledged before the main loop ends
+            eventloop_remove(&state->events, STDIN_FILENO);
+            eventloop_timer_add(&state->events, RELIABLE_LINGER, peerchat_on_linger, state);
+            state->exiting = true;
         }
         // Connect to the target peer
         // Format: /join [-p <port>] <address>
@@ -116,34 +166,65 @@ void peerchat_handle_input(Peerchat *state) {
                 return;
             }
             address = inet_addr(address_buf);
-            // Connect
-            peerchat_connect(state, port, address);
+            // Connect, sharing our peers (we have none yet)
+            peerchat_connect(state, port, address, true);
         }
-        // Print all users with the matching age
-        // Format: /age <number>
+        // Print all users with the matching age, or an age in the range
+        // Format: /age <number>[-<number>]
         else if (starts_with(line, "/age")) {
-            uint8_t age;
-            if (sscanf(line, "/age %hhu", &age) == 1) {
-                if (state->self.age == age) {
+            uint8_t low, high;
+            int parsed = sscanf(line, "/age %hhu-%hhu", &low, &high);
+            if (parsed >= 1) {
+                high = parsed == 2 ? high : low;
+                if (state->self.age >= low && state->self.age <= high) {
                     user_print(&state->self);
                 }
-                userlist_print_by_age(&state->peers, age);
+                userlist_print_by_age(&state->peers, low, high);
             } else {
-                printf("[Expected: /age <number>]\n");
+                printf("[Expected: /age <number>[-<number>]]\n");
             }
         }
-        // Print all users with the matching zip code
-        // Format: /zip <number>
+        // Print all users with the matching zip code, a zip code in the
+        // range, or a zip code starting with the digits
+        // Format: /zip <number>[-<number>] or /zip <digits>*
         else if (starts_with(line, "/zip")) {
-            uint32_t zip_code;
-            if (sscanf(line, "/zip %u", &zip_code) == 1) {
-                if (state->self.zip_code == zip_code) {
+            uint32_t low, high;
+            char digits[11];
+            char star;
+            int parsed = sscanf(line, "/zip %u-%u", &low, &high);
+            if (sscanf(line, "/zip %10[0-9]%c", digits, &star) == 2 && star == '*') {
+                if (user_zip_has_prefix(&state->self, digits)) {
                     user_print(&state->self);
                 }
-                userlist_print_by_zip(&state->peers, zip_code);
+                userlist_print_by_zip_prefix(&state->peers, digits);
+            } else if (parsed >= 1) {
+                high = parsed == 2 ? high : low;
+                if (state->self.zip_code >= low && state->self.zip_code <= high) {
+                    user_print(&state->self);
+                }
+                userlist_print_by_zip(&state->peers, low, high);
             } else {
-                printf("[Expected: /zip <number>]\n");
+                printf("[Expected: /zip <number>[-<number>] or /zip <digits>*]\n");
+            }
+        }
+        // Send our messages as rumors relayed to fanout peers at a time, or
+        // back to every peer directly
+        // Format: /gossip [<fanout>|off]
+        else if (starts_with(line, "/gossip")) {
+            uint32_t fanout;
+            if (strcmp(line, "/gossip off") == 0) {
+                state->gossip.enabled = false;
+                printf("[Gossip off - Messages go to every peer]\n");
+                return;
+            } else if (strcmp(line, "/gossip") == 0) {
+                fanout = GOSSIP_FANOUT;
+            } else if (sscanf(line, "/gossip %u", &fanout) != 1 || fanout == 0 || fanout > GOSSIP_FANOUT_MAX) {
+                printf("[Expected: /gossip [<fanout>|off], fanout from 1 to %u]\n", GOSSIP_FANOUT_MAX);
+                return;
             }
+            state->gossip.enabled = true;
+            state->gossip.fanout = fanout;
+            printf("[Gossip on - Messages relayed to %u peers at a time]\n", fanout);
         }
         // Print all active users
         else if (starts_with(line, "/who")) {
@@ -153,84 +234,208 @@ void peerchat_handle_input(Peerchat *state) {
         // Disconnect from all peers
         else if (starts_with(line, "/leave")) {
             // Send leave packet
-            PacketLeave *packet = packet_leave(&state->self);
-            packet_send_all(state->socket, packet, sizeof(PacketLeave), &state->peers);
+            Packet *packet = packet_leave(&state->self);
+            peerchat_broadcast(state, packet);
             // Cleanup userlist
             userlist_remove_all(&state->peers);
+            swim_remove_all(&state->swim);
             printf("[Left chat]\n");
         }
         // Send the chat message
-        else {
-            PacketMessage *packet = packet_message(&state->self, line);
-            packet_send_all(state->socket, packet, sizeof(PacketMessage), &state->peers);
+        else if (state->gossip.enabled) {
+            uint64_t id = gossip_next_id(&state->gossip);
+            Packet *packet = packet_rumor(state->self.username, id, state->gossip.fanout, 0, line);
+            peerchat_gossip(state, packet, state->gossip.fanout);
+        } else {
+            Packet *packet = packet_message(&state->self, line);
+            peerchat_broadcast(state, packet);
         }
     }
 }
 
-void peerchat_read(Peerchat *state) {
-    // Read data from the socket
-    struct sockaddr_in addr;
-    uint32_t addr_size = 0;
-    uint8_t buffer[2048];
-    ssize_t bytes_read = recvfrom(state->socket, (char *)buffer, 2048, 0, (struct sockaddr *)&addr, &addr_size);
-    if (bytes_read <= 0) {
-        printf("[Read Failure - No bytes received]\n");
-        return;
-    }
-
-    // If the address is 0.0.0.0, set it to 127.0.0.1 (network order)
-    uint32_t address = addr.sin_addr.s_addr;
-    if (address == 0) {
-        address = 0x100007F;
-    }
+/**
+ * Decodes one received packet and hands it to its handler.
+ */
+void peerchat_dispatch(Peerchat *state, uint8_t *buffer, uint32_t bytes_read, uint16_t port, uint32_t address) {
+    // If the address is 0.0.0.0, set it to 127.0.0.1
+    address = ip4_normalize(address);
 
-    // Switch on packet type
-    switch (buffer[0]) {
+    // Switch on packet type, dropping packets that don't decode
+    switch (packet_type(buffer, bytes_read)) {
         case PACKET_MESSAGE: {
-            peerchat_read_message(state, (PacketMessage *)buffer, address);
+            PacketMessage packet;
+            if (packet_read_message(buffer, bytes_read, &packet)) {
+                peerchat_read_message(state, &packet, address);
+            }
             break;
         }
         case PACKET_JOIN: {
-            peerchat_read_join(state, (PacketJoin *)buffer, address);
+            PacketJoin packet;
+            if (packet_read_join(buffer, bytes_read, &packet)) {
+                peerchat_read_join(state, &packet, address);
+            }
             break;
         }
         case PACKET_LEAVE: {
-            peerchat_read_leave(state, (PacketLeave *)buffer, address);
+            PacketLeave packet;
+            if (packet_read_leave(buffer, bytes_read, &packet)) {
+                peerchat_read_leave(state, &packet, address);
+            }
             break;
         }
+        case PACKET_RUMOR: {
+            PacketRumor packet;
+            if (packet_read_rumor(buffer, bytes_read, &packet)) {
+                peerchat_read_rumor(state, &packet, address);
+            }
+            break;
+        }
+        case PACKET_DATA:
+        case PACKET_ACK:
+            reliable_receive(&state->reliable, buffer, bytes_read, port, address);
+            break;
+        case PACKET_PING:
+        case PACKET_PING_REQ:
+        case PACKET_PING_ACK:
+            swim_receive(&state->swim, buffer, bytes_read, port, address);
+            break;
+    }
+}
+
+void peerchat_read(Peerchat *state) {
+    // Drain the socket a batch at a time, handling each batch before the
+    // buffers are reused. Stop after a few batches so stdin isn't starved;
+    // the event loop calls back while datagrams are left.
+    for (uint32_t round = 0; round < PACKET_DRAIN; round++) {
+        int32_t received = packet_receive(state->socket, &state->receiver);
+        if (received < 0) {
+            printf("[Read Failure - No bytes received]\n");
+            return;
+        }
+        for (int32_t i = 0; i < received; i++) {
+            uint32_t length;
+            uint16_t port;
+            uint32_t address;
+            uint8_t *buffer = packet_received(&state->receiver, i, &length, &port, &address);
+            peerchat_dispatch(state, buffer, length, port, address);
+        }
+        // Send the acks and replies for the whole batch together
+        reliable_flush(&state->reliable);
+        if (received < PACKET_RECEIVE) {
+            return;
+        }
     }
 }
 
 void peerchat_read_message(Peerchat *state, PacketMessage *packet, uint32_t address) {
     // Display the message
-    packet->username[USERNAME_LENGTH - 1] = '\0';
-    packet->message[MESSAGE_LENGTH - 1] = '\0';
     printf("<%s> %s\n", packet->username, packet->message);
 }
 
 void peerchat_read_join(Peerchat *state, PacketJoin *packet, uint32_t address) {
     // Join message for the first connection
     if (state->peers.length == 0) {
-        printf("[Joined chat with %u members]\n", packet->peer_length + 1);
+        printf("[Joined chat with %u members]\n", packet->peer_total + 1);
     }
-    // Check if we're already connected to that peer
-    if (userlist_has_user(&state->peers, packet->port, address)) {
-        return;
+    // A join too large for one packet arrives split over several, so only
+    // the first from a peer adds it, and every one has peers to connect to.
+    // In gossip mode only a newcomer is sent all our peers, since everyone
+    // else already has them; sending them to each peer that connects would
+    // cost the room traffic for every peer per join. Only that decision
+    // depends on the mode.
+    bool gossip = state->gossip.enabled;
+    if (!userlist_has_user(&state->peers, packet->port, address)) {
+        // Add the peer
+        peerchat_connect(state, packet->port, address, !gossip || packet->peer_total == 0);
+        User *peer = userlist_add(&state->peers, packet->username, packet->port, address, packet->zip_code, packet->age);
+        printf("[%s@%s:%hu has joined (Zip: %u, Age: %hhu)]\n", peer->username, ip4_to_string(peer->address), packet->port, peer->zip_code, peer->age);
+        swim_add(&state->swim, packet->port, address);
     }
-    // Add the peer
-    peerchat_connect(state, packet->port, address);
-    User *peer = userlist_add(&state->peers, packet->username, packet->port, address, packet->zip_code, packet->age);
-    printf("[%s@%s:%hu has joined (Zip: %u, Age: %hhu)]\n", peer->username, ip4_to_string(peer->address), packet->port, peer->zip_code, peer->age);
     // Connect to their peers
-    packet->peer_length = packet->peer_length > MAX_PEERS ? MAX_PEERS : packet->peer_length;
     for (uint32_t i = 0; i < packet->peer_length; i++) {
-        peerchat_connect(state, packet->peers[i].port, packet->peers[i].address);
+        uint16_t port;
+        uint32_t address;
+        packet_join_peer(packet, i, &port, &address);
+        peerchat_connect(state, port, address, !gossip);
     }
 }
 
 void peerchat_read_leave(Peerchat *state, PacketLeave *packet, uint32_t address) {
     // Remove the peer
     userlist_remove_by_connection(&state->peers, packet->port, address);
+    swim_remove(&state->swim, packet->port, address);
+    // Stop resending to it. It still gets the ack for its leave, which goes
+    // out separately.
+    reliable_close(&state->reliable, packet->port, address);
+}
+
+void peerchat_read_rumor(Peerchat *state, PacketRumor *packet, uint32_t address) {
+    // Drop rumors we've already relayed
+    if (!gossip_witness(&state->gossip, packet->id)) {
+        return;
+    }
+    // Display the message
+    printf("<%s> %s\n", packet->username, packet->message);
+    // Relay it on, whether or not our own messages are gossiped
+    if (packet->hops + 1 < GOSSIP_HOPS) {
+        Packet *relay = packet_rumor(packet->username, packet->id, packet->fanout, packet->hops + 1, packet->message);
+        peerchat_gossip(state, relay, packet->fanout);
+    }
+}
+
+/**
+ * Reliable callback for each packet a peer sends, in order.
+ */
+void peerchat_on_deliver(void *context, uint8_t *bytes, uint32_t length, uint16_t port, uint32_t address) {
+    Peerchat *state = context;
+    // Once we've exited, we only wait for acks
+    if (!state->exiting) {
+        peerchat_dispatch(state, bytes, length, port, address);
+    }
+}
+
+/**
+ * Reliable callback for packets dropped after a peer stopped acknowledging
+ * them.
+ */
+void peerchat_on_failure(void *context, uint16_t port, uint32_t address, uint32_t dropped) {
+    Peerchat *state = context;
+    if (state->exiting) {
+        return;
+    }
+    User *peer = userlist_find(&state->peers, port, address);
+    printf("[Error: Delivery failure to %s@%s:%hu, %u packets dropped]\n", peer == NULL ? "?" : peer->username, ip4_to_string(address), port, dropped);
+}
+
+/**
+ * Swim callback for a peer found to have died without leaving.
+ */
+void peerchat_on_dead(void *context, uint16_t port, uint32_t address) {
+    Peerchat *state = context;
+    User *peer = userlist_find(&state->peers, port, address);
+    if (peer == NULL) {
+        return;
+    }
+    printf("[%s@%s:%hu stopped responding]\n", peer->username, ip4_to_string(address), port);
+    userlist_drop(&state->peers, port, address);
+    // Stop resending to it
+    reliable_close(&state->reliable, port, address);
+}
+
+/**
+ * Event loop callback for stdin.
+ */
+void peerchat_on_input(void *context, int32_t file_descriptor) {
+    Peerchat *state = context;
+    peerchat_handle_input(state);
+    reliable_flush(&state->reliable);
+}
+
+/**
+ * Event loop callback for the socket.
+ */
+void peerchat_on_socket(void *context, int32_t file_descriptor) {
+    peerchat_read((Peerchat *)context);
 }
 
 ///////////////////////////////////////////////////////////
@@ -246,8 +451,8 @@ int main(int argc, char *argv[]) {
     peerchat_initialize(&state);
     // Parse the command line arguments
     user_parse_arguments(&state.self, argc, argv);
-    // Add stdin to the file descriptor set
-    filedescriptorset_add(&state.master_fds, STDIN_FILENO);
+    // Watch stdin for input
+    eventloop_add(&state.events, STDIN_FILENO, peerchat_on_input, &state);
 
     // Setup socket that our peers will send data to
     int32_t accept_socket = socket(
@@ -273,34 +478,19 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Store the accept socket
+    // Store the accept socket, and send everything but probes over it
+    // reliably
     state.socket = accept_socket;
-    // Add accept_socket to the master file descriptor list
-    filedescriptorset_add(&state.master_fds, accept_socket);
-
-    // Loop forever
-    while (true) {
-        fd_set read_fds = filedescriptorset_select(&state.master_fds);
+    reliable_initialize(&state.reliable, accept_socket, &state.events, peerchat_on_deliver, peerchat_on_failure, &state);
+    // Probe peers over it too, to notice the ones that die
+    swim_initialize(&state.swim, accept_socket, &state.events, state.self.username, state.self.port, peerchat_on_dead, &state);
+    // Watch accept_socket for data from peers
+    eventloop_add(&state.events, accept_socket, peerchat_on_socket, &state);
 
-        // Loop through our file descriptors
-        for (int32_t i = 0; i < state.master_fds.length; i++) {
-            // If the file descriptor is not set, skip to the next one
-            if (!FD_ISSET(i, &read_fds)) continue;
-
-            // If the file descriptor is stdin, handle input
-            if (i == STDIN_FILENO) {
-                peerchat_handle_input(&state);
-            }
-            // If the file descriptor is accept_socket, handle receiving data
-            else if (i == accept_socket) {
-                peerchat_read(&state);
-            }
-            // Else we're receiving data from an unknown file descriptor
-            else {
-                printf("[Error: Unknown file descriptor selected.]\n");
-                exit(EXIT_FAILURE);
-            }
-        }
+    // Dispatch whatever is ready until we've exited, and our last packets
+    // are acknowledged or we've waited long enough
+    while (!state.exiting || (reliable_pending(&state.reliable) > 0 && !state.lingered)) {
+        eventloop_wait(&state.events);
     }
 
     return 0;
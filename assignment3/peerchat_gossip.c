@@ -0,0 +1,85 @@
+/**
+ * peerchat_gossip.c
+ * 
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "peerchat_gossip.h"
+#include "peerchat_utility.h"
+
+///////////////////////////////////////////////////////////
+// Gossip helpers
+///////////////////////////////////////////////////////////
+
+/**
+ * Returns the set of the seen table the rumor id belongs in.
+ */
+static uint32_t gossip_set(uint64_t id) {
+    return (id * 0x9E3779B97F4A7C15) >> 32 & (GOSSIP_SEEN_SETS - 1);
+}
+
+///////////////////////////////////////////////////////////
+// Gossip functions
+///////////////////////////////////////////////////////////
+
+void gossip_initialize(Gossip *gossip) {
+    memset(gossip, 0, sizeof(Gossip));
+    gossip->fanout = GOSSIP_FANOUT;
+    gossip->random = random_seed() | 1;
+    // Ids of 0 mark empty entries in the seen table
+    gossip->origin = random_next(&gossip->random) >> 32;
+    if (gossip->origin == 0) {
+        gossip->origin = 1;
+    }
+}
+
+uint64_t gossip_next_id(Gossip *gossip) {
+    gossip->sequence += 1;
+    uint64_t id = (uint64_t)gossip->origin << 32 | gossip->sequence;
+    gossip_witness(gossip, id);
+    return id;
+}
+
+bool gossip_witness(Gossip *gossip, uint64_t id) {
+    uint32_t set = gossip_set(id);
+    for (uint32_t way = 0; way < GOSSIP_SEEN_WAYS; way++) {
+        if (gossip->seen[set][way] == id) {
+            return false;
+        }
+    }
+    gossip->seen[set][gossip->replace[set]] = id;
+    gossip->replace[set] = (gossip->replace[set] + 1) % GOSSIP_SEEN_WAYS;
+    return true;
+}
+
+uint32_t gossip_pick(Gossip *gossip, uint32_t length, uint32_t fanout, uint32_t **chosen) {
+    if (fanout > GOSSIP_FANOUT_MAX) {
+        fanout = GOSSIP_FANOUT_MAX;
+    }
+    *chosen = gossip->chosen;
+    // Few enough peers that everyone is picked
+    if (length <= fanout) {
+        for (uint32_t i = 0; i < length; i++) {
+            gossip->chosen[i] = i;
+        }
+        return length;
+    }
+    // Draw until fanout distinct positions are picked. There are more
+    // positions than picks, so the draws finish quickly.
+    uint32_t count = 0;
+    while (count < fanout) {
+        uint32_t position = random_next(&gossip->random) % length;
+        bool picked = false;
+        for (uint32_t i = 0; i < count && !picked; i++) {
+            picked = gossip->chosen[i] == position;
+        }
+        if (!picked) {
+            gossip->chosen[count++] = position;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,76 @@
+/**
+ * peerchat_gossip.h
+ * 
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef PEERCHAT_GOSSIP_INCLUDED
+#define PEERCHAT_GOSSIP_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////
+// Gossip macros
+///////////////////////////////////////////////////////////
+
+#define GOSSIP_FANOUT 8       // Peers a rumor is relayed to unless another fanout is chosen
+#define GOSSIP_FANOUT_MAX 32  // Most peers a rumor is relayed to, whatever its origin asked for
+#define GOSSIP_HOPS 16        // Relays a rumor makes before it's dropped
+#define GOSSIP_SEEN_SETS 1024 // Sets of remembered rumor ids, a power of two
+#define GOSSIP_SEEN_WAYS 4    // Rumor ids remembered per set
+
+///////////////////////////////////////////////////////////
+// Gossip structs
+///////////////////////////////////////////////////////////
+
+/**
+ * State for spreading broadcasts as rumors. Rather than sending to every
+ * peer, the origin sends to a few random peers, and each peer that hears a
+ * rumor for the first time relays it to a few more, so every node sends a
+ * fixed number of packets per broadcast however large the room is.
+ * 
+ * A rumor's id is its origin's random id in the high 32 bits and the origin's
+ * sequence number in the low 32 bits. Recently seen ids are kept in a fixed
+ * set associative table, oldest replaced first within each set, so duplicates
+ * are suppressed in constant memory.
+ */
+typedef struct {
+    bool enabled;                                      // True if our broadcasts are sent as rumors
+    uint8_t fanout;                                    // Peers our rumors are sent to
+    uint32_t origin;                                   // Random id naming us as a rumor's origin, never 0
+    uint32_t sequence;                                 // Sequence number of our last rumor
+    uint64_t random;                                   // xorshift state for picking peers, never 0
+    uint32_t chosen[GOSSIP_FANOUT_MAX];                // Userlist positions from the last pick
+    uint64_t seen[GOSSIP_SEEN_SETS][GOSSIP_SEEN_WAYS]; // Recently seen rumor ids, 0 if empty
+    uint8_t replace[GOSSIP_SEEN_SETS];                 // Way each set replaces next
+} Gossip;
+
+///////////////////////////////////////////////////////////
+// Gossip functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Initializes gossip, disabled, with a random origin id.
+ */
+void gossip_initialize(Gossip *gossip);
+
+/**
+ * Returns the id for a new rumor from us, already marked as seen.
+ */
+uint64_t gossip_next_id(Gossip *gossip);
+
+/**
+ * Marks the rumor id as seen. Returns true if it hadn't been seen before.
+ */
+bool gossip_witness(Gossip *gossip, uint64_t id);
+
+/**
+ * Picks up to fanout distinct positions at random from a userlist of the
+ * given length, and points chosen at them. Returns the number picked.
+ * 
+ * Successive calls to this function overwrite the chosen positions.
+ */
+uint32_t gossip_pick(Gossip *gossip, uint32_t length, uint32_t fanout, uint32_t **chosen);
+
+#endif
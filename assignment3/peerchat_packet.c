@@ -4,8 +4,12 @@
  * Author: Joseph Cumbo (jwc6999)
  */
 
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+
 #include <arpa/inet.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 
@@ -13,53 +17,353 @@
 #include "peerchat_user.h"
 #include "peerchat_utility.h"
 
+///////////////////////////////////////////////////////////
+// Packet helpers
+///////////////////////////////////////////////////////////
+
+/**
+ * Reusable arrays for sending many frames at once.
+ */
+typedef struct {
+    struct mmsghdr *messages;         // One message per frame
+    struct sockaddr_in *destinations; // Address of each frame's peer
+    struct iovec *iovecs;             // Each frame's header, then its payload
+    uint32_t capacity;                // Number of frames each array has room for
+} PacketBatch;
+
+/**
+ * Reads fields from a received packet in order. Once a read would run past
+ * the end, ok is cleared and every later read gives zeros.
+ */
+typedef struct {
+    uint8_t *bytes;  // Received packet
+    uint32_t length; // Total number of bytes received
+    uint32_t offset; // Next byte to read
+    bool ok;         // False once a read ran past the end
+} PacketReader;
+
+static void packet_put_u8(Packet *packet, uint8_t value) {
+    packet->bytes[packet->length++] = value;
+}
+
+static void packet_put_u16(Packet *packet, uint16_t value) {
+    packet->bytes[packet->length++] = value >> 8;
+    packet->bytes[packet->length++] = value;
+}
+
+static void packet_put_u32(Packet *packet, uint32_t value) {
+    packet_put_u16(packet, value >> 16);
+    packet_put_u16(packet, value);
+}
+
+static void packet_put_bytes(Packet *packet, const void *bytes, uint32_t length) {
+    memcpy(packet->bytes + packet->length, bytes, length);
+    packet->length += length;
+}
+
+/**
+ * Writes a big-endian integer of the given number of bytes.
+ */
+static void packet_write(uint8_t *bytes, uint64_t value, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        bytes[i] = value >> (8 * (length - 1 - i));
+    }
+}
+
+/**
+ * Starts a packet of the given type from the named user.
+ */
+static void packet_begin(Packet *packet, PacketType type, char *username) {
+    uint8_t username_length = strnlen(username, USERNAME_LENGTH - 1);
+    packet->length = 0;
+    packet_put_u8(packet, PACKET_VERSION);
+    packet_put_u8(packet, type);
+    packet_put_u8(packet, username_length);
+    packet_put_bytes(packet, username, username_length);
+}
+
+/**
+ * Returns a pointer to the next length bytes, or NULL if there aren't that
+ * many left.
+ */
+static uint8_t *packet_get_bytes(PacketReader *reader, uint32_t length) {
+    if (!reader->ok || reader->length - reader->offset < length) {
+        reader->ok = false;
+        return NULL;
+    }
+    reader->offset += length;
+    return reader->bytes + reader->offset - length;
+}
+
+static uint8_t packet_get_u8(PacketReader *reader) {
+    uint8_t *bytes = packet_get_bytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint16_t packet_get_u16(PacketReader *reader) {
+    uint8_t *bytes = packet_get_bytes(reader, 2);
+    return bytes == NULL ? 0 : bytes[0] << 8 | bytes[1];
+}
+
+static uint32_t packet_get_u32(PacketReader *reader) {
+    uint32_t high = packet_get_u16(reader);
+    return high << 16 | packet_get_u16(reader);
+}
+
+/**
+ * Reads a string with a length of the given size into dest, which holds
+ * capacity bytes. A string too long for dest is cut short.
+ */
+static void packet_get_string(PacketReader *reader, uint32_t size, char *dest, uint32_t capacity) {
+    uint32_t length = size == 1 ? packet_get_u8(reader) : packet_get_u16(reader);
+    uint8_t *bytes = packet_get_bytes(reader, length);
+    if (bytes == NULL) {
+        length = 0;
+    } else if (length >= capacity) {
+        length = capacity - 1;
+    }
+    memcpy(dest, bytes, length);
+    dest[length] = '\0';
+}
+
+/**
+ * Starts reading a received packet after its version and type, and reads the
+ * username every packet starts with.
+ */
+static void packet_read_begin(PacketReader *reader, uint8_t *bytes, uint32_t length, char *username) {
+    reader->bytes = bytes;
+    reader->length = length;
+    reader->offset = 2;
+    reader->ok = length >= 2;
+    packet_get_string(reader, 1, username, USERNAME_LENGTH);
+}
+
 ///////////////////////////////////////////////////////////
 // Packet functions
 ///////////////////////////////////////////////////////////
 
-PacketMessage message_instance;
+Packet message_instance;
 
-PacketMessage *packet_message(User *user, char *message) {
-    message_instance.type = PACKET_MESSAGE;
-    strncpy(message_instance.username, user->username, USERNAME_LENGTH);
-    strncpy(message_instance.message, message, MESSAGE_LENGTH);
+Packet *packet_message(User *user, char *message) {
+    uint16_t message_length = strnlen(message, MESSAGE_LENGTH - 1);
+    packet_begin(&message_instance, PACKET_MESSAGE, user->username);
+    packet_put_u16(&message_instance, message_length);
+    packet_put_bytes(&message_instance, message, message_length);
     return &message_instance;
 }
 
-PacketJoin join_instance;
+Packet join_instance;
 
-PacketJoin *packet_join(User *user, UserList *list, uint16_t port, uint32_t address) {
+Packet *packet_join(User *user, UserList *list, uint16_t port, uint32_t address, uint32_t *cursor) {
     // Join
-    join_instance.type = PACKET_JOIN;
-    strncpy(join_instance.username, user->username, USERNAME_LENGTH);
-    join_instance.port = user->port;
-    join_instance.age = user->age;
-    join_instance.zip_code = user->zip_code;
-
-    // Peer
-    uint32_t x = 0;
-    for (uint32_t i = 0; i < list->length; i++) {
-        User *user = &list->users[i];
-        if (user->port != port || user->address != address) {
-            join_instance.peers[x].address = user->address;
-            join_instance.peers[x].port = user->port;
-            x += 1;
+    packet_begin(&join_instance, PACKET_JOIN, user->username);
+    packet_put_u16(&join_instance, user->port);
+    packet_put_u32(&join_instance, user->zip_code);
+    packet_put_u8(&join_instance, user->age);
+    packet_put_u32(&join_instance, list->length - (userlist_has_user(list, port, address) ? 1 : 0));
+    uint32_t count_offset = join_instance.length;
+    packet_put_u16(&join_instance, 0);
+
+    // Peers, as many as fit
+    uint16_t count = 0;
+    for (; *cursor < list->length && join_instance.length + PACKET_PEER_LENGTH <= PACKET_PAYLOAD_LENGTH; *cursor += 1) {
+        User *peer = &list->users[*cursor];
+        if (peer->port != port || peer->address != address) {
+            packet_put_bytes(&join_instance, &peer->address, 4);
+            packet_put_u16(&join_instance, peer->port);
+            count += 1;
         }
     }
-    join_instance.peer_length = x;
+    join_instance.bytes[count_offset] = count >> 8;
+    join_instance.bytes[count_offset + 1] = count;
     return &join_instance;
 }
 
-PacketLeave leave_instance;
+Packet leave_instance;
 
-PacketLeave *packet_leave(User *user) {
-    leave_instance.type = PACKET_LEAVE;
-    strncpy(leave_instance.username, user->username, USERNAME_LENGTH);
-    leave_instance.port = user->port;
+Packet *packet_leave(User *user) {
+    packet_begin(&leave_instance, PACKET_LEAVE, user->username);
+    packet_put_u16(&leave_instance, user->port);
     return &leave_instance;
 }
 
-void packet_send_direct(int32_t socket, void *packet, uint32_t size, uint16_t port, uint32_t address) {
+Packet rumor_instance;
+
+Packet *packet_rumor(char *username, uint64_t id, uint8_t fanout, uint8_t hops, char *message) {
+    uint16_t message_length = strnlen(message, MESSAGE_LENGTH - 1);
+    packet_begin(&rumor_instance, PACKET_RUMOR, username);
+    packet_put_u32(&rumor_instance, id >> 32);
+    packet_put_u32(&rumor_instance, id);
+    packet_put_u8(&rumor_instance, fanout);
+    packet_put_u8(&rumor_instance, hops);
+    packet_put_u16(&rumor_instance, message_length);
+    packet_put_bytes(&rumor_instance, message, message_length);
+    return &rumor_instance;
+}
+
+Packet ping_instance;
+
+Packet *packet_ping(PacketType type, char *username, uint32_t sequence, uint16_t port, uint32_t address, PacketUpdate *updates, uint32_t count) {
+    packet_begin(&ping_instance, type, username);
+    packet_put_u32(&ping_instance, sequence);
+    packet_put_bytes(&ping_instance, &address, 4);
+    packet_put_u16(&ping_instance, port);
+    packet_put_u8(&ping_instance, count);
+    for (uint32_t i = 0; i < count; i++) {
+        packet_put_bytes(&ping_instance, &updates[i].address, 4);
+        packet_put_u16(&ping_instance, updates[i].port);
+        packet_put_u8(&ping_instance, updates[i].status);
+        packet_put_u32(&ping_instance, updates[i].incarnation);
+    }
+    return &ping_instance;
+}
+
+void packet_frame(PacketFrame *frame, PacketHeader *header) {
+    uint8_t *bytes = frame->header;
+    bytes[0] = PACKET_VERSION;
+    bytes[1] = frame->payload == NULL ? PACKET_ACK : PACKET_DATA;
+    packet_write(bytes + 2, header->session, 4);
+    packet_write(bytes + 6, header->peer_session, 4);
+    packet_write(bytes + 10, header->ack, 4);
+    packet_write(bytes + 14, header->sack, 8);
+    frame->header_length = PACKET_ACK_LENGTH;
+    if (frame->payload != NULL) {
+        packet_write(bytes + 22, header->sequence, 4);
+        packet_write(bytes + 26, header->first, 4);
+        frame->header_length = PACKET_HEADER_LENGTH;
+    }
+}
+
+void packet_receiver_initialize(PacketReceiver *receiver) {
+    memset(receiver, 0, sizeof(PacketReceiver));
+    for (uint32_t i = 0; i < PACKET_RECEIVE; i++) {
+        receiver->iovecs[i].iov_base = receiver->buffers[i];
+        receiver->iovecs[i].iov_len = PACKET_LENGTH;
+        receiver->messages[i].msg_hdr.msg_iov = &receiver->iovecs[i];
+        receiver->messages[i].msg_hdr.msg_iovlen = 1;
+        receiver->messages[i].msg_hdr.msg_name = &receiver->sources[i];
+    }
+}
+
+int32_t packet_receive(int32_t socket, PacketReceiver *receiver) {
+    // The kernel shrinks msg_namelen to the address it wrote, so reset it
+    for (uint32_t i = 0; i < PACKET_RECEIVE; i++) {
+        receiver->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int received;
+    do {
+        received = recvmmsg(socket, receiver->messages, PACKET_RECEIVE, MSG_DONTWAIT, NULL);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    return received;
+}
+
+uint8_t *packet_received(PacketReceiver *receiver, int32_t index, uint32_t *length, uint16_t *port, uint32_t *address) {
+    struct mmsghdr *message = &receiver->messages[index];
+    *port = ntohs(receiver->sources[index].sin_port);
+    *address = receiver->sources[index].sin_addr.s_addr;
+    // A truncated datagram can't be decoded, so present it as empty
+    *length = message->msg_hdr.msg_flags & MSG_TRUNC ? 0 : message->msg_len;
+    return receiver->buffers[index];
+}
+
+int32_t packet_type(uint8_t *bytes, uint32_t length) {
+    if (length < 2 || bytes[0] != PACKET_VERSION) {
+        return -1;
+    }
+    return bytes[1];
+}
+
+bool packet_read_message(uint8_t *bytes, uint32_t length, PacketMessage *packet) {
+    PacketReader reader;
+    packet_read_begin(&reader, bytes, length, packet->username);
+    packet_get_string(&reader, 2, packet->message, MESSAGE_LENGTH);
+    return reader.ok;
+}
+
+bool packet_read_join(uint8_t *bytes, uint32_t length, PacketJoin *packet) {
+    PacketReader reader;
+    packet_read_begin(&reader, bytes, length, packet->username);
+    packet->port = packet_get_u16(&reader);
+    packet->zip_code = packet_get_u32(&reader);
+    packet->age = packet_get_u8(&reader);
+    packet->peer_total = packet_get_u32(&reader);
+    packet->peer_length = packet_get_u16(&reader);
+    packet->peers = packet_get_bytes(&reader, packet->peer_length * PACKET_PEER_LENGTH);
+    return reader.ok;
+}
+
+bool packet_read_leave(uint8_t *bytes, uint32_t length, PacketLeave *packet) {
+    PacketReader reader;
+    packet_read_begin(&reader, bytes, length, packet->username);
+    packet->port = packet_get_u16(&reader);
+    return reader.ok;
+}
+
+bool packet_read_rumor(uint8_t *bytes, uint32_t length, PacketRumor *packet) {
+    PacketReader reader;
+    packet_read_begin(&reader, bytes, length, packet->username);
+    uint64_t origin = packet_get_u32(&reader);
+    packet->id = origin << 32 | packet_get_u32(&reader);
+    packet->fanout = packet_get_u8(&reader);
+    packet->hops = packet_get_u8(&reader);
+    packet_get_string(&reader, 2, packet->message, MESSAGE_LENGTH);
+    return reader.ok;
+}
+
+bool packet_read_ping(uint8_t *bytes, uint32_t length, PacketPing *packet) {
+    PacketReader reader;
+    packet_read_begin(&reader, bytes, length, packet->username);
+    packet->sequence = packet_get_u32(&reader);
+    uint8_t *address = packet_get_bytes(&reader, 4);
+    packet->address = 0;
+    if (address != NULL) {
+        memcpy(&packet->address, address, 4);
+    }
+    packet->port = packet_get_u16(&reader);
+    packet->update_length = packet_get_u8(&reader);
+    packet->updates = packet_get_bytes(&reader, packet->update_length * PACKET_UPDATE_LENGTH);
+    return reader.ok;
+}
+
+bool packet_read_header(uint8_t *bytes, uint32_t length, PacketHeader *header) {
+    PacketReader reader = {bytes, length, 2, length >= 2};
+    header->type = packet_type(bytes, length);
+    header->session = packet_get_u32(&reader);
+    header->peer_session = packet_get_u32(&reader);
+    header->ack = packet_get_u32(&reader);
+    uint64_t sack = packet_get_u32(&reader);
+    header->sack = sack << 32 | packet_get_u32(&reader);
+    header->sequence = 0;
+    header->first = 0;
+    header->payload = NULL;
+    header->length = 0;
+    if (header->type == PACKET_DATA) {
+        header->sequence = packet_get_u32(&reader);
+        header->first = packet_get_u32(&reader);
+        header->payload = bytes + reader.offset;
+        header->length = length - reader.offset;
+    }
+    return reader.ok;
+}
+
+void packet_join_peer(PacketJoin *packet, uint32_t index, uint16_t *port, uint32_t *address) {
+    uint8_t *peer = packet->peers + index * PACKET_PEER_LENGTH;
+    memcpy(address, peer, 4);
+    *port = peer[4] << 8 | peer[5];
+}
+
+void packet_ping_update(PacketPing *packet, uint32_t index, PacketUpdate *update) {
+    uint8_t *bytes = packet->updates + index * PACKET_UPDATE_LENGTH;
+    memcpy(&update->address, bytes, 4);
+    update->port = bytes[4] << 8 | bytes[5];
+    update->status = bytes[6];
+    update->incarnation = (uint32_t)bytes[7] << 24 | bytes[8] << 16 | bytes[9] << 8 | bytes[10];
+}
+
+void packet_send_direct(int32_t socket, Packet *packet, uint16_t port, uint32_t address) {
     // Configure destination
     struct sockaddr_in destination;
     destination.sin_family = AF_INET;
@@ -67,17 +371,73 @@ void packet_send_direct(int32_t socket, void *packet, uint32_t size, uint16_t po
     destination.sin_addr.s_addr = address;
 
     // Send the payload
-    if (sendto(socket, packet, size, 0, (struct sockaddr *)&destination, sizeof(destination)) < 0) {
+    if (sendto(socket, packet->bytes, packet->length, 0, (struct sockaddr *)&destination, sizeof(destination)) < 0) {
         printf("[Error: Send failure to %s]\n", ip4_to_string(address));
     }
 }
 
-void packet_send(int32_t socket, void *packet, uint32_t size, User *user) {
-    packet_send_direct(socket, packet, size, user->port, user->address);
+void packet_send(int32_t socket, Packet *packet, User *user) {
+    packet_send_direct(socket, packet, user->port, user->address);
 }
 
-void packet_send_all(int32_t socket, void *packet, uint32_t size, UserList *list) {
-    for (uint32_t i = 0; i < list->length; i++) {
-        packet_send(socket, packet, size, &list->users[i]);
+PacketBatch batch_instance;
+
+uint32_t packet_send_frames(int32_t socket, PacketFrame *frames, uint32_t count) {
+    // Make room for every frame
+    PacketBatch *batch = &batch_instance;
+    if (batch->capacity < count) {
+        uint32_t capacity = batch->capacity == 0 ? 64 : batch->capacity;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        free(batch->messages);
+        free(batch->destinations);
+        free(batch->iovecs);
+        batch->messages = malloc(capacity * sizeof(struct mmsghdr));
+        batch->destinations = malloc(capacity * sizeof(struct sockaddr_in));
+        batch->iovecs = malloc(capacity * 2 * sizeof(struct iovec));
+        if (batch->messages == NULL || batch->destinations == NULL || batch->iovecs == NULL) {
+            printf("[Error: Out of memory]\n");
+            exit(EXIT_FAILURE);
+        }
+        batch->capacity = capacity;
+    }
+
+    // Prepare every frame, pointing at its payload rather than copying it
+    for (uint32_t i = 0; i < count; i++) {
+        PacketFrame *frame = &frames[i];
+        struct sockaddr_in *destination = &batch->destinations[i];
+        memset(destination, 0, sizeof(struct sockaddr_in));
+        destination->sin_family = AF_INET;
+        destination->sin_port = htons(frame->port);
+        destination->sin_addr.s_addr = frame->address;
+        struct iovec *iovecs = &batch->iovecs[i * 2];
+        iovecs[0] = (struct iovec){frame->header, frame->header_length};
+        if (frame->payload != NULL) {
+            iovecs[1] = (struct iovec){frame->payload->bytes, frame->payload->length};
+        }
+        struct mmsghdr *message = &batch->messages[i];
+        memset(message, 0, sizeof(struct mmsghdr));
+        message->msg_hdr.msg_name = destination;
+        message->msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        message->msg_hdr.msg_iov = iovecs;
+        message->msg_hdr.msg_iovlen = frame->payload == NULL ? 1 : 2;
+    }
+
+    // Submit as few calls as the kernel allows. sendmmsg stops at the first
+    // message that fails, so skip that frame and carry on after it.
+    uint32_t failures = 0;
+    uint32_t sent = 0;
+    while (sent < count) {
+        uint32_t remaining = count - sent;
+        int result = sendmmsg(socket, &batch->messages[sent], remaining > PACKET_BATCH ? PACKET_BATCH : remaining, 0);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            failures += 1;
+            sent += 1;
+        } else {
+            sent += result;
+        }
     }
-}
\ No newline at end of file
+    return failures;
+}
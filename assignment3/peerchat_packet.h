@@ -7,49 +7,175 @@
 #ifndef PEERCHAT_PACKET_INCLUDED
 #define PEERCHAT_PACKET_INCLUDED
 
+#include <netinet/in.h>
 #include <stdint.h>
+#include <sys/socket.h>
 
 #include "peerchat_user.h"
 #include "peerchat_utility.h"
 
+///////////////////////////////////////////////////////////
+// Packet macros
+///////////////////////////////////////////////////////////
+
+#define PACKET_VERSION 0xA2     // First byte of every packet, changed whenever the encoding does
+#define PACKET_LENGTH 1400      // Largest packet sent, so none are fragmented on common links
+#define PACKET_PEER_LENGTH 6    // Bytes per peer listed in a join: address, then port
+#define PACKET_BATCH 1024       // Most datagrams handed to the kernel in one call, its UIO_MAXIOV
+#define PACKET_RECEIVE 64       // Datagrams drained from the socket per call
+#define PACKET_DRAIN 4          // Calls a drain makes before letting other events run
+#define PACKET_ACK_LENGTH 22    // Bytes in an ack, or in the header of a data packet before its sequence
+#define PACKET_HEADER_LENGTH 30 // Bytes in the header of a data packet
+#define PACKET_UPDATE_LENGTH 11 // Bytes per membership update in a ping: address, port, status, incarnation
+
+// Largest packet a data packet carries
+#define PACKET_PAYLOAD_LENGTH (PACKET_LENGTH - PACKET_HEADER_LENGTH)
+
 ///////////////////////////////////////////////////////////
 // Packet structs
 ///////////////////////////////////////////////////////////
 
+/**
+ * Every packet starts with PACKET_VERSION and the type. Multi-byte integers
+ * are big-endian and unpadded, addresses are the four bytes of the IPv4
+ * address, and strings are a length then that many bytes with no terminator.
+ * 
+ * MESSAGE: username (1 byte length), message (2 byte length)
+ * JOIN:    username (1 byte length), port (2), zip code (4), age (1),
+ *          peers the sender knows (4), peers listed (2), then each listed
+ *          peer's address (4) and port (2)
+ * LEAVE:   username (1 byte length), port (2)
+ * RUMOR:   origin's username (1 byte length), rumor id (8), fanout (1),
+ *          hops so far (1), message (2 byte length)
+ * ACK:     session of the sender's channel (4), the session it has for
+ *          ours (4), next sequence wanted from us (4), which of the 64
+ *          after it it has (8)
+ * DATA:    the same fields as an ack, then sequence (4), the oldest
+ *          sequence the sender is still sending (4), then a whole packet of
+ *          one of the types above
+ * PING, PING_REQ, PING_ACK:
+ *          username (1 byte length), probe sequence (4), address (4) and
+ *          port (2) of the peer probed, updates listed (1), then each
+ *          update's address (4), port (2), status (1) and incarnation (4)
+ * 
+ * A sender that knows more peers than fit in one join sends several, each
+ * listing the next run of peers. A rumor is a message relayed from peer to
+ * peer by gossip rather than sent by its origin to everyone. Data and ack
+ * packets carry the others reliably and in order; see peerchat_reliable.h.
+ * Pings probe whether peers are still running, and are never resent, since
+ * one going unanswered is the point; see peerchat_swim.h.
+ */
 typedef enum {
     PACKET_MESSAGE,
     PACKET_JOIN,
     PACKET_LEAVE,
+    PACKET_RUMOR,
+    PACKET_DATA,
+    PACKET_ACK,
+    PACKET_PING,
+    PACKET_PING_REQ,
+    PACKET_PING_ACK,
 } PacketType;
 
+/**
+ * An encoded packet ready to send.
+ */
+typedef struct {
+    uint8_t bytes[PACKET_LENGTH]; // Encoded packet
+    uint32_t length;              // Total number of bytes in use
+} Packet;
+
+/**
+ * The header of a data or ack packet.
+ */
+typedef struct {
+    PacketType type;       // PACKET_DATA or PACKET_ACK
+    uint32_t session;      // Session of the sender's channel to us
+    uint32_t peer_session; // Session the sender has for our channel to it, 0 if it has none
+    uint32_t ack;          // Next sequence the sender wants from us
+    uint64_t sack;         // Bit i set if the sender has sequence ack + 1 + i
+    uint32_t sequence;     // Sequence of the data packet
+    uint32_t first;        // Oldest sequence the sender is still sending, so any before it are skipped
+    uint8_t *payload;      // Packet a data packet carries, left in the received bytes
+    uint32_t length;       // Bytes in payload
+} PacketHeader;
+
+/**
+ * A data or ack packet for one peer. The header is encoded per peer, while
+ * the payload may be shared by the frames for many peers.
+ */
+typedef struct {
+    uint8_t header[PACKET_HEADER_LENGTH]; // Encoded header
+    uint32_t header_length;               // Bytes in header
+    Packet *payload;                      // Packet carried after the header, NULL for an ack
+    uint16_t port;                        // Port of the peer
+    uint32_t address;                     // Address of the peer
+} PacketFrame;
+
+/**
+ * A fixed ring of buffers that datagrams are drained into, a batch at a time.
+ * Buffers are reused by each batch, so a packet must be handled before the
+ * next one is received.
+ */
+typedef struct {
+    uint8_t buffers[PACKET_RECEIVE][PACKET_LENGTH]; // Received datagrams
+    struct iovec iovecs[PACKET_RECEIVE];            // Each points at its buffer
+    struct sockaddr_in sources[PACKET_RECEIVE];     // Who sent each datagram
+    struct mmsghdr messages[PACKET_RECEIVE];        // Each points at its iovec and source
+} PacketReceiver;
+
 typedef struct
 {
-    uint8_t type;
     char username[USERNAME_LENGTH];
     char message[MESSAGE_LENGTH];
 } PacketMessage;
 
 typedef struct
 {
-    uint8_t type;
     char username[USERNAME_LENGTH];
     uint16_t port;
     uint32_t zip_code;
     uint8_t age;
-    uint32_t peer_length;
-    struct {
-        uint32_t address;
-        uint16_t port;
-    } peers[MAX_PEERS];
+    uint32_t peer_total;  // Peers the sender knows, across all its joins
+    uint32_t peer_length; // Peers listed in this packet
+    uint8_t *peers;       // Encoded peers, read with packet_join_peer
 } PacketJoin;
 
 typedef struct
 {
-    uint8_t type;
     char username[USERNAME_LENGTH];
     uint16_t port;
 } PacketLeave;
 
+typedef struct
+{
+    char username[USERNAME_LENGTH]; // Username of the rumor's origin
+    uint64_t id;                    // Origin's id, then its sequence number
+    uint8_t fanout;                 // Peers each relay sends the rumor to
+    uint8_t hops;                   // Relays the rumor has made
+    char message[MESSAGE_LENGTH];
+} PacketRumor;
+
+typedef struct
+{
+    char username[USERNAME_LENGTH]; // Username of the sender
+    uint32_t sequence;              // Probe the ping, request or ack belongs to
+    uint16_t port;                  // Port of the peer probed
+    uint32_t address;               // Address of the peer probed
+    uint32_t update_length;         // Membership updates listed
+    uint8_t *updates;               // Encoded updates, read with packet_ping_update
+} PacketPing;
+
+/**
+ * A change in a peer's membership, as carried by pings.
+ */
+typedef struct {
+    uint32_t address;     // Address of the peer
+    uint16_t port;        // Port of the peer
+    uint8_t status;       // Alive, suspect or dead, as a SwimStatus
+    uint32_t incarnation; // Incarnation of the peer the status is about
+} PacketUpdate;
+
 ///////////////////////////////////////////////////////////
 // Packet functions
 ///////////////////////////////////////////////////////////
@@ -59,35 +185,126 @@ typedef struct
  * 
  * Successive calls to this function overwrite the returned packet.
  */
-PacketMessage *packet_message(User *user, char *message);
+Packet *packet_message(User *user, char *message);
 
 /**
- * Prepares a temporary packet with the join payload.
+ * Prepares a temporary packet with the join payload for the peer at the
+ * port/address, listing as many of our other peers as fit, starting from the
+ * userlist position at cursor. Advances cursor past the peers considered;
+ * more joins are needed while it's short of the userlist's length.
  * 
  * Successive calls to this function overwrite the returned packet.
  */
-PacketJoin *packet_join(User *user, UserList *list, uint16_t port, uint32_t address);
+Packet *packet_join(User *user, UserList *list, uint16_t port, uint32_t address, uint32_t *cursor);
 
 /**
  * Prepares a temporary packet with the leave payload.
  * 
  * Successive calls to this function overwrite the returned packet.
  */
-PacketLeave *packet_leave(User *user);
+Packet *packet_leave(User *user);
+
+/**
+ * Prepares a temporary packet with the rumor payload.
+ * 
+ * Successive calls to this function overwrite the returned packet.
+ */
+Packet *packet_rumor(char *username, uint64_t id, uint8_t fanout, uint8_t hops, char *message);
+
+/**
+ * Prepares a temporary packet with a ping, ping request or ping ack payload
+ * for the probe of the peer at the port/address, listing the updates.
+ * 
+ * Successive calls to this function overwrite the returned packet.
+ */
+Packet *packet_ping(PacketType type, char *username, uint32_t sequence, uint16_t port, uint32_t address, PacketUpdate *updates, uint32_t count);
+
+/**
+ * Encodes a data header, if a payload is given, or an ack into the frame.
+ */
+void packet_frame(PacketFrame *frame, PacketHeader *header);
+
+/**
+ * Points each of the receiver's messages at its buffer and source.
+ */
+void packet_receiver_initialize(PacketReceiver *receiver);
+
+/**
+ * Receives up to PACKET_RECEIVE datagrams that are already waiting, without
+ * blocking. Returns the number received, 0 if none were waiting, or -1 on an
+ * error. Datagrams too long for a buffer are dropped.
+ */
+int32_t packet_receive(int32_t socket, PacketReceiver *receiver);
+
+/**
+ * Returns the bytes and length of a datagram received by the last call to
+ * packet_receive, and its source port/address.
+ */
+uint8_t *packet_received(PacketReceiver *receiver, int32_t index, uint32_t *length, uint16_t *port, uint32_t *address);
+
+/**
+ * Returns the type of a received packet, or -1 if it's too short or of
+ * another version.
+ */
+int32_t packet_type(uint8_t *bytes, uint32_t length);
+
+/**
+ * Decodes a received message packet. Returns false if it's malformed.
+ */
+bool packet_read_message(uint8_t *bytes, uint32_t length, PacketMessage *packet);
+
+/**
+ * Decodes a received join packet. The listed peers stay in bytes. Returns
+ * false if it's malformed.
+ */
+bool packet_read_join(uint8_t *bytes, uint32_t length, PacketJoin *packet);
+
+/**
+ * Decodes a received leave packet. Returns false if it's malformed.
+ */
+bool packet_read_leave(uint8_t *bytes, uint32_t length, PacketLeave *packet);
+
+/**
+ * Decodes a received rumor packet. Returns false if it's malformed.
+ */
+bool packet_read_rumor(uint8_t *bytes, uint32_t length, PacketRumor *packet);
+
+/**
+ * Decodes a received ping, ping request or ping ack. The listed updates stay
+ * in bytes. Returns false if it's malformed.
+ */
+bool packet_read_ping(uint8_t *bytes, uint32_t length, PacketPing *packet);
+
+/**
+ * Decodes the header of a received data or ack packet. The payload stays in
+ * bytes. Returns false if it's malformed.
+ */
+bool packet_read_header(uint8_t *bytes, uint32_t length, PacketHeader *header);
+
+/**
+ * Reads the port and address of a peer listed in a join.
+ */
+void packet_join_peer(PacketJoin *packet, uint32_t index, uint16_t *port, uint32_t *address);
+
+/**
+ * Reads a membership update listed in a ping.
+ */
+void packet_ping_update(PacketPing *packet, uint32_t index, PacketUpdate *update);
 
 /**
  * Sends a packet directly to a port/address.
  */
-void packet_send_direct(int32_t socket, void *packet, uint32_t size, uint16_t port, uint32_t address);
+void packet_send_direct(int32_t socket, Packet *packet, uint16_t port, uint32_t address);
 
 /**
  * Sends a packet to the user.
  */
-void packet_send(int32_t socket, void *packet, uint32_t size, User *user);
+void packet_send(int32_t socket, Packet *packet, User *user);
 
 /**
- * Sends a packet to all users in the userlist.
+ * Sends each frame to its peer, batching the sends into as few system calls
+ * as possible. Returns the number of frames that couldn't be sent.
  */
-void packet_send_all(int32_t socket, void *packet, uint32_t size, UserList *list);
+uint32_t packet_send_frames(int32_t socket, PacketFrame *frames, uint32_t count);
 
-#endif
\ No newline at end of file
+#endif
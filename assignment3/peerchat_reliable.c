@@ -0,0 +1,646 @@
+/**
+ * peerchat_reliable.c
+ * 
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#define _GNU_SOURCE // struct mmsghdr, through peerchat_packet.h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "peerchat_packet.h"
+#include "peerchat_reliable.h"
+#include "peerchat_user.h"
+#include "peerchat_utility.h"
+
+///////////////////////////////////////////////////////////
+// Reliable helpers
+///////////////////////////////////////////////////////////
+
+/**
+ * Returns true if sequence a comes before sequence b, allowing for wrap.
+ */
+static bool reliable_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+/**
+ * Returns the channel for the peer at the port/address, creating it if it's
+ * new. Channels stay put in memory, so timers can refer to them.
+ */
+static ReliableChannel *reliable_channel(Reliable *reliable, uint16_t port, uint32_t address) {
+    address = ip4_normalize(address);
+    int32_t position = address_table_find(&reliable->table, port, address);
+    if (position >= 0) {
+        ReliableChannel *channel = reliable->channels[position];
+        // A closed channel that's used again is kept after all
+        if (channel->closed) {
+            channel->closed = false;
+            for (uint32_t i = 0; i < reliable->closed_length; i++) {
+                if (reliable->closed[i] == channel) {
+                    reliable->closed[i] = reliable->closed[--reliable->closed_length];
+                    break;
+                }
+            }
+        }
+        return channel;
+    }
+    ReliableChannel *channel = calloc(1, sizeof(ReliableChannel));
+    if (channel == NULL) {
+        printf("[Error: Out of memory]\n");
+        exit(EXIT_FAILURE);
+    }
+    channel->reliable = reliable;
+    channel->session = random_seed() >> 32;
+    if (channel->session == 0) {
+        channel->session = 1;
+    }
+    channel->port = port;
+    channel->address = address;
+    channel->base = 1;
+    channel->expected = 1;
+    channel->rto = RELIABLE_RTO_INITIAL;
+    reliable->channels = array_grow(reliable->channels, &reliable->capacity, reliable->length + 1, sizeof(ReliableChannel *));
+    address_table_put(&reliable->table, port, address, reliable->length);
+    reliable->channels[reliable->length++] = channel;
+    return channel;
+}
+
+/**
+ * Returns a new payload holding a copy of the packet, with no references.
+ */
+static ReliablePayload *reliable_payload(Packet *packet) {
+    ReliablePayload *payload = malloc(sizeof(ReliablePayload));
+    if (payload == NULL) {
+        printf("[Error: Out of memory]\n");
+        exit(EXIT_FAILURE);
+    }
+    payload->references = 0;
+    payload->packet = *packet;
+    return payload;
+}
+
+/**
+ * Drops a reference to the payload, freeing it if it was the last.
+ */
+static void reliable_release(ReliablePayload *payload) {
+    payload->references -= 1;
+    if (payload->references == 0) {
+        free(payload);
+    }
+}
+
+/**
+ * Returns the entry the given number of places after the channel's oldest.
+ */
+static ReliableEntry *reliable_entry(ReliableChannel *channel, uint32_t index) {
+    return &channel->entries[(channel->entry_head + index) & (channel->entry_capacity - 1)];
+}
+
+/**
+ * Queues a frame carrying the payload for the next flush.
+ */
+static void reliable_frame(ReliableChannel *channel, ReliablePayload *payload, uint32_t sequence) {
+    Reliable *reliable = channel->reliable;
+    reliable->frames = array_grow(reliable->frames, &reliable->frame_capacity, reliable->frame_length + 1, sizeof(ReliableFrame));
+    reliable->frames[reliable->frame_length++] = (ReliableFrame){channel, payload, sequence};
+    payload->references += 1;
+}
+
+/**
+ * Has an ack go out to the channel's peer at the next flush.
+ */
+static void reliable_ack_now(ReliableChannel *channel) {
+    Reliable *reliable = channel->reliable;
+    if (!channel->ack_due) {
+        reliable->due = array_grow(reliable->due, &reliable->due_capacity, reliable->due_length + 1, sizeof(ReliableChannel *));
+        reliable->due[reliable->due_length++] = channel;
+        channel->ack_due = true;
+    }
+}
+
+static void reliable_on_ack_timer(void *context) {
+    ReliableChannel *channel = context;
+    channel->ack_timer = 0;
+    reliable_ack_now(channel);
+    reliable_flush(channel->reliable);
+}
+
+/**
+ * Notes a packet received from the channel's peer. Every second packet is
+ * acknowledged at the next flush, as is any packet out of order or from a
+ * closed channel, which the flush frees; otherwise the ack waits a little for
+ * another packet to cover.
+ */
+static void reliable_owe_ack(ReliableChannel *channel, bool now) {
+    channel->ack_owed += 1;
+    if (now || channel->closed || channel->ack_owed >= 2) {
+        reliable_ack_now(channel);
+    } else if (channel->ack_timer == 0) {
+        channel->ack_timer = eventloop_timer_add(channel->reliable->events, RELIABLE_ACK_DELAY, reliable_on_ack_timer, channel);
+    }
+}
+
+static void reliable_on_retransmit_timer(void *context);
+
+/**
+ * Starts the retransmission timer afresh while packets are in flight.
+ */
+static void reliable_arm(ReliableChannel *channel) {
+    eventloop_timer_cancel(channel->reliable->events, channel->retransmit_timer);
+    channel->retransmit_timer = 0;
+    if (channel->sent > 0) {
+        channel->retransmit_timer = eventloop_timer_add(channel->reliable->events, channel->rto, reliable_on_retransmit_timer, channel);
+    }
+}
+
+/**
+ * Sends queued entries that haven't been sent, as far as the window allows.
+ */
+static void reliable_transmit(ReliableChannel *channel) {
+    bool idle = channel->sent == 0;
+    uint64_t now = monotonic_ms();
+    while (channel->sent < channel->entry_length && channel->sent < RELIABLE_WINDOW) {
+        ReliableEntry *entry = reliable_entry(channel, channel->sent);
+        entry->sent_at = now;
+        reliable_frame(channel, entry->payload, channel->base + channel->sent);
+        channel->sent += 1;
+    }
+    if (idle && channel->sent > 0) {
+        reliable_arm(channel);
+    }
+}
+
+/**
+ * Queues the payload for the channel's peer.
+ */
+static void reliable_queue(ReliableChannel *channel, ReliablePayload *payload) {
+    uint32_t length = channel->entry_length + 1;
+    if (length > channel->entry_capacity) {
+        // Grow the ring, unwrapping it so the oldest entry is first
+        uint32_t capacity = channel->entry_capacity == 0 ? 16 : channel->entry_capacity * 2;
+        ReliableEntry *entries = malloc(capacity * sizeof(ReliableEntry));
+        if (entries == NULL) {
+            printf("[Error: Out of memory]\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < channel->entry_length; i++) {
+            entries[i] = *reliable_entry(channel, i);
+        }
+        free(channel->entries);
+        channel->entries = entries;
+        channel->entry_capacity = capacity;
+        channel->entry_head = 0;
+    }
+    *reliable_entry(channel, channel->entry_length) = (ReliableEntry){payload, 0, false, false};
+    channel->entry_length = length;
+    channel->reliable->pending += 1;
+    payload->references += 1;
+    reliable_transmit(channel);
+}
+
+/**
+ * Removes the oldest entry from the channel.
+ */
+static void reliable_pop(ReliableChannel *channel) {
+    reliable_release(reliable_entry(channel, 0)->payload);
+    channel->entry_head = (channel->entry_head + 1) & (channel->entry_capacity - 1);
+    channel->entry_length -= 1;
+    channel->base += 1;
+    if (channel->sent > 0) {
+        channel->sent -= 1;
+    }
+    channel->reliable->pending -= 1;
+}
+
+/**
+ * Drops every entry of the channel, returning how many there were. The
+ * sequence carries on from where they left off.
+ */
+static uint32_t reliable_drop(ReliableChannel *channel) {
+    uint32_t dropped = channel->entry_length;
+    while (channel->entry_length > 0) {
+        reliable_pop(channel);
+    }
+    reliable_arm(channel);
+    return dropped;
+}
+
+/**
+ * Removes the channel's frames waiting for the next flush.
+ */
+static void reliable_unframe(ReliableChannel *channel) {
+    Reliable *reliable = channel->reliable;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < reliable->frame_length; i++) {
+        if (reliable->frames[i].channel == channel) {
+            reliable_release(reliable->frames[i].payload);
+        } else {
+            reliable->frames[kept++] = reliable->frames[i];
+        }
+    }
+    reliable->frame_length = kept;
+}
+
+/**
+ * Frees a closed channel, moving the last channel into its place. It must
+ * have no frames or acks waiting for a flush.
+ */
+static void reliable_free(ReliableChannel *channel) {
+    Reliable *reliable = channel->reliable;
+    eventloop_timer_cancel(reliable->events, channel->retransmit_timer);
+    eventloop_timer_cancel(reliable->events, channel->ack_timer);
+    for (uint32_t i = 0; i < RELIABLE_WINDOW; i++) {
+        free(channel->buffered[i]);
+    }
+    free(channel->entries);
+    uint32_t position = address_table_find(&reliable->table, channel->port, channel->address);
+    address_table_remove(&reliable->table, channel->port, channel->address);
+    reliable->length -= 1;
+    if (position != reliable->length) {
+        ReliableChannel *last = reliable->channels[reliable->length];
+        reliable->channels[position] = last;
+        address_table_put(&reliable->table, last->port, last->address, position);
+    }
+    free(channel);
+}
+
+/**
+ * Frees the channels closed since the last flush, now that their last acks
+ * have gone out.
+ */
+static void reliable_free_closed(Reliable *reliable) {
+    for (uint32_t i = 0; i < reliable->closed_length; i++) {
+        reliable_free(reliable->closed[i]);
+    }
+    reliable->closed_length = 0;
+}
+
+/**
+ * Starts the streams to and from the channel's peer over from 1 when a new
+ * session appears on its port/address. The peer has restarted, or freed its
+ * channel to us, so whatever we hadn't got acknowledged is sent again as the
+ * start of the new stream.
+ */
+static void reliable_reset(ReliableChannel *channel) {
+    // Unflushed frames are numbered for the old stream
+    reliable_unframe(channel);
+    for (uint32_t i = 0; i < channel->entry_length; i++) {
+        reliable_entry(channel, i)->retransmitted = false;
+        reliable_entry(channel, i)->sacked = false;
+    }
+    channel->sent = 0;
+    reliable_arm(channel);
+    channel->base = 1;
+    channel->measured = false;
+    channel->rto = RELIABLE_RTO_INITIAL;
+    channel->retries = 0;
+    for (uint32_t i = 0; i < RELIABLE_WINDOW; i++) {
+        free(channel->buffered[i]);
+        channel->buffered[i] = NULL;
+    }
+    channel->expected = 1;
+    channel->ack_owed = 0;
+    reliable_transmit(channel);
+}
+
+/**
+ * Folds a round trip sample into the channel's retransmission timeout, as
+ * in RFC 6298.
+ */
+static void reliable_measure(ReliableChannel *channel, uint32_t sample) {
+    if (!channel->measured) {
+        channel->srtt = sample;
+        channel->rttvar = sample / 2;
+        channel->measured = true;
+    } else {
+        uint32_t delta = channel->srtt > sample ? channel->srtt - sample : sample - channel->srtt;
+        channel->rttvar = (3 * channel->rttvar + delta) / 4;
+        channel->srtt = (7 * channel->srtt + sample) / 8;
+    }
+    uint32_t rto = channel->srtt + (4 * channel->rttvar > 1 ? 4 * channel->rttvar : 1);
+    channel->rto = rto < RELIABLE_RTO_MIN ? RELIABLE_RTO_MIN : rto > RELIABLE_RTO_MAX ? RELIABLE_RTO_MAX : rto;
+}
+
+/**
+ * Resends the entry, which has been sent before.
+ */
+static void reliable_resend(ReliableChannel *channel, uint32_t index) {
+    ReliableEntry *entry = reliable_entry(channel, index);
+    entry->retransmitted = true;
+    entry->sent_at = monotonic_ms();
+    reliable_frame(channel, entry->payload, channel->base + index);
+}
+
+static void reliable_on_retransmit_timer(void *context) {
+    ReliableChannel *channel = context;
+    Reliable *reliable = channel->reliable;
+    channel->retransmit_timer = 0;
+    if (channel->sent == 0) {
+        return;
+    }
+    // Give up on a peer that's stopped acknowledging anything
+    channel->retries += 1;
+    if (channel->retries > RELIABLE_RETRIES) {
+        channel->retries = 0;
+        uint32_t dropped = reliable_drop(channel);
+        reliable->failure(reliable->context, channel->port, channel->address, dropped);
+        return;
+    }
+    // Resend whatever in flight the peer hasn't said it has, waiting twice as
+    // long for it this time
+    for (uint32_t i = 0; i < channel->sent; i++) {
+        if (!reliable_entry(channel, i)->sacked) {
+            reliable_resend(channel, i);
+        }
+    }
+    channel->rto = channel->rto * 2 > RELIABLE_RTO_MAX ? RELIABLE_RTO_MAX : channel->rto * 2;
+    reliable_arm(channel);
+    reliable_flush(reliable);
+}
+
+/**
+ * Handles an ack from the channel's peer for our stream.
+ */
+static void reliable_acked(ReliableChannel *channel, uint32_t ack, uint64_t sack) {
+    // Ignore acks that go backwards, or past what we've sent
+    uint32_t advance = ack - channel->base;
+    if (advance > channel->sent) {
+        return;
+    }
+
+    // Drop everything before the ack, timing the round trip of the newest
+    // packet that wasn't resent
+    uint64_t now = monotonic_ms();
+    bool timed = false;
+    uint32_t sample = 0;
+    for (uint32_t i = 0; i < advance; i++) {
+        ReliableEntry *entry = reliable_entry(channel, 0);
+        if (!entry->retransmitted) {
+            timed = true;
+            sample = now - entry->sent_at;
+        }
+        reliable_pop(channel);
+    }
+    if (timed) {
+        reliable_measure(channel, sample);
+    }
+
+    // Mark the packets the peer has past the ack, and resend the first one
+    // it's missing if enough later ones have arrived
+    uint32_t sacked = 0;
+    for (uint32_t i = 1; i < channel->sent && i <= 64; i++) {
+        ReliableEntry *entry = reliable_entry(channel, i);
+        entry->sacked = entry->sacked || (sack >> (i - 1) & 1);
+        sacked += entry->sacked;
+    }
+    if (channel->sent > 0 && sacked >= RELIABLE_FAST_RETRANSMIT && !reliable_entry(channel, 0)->retransmitted) {
+        reliable_resend(channel, 0);
+    }
+
+    // Progress restarts the timer and opens the window for queued entries
+    if (advance > 0) {
+        channel->retries = 0;
+        reliable_arm(channel);
+        reliable_transmit(channel);
+    }
+}
+
+/**
+ * Hands a packet received from the channel's peer to the callback. Packets
+ * that would nest another layer of data are dropped.
+ */
+static void reliable_deliver(ReliableChannel *channel, uint8_t *bytes, uint32_t length) {
+    int32_t type = packet_type(bytes, length);
+    if (type != PACKET_DATA && type != PACKET_ACK) {
+        Reliable *reliable = channel->reliable;
+        reliable->deliver(reliable->context, bytes, length, channel->port, channel->address);
+    }
+}
+
+/**
+ * Delivers buffered packets from expected on, until one is missing. Returns
+ * true if any were delivered.
+ */
+static bool reliable_drain(ReliableChannel *channel) {
+    bool delivered = false;
+    Packet *packet;
+    while ((packet = channel->buffered[channel->expected % RELIABLE_WINDOW]) != NULL) {
+        channel->buffered[channel->expected % RELIABLE_WINDOW] = NULL;
+        channel->expected += 1;
+        reliable_deliver(channel, packet->bytes, packet->length);
+        free(packet);
+        delivered = true;
+    }
+    return delivered;
+}
+
+/**
+ * Skips ahead to the oldest sequence the peer is still sending, discarding
+ * anything buffered before it.
+ */
+static void reliable_skip(ReliableChannel *channel, uint32_t first) {
+    for (uint32_t i = 0; i < RELIABLE_WINDOW && reliable_before(channel->expected, first); i++) {
+        free(channel->buffered[channel->expected % RELIABLE_WINDOW]);
+        channel->buffered[channel->expected % RELIABLE_WINDOW] = NULL;
+        channel->expected += 1;
+    }
+    channel->expected = first;
+    reliable_drain(channel);
+}
+
+/**
+ * Handles a data packet from the channel's peer, delivering it and anything
+ * buffered after it if it's the next expected.
+ */
+static void reliable_accept(ReliableChannel *channel, PacketHeader *header) {
+    if (reliable_before(channel->expected, header->first)) {
+        reliable_skip(channel, header->first);
+    }
+    uint32_t offset = header->sequence - channel->expected;
+    if (reliable_before(header->sequence, channel->expected) || offset >= RELIABLE_WINDOW) {
+        // Already delivered, so our ack was lost, or too far ahead to hold
+        reliable_owe_ack(channel, true);
+    } else if (offset > 0) {
+        // Early, so hold it and tell the peer what's missing
+        Packet **slot = &channel->buffered[header->sequence % RELIABLE_WINDOW];
+        if (*slot == NULL) {
+            *slot = malloc(sizeof(Packet));
+            if (*slot == NULL) {
+                printf("[Error: Out of memory]\n");
+                exit(EXIT_FAILURE);
+            }
+            memcpy((*slot)->bytes, header->payload, header->length);
+            (*slot)->length = header->length;
+        }
+        reliable_owe_ack(channel, true);
+    } else {
+        // Next in order, delivered straight from the receive buffer
+        channel->expected += 1;
+        reliable_deliver(channel, header->payload, header->length);
+        reliable_owe_ack(channel, reliable_drain(channel));
+    }
+}
+
+/**
+ * Returns the bitmap of packets received past expected.
+ */
+static uint64_t reliable_sack(ReliableChannel *channel) {
+    uint64_t sack = 0;
+    for (uint32_t i = 1; i < RELIABLE_WINDOW; i++) {
+        if (channel->buffered[(channel->expected + i) % RELIABLE_WINDOW] != NULL) {
+            sack |= (uint64_t)1 << (i - 1);
+        }
+    }
+    return sack;
+}
+
+///////////////////////////////////////////////////////////
+// Reliable functions
+///////////////////////////////////////////////////////////
+
+void reliable_initialize(Reliable *reliable, int32_t socket, EventLoop *events, ReliableDeliver deliver, ReliableFailure failure, void *context) {
+    memset(reliable, 0, sizeof(Reliable));
+    reliable->socket = socket;
+    reliable->events = events;
+    reliable->deliver = deliver;
+    reliable->failure = failure;
+    reliable->context = context;
+    address_table_initialize(&reliable->table);
+}
+
+void reliable_send(Reliable *reliable, Packet *packet, uint16_t port, uint32_t address) {
+    reliable_queue(reliable_channel(reliable, port, address), reliable_payload(packet));
+}
+
+void reliable_send_all(Reliable *reliable, Packet *packet, UserList *list) {
+    if (list->length == 0) {
+        return;
+    }
+    ReliablePayload *payload = reliable_payload(packet);
+    for (uint32_t i = 0; i < list->length; i++) {
+        reliable_queue(reliable_channel(reliable, list->users[i].port, list->users[i].address), payload);
+    }
+}
+
+void reliable_send_some(Reliable *reliable, Packet *packet, UserList *list, uint32_t *positions, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    ReliablePayload *payload = reliable_payload(packet);
+    for (uint32_t i = 0; i < count; i++) {
+        User *user = &list->users[positions[i]];
+        reliable_queue(reliable_channel(reliable, user->port, user->address), payload);
+    }
+}
+
+void reliable_close(Reliable *reliable, uint16_t port, uint32_t address) {
+    int32_t position = address_table_find(&reliable->table, port, ip4_normalize(address));
+    if (position >= 0) {
+        ReliableChannel *channel = reliable->channels[position];
+        reliable_unframe(channel);
+        reliable_drop(channel);
+        if (!channel->closed) {
+            // An ack still owed goes out before the channel is freed
+            if (channel->ack_owed > 0) {
+                reliable_ack_now(channel);
+            }
+            channel->closed = true;
+            reliable->closed = array_grow(reliable->closed, &reliable->closed_capacity, reliable->closed_length + 1, sizeof(ReliableChannel *));
+            reliable->closed[reliable->closed_length++] = channel;
+        }
+    }
+}
+
+void reliable_receive(Reliable *reliable, uint8_t *bytes, uint32_t length, uint16_t port, uint32_t address) {
+    PacketHeader header;
+    if (!packet_read_header(bytes, length, &header) || header.session == 0) {
+        return;
+    }
+    ReliableChannel *channel = reliable_channel(reliable, port, address);
+    // A new session means the peer is new, has restarted or has freed its
+    // channel to us
+    if (header.session != channel->peer_session) {
+        if (channel->peer_session != 0) {
+            reliable_reset(channel);
+        }
+        channel->peer_session = header.session;
+    }
+    // Acks only count if they're for our stream
+    if (header.peer_session == channel->session) {
+        reliable_acked(channel, header.ack, header.sack);
+    }
+    if (header.type == PACKET_DATA) {
+        if (header.peer_session != 0 && header.peer_session != channel->session) {
+            // Meant for an earlier channel to the peer, in this process or
+            // an earlier one on our port. Our ack tells the peer we're new,
+            // so it starts its stream over.
+            reliable_owe_ack(channel, true);
+        } else {
+            reliable_accept(channel, &header);
+        }
+    }
+}
+
+void reliable_flush(Reliable *reliable) {
+    uint32_t count = reliable->frame_length + reliable->due_length;
+    if (count == 0) {
+        reliable_free_closed(reliable);
+        return;
+    }
+    reliable->packets = array_grow(reliable->packets, &reliable->packet_capacity, count, sizeof(PacketFrame));
+
+    // Encode data frames, each carrying an ack, then acks for channels that
+    // are still owed one
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < reliable->frame_length; i++) {
+        ReliableFrame *frame = &reliable->frames[i];
+        ReliableChannel *channel = frame->channel;
+        PacketHeader header = {PACKET_DATA, channel->session, channel->peer_session, channel->expected, reliable_sack(channel), frame->sequence, channel->base};
+        PacketFrame *packet = &reliable->packets[length++];
+        packet->payload = &frame->payload->packet;
+        packet->port = channel->port;
+        packet->address = channel->address;
+        packet_frame(packet, &header);
+        channel->ack_owed = 0;
+        channel->ack_due = false;
+        eventloop_timer_cancel(reliable->events, channel->ack_timer);
+        channel->ack_timer = 0;
+    }
+    for (uint32_t i = 0; i < reliable->due_length; i++) {
+        ReliableChannel *channel = reliable->due[i];
+        if (!channel->ack_due) {
+            continue;
+        }
+        PacketHeader header = {PACKET_ACK, channel->session, channel->peer_session, channel->expected, reliable_sack(channel)};
+        PacketFrame *packet = &reliable->packets[length++];
+        packet->payload = NULL;
+        packet->port = channel->port;
+        packet->address = channel->address;
+        packet_frame(packet, &header);
+        channel->ack_owed = 0;
+        channel->ack_due = false;
+        eventloop_timer_cancel(reliable->events, channel->ack_timer);
+        channel->ack_timer = 0;
+    }
+
+    // Send them all at once. Any that fail are resent like lost packets.
+    uint32_t failures = packet_send_frames(reliable->socket, reliable->packets, length);
+    if (failures > 0) {
+        printf("[Error: Send failure for %u of %u packets]\n", failures, length);
+    }
+    for (uint32_t i = 0; i < reliable->frame_length; i++) {
+        reliable_release(reliable->frames[i].payload);
+    }
+    reliable->frame_length = 0;
+    reliable->due_length = 0;
+    reliable_free_closed(reliable);
+}
+
+uint32_t reliable_pending(Reliable *reliable) {
+    return reliable->pending;
+}
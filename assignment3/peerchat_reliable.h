@@ -0,0 +1,186 @@
+/**
+ * peerchat_reliable.h
+ * 
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef PEERCHAT_RELIABLE_INCLUDED
+#define PEERCHAT_RELIABLE_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "peerchat_packet.h"
+#include "peerchat_user.h"
+#include "peerchat_utility.h"
+
+///////////////////////////////////////////////////////////
+// Reliable macros
+///////////////////////////////////////////////////////////
+
+#define RELIABLE_WINDOW 64         // Most packets in flight to a peer, and the span of packets buffered from one
+#define RELIABLE_RTO_INITIAL 300   // Milliseconds before a retransmission until a round trip is measured
+#define RELIABLE_RTO_MIN 100       // Fewest milliseconds waited before retransmitting
+#define RELIABLE_RTO_MAX 4000      // Most milliseconds waited before retransmitting
+#define RELIABLE_RETRIES 6         // Timeouts in a row before the packets for a peer are dropped
+#define RELIABLE_ACK_DELAY 10      // Milliseconds an ack waits for more packets to cover
+#define RELIABLE_FAST_RETRANSMIT 3 // Later packets acknowledged before a missing one is resent early
+#define RELIABLE_LINGER 2000       // Most milliseconds spent getting last packets acknowledged before exiting
+
+///////////////////////////////////////////////////////////
+// Reliable structs
+///////////////////////////////////////////////////////////
+
+/**
+ * Called with each packet received from a peer, in the order it was sent.
+ */
+typedef void (*ReliableDeliver)(void *context, uint8_t *bytes, uint32_t length, uint16_t port, uint32_t address);
+
+/**
+ * Called when the packets for a peer are dropped after going unacknowledged.
+ */
+typedef void (*ReliableFailure)(void *context, uint16_t port, uint32_t address, uint32_t dropped);
+
+/**
+ * A packet queued for one or more peers, freed once none of them need it.
+ */
+typedef struct {
+    uint32_t references; // Queued entries and frames using the packet
+    Packet packet;       // The packet
+} ReliablePayload;
+
+/**
+ * A packet queued for a peer.
+ */
+typedef struct {
+    ReliablePayload *payload; // The packet
+    uint64_t sent_at;         // Monotonic millisecond it was last sent
+    bool retransmitted;       // True once resent, so its ack doesn't time the round trip
+    bool sacked;              // True if the peer has it, though not every packet before it
+} ReliableEntry;
+
+/**
+ * The streams of packets to and from one peer. Each is numbered from 1 and
+ * belongs to the sessions of both ends. Each end picks a new session for
+ * every channel it creates, so a peer that restarted or freed its channel to
+ * us starts new streams rather than continuing old ones.
+ */
+typedef struct ReliableChannel {
+    struct Reliable *reliable;         // Owner of the channel, for its timers
+    uint32_t address;                  // Address of the peer
+    uint16_t port;                     // Port of the peer
+    uint32_t session;                  // Random id of our end of the channel, never 0
+    uint32_t peer_session;             // Session of the peer's end, 0 until we've heard from it
+    ReliableEntry *entries;            // Ring of packets to send not yet acknowledged, oldest first
+    uint32_t entry_capacity;           // Number of entries the ring has room for, a power of two
+    uint32_t entry_head;               // Position of the oldest entry in the ring
+    uint32_t entry_length;             // Number of entries in the ring
+    uint32_t sent;                     // Number of entries, oldest first, sent at least once
+    uint32_t base;                     // Sequence of the oldest entry
+    bool measured;                     // True once a round trip has been timed
+    uint32_t srtt;                     // Smoothed round trip in milliseconds
+    uint32_t rttvar;                   // Round trip variation in milliseconds
+    uint32_t rto;                      // Milliseconds before retransmitting
+    uint32_t retries;                  // Timeouts since the peer last acknowledged anything
+    TimerId retransmit_timer;          // Pending retransmission, 0 if none
+    uint32_t expected;                 // Next sequence to deliver from the peer
+    Packet *buffered[RELIABLE_WINDOW]; // Packets received ahead of expected, by sequence modulo the window
+    uint32_t ack_owed;                 // Packets received since the peer was last acknowledged
+    bool ack_due;                      // True if an ack goes out with the next flush
+    TimerId ack_timer;                 // Pending delayed ack, 0 if none
+    bool closed;                       // True once the peer is gone, until the next flush frees the channel
+} ReliableChannel;
+
+/**
+ * A data packet for a channel, waiting for the next flush.
+ */
+typedef struct {
+    ReliableChannel *channel; // Channel it's for
+    ReliablePayload *payload; // Packet to carry
+    uint32_t sequence;        // Sequence of the packet
+} ReliableFrame;
+
+/**
+ * Ordered, reliable delivery over the UDP socket. Each packet sent to a peer
+ * is numbered and kept until the peer acknowledges it, and resent if it
+ * isn't acknowledged in time, waiting longer each time it's resent.
+ * 
+ * Acks are cumulative, the next sequence wanted, with a bitmap of the packets
+ * after it that were received early, so only the missing ones are resent.
+ * Acks ride along with data going the same way, and otherwise wait briefly
+ * to cover more packets. Everything queued is sent in one batch per flush.
+ */
+typedef struct Reliable {
+    int32_t socket;             // UDP socket
+    EventLoop *events;          // Runs the timers
+    ReliableChannel **channels; // Every channel
+    uint32_t length;            // Number of entries in channels
+    uint32_t capacity;          // Number of entries channels has room for
+    AddressTable table;         // Positions in channels by (address, port)
+    ReliableChannel **closed;   // Channels closed since the last flush, which frees them
+    uint32_t closed_length;     // Number of entries in closed
+    uint32_t closed_capacity;   // Number of entries closed has room for
+    ReliableChannel **due;      // Channels owed an ack at the next flush
+    uint32_t due_length;        // Number of entries in due
+    uint32_t due_capacity;      // Number of entries due has room for
+    ReliableFrame *frames;      // Frames waiting for the next flush
+    uint32_t frame_length;      // Number of entries in frames
+    uint32_t frame_capacity;    // Number of entries frames has room for
+    PacketFrame *packets;       // Frames as they're encoded for sending
+    uint32_t packet_capacity;   // Number of entries packets has room for
+    uint32_t pending;           // Packets queued for every peer not yet acknowledged
+    ReliableDeliver deliver;    // Called with each packet received
+    ReliableFailure failure;    // Called when a peer's packets are dropped
+    void *context;              // Passed to the callbacks
+} Reliable;
+
+///////////////////////////////////////////////////////////
+// Reliable functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Initializes reliable delivery over the socket, with no channels.
+ */
+void reliable_initialize(Reliable *reliable, int32_t socket, EventLoop *events, ReliableDeliver deliver, ReliableFailure failure, void *context);
+
+/**
+ * Queues a packet for the peer at the port/address.
+ */
+void reliable_send(Reliable *reliable, Packet *packet, uint16_t port, uint32_t address);
+
+/**
+ * Queues a packet for all users in the userlist. The packet is stored once,
+ * however many users it's queued for.
+ */
+void reliable_send_all(Reliable *reliable, Packet *packet, UserList *list);
+
+/**
+ * Queues a packet for the users at the given userlist positions.
+ */
+void reliable_send_some(Reliable *reliable, Packet *packet, UserList *list, uint32_t *positions, uint32_t count);
+
+/**
+ * Drops the packets queued for the peer at the port/address without
+ * reporting them, once the peer is known to be gone. The channel is freed at
+ * the next flush, after any ack still owed to the peer, unless the peer is
+ * heard from or sent to again first.
+ */
+void reliable_close(Reliable *reliable, uint16_t port, uint32_t address);
+
+/**
+ * Handles a received data or ack packet, delivering any packets it puts in
+ * order.
+ */
+void reliable_receive(Reliable *reliable, uint8_t *bytes, uint32_t length, uint16_t port, uint32_t address);
+
+/**
+ * Sends every queued data packet and owed ack.
+ */
+void reliable_flush(Reliable *reliable);
+
+/**
+ * Returns the number of packets not yet acknowledged, across every peer.
+ */
+uint32_t reliable_pending(Reliable *reliable);
+
+#endif
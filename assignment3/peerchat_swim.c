@@ -0,0 +1,464 @@
+/**
+ * peerchat_swim.c
+ * 
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#define _GNU_SOURCE // struct mmsghdr, through peerchat_packet.h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "peerchat_packet.h"
+#include "peerchat_swim.h"
+#include "peerchat_utility.h"
+
+///////////////////////////////////////////////////////////
+// Swim helpers
+///////////////////////////////////////////////////////////
+
+/**
+ * Returns the member at the port/address, or NULL if we've never had it.
+ */
+static SwimMember *swim_find(Swim *swim, uint16_t port, uint32_t address) {
+    int32_t position = address_table_find(&swim->table, port, address);
+    return position < 0 ? NULL : swim->members[position];
+}
+
+/**
+ * Returns true if the port/address is ours, as far as we know our address.
+ */
+static bool swim_is_self(Swim *swim, uint16_t port, uint32_t address) {
+    return port == swim->port && address == swim->address && address != 0;
+}
+
+/**
+ * Returns the number of pings each update is carried by, a few times log2 of
+ * the room's size.
+ */
+static uint32_t swim_sends(Swim *swim) {
+    uint32_t log = 1;
+    while ((1u << log) < swim->live + 2) {
+        log += 1;
+    }
+    return SWIM_LAMBDA * log;
+}
+
+/**
+ * Returns the milliseconds a suspect has to refute its suspicion, a few
+ * periods for each decimal digit of the room's size.
+ */
+static uint32_t swim_suspect_timeout(Swim *swim) {
+    uint32_t digits = 1;
+    for (uint32_t size = swim->live + 1; size >= 10; size /= 10) {
+        digits += 1;
+    }
+    return SWIM_SUSPECT_PERIODS * digits * SWIM_PERIOD;
+}
+
+/**
+ * Has the member's status, as it is now, carried by the next few pings.
+ */
+static void swim_spread(SwimMember *member) {
+    Swim *swim = member->swim;
+    if (member->sends == 0) {
+        swim->updates = array_grow(swim->updates, &swim->update_capacity, swim->update_length + 1, sizeof(SwimMember *));
+        swim->updates[swim->update_length++] = member;
+    }
+    member->sends = swim_sends(swim);
+}
+
+/**
+ * Puts a newly live member at a random place in the rest of this round, so
+ * it's probed before the round ends.
+ */
+static void swim_enqueue(SwimMember *member) {
+    Swim *swim = member->swim;
+    swim->order = array_grow(swim->order, &swim->order_capacity, swim->order_length + 1, sizeof(SwimMember *));
+    swim->order[swim->order_length++] = member;
+    uint32_t remaining = swim->order_length - swim->cursor;
+    uint32_t position = swim->cursor + random_next(&swim->random) % remaining;
+    swim->order[swim->order_length - 1] = swim->order[position];
+    swim->order[position] = member;
+}
+
+/**
+ * Stops suspecting the member, whatever comes of it.
+ */
+static void swim_unsuspect(SwimMember *member) {
+    eventloop_timer_cancel(member->swim->events, member->suspect_timer);
+    member->suspect_timer = 0;
+}
+
+/**
+ * Frees a dead member, taking it out of this round and the updates to carry,
+ * and moving the last member into its place.
+ */
+static void swim_free(SwimMember *member) {
+    Swim *swim = member->swim;
+    // The rest of the round keeps its order
+    uint32_t kept = 0;
+    uint32_t cursor = swim->cursor;
+    for (uint32_t i = 0; i < swim->order_length; i++) {
+        if (swim->order[i] != member) {
+            swim->order[kept++] = swim->order[i];
+        } else if (i < swim->cursor) {
+            cursor -= 1;
+        }
+    }
+    swim->order_length = kept;
+    swim->cursor = cursor;
+    if (member->sends > 0) {
+        for (uint32_t i = 0; i < swim->update_length; i++) {
+            if (swim->updates[i] == member) {
+                swim->updates[i] = swim->updates[--swim->update_length];
+                break;
+            }
+        }
+    }
+    uint32_t position = address_table_find(&swim->table, member->port, member->address);
+    address_table_remove(&swim->table, member->port, member->address);
+    swim->length -= 1;
+    if (position != swim->length) {
+        SwimMember *last = swim->members[swim->length];
+        swim->members[position] = last;
+        address_table_put(&swim->table, last->port, last->address, position);
+    }
+    free(member);
+}
+
+/**
+ * Marks the member dead and tells the callback. Other peers are told too,
+ * and the member is kept until they have been, so stale news of it being
+ * alive is ignored meanwhile. A member that left by itself is freed at once.
+ */
+static void swim_die(SwimMember *member, bool spread) {
+    Swim *swim = member->swim;
+    swim_unsuspect(member);
+    member->status = SWIM_DEAD;
+    swim->live -= 1;
+    if (swim->probe == member) {
+        swim->probe = NULL;
+    }
+    if (spread) {
+        swim_spread(member);
+        swim->dead(swim->context, member->port, member->address);
+    } else {
+        swim_free(member);
+    }
+}
+
+static void swim_on_suspect_timer(void *context) {
+    SwimMember *member = context;
+    member->suspect_timer = 0;
+    if (member->status == SWIM_SUSPECT) {
+        swim_die(member, true);
+    }
+}
+
+/**
+ * Suspects the member at the given incarnation, giving it a while to refute
+ * the suspicion before it's dead.
+ */
+static void swim_suspect(SwimMember *member, uint32_t incarnation) {
+    member->incarnation = incarnation;
+    if (member->status == SWIM_ALIVE) {
+        member->status = SWIM_SUSPECT;
+        member->suspect_timer = eventloop_timer_add(member->swim->events, swim_suspect_timeout(member->swim), swim_on_suspect_timer, member);
+    }
+    swim_spread(member);
+}
+
+/**
+ * Applies an update heard from a peer, and spreads it on if it's news.
+ */
+static void swim_apply(Swim *swim, PacketUpdate *update) {
+    // Refute suspicions of us by raising our incarnation past them
+    if (swim_is_self(swim, update->port, update->address)) {
+        if (update->status != SWIM_ALIVE && update->incarnation >= swim->incarnation) {
+            swim->incarnation = update->incarnation + 1;
+            swim->self_sends = swim_sends(swim);
+        }
+        return;
+    }
+    // Peers that haven't joined us, or that are already dead, are left alone
+    SwimMember *member = swim_find(swim, update->port, update->address);
+    if (member == NULL || member->status == SWIM_DEAD) {
+        return;
+    }
+    switch (update->status) {
+        case SWIM_ALIVE:
+            if (update->incarnation > member->incarnation) {
+                swim_unsuspect(member);
+                member->status = SWIM_ALIVE;
+                member->incarnation = update->incarnation;
+                swim_spread(member);
+            }
+            break;
+        case SWIM_SUSPECT:
+            if (update->incarnation > member->incarnation || (update->incarnation == member->incarnation && member->status == SWIM_ALIVE)) {
+                swim_suspect(member, update->incarnation);
+            }
+            break;
+        case SWIM_DEAD:
+            if (update->incarnation >= member->incarnation) {
+                member->incarnation = update->incarnation;
+                swim_die(member, true);
+            }
+            break;
+    }
+}
+
+/**
+ * Fills updates with the ones carried fewest times so far, our own first,
+ * and counts them as carried. Returns the number filled.
+ */
+static uint32_t swim_piggyback(Swim *swim, PacketUpdate *updates) {
+    uint32_t count = 0;
+    if (swim->self_sends > 0 && swim->address != 0) {
+        updates[count++] = (PacketUpdate){swim->address, swim->port, SWIM_ALIVE, swim->incarnation};
+        swim->self_sends -= 1;
+    }
+    // Updates with the most sends left are the newest, and the ones the
+    // room has heard least, so bring those to the front and take them
+    uint32_t taken = 0;
+    while (count < SWIM_PIGGYBACK && taken < swim->update_length) {
+        uint32_t best = taken;
+        for (uint32_t i = taken + 1; i < swim->update_length; i++) {
+            if (swim->updates[i]->sends > swim->updates[best]->sends) {
+                best = i;
+            }
+        }
+        SwimMember *member = swim->updates[best];
+        if (member->sends == 0) {
+            break;
+        }
+        swim->updates[best] = swim->updates[taken];
+        swim->updates[taken++] = member;
+        updates[count++] = (PacketUpdate){member->address, member->port, member->status, member->incarnation};
+        member->sends -= 1;
+    }
+    // Forget the updates that have been carried enough, and with them the
+    // members whose death they spread
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < swim->update_length; i++) {
+        SwimMember *member = swim->updates[i];
+        if (member->sends > 0) {
+            swim->updates[kept++] = member;
+        } else if (member->status == SWIM_DEAD) {
+            swim_free(member);
+        }
+    }
+    swim->update_length = kept;
+    return count;
+}
+
+/**
+ * Sends a ping of the given type about the peer at target_port/address to
+ * the peer at port/address, carrying whatever updates are waiting.
+ */
+static void swim_send(Swim *swim, PacketType type, uint32_t sequence, uint16_t target_port, uint32_t target_address, uint16_t port, uint32_t address) {
+    PacketUpdate updates[SWIM_PIGGYBACK + 1];
+    uint32_t count = 0;
+    // A suspect hears it's suspected from everyone it talks to, so it has
+    // every chance to refute it
+    SwimMember *member = swim_find(swim, port, address);
+    if (member != NULL && member->status == SWIM_SUSPECT) {
+        updates[count++] = (PacketUpdate){member->address, member->port, member->status, member->incarnation};
+    }
+    count += swim_piggyback(swim, updates + count);
+    Packet *packet = packet_ping(type, swim->username, sequence, target_port, target_address, updates, count);
+    packet_send_direct(swim->socket, packet, port, address);
+}
+
+/**
+ * Returns the next member to probe, or NULL if there are none. A round
+ * visits every live member once in a shuffled order, so each is probed
+ * within two rounds of dying however the draws fall. The one exception is a
+ * member that dies and rejoins after its turn, which gets another turn later
+ * in the same round.
+ */
+static SwimMember *swim_next(Swim *swim) {
+    if (swim->live == 0) {
+        return NULL;
+    }
+    while (true) {
+        // Start a new round over the live members, shuffled
+        if (swim->cursor >= swim->order_length) {
+            swim->order_length = 0;
+            swim->cursor = 0;
+            swim->order = array_grow(swim->order, &swim->order_capacity, swim->live, sizeof(SwimMember *));
+            for (uint32_t i = 0; i < swim->length; i++) {
+                SwimMember *member = swim->members[i];
+                if (member->status != SWIM_DEAD) {
+                    uint32_t position = random_next(&swim->random) % (swim->order_length + 1);
+                    swim->order[swim->order_length++] = swim->order[position];
+                    swim->order[position] = member;
+                }
+            }
+        }
+        SwimMember *member = swim->order[swim->cursor++];
+        if (member->status != SWIM_DEAD) {
+            return member;
+        }
+    }
+}
+
+static void swim_on_ack_timer(void *context) {
+    Swim *swim = context;
+    SwimMember *target = swim->probe;
+    if (target == NULL || swim->probe_acked) {
+        return;
+    }
+    // Ask a few other members to try, drawn from this round's order
+    SwimMember *asked[SWIM_INDIRECT];
+    uint32_t count = 0;
+    for (uint32_t draw = 0; draw < SWIM_INDIRECT * 4 && count < SWIM_INDIRECT && swim->order_length > 0; draw++) {
+        SwimMember *member = swim->order[random_next(&swim->random) % swim->order_length];
+        bool picked = member == target || member->status == SWIM_DEAD;
+        for (uint32_t i = 0; i < count && !picked; i++) {
+            picked = asked[i] == member;
+        }
+        if (!picked) {
+            asked[count++] = member;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        swim_send(swim, PACKET_PING_REQ, swim->probe_sequence, target->port, target->address, asked[i]->port, asked[i]->address);
+    }
+}
+
+static void swim_on_period(void *context) {
+    Swim *swim = context;
+    // The last probe went unanswered, even through other members
+    if (swim->probe != NULL && !swim->probe_acked && swim->probe->status == SWIM_ALIVE) {
+        swim_suspect(swim->probe, swim->probe->incarnation);
+    }
+    // Probe the next member, asking others to help if it doesn't ack in time
+    swim->probe = swim_next(swim);
+    if (swim->probe != NULL) {
+        swim->sequence += 1;
+        swim->probe_sequence = swim->sequence;
+        swim->probe_acked = false;
+        swim_send(swim, PACKET_PING, swim->probe_sequence, swim->probe->port, swim->probe->address, swim->probe->port, swim->probe->address);
+        eventloop_timer_add(swim->events, SWIM_ACK_TIMEOUT, swim_on_ack_timer, swim);
+    }
+    eventloop_timer_add(swim->events, SWIM_PERIOD, swim_on_period, swim);
+}
+
+///////////////////////////////////////////////////////////
+// Swim functions
+///////////////////////////////////////////////////////////
+
+void swim_initialize(Swim *swim, int32_t socket, EventLoop *events, char *username, uint16_t port, SwimDead dead, void *context) {
+    memset(swim, 0, sizeof(Swim));
+    swim->socket = socket;
+    swim->events = events;
+    swim->username = username;
+    swim->port = port;
+    swim->dead = dead;
+    swim->context = context;
+    swim->random = random_seed() | 1;
+    address_table_initialize(&swim->table);
+    eventloop_timer_add(events, SWIM_PERIOD, swim_on_period, swim);
+}
+
+void swim_add(Swim *swim, uint16_t port, uint32_t address) {
+    SwimMember *member = swim_find(swim, port, address);
+    bool queued = false;
+    if (member == NULL) {
+        member = calloc(1, sizeof(SwimMember));
+        if (member == NULL) {
+            printf("[Error: Out of memory]\n");
+            exit(EXIT_FAILURE);
+        }
+        member->swim = swim;
+        member->port = port;
+        member->address = address;
+        member->status = SWIM_DEAD;
+        swim->members = array_grow(swim->members, &swim->capacity, swim->length + 1, sizeof(SwimMember *));
+        address_table_put(&swim->table, port, address, swim->length);
+        swim->members[swim->length++] = member;
+    } else if (member->status != SWIM_DEAD) {
+        return;
+    } else {
+        // Back after dying, so news of its death still going around is stale
+        member->incarnation += 1;
+        // If this round hasn't reached its old place yet, it's probed there
+        for (uint32_t i = swim->cursor; i < swim->order_length && !queued; i++) {
+            queued = swim->order[i] == member;
+        }
+    }
+    member->status = SWIM_ALIVE;
+    swim->live += 1;
+    if (!queued) {
+        swim_enqueue(member);
+    }
+}
+
+void swim_remove(Swim *swim, uint16_t port, uint32_t address) {
+    SwimMember *member = swim_find(swim, port, address);
+    if (member != NULL && member->status != SWIM_DEAD) {
+        swim_die(member, false);
+    }
+}
+
+void swim_remove_all(Swim *swim) {
+    for (uint32_t i = 0; i < swim->length; i++) {
+        swim_unsuspect(swim->members[i]);
+        free(swim->members[i]);
+    }
+    address_table_clear(&swim->table);
+    swim->length = 0;
+    swim->live = 0;
+    swim->probe = NULL;
+    swim->order_length = 0;
+    swim->cursor = 0;
+    swim->update_length = 0;
+}
+
+void swim_receive(Swim *swim, uint8_t *bytes, uint32_t length, uint16_t port, uint32_t address) {
+    PacketPing packet;
+    int32_t type = packet_type(bytes, length);
+    if (!packet_read_ping(bytes, length, &packet)) {
+        return;
+    }
+    // A ping names us as its sender sees us, which is how we know which
+    // updates are about us
+    if (type == PACKET_PING && packet.port == swim->port) {
+        swim->address = packet.address;
+    }
+    for (uint32_t i = 0; i < packet.update_length; i++) {
+        PacketUpdate update;
+        packet_ping_update(&packet, i, &update);
+        swim_apply(swim, &update);
+    }
+
+    switch (type) {
+        case PACKET_PING:
+            swim_send(swim, PACKET_PING_ACK, packet.sequence, swim->port, swim->address, port, address);
+            break;
+        case PACKET_PING_REQ: {
+            // Ping the target ourselves, remembering who to pass its ack to
+            swim->sequence += 1;
+            swim->relays[swim->sequence % SWIM_RELAYS] = (SwimRelay){swim->sequence, port, address, packet.sequence};
+            swim_send(swim, PACKET_PING, swim->sequence, packet.port, packet.address, packet.port, packet.address);
+            break;
+        }
+        case PACKET_PING_ACK: {
+            if (swim->probe != NULL && packet.sequence == swim->probe_sequence) {
+                swim->probe_acked = true;
+                break;
+            }
+            SwimRelay *relay = &swim->relays[packet.sequence % SWIM_RELAYS];
+            if (relay->sequence == packet.sequence && packet.sequence != 0) {
+                relay->sequence = 0;
+                swim_send(swim, PACKET_PING_ACK, relay->requester_sequence, packet.port, packet.address, relay->requester_port, relay->requester_address);
+            }
+            break;
+        }
+    }
+}
@@ -0,0 +1,145 @@
+/**
+ * peerchat_swim.h
+ * 
+ * Author: Joseph Cumbo (jwc6999)
+ */
+
+#ifndef PEERCHAT_SWIM_INCLUDED
+#define PEERCHAT_SWIM_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "peerchat_packet.h"
+#include "peerchat_utility.h"
+
+///////////////////////////////////////////////////////////
+// Swim macros
+///////////////////////////////////////////////////////////
+
+#define SWIM_PERIOD 1000          // Milliseconds between probes
+#define SWIM_ACK_TIMEOUT 400      // Milliseconds a ping waits for its ack before asking others to try
+#define SWIM_INDIRECT 3           // Peers asked to ping a peer that didn't ack us
+#define SWIM_SUSPECT_PERIODS 3    // Periods per decimal digit of the room's size a suspect has to refute it
+#define SWIM_PIGGYBACK 8          // Most membership updates carried by one ping
+#define SWIM_LAMBDA 3             // Times log2 of the room's size that each update is carried
+#define SWIM_RELAYS 32            // Pings sent on others' behalf that we remember, to pass on their acks
+
+///////////////////////////////////////////////////////////
+// Swim structs
+///////////////////////////////////////////////////////////
+
+/**
+ * Called when a peer is found to have died, by us or by another peer.
+ */
+typedef void (*SwimDead)(void *context, uint16_t port, uint32_t address);
+
+/**
+ * What we believe about a peer. Each status only gives way to a later one,
+ * or to alive with a higher incarnation, which only the peer itself raises.
+ */
+typedef enum {
+    SWIM_ALIVE,
+    SWIM_SUSPECT,
+    SWIM_DEAD,
+} SwimStatus;
+
+/**
+ * A peer we've probed or heard about.
+ */
+typedef struct SwimMember {
+    struct Swim *swim;     // Owner of the member, for its timers
+    uint32_t address;      // Address of the peer
+    uint16_t port;         // Port of the peer
+    SwimStatus status;     // What we believe about the peer
+    uint32_t incarnation;  // Incarnation the status is about
+    TimerId suspect_timer; // Pending end of the peer's suspicion, 0 if none
+    uint32_t sends;        // Pings left to carry the latest update about the peer
+} SwimMember;
+
+/**
+ * A ping we sent because another peer asked, so its ack can be passed back.
+ */
+typedef struct {
+    uint32_t sequence;           // Sequence of our ping, 0 if the slot is free
+    uint16_t requester_port;     // Port of the peer that asked
+    uint32_t requester_address;  // Address of the peer that asked
+    uint32_t requester_sequence; // Sequence of the peer's own probe
+} SwimRelay;
+
+/**
+ * Failure detection in the style of SWIM. Once a period we ping one peer,
+ * going through them all in a shuffled order. If it doesn't ack in time, a
+ * few other peers are asked to ping it for us, in case only our path to it
+ * is broken. If none of their acks come back either, it's suspected, and it
+ * is declared dead unless it refutes the suspicion in time by raising its
+ * incarnation.
+ * 
+ * Suspicions, deaths and refutations are spread by piggybacking them on the
+ * pings themselves, each carried a few times log2 of the room's size, so
+ * every peer sends a constant number of probes per period however large the
+ * room is. Suspects are given longer in larger rooms, where news of their
+ * refutation takes longer to go around, but still only a few seconds.
+ */
+typedef struct Swim {
+    int32_t socket;                // UDP socket
+    EventLoop *events;             // Runs the timers
+    char *username;                // Our username, sent with each ping
+    uint16_t port;                 // Our port
+    uint32_t address;              // Our address as peers see it, learned from their pings, 0 until then
+    uint32_t incarnation;          // Our incarnation, raised to refute suspicions of us
+    uint32_t self_sends;           // Pings left to carry our latest refutation
+    SwimMember **members;          // Every member, dead ones only while their death is being spread
+    uint32_t length;               // Number of entries in members
+    uint32_t capacity;             // Number of entries members has room for
+    AddressTable table;            // Positions in members by (address, port)
+    uint32_t live;                 // Number of members not dead
+    SwimMember **order;            // Members to probe this round, in shuffled order
+    uint32_t order_length;         // Number of entries in order
+    uint32_t order_capacity;       // Number of entries order has room for
+    uint32_t cursor;               // Position in order of the next member to probe
+    SwimMember **updates;          // Members with an update still to be carried
+    uint32_t update_length;        // Number of entries in updates
+    uint32_t update_capacity;      // Number of entries updates has room for
+    SwimMember *probe;             // Member probed this period, NULL if none
+    uint32_t probe_sequence;       // Sequence of the probe's pings
+    bool probe_acked;              // True once the probe has been acked, directly or not
+    uint32_t sequence;             // Sequence of our last ping
+    SwimRelay relays[SWIM_RELAYS]; // Pings sent for others, by sequence modulo SWIM_RELAYS
+    uint64_t random;               // xorshift state for shuffling and picking, never 0
+    SwimDead dead;                 // Called when a member dies
+    void *context;                 // Passed to the callback
+} Swim;
+
+///////////////////////////////////////////////////////////
+// Swim functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Initializes failure detection over the socket with no members, and starts
+ * probing once a period.
+ */
+void swim_initialize(Swim *swim, int32_t socket, EventLoop *events, char *username, uint16_t port, SwimDead dead, void *context);
+
+/**
+ * Starts probing the peer at the port/address, which has joined.
+ */
+void swim_add(Swim *swim, uint16_t port, uint32_t address);
+
+/**
+ * Stops probing the peer at the port/address, which has left. Other peers
+ * hear it leave themselves, so this isn't spread.
+ */
+void swim_remove(Swim *swim, uint16_t port, uint32_t address);
+
+/**
+ * Stops probing every peer, as when we leave.
+ */
+void swim_remove_all(Swim *swim);
+
+/**
+ * Handles a received ping, ping request or ping ack.
+ */
+void swim_receive(Swim *swim, uint8_t *bytes, uint32_t length, uint16_t port, uint32_t address);
+
+#endif
@@ -17,28 +17,122 @@
 #include "peerchat_utility.h"
 
 ///////////////////////////////////////////////////////////
-// UserList functions
+// UserIndex helpers
 ///////////////////////////////////////////////////////////
 
-void userlist_initialize(UserList *list, FileDescriptorSet *master_fds) {
-    list->length = 0;
+/**
+ * Returns true if the entry sorts before the given key.
+ */
+static bool userindex_before(UserIndexEntry *entry, uint32_t value, uint32_t address, uint16_t port) {
+    if (entry->value != value) return entry->value < value;
+    if (entry->address != address) return entry->address < address;
+    return entry->port < port;
 }
 
-void userlist_print_by_age(UserList *list, uint8_t age) {
-    for (uint32_t i = 0; i < list->length; i++) {
-        User *user = &list->users[i];
-        if (user->age == age) {
-            user_print(user);
+/**
+ * Returns the position of the first entry that doesn't sort before the key.
+ */
+static uint32_t userindex_lower_bound(UserIndex *index, uint32_t value, uint32_t address, uint16_t port) {
+    uint32_t low = 0;
+    uint32_t high = index->length;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (userindex_before(&index->entries[middle], value, address, port)) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
     }
+    return low;
 }
 
-void userlist_print_by_zip(UserList *list, uint32_t zip_code) {
-    for (uint32_t i = 0; i < list->length; i++) {
-        User *user = &list->users[i];
-        if (user->zip_code == zip_code) {
-            user_print(&list->users[i]);
+/**
+ * Inserts the user at the given userlist position into the index.
+ */
+static void userindex_insert(UserIndex *index, uint32_t value, User *user, uint32_t position) {
+    index->entries = array_grow(index->entries, &index->capacity, index->length + 1, sizeof(UserIndexEntry));
+    uint32_t at = userindex_lower_bound(index, value, user->address, user->port);
+    memmove(&index->entries[at + 1], &index->entries[at], (index->length - at) * sizeof(UserIndexEntry));
+    index->entries[at] = (UserIndexEntry){value, user->address, user->port, position};
+    index->length += 1;
+}
+
+/**
+ * Returns the entry for the user, who must be in the index.
+ */
+static UserIndexEntry *userindex_find(UserIndex *index, uint32_t value, User *user) {
+    return &index->entries[userindex_lower_bound(index, value, user->address, user->port)];
+}
+
+static void userindex_remove(UserIndex *index, uint32_t value, User *user) {
+    UserIndexEntry *entry = userindex_find(index, value, user);
+    index->length -= 1;
+    memmove(entry, entry + 1, (&index->entries[index->length] - entry) * sizeof(UserIndexEntry));
+}
+
+/**
+ * Prints the users with values from low to high, inclusive.
+ */
+static void userindex_print(UserIndex *index, User *users, uint32_t low, uint32_t high) {
+    for (uint32_t i = userindex_lower_bound(index, low, 0, 0); i < index->length && index->entries[i].value <= high; i++) {
+        user_print(&users[index->entries[i].position]);
+    }
+}
+
+///////////////////////////////////////////////////////////
+// UserList helpers
+///////////////////////////////////////////////////////////
+
+/**
+ * Removes the user at the given position, moving the last user into its
+ * place.
+ */
+static void userlist_remove_at(UserList *list, uint32_t position) {
+    User *user = &list->users[position];
+    address_table_remove(&list->index, user->port, user->address);
+    userindex_remove(&list->by_age, user->age, user);
+    userindex_remove(&list->by_zip, user->zip_code, user);
+    list->length -= 1;
+    if (position != list->length) {
+        User *last = &list->users[list->length];
+        address_table_put(&list->index, last->port, last->address, position);
+        userindex_find(&list->by_age, last->age, last)->position = position;
+        userindex_find(&list->by_zip, last->zip_code, last)->position = position;
+        *user = *last;
+    }
+}
+
+///////////////////////////////////////////////////////////
+// UserList functions
+///////////////////////////////////////////////////////////
+
+void userlist_initialize(UserList *list) {
+    memset(list, 0, sizeof(UserList));
+    address_table_initialize(&list->index);
+}
+
+void userlist_print_by_age(UserList *list, uint8_t low, uint8_t high) {
+    userindex_print(&list->by_age, list->users, low, high);
+}
+
+void userlist_print_by_zip(UserList *list, uint32_t low, uint32_t high) {
+    userindex_print(&list->by_zip, list->users, low, high);
+}
+
+void userlist_print_by_zip_prefix(UserList *list, char *digits) {
+    // Only zero itself is written with a leading zero
+    if (digits[0] == '0') {
+        if (strcmp(digits, "0") == 0) {
+            userlist_print_by_zip(list, 0, 0);
         }
+        return;
+    }
+    // Zip codes starting with the digits make up one range per length longer
+    // than the prefix: 146 covers 146, 1460-1469, 14600-14699 and so on
+    uint64_t prefix = strtoull(digits, NULL, 10);
+    for (uint64_t scale = 1; prefix * scale <= UINT32_MAX; scale *= 10) {
+        uint64_t high = (prefix + 1) * scale - 1;
+        userlist_print_by_zip(list, prefix * scale, high > UINT32_MAX ? UINT32_MAX : high);
     }
 }
 
@@ -49,43 +143,44 @@ void userlist_print(UserList *list) {
 }
 
 bool userlist_has_user(UserList *list, uint16_t port, uint32_t address) {
-    for (uint32_t i = 0; i < list->length; i++) {
-        User *user = &list->users[i];
-        if (user->port == port && user->address == address) {
-            return true;
-        }
-    }
-    return false;
+    return userlist_find(list, port, address) != NULL;
+}
+
+User *userlist_find(UserList *list, uint16_t port, uint32_t address) {
+    int32_t position = address_table_find(&list->index, port, ip4_normalize(address));
+    return position < 0 ? NULL : &list->users[position];
 }
 
 User *userlist_add(UserList *list, char *username, uint16_t port, uint32_t address, uint32_t zip_code, uint8_t age) {
-    if (list->length == MAX_PEERS - 1) {
-        printf("[Warning: Attempted to add user while at capacity]\n");
-        return NULL;
-    }
-    // If the address is 0.0.0.0, set it to 127.0.0.1 (network order)
-    if (address == 0) {
-        address = 0x100007F;
-    }
+    list->users = array_grow(list->users, &list->capacity, list->length + 1, sizeof(User));
+    address = ip4_normalize(address);
     // Get the peer
     User *slot = &list->users[list->length];
     strncpy(slot->username, username, USERNAME_LENGTH);
+    slot->username[USERNAME_LENGTH - 1] = '\0';
     slot->port = port;
     slot->address = address;
     slot->zip_code = zip_code;
     slot->age = age;
+    address_table_put(&list->index, port, address, list->length);
+    userindex_insert(&list->by_age, age, slot, list->length);
+    userindex_insert(&list->by_zip, zip_code, slot, list->length);
     list->length += 1;
     return slot;
 }
 
 void userlist_remove_by_connection(UserList *list, uint16_t port, uint32_t address) {
-    for (uint32_t i = 0; i < list->length; i++) {
-        User *user = &list->users[i];
-        if (user->port == port && user->address == address) {
-            printf("[%s@%s:%hu left the chat]\n", user->username, ip4_to_string(address), port);
-            list->length -= 1;
-            *user = list->users[list->length];
-        }
+    User *user = userlist_find(list, port, address);
+    if (user != NULL) {
+        printf("[%s@%s:%hu left the chat]\n", user->username, ip4_to_string(user->address), port);
+        userlist_remove_at(list, user - list->users);
+    }
+}
+
+void userlist_drop(UserList *list, uint16_t port, uint32_t address) {
+    User *user = userlist_find(list, port, address);
+    if (user != NULL) {
+        userlist_remove_at(list, user - list->users);
     }
 }
 
@@ -95,12 +190,21 @@ void userlist_remove_all(UserList *list) {
         printf("[%s@%s left the chat]\n", user.username, ip4_to_string(user.address));
     }
     list->length = 0;
+    list->by_age.length = 0;
+    list->by_zip.length = 0;
+    address_table_clear(&list->index);
 }
 
 ///////////////////////////////////////////////////////////
 // User functions
 ///////////////////////////////////////////////////////////
 
+bool user_zip_has_prefix(User *user, char *digits) {
+    char zip_code[16];
+    snprintf(zip_code, sizeof(zip_code), "%u", user->zip_code);
+    return starts_with(zip_code, digits);
+}
+
 void user_print(User *state) {
     printf(
         "[Username: %s | Zip: %u | Age: %hhu]\n",
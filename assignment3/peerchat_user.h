@@ -24,13 +24,38 @@ typedef struct
     uint8_t age;       // Age of peer
 } User;
 
+///////////////////////////////////////////////////////////
+// UserIndex structs
+///////////////////////////////////////////////////////////
+
+typedef struct {
+    uint32_t value;    // Indexed field of the user
+    uint32_t address;  // Address of the user, to tell users with the same value apart
+    uint16_t port;     // Port of the user
+    uint32_t position; // Position of the user in the userlist
+} UserIndexEntry;
+
+/**
+ * Users sorted by one field, then by connection, so ranges of the field are
+ * found by binary search.
+ */
+typedef struct {
+    UserIndexEntry *entries; // Entries in order
+    uint32_t length;         // Total number of entries
+    uint32_t capacity;       // Number of entries the array has room for
+} UserIndex;
+
 ///////////////////////////////////////////////////////////
 // UserList structs
 ///////////////////////////////////////////////////////////
 
 typedef struct {
-    User users[MAX_PEERS]; // Array of users
-    uint32_t length;       // Total number users
+    User *users;             // Array of users
+    uint32_t length;         // Total number users
+    uint32_t capacity;       // Number of users the array has room for
+    AddressTable index;      // Positions in users by (address, port)
+    UserIndex by_age;        // Users sorted by age
+    UserIndex by_zip;        // Users sorted by zip code
 } UserList;
 
 ///////////////////////////////////////////////////////////
@@ -40,17 +65,23 @@ typedef struct {
 /**
  * Initializes a userlist.
  */
-void userlist_initialize(UserList *list, FileDescriptorSet *master_fds);
+void userlist_initialize(UserList *list);
 
 /**
- * Prints users matching the given age.
+ * Prints users with an age from low to high, inclusive, youngest first.
  */
-void userlist_print_by_age(UserList *list, uint8_t age);
+void userlist_print_by_age(UserList *list, uint8_t low, uint8_t high);
 
 /**
- * Prints users matching the given zip code.
+ * Prints users with a zip code from low to high, inclusive, lowest first.
  */
-void userlist_print_by_zip(UserList *list, uint32_t zip_code);
+void userlist_print_by_zip(UserList *list, uint32_t low, uint32_t high);
+
+/**
+ * Prints users whose zip code, written in decimal, starts with the given
+ * digits.
+ */
+void userlist_print_by_zip_prefix(UserList *list, char *digits);
 
 /**
  * Prints all users.
@@ -63,8 +94,14 @@ void userlist_print(UserList *list);
 bool userlist_has_user(UserList *list, uint16_t port, uint32_t address);
 
 /**
- * Adds the given user to the userlist. Returns a pointer to the added peer,
- * or NULL if the list is full.
+ * Finds the peer with the given port and address. Returns NULL if there isn't
+ * one.
+ */
+User *userlist_find(UserList *list, uint16_t port, uint32_t address);
+
+/**
+ * Adds the given user to the userlist, growing it as needed. Returns a pointer
+ * to the added peer, which is valid until the next add or remove.
  */
 User *userlist_add(UserList *list, char *username, uint16_t port, uint32_t address, uint32_t zip_code, uint8_t age);
 
@@ -73,6 +110,12 @@ User *userlist_add(UserList *list, char *username, uint16_t port, uint32_t addre
  */
 void userlist_remove_by_connection(UserList *list, uint16_t port, uint32_t address);
 
+/**
+ * Removes the user with the matching connection parameters from the userlist
+ * without announcing that it left, for a caller that reports why itself.
+ */
+void userlist_drop(UserList *list, uint16_t port, uint32_t address);
+
 /**
  * Disconnects and removes all users from the userlist.
  */
@@ -82,6 +125,12 @@ void userlist_remove_all(UserList *list);
 // User functions
 ///////////////////////////////////////////////////////////
 
+/**
+ * Returns true if the user's zip code, written in decimal, starts with the
+ * given digits.
+ */
+bool user_zip_has_prefix(User *user, char *digits);
+
 /**
  * Prints the data for a user.
  */
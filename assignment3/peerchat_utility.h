@@ -15,49 +15,169 @@
 // Global macros
 ///////////////////////////////////////////////////////////
 
-#define MAX_PEERS 32
 #define USERNAME_LENGTH 32
 #define MESSAGE_LENGTH 256
 #define DEFAULT_PORT 8129
+#define EVENTLOOP_BATCH 64 // Readiness events taken from the kernel per wait
 
 ///////////////////////////////////////////////////////////
-// FileDescriptorSet structs
+// EventLoop structs
 ///////////////////////////////////////////////////////////
 
+/**
+ * Called when a watched file descriptor has data to read.
+ */
+typedef void (*EventCallback)(void *context, int32_t file_descriptor);
+
+/**
+ * Called once when a timer expires.
+ */
+typedef void (*TimerCallback)(void *context);
+
+/**
+ * Identifies a pending timer. The slot is in the low 32 bits and the slot's
+ * generation in the high 32 bits, so a stale id never cancels a newer timer.
+ * 0 is never a valid id.
+ */
+typedef uint64_t TimerId;
+
 typedef struct {
-    fd_set master_fds; // The file descriptor list
-    uint32_t length;   // Total number of active read file descriptors
-} FileDescriptorSet;
+    EventCallback callback; // Called when the descriptor is readable, NULL if unwatched
+    void *context;          // Passed to the callback
+    bool polled;            // True if epoll can't watch it, such as a regular file, so it's always ready
+} EventHandler;
+
+typedef struct {
+    uint64_t deadline;      // Monotonic millisecond the timer fires at
+    TimerCallback callback; // Called when the timer fires, NULL if the slot is free
+    void *context;          // Passed to the callback
+    uint32_t generation;    // Bumped each time the slot is freed
+    uint32_t next;          // Heap position while pending, next free slot while free
+} EventTimer;
+
+typedef struct {
+    int32_t epoll;             // The epoll instance
+    EventHandler *handlers;    // Handlers indexed by file descriptor
+    uint32_t handler_capacity; // Number of entries in handlers
+    uint32_t length;           // Total number of watched file descriptors
+    uint32_t polled;           // Number of watched file descriptors that are always ready
+    EventTimer *timers;        // Timer slots
+    uint32_t timer_capacity;   // Number of entries in timers
+    uint32_t free_timer;       // First free slot in timers, or timer_capacity if none are free
+    uint32_t *heap;            // Pending timer slots as a min heap by deadline
+    uint32_t timer_count;      // Number of entries in heap
+} EventLoop;
 
 ///////////////////////////////////////////////////////////
-// FileDescriptorSet functions
+// EventLoop functions
 ///////////////////////////////////////////////////////////
 
 /**
- * Adds the given file descriptor to the set.
+ * Initializes an event loop with nothing watched and no timers.
+ */
+void eventloop_initialize(EventLoop *loop);
+
+/**
+ * Watches the given file descriptor, calling back each time it's readable.
+ */
+void eventloop_add(EventLoop *loop, int32_t file_descriptor, EventCallback callback, void *context);
+
+/**
+ * Stops watching the given file descriptor. Call before closing it.
+ */
+void eventloop_remove(EventLoop *loop, int32_t file_descriptor);
+
+/**
+ * Calls back once after delay milliseconds. Returns an id for cancelling.
  */
-void filedescriptorset_add(FileDescriptorSet *set, int32_t file_descriptor);
+TimerId eventloop_timer_add(EventLoop *loop, uint32_t delay, TimerCallback callback, void *context);
 
 /**
- * Removes the given file descriptor to the set.
+ * Cancels a pending timer. Does nothing if it's already fired or been
+ * cancelled.
  */
-void filedescriptorset_remove(FileDescriptorSet *set, int32_t file_descriptor);
+void eventloop_timer_cancel(EventLoop *loop, TimerId timer);
 
 /**
- * Clears all tracked file descriptors.
+ * Blocks until a watched file descriptor is readable or the next timer is due,
+ * then calls back for each ready descriptor and each expired timer. Only the
+ * descriptors that are ready are visited, however many are watched.
  */
-void filedescriptorset_reset(FileDescriptorSet *set);
+void eventloop_wait(EventLoop *loop);
 
 /**
- * Selects on the tracked file descriptors. Returns the read file descriptor
- * set. 
+ * Releases the event loop.
  */
-fd_set filedescriptorset_select(FileDescriptorSet *set);
+void eventloop_destroy(EventLoop *loop);
+
+///////////////////////////////////////////////////////////
+// AddressTable structs
+///////////////////////////////////////////////////////////
+
+typedef struct {
+    uint32_t address; // Address of the peer
+    uint16_t port;    // Port of the peer
+    int32_t value;    // Position of the peer's entry in its owner's array, -1 if the slot is empty
+} AddressSlot;
+
+/**
+ * Open addressing table from a peer's (address, port) to the position of its
+ * entry in an array kept by the owner. Slots are probed linearly from a
+ * Fibonacci hash of the key, which is stored in the slot so probing never
+ * leaves the table, and the table is kept at most half full. Removing an
+ * entry shifts later ones back rather than leaving a tombstone.
+ */
+typedef struct {
+    AddressSlot *slots; // Slots of the table
+    uint32_t capacity;  // Number of slots, a power of two
+    uint32_t length;    // Number of entries
+} AddressTable;
+
+///////////////////////////////////////////////////////////
+// AddressTable functions
+///////////////////////////////////////////////////////////
+
+/**
+ * Initializes an empty table.
+ */
+void address_table_initialize(AddressTable *table);
+
+/**
+ * Returns the position stored for the port/address, or -1 if there is none.
+ */
+int32_t address_table_find(AddressTable *table, uint16_t port, uint32_t address);
+
+/**
+ * Stores the position for the port/address, replacing any already stored.
+ */
+void address_table_put(AddressTable *table, uint16_t port, uint32_t address, int32_t value);
+
+/**
+ * Removes the port/address, if it's there.
+ */
+void address_table_remove(AddressTable *table, uint16_t port, uint32_t address);
+
+/**
+ * Removes every entry, keeping the slots.
+ */
+void address_table_clear(AddressTable *table);
+
+/**
+ * Releases the table.
+ */
+void address_table_destroy(AddressTable *table);
 
 ///////////////////////////////////////////////////////////
 // Utility functions
 ///////////////////////////////////////////////////////////
 
+/**
+ * Grows an array to hold at least the given number of entries, doubling its
+ * capacity and zeroing the new entries. Returns the array, which may have
+ * moved. Exits if memory runs out.
+ */
+void *array_grow(void *array, uint32_t *capacity, uint32_t needed, size_t size);
+
 /**
  * Checks is the first sring starts with the second string.
  * 
@@ -81,4 +201,26 @@ uint32_t remove_delimiters(char *source);
  */
 char *ip4_to_string(uint32_t ip4_address);
 
+/**
+ * Returns the address a peer is known by. Peers reached at 0.0.0.0 answer
+ * from 127.0.0.1, so both are stored as 127.0.0.1 (network order).
+ */
+uint32_t ip4_normalize(uint32_t ip4_address);
+
+/**
+ * Returns milliseconds from a monotonic clock.
+ */
+uint64_t monotonic_ms(void);
+
+/**
+ * Returns a random number for seeding generators and picking ids.
+ */
+uint64_t random_seed(void);
+
+/**
+ * Returns the next number from the xorshift generator with the given state,
+ * which is never 0, seeded from random_seed.
+ */
+uint64_t random_next(uint64_t *state);
+
 #endif